@@ -1,6 +1,40 @@
 #include "cMain.h"
 #include "../Network_Code/TCP_client.h"
 
+#include <thread>
+
+/* The window that Argon2's progress reports go to. They arrive on Argon2's
+ * own thread, so they're handed over to the GUI thread with CallAfter().
+ */
+static cMain* argon2_progress_frame = NULL;
+
+static void gui_argon2_progress(u64 slices_done, u64 slices_total){
+
+    cMain* frame = argon2_progress_frame;
+
+    if(frame){
+        frame->CallAfter([frame, slices_done, slices_total](){
+            frame->ShowArgon2Progress(slices_done, slices_total);
+        });
+    }
+}
+
+/* The window that hears about a dropped connection, once begin_polling()
+ * knows whether the session got resumed. That's on the polling thread too.
+ */
+static cMain* session_status_frame = NULL;
+
+static void gui_session_status(u8 session_status){
+
+    cMain* frame = session_status_frame;
+
+    if(frame){
+        frame->CallAfter([frame, session_status](){
+            frame->ShowSessionStatus(session_status);
+        });
+    }
+}
+
 /* Implement what the Event Table is.
  *
  * Parm 1 - the class it is producing the events for.
@@ -212,6 +246,12 @@ cMain::cMain() : wxFrame(
     roomid_input->Hide();
     userid_input->Hide();
 
+    argon2_progress_frame = this;
+    argon2_progress_hook  = gui_argon2_progress;
+
+    session_status_frame = this;
+    session_status_hook  = gui_session_status;
+
     /* Similarly construct the rest of the member variables. */
     
     /*
@@ -350,12 +390,16 @@ void cMain::BtnClickLogin(wxCommandEvent &evt){
 
 void cMain::BtnClickLoginGo(wxCommandEvent &evt){
 
-    uint8_t login_status = 1;
     uint8_t password[16];
     int password_len;
 
     wxString pwd_as_wxstring = "";
 
+    if(argon2_busy){
+        evt.Skip();
+        return;
+    }
+
     info_msg_box->Hide();
 
     pwd_as_wxstring = password_input->GetValue();
@@ -377,9 +421,49 @@ void cMain::BtnClickLoginGo(wxCommandEvent &evt){
             ,password_len
     );
 
-    login_status = login(password, password_len);
+    /* Login unlocks the private key with Argon2, which takes a while. Do it
+     * on another thread so the window keeps painting. Back cancels it.
+     */
+    argon2_busy = true;
+
+    btn_login_GO->Disable();
+    btn_login_BACK->SetLabel("Cancel");
+
+    info_msg_box->SetValue("");
+    info_msg_box->WriteText("Unlocking your private key...");
+    info_msg_box->Show();
+
+    client_argon2_arm();
+
+    std::thread([this, password, password_len]() mutable {
+
+        uint8_t login_status = login(password, password_len);
+
+        explicit_bzero(password, sizeof(password));
+
+        CallAfter([this, login_status](){ FinishLogin(login_status); });
+
+    }).detach();
 
-    if(login_status == 0){
+    explicit_bzero(password, sizeof(password));
+
+    /* End the event. */
+    evt.Skip();
+}
+
+void cMain::FinishLogin(uint8_t login_status){
+
+    argon2_busy = false;
+
+    btn_login_GO->Enable();
+    btn_login_BACK->SetLabel("Back");
+
+    if(login_status == 0 && argon2_cancel_requested){
+        info_msg_box->SetValue("");
+        info_msg_box->WriteText("Login cancelled.");
+        info_msg_box->Show();
+    }
+    else if(login_status == 0){
         /* Add code to render 'could not login rosetta' msg on user's screen. */
         info_msg_box->SetValue("");
         info_msg_box->WriteText("Error. Login failed unexpectedly.");
@@ -408,14 +492,73 @@ void cMain::BtnClickLoginGo(wxCommandEvent &evt){
         password_input->Hide();
 
     }
-    
-    /* End the event. */
-    evt.Skip();
+}
+
+void cMain::ShowArgon2Progress(uint64_t slices_done, uint64_t slices_total){
+
+    if(!argon2_busy){
+        return;
+    }
+
+    info_msg_box->SetValue("");
+    info_msg_box->WriteText(
+        wxString::Format( "Running Argon2... %d%%"
+                         ,(int)((slices_done * 100) / slices_total)
+                        )
+    );
+    info_msg_box->Show();
+}
+
+void cMain::ShowSessionStatus(uint8_t session_status){
+
+    /* Whatever screen we were on, rooms and logins alike, is gone now. */
+    btn_makeroom_GO->Hide();
+    btn_makeroom_BACK->Hide();
+    btn_joinroom_GO->Hide();
+    btn_joinroom_BACK->Hide();
+    btn_closeyourroom->Hide();
+    btn_leavetheroom->Hide();
 
+    roomid_input->SetValue("");
+    roomid_input->Hide();
+
+    userid_input->SetValue("");
+    userid_input->Hide();
+
+    info_msg_box->SetValue("");
+
+    if(session_status == SESSION_RESUMED){
+        /* Logged in again on a new connection, but the room is gone. */
+        info_msg_box->WriteText("Reconnected. You are no longer in a room.");
+
+        btn_makeroom->Show();
+        btn_joinroom->Show();
+        btn_quit->Show();
+    }
+    else{
+        /* Back to the login screen. */
+        info_msg_box->WriteText("Lost the connection. Please log in again.");
+
+        btn_makeroom->Hide();
+        btn_joinroom->Hide();
+
+        btn_reg->Show();
+        btn_login->Show();
+        btn_quit->Show();
+    }
+
+    info_msg_box->Show();
 }
 
 void cMain::BtnClickLoginBack(wxCommandEvent &evt){
 
+    /* While logging in, this is the Cancel button. */
+    if(argon2_busy){
+        client_argon2_cancel();
+        evt.Skip();
+        return;
+    }
+
     btn_reg->Show();
     btn_login->Show();
     btn_quit->Show();
@@ -450,11 +593,14 @@ void cMain::BtnClickRegister(wxCommandEvent &evt){
 
 void cMain::BtnClickRegGo(wxCommandEvent &evt){
 
-    uint8_t register_status = 1;
     uint8_t password[16];
     int password_len;
     wxString pwd_as_wxstring = "";
 
+    if(argon2_busy){
+        goto label_exit;
+    }
+
     info_msg_box->SetValue("");
     info_msg_box->Hide();
 
@@ -475,15 +621,58 @@ void cMain::BtnClickRegGo(wxCommandEvent &evt){
             ,password_len
     );
 
-    /* At this point we're sure the password is valid. Register the user. */
-    register_status = reg(password, password_len);
+    /* At this point we're sure the password is valid. Register the user,
+     * on another thread, as calibrating and running Argon2 takes a while.
+     */
+    argon2_busy = true;
+
+    btn_reg_GO->Disable();
+    btn_reg_BACK->SetLabel("Cancel");
+
+    info_msg_box->SetValue("");
+    info_msg_box->WriteText("Measuring this machine for Argon2...");
+    info_msg_box->Show();
+
+    client_argon2_arm();
+
+    std::thread([this, password, password_len]() mutable {
+
+        uint8_t register_status = reg(password, password_len);
+
+        explicit_bzero(password, sizeof(password));
+
+        CallAfter([this, register_status](){ FinishReg(register_status); });
+
+    }).detach();
+
+    explicit_bzero(password, sizeof(password));
+
+label_exit:
+
+    /* End the event. */
+    evt.Skip();
+    return;
+}
+
+void cMain::FinishReg(uint8_t register_status){
+
+    argon2_busy = false;
+
+    btn_reg_GO->Enable();
+    btn_reg_BACK->SetLabel("Back");
 
     /* Display error box that something went wrong, try again. */
     if(register_status == 0){
         info_msg_box->SetValue("");
-        info_msg_box->WriteText("Error: Something went wrong. Try again.");
+
+        if(argon2_cancel_requested){
+            info_msg_box->WriteText("Registration cancelled.");
+        }
+        else{
+            info_msg_box->WriteText("Error: Something went wrong. Try again.");
+        }
+
         info_msg_box->Show();
-        goto label_exit;
     }
 
     /* Change GUI to reflect successful registration, say GOOD in msg box
@@ -506,16 +695,17 @@ void cMain::BtnClickRegGo(wxCommandEvent &evt){
         password_input->SetValue("");
         password_input->Hide();
     }
-
-label_exit:
-
-    /* End the event. */
-    evt.Skip();
-    return;
 }
 
 void cMain::BtnClickRegBack(wxCommandEvent &evt){
 
+    /* While registering, this is the Cancel button. */
+    if(argon2_busy){
+        client_argon2_cancel();
+        evt.Skip();
+        return;
+    }
+
     btn_reg->Show();
     btn_login->Show();
     btn_quit->Show();
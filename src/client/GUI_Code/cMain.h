@@ -56,6 +56,20 @@ public:
     void BtnClickCloseYourRoom(wxCommandEvent &evt);
     void BtnClickLeaveTheRoom(wxCommandEvent &evt);
 
+    /* Login and Registration run on a thread of their own, as their Argon2
+     * hash takes seconds. These show their outcome once they're done.
+     */
+    bool argon2_busy = false;
+
+    void ShowArgon2Progress(uint64_t slices_done, uint64_t slices_total);
+    void FinishLogin(uint8_t login_status);
+    void FinishReg(uint8_t register_status);
+
+    /* The connection dropped and the poller either resumed the session on a
+     * new one or gave up on it. Called on the GUI thread with CallAfter().
+     */
+    void ShowSessionStatus(uint8_t session_status);
+
 
     wxDECLARE_EVENT_TABLE();
 
@@ -28,13 +28,69 @@
 #define LONG_NONCE_LEN   16
 #define PASSWORD_BUF_SIZ 16
 #define HMAC_TRUNC_BYTES 8
+#define SESSION_MAC_LEN  32
 #define ARGON_STRING_LEN 8
 #define ARGON_HASH_LEN   64
 #define MESSAGE_LINE_LEN (SMALL_FIELD_LEN + 2 + MAX_TXT_LEN)
 #define SIGNATURE_LEN    ((2 * sizeof(bigint)) + (2 * PRIVKEY_LEN))
 
+/* user_save.dat begins with a versioned header:
+ *
+ * ===========================================================================
+ * | "RSAV" | version | Argon2 p | Argon2 m (KiB) | Argon2 t | key type |
+ * |========|=========|==========|================|==========|==========|
+ * |   4B   |   4B    |    4B    |       4B       |    4B    |    4B    |
+ * ===========================================================================
+ *
+ * followed by what Registration always saved: ChaCha20 nonce, encrypted
+ * private key, public key, Argon2 salt string.
+ *
+ * Version 2 is the first one whose key comes from an RFC 9106 conformant
+ * Argon2id. Save files of version 1, and ones from before the header existed,
+ * were encrypted under Argon2 output we no longer reproduce and can't be
+ * unlocked anymore - the user has to register again.
+ *
+ * Version 3 adds the key type, which of cryptolib's public-key backends the
+ * saved keys belong to (PK_TYPE_FFDH3072, PK_TYPE_CURVE25519). Version 2 has
+ * no key type field, its keys are always FFDH-3072, and it's still read.
+ */
+#define SAVEFILE_MAGIC         "RSAV"
+#define SAVEFILE_MAGIC_LEN     4
+#define SAVEFILE_VERSION       3
+#define SAVEFILE_V2_HEADER_LEN (SAVEFILE_MAGIC_LEN + (4 * sizeof(u32)))
+#define SAVEFILE_HEADER_LEN    (SAVEFILE_MAGIC_LEN + (5 * sizeof(u32)))
+
+/* What Registration uses if Argon2 calibration can't run. */
+#define DEFAULT_ARGON2_P    4
+#define DEFAULT_ARGON2_M    2097000
+#define DEFAULT_ARGON2_T    1
+
+/* What Registration calibrates Argon2 towards: how long unlocking the saved
+ * private key at login should take, and the most memory it may use for it.
+ */
+#define ARGON2_TARGET_MS    1000
+#define ARGON2_MAX_MEM_KIB  2097152
+
 u8 temp_handshake_memory_region_isLocked = 0;
 
+/* The Argon2 hash of Login and Registration runs as an async job, so that the
+ * GUI can keep painting, show its progress and cancel it. Only one at a time.
+ *
+ * The GUI arms cancellation with client_argon2_arm() before it starts Login
+ * or Registration on a thread of their own, and may then call
+ * client_argon2_cancel() from its own thread at any point. If the job isn't
+ * running yet, it's cancelled as soon as it would start.
+ * argon2_progress_hook, if set, is called on Argon2's thread after each slice.
+ */
+struct Argon2_async argon2_job;
+
+pthread_mutex_t argon2_job_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+u8 argon2_job_running      = 0;
+u8 argon2_cancel_requested = 0;
+
+void (*argon2_progress_hook)(u64 slices_done, u64 slices_total) = NULL;
+
 struct roommate{
     char   guest_user_id[SMALL_FIELD_LEN];
     bigint guest_pubkey;
@@ -43,6 +99,7 @@ struct roommate{
     u8*    guest_KAB;
     u8*    guest_Nonce; 
     u64    guest_nonce_counter;
+    struct BLAKE2B_MAC_ctx guest_mac_ctx;
 };
 
 #define roommates_arr_siz 63
@@ -83,6 +140,12 @@ pthread_t poller_threadID;
 
 u8 own_privkey_buf[PRIVKEY_LEN];
 
+/* Which public-key backend our long-term keys are for, from user_save.dat.
+ * Logins only work with FFDH-3072 so far, so it's always that for now. Other
+ * key types will log in with PACKET_ID_05, see construct_msg_00().
+ */
+u32 own_key_type = PK_TYPE_FFDH3072;
+
 bigint server_shared_secret;
 bigint nonce_bigint;
 bigint *M  = NULL;
@@ -97,6 +160,59 @@ bigint own_pubkey;
 /* These are for talking securely to the Rosetta server only. */
 u8 *KAB, *KBA;
 
+/* Session-MAC mode for our polls, room leaves and log offs, see
+ * init_session_macs(). Set use_session_macs to 0 to sign them instead.
+ * We only ask for it at login, it's on only if the server said yes too.
+ * session_mac_mutex keeps the send counter in the order packets go out.
+ */
+u8  use_session_macs   = 1;
+u8  session_macs_ready = 0;
+u64 session_mac_send_counter = 0;
+u64 session_mac_recv_counter = 0;
+
+struct BLAKE2B_MAC_ctx session_mac_send_ctx;
+struct BLAKE2B_MAC_ctx session_mac_recv_ctx;
+
+pthread_mutex_t session_mac_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Send text messages as type_31, tagged for each guest instead of signed,
+ * see construct_msg_30(). Only done while session MACs are up. Off unless
+ * set to 1: a roommate whose client doesn't know type_31 can't read those
+ * at all, so only turn it on when everyone in the room can. Type_31s that
+ * others send are read either way.
+ */
+u8 use_room_macs = 0;
+
+/* Session resumption, see resume_session(). The ticket is opaque to us, only
+ * the server can open it, so all we need to know about it is its length.
+ * Set want_resume_ticket to 0 to not ask for one when logging in.
+ */
+#define RESUME_TICKET_SECRET_LEN ((2 * SESSION_KEY_LEN) + LONG_NONCE_LEN)
+
+#define RESUME_TICKET_BODY_LEN \
+        (SMALL_FIELD_LEN + (2 * PUBKEY_LEN) + RESUME_TICKET_SECRET_LEN)
+
+#define RESUME_TICKET_LEN \
+        (SHORT_NONCE_LEN + RESUME_TICKET_BODY_LEN + SESSION_MAC_LEN)
+
+#define RESUME_NONCE_LEN   32
+#define RESUME_WANT_TICKET 0x01
+
+/* Login flag - we want session MACs, see init_session_macs(). */
+#define LOGIN_WANT_SESSION_MACS 0x02
+
+u8 want_resume_ticket   = 1;
+u8 session_ticket_valid = 0;
+u8 session_ticket[RESUME_TICKET_LEN];
+
+/* When the connection drops, begin_polling() tries resume_session() and then
+ * calls session_status_hook, if set, on the polling thread with one of these.
+ */
+#define SESSION_LOST    0 /* Couldn't resume, the user has to log in again. */
+#define SESSION_RESUMED 1 /* Logged in on a new connection, but in no room. */
+
+void (*session_status_hook)(u8 session_status) = NULL;
+
 /* Memory region holding short-term cryptographic artifacts for Login scheme. */
 u8 temp_handshake_buf[TEMP_BUF_SIZ];
 
@@ -115,11 +231,15 @@ struct sockaddr_in servaddr;
 #define PACKET_ID_00 0xAD0084FF0CC25B0E
 #define PACKET_ID_01 0xE7D09F1FEFEA708B
 #define PACKET_ID_02 0x146AAE4D100DAEEA
+#define PACKET_ID_03 0xCAF4D10C898C4FFC
+#define PACKET_ID_04 0xAB9DE36FCF840299
+#define PACKET_ID_05 0x3E91C7B25D0A64F9
 #define PACKET_ID_10 0x13C4A44F70842AC1
 #define PACKET_ID_11 0xAEFB70A4A8E610DF
 #define PACKET_ID_20 0x9FF4D1E0EAE100A5
 #define PACKET_ID_21 0x7C8124568ED45F1A
 #define PACKET_ID_30 0x9FFA7475DDC8B11C
+#define PACKET_ID_31 0x5E1B9C34A07D2F68
 #define PACKET_ID_40 0xCAFB1C01456DF7F0
 #define PACKET_ID_41 0xDC4F771C0B22FDAB
 #define PACKET_ID_50 0x41C20F0BB4E34890
@@ -134,9 +254,13 @@ u8 authenticate_server(u8* signed_ptr, u64 signed_len, u64 sign_offset){
     
     u64 s_offset = sign_offset;
     u64 e_offset = (sign_offset + sizeof(bigint) + PRIVKEY_LEN);
+    u64 prehash_id;
    
     u8 status; 
     
+    /* Which prehash the server used. Read it before its slot is overwritten. */
+    prehash_id = Signature_GET_PREHASH_ID(signed_ptr + s_offset);
+
     /* Reconstruct the sender's signature as the two BigInts that make it up. */
     recv_s = (bigint*)(signed_ptr + s_offset);
     recv_e = (bigint*)(signed_ptr + e_offset);    
@@ -169,6 +293,7 @@ u8 authenticate_server(u8* signed_ptr, u64 signed_len, u64 sign_offset){
     /* Verify the sender's cryptographic signature. */
     status = Signature_VALIDATE(
         Gm, &server_pubkey_mont, M, Q, recv_s, recv_e, signed_ptr, signed_len
+       ,prehash_id
     );
 
     free(recv_s->bits);
@@ -177,6 +302,270 @@ u8 authenticate_server(u8* signed_ptr, u64 signed_len, u64 sign_offset){
     return status; 
 }
 
+/* Session-MAC mode for post-login control traffic.
+ *
+ * Our poll (40), leave room (50) and log off (60) packets can carry a keyed
+ * BLAKE2b tag in place of a signature, which saves the server a signature
+ * check and a signature of its reply on every poll:
+ *
+================================================================================
+| packet ID 40, 50 or 60 |  user_ix  |  counter  |          MAC tag           |
+|========================|===========|===========|============================|
+|       SMALL_LEN        | SMALL_LEN | SMALL_LEN |      SESSION_MAC_LEN       |
+--------------------------------------------------------------------------------
+ *
+ * The server tells them apart from the signed ones by their size, and replies
+ * to a MAC'd poll with MAC'd 40 and 41 packets, the counter and the tag in 
+ * place of the signature at the end. Tags are over everything before them.
+ *
+ * One key per direction, made at login from the long-term session key of that
+ * direction and that login's one-time keys, so each session has its own:
+ *
+ *   K_mac = BLAKE2B{32}(key = KAB or KBA, KAB_s || KBA_s || direction byte)
+ *
+ * and one counter per direction, starting at 1. Counters that aren't above
+ * the last one accepted are rejected as replays, on both sides.
+ */
+#define SESSION_MAC_DIR_C2S 0x01
+#define SESSION_MAC_DIR_S2C 0x02
+
+/* Counter and tag, what replaces SIGNATURE_LEN in a MAC'd packet. */
+#define SESSION_MAC_AUTH_LEN (SMALL_FIELD_LEN + SESSION_MAC_LEN)
+
+/* Called when the login went through, with KAB_s || KBA_s that are still in
+ * the handshake memory region, or when a session was resumed, with both sides'
+ * nonces. Either way, 2 * SESSION_KEY_LEN bytes only this session has.
+ */
+void init_session_macs(u8* one_time_keys){
+
+    u8 mac_key[SESSION_MAC_LEN];
+    u8 kdf_input[(2 * SESSION_KEY_LEN) + 1];
+
+    if(!use_session_macs){
+        return;
+    }
+
+    memcpy(kdf_input, one_time_keys, 2 * SESSION_KEY_LEN);
+
+    kdf_input[2 * SESSION_KEY_LEN] = SESSION_MAC_DIR_C2S;
+
+    BLAKE2B_KEYED( KAB, SESSION_KEY_LEN, kdf_input, sizeof(kdf_input)
+                  ,SESSION_MAC_LEN, mac_key
+                 );
+
+    pthread_mutex_lock(&session_mac_mutex);
+
+    BLAKE2B_MAC_INIT( &session_mac_send_ctx
+                     ,mac_key, SESSION_MAC_LEN, SESSION_MAC_LEN
+                    );
+
+    kdf_input[2 * SESSION_KEY_LEN] = SESSION_MAC_DIR_S2C;
+
+    BLAKE2B_KEYED( KBA, SESSION_KEY_LEN, kdf_input, sizeof(kdf_input)
+                  ,SESSION_MAC_LEN, mac_key
+                 );
+
+    BLAKE2B_MAC_INIT( &session_mac_recv_ctx
+                     ,mac_key, SESSION_MAC_LEN, SESSION_MAC_LEN
+                    );
+
+    session_mac_send_counter = 0;
+    session_mac_recv_counter = 0;
+    session_macs_ready       = 1;
+
+    pthread_mutex_unlock(&session_mac_mutex);
+
+    explicit_bzero(mac_key,   SESSION_MAC_LEN);
+    explicit_bzero(kdf_input, sizeof(kdf_input));
+
+    return;
+}
+
+/* Forget this session's MAC keys. We go back to signing until next login. */
+void release_session_macs(void){
+
+    pthread_mutex_lock(&session_mac_mutex);
+
+    explicit_bzero(&session_mac_send_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+    explicit_bzero(&session_mac_recv_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+
+    session_mac_send_counter = 0;
+    session_mac_recv_counter = 0;
+    session_macs_ready       = 0;
+
+    pthread_mutex_unlock(&session_mac_mutex);
+
+    return;
+}
+
+/* Put our next counter at counter_offset in payload and the tag right after
+ * it, then send the counter_offset + SESSION_MAC_AUTH_LEN bytes. Both under
+ * the lock, so that packets reach the server in the order of their counters.
+ *
+ * Returns 1 if it was sent, 0 if not.
+ */
+u8 session_mac_send(u8* payload, u64 counter_offset){
+
+    u8 status = 1;
+
+    pthread_mutex_lock(&session_mac_mutex);
+
+    ++session_mac_send_counter;
+
+    *((u64*)(payload + counter_offset)) = session_mac_send_counter;
+
+    BLAKE2B_MAC( &session_mac_send_ctx
+                ,payload, counter_offset + SMALL_FIELD_LEN
+                ,payload + counter_offset + SMALL_FIELD_LEN
+               );
+
+    if(send( own_socket_fd, payload, counter_offset + SESSION_MAC_AUTH_LEN, 0)
+       == -1
+      )
+    {
+        status = 0;
+    }
+
+    pthread_mutex_unlock(&session_mac_mutex);
+
+    return status;
+}
+
+/* Check the session MAC of a reply from the server whose counter is at
+ * counter_offset. Returns 1 if the tag is right and the counter a new one.
+ */
+u8 authenticate_server_mac(u8* payload, u64 counter_offset){
+
+    u64 counter;
+    u8  status = 0;
+
+    pthread_mutex_lock(&session_mac_mutex);
+
+    if(!session_macs_ready){
+        goto label_cleanup;
+    }
+
+    if(BLAKE2B_MAC_VERIFY( &session_mac_recv_ctx
+                          ,payload, counter_offset + SMALL_FIELD_LEN
+                          ,payload + counter_offset + SMALL_FIELD_LEN
+                         ) != 1
+      )
+    {
+        printf("[ERR] Client: Session MAC tag of server doesn't match.\n\n");
+        goto label_cleanup;
+    }
+
+    counter = *((u64*)(payload + counter_offset));
+
+    if(counter <= session_mac_recv_counter){
+        printf("[ERR] Client: Replayed session MAC counter %lu.\n\n", counter);
+        goto label_cleanup;
+    }
+
+    session_mac_recv_counter = counter;
+    status = 1;
+
+label_cleanup:
+
+    pthread_mutex_unlock(&session_mac_mutex);
+
+    return status;
+}
+
+/* Room MACs - the per-guest tags of type_31 text messages.
+ *
+ * Each guest's slot in the AD of a type_31 gets a keyed BLAKE2b tag next to
+ * their copy of K, with a key only we and that guest have, made when they
+ * came into the room from our DH with them, same as the K is sent with:
+ *
+ *   K_tag = BLAKE2B{32}(key = KBA || KAB, guest_Nonce || ROOM_MAC_LABEL)
+ *
+ * Both of us split the DH into KBA, KAB and Nonce the same way, so unlike
+ * which of KAB or KBA each one wraps K with, KBA || KAB is the same key on
+ * both ends, and the one tag key checks messages going either way. The IDs
+ * at the start of what's tagged already say which way a message went.
+ *
+ * The tag is over who it's from and to, the text's length, our nonce counter
+ * with them, their encrypted K and a hash of the encrypted text:
+ *
+================================================================================
+| sender_id | guest_id |  TXT_LEN  |  counter  |   encr_K   |  H(encr_msg)    |
+|===========|==========|===========|===========|============|=================|
+| SMALL_LEN | SMALL_LEN| SMALL_LEN | SMALL_LEN | ONETIME_LEN| ROOM_DIGEST_LEN |
+--------------------------------------------------------------------------------
+ *
+ * The counter goes up with every message between two guests anyway, so a
+ * replayed or reordered message doesn't check out, and the sender and guest
+ * IDs keep the server from handing one guest's copy to someone else. Whoever
+ * relays it doesn't get to touch it without the guest seeing that it did.
+ */
+#define ROOM_MAC_LABEL  0x31
+#define ROOM_DIGEST_LEN 64
+
+#define ROOM_MAC_INPUT_LEN \
+        ((4 * SMALL_FIELD_LEN) + ONE_TIME_KEY_LEN + ROOM_DIGEST_LEN)
+
+/* Make the tag key state of the guest in roommates[guest_ix], whose session
+ * keys and Nonce are already in place. Not keyed by roommate_key_usage_bitmask
+ * like their K is - that's the other way round on their end, this isn't.
+ */
+void init_guest_mac(u64 guest_ix){
+
+    u8  tag_key[SESSION_MAC_LEN];
+    u8  kdf_key[2 * SESSION_KEY_LEN];
+    u8  kdf_input[LONG_NONCE_LEN + 1];
+
+    memcpy(kdf_key, roommates[guest_ix].guest_KBA, SESSION_KEY_LEN);
+    memcpy( kdf_key + SESSION_KEY_LEN, roommates[guest_ix].guest_KAB
+           ,SESSION_KEY_LEN
+          );
+
+    memcpy(kdf_input, roommates[guest_ix].guest_Nonce, LONG_NONCE_LEN);
+
+    kdf_input[LONG_NONCE_LEN] = ROOM_MAC_LABEL;
+
+    BLAKE2B_KEYED( kdf_key, sizeof(kdf_key), kdf_input, sizeof(kdf_input)
+                  ,SESSION_MAC_LEN, tag_key
+                 );
+
+    BLAKE2B_MAC_INIT( &(roommates[guest_ix].guest_mac_ctx)
+                     ,tag_key, SESSION_MAC_LEN, SESSION_MAC_LEN
+                    );
+
+    explicit_bzero(tag_key,   SESSION_MAC_LEN);
+    explicit_bzero(kdf_key,   sizeof(kdf_key));
+    explicit_bzero(kdf_input, sizeof(kdf_input));
+
+    return;
+}
+
+/* Lay out what a room MAC tag is over into buf, ROOM_MAC_INPUT_LEN bytes. */
+void room_mac_input( u8* buf, const char* sender_id, const char* guest_id
+                    ,u64 text_len, u64 counter, u8* encr_K, u8* msg_digest
+                   )
+{
+    u64 offset = 0;
+
+    memcpy(buf + offset, sender_id, SMALL_FIELD_LEN);
+    offset += SMALL_FIELD_LEN;
+
+    memcpy(buf + offset, guest_id, SMALL_FIELD_LEN);
+    offset += SMALL_FIELD_LEN;
+
+    memcpy(buf + offset, &text_len, SMALL_FIELD_LEN);
+    offset += SMALL_FIELD_LEN;
+
+    memcpy(buf + offset, &counter, SMALL_FIELD_LEN);
+    offset += SMALL_FIELD_LEN;
+
+    memcpy(buf + offset, encr_K, ONE_TIME_KEY_LEN);
+    offset += ONE_TIME_KEY_LEN;
+
+    memcpy(buf + offset, msg_digest, ROOM_DIGEST_LEN);
+
+    return;
+}
+
 /* Do everything that can be done before we construct message_00 to begin 
  * the login handshake protocol to securely transport our long-term public key
  * to the server so it can also compute the same DH shared secret that we did,
@@ -188,6 +577,86 @@ u8 authenticate_server(u8* signed_ptr, u64 signed_len, u64 sign_offset){
 
 /* Initialize client software's internal state and bookkeeping. */
 
+void client_argon2_progress( struct Argon2_async* async
+                            ,u64 slices_done, u64 slices_total
+                           )
+{
+    (void)async;
+
+    if(argon2_progress_hook){
+        argon2_progress_hook(slices_done, slices_total);
+    }
+}
+
+void client_argon2_arm(void){
+
+    pthread_mutex_lock(&argon2_job_mutex);
+    argon2_cancel_requested = 0;
+    pthread_mutex_unlock(&argon2_job_mutex);
+}
+
+void client_argon2_cancel(void){
+
+    pthread_mutex_lock(&argon2_job_mutex);
+
+    argon2_cancel_requested = 1;
+
+    if(argon2_job_running){
+        Argon2_CANCEL(&argon2_job);
+    }
+
+    pthread_mutex_unlock(&argon2_job_mutex);
+}
+
+/* Start hashing in the background. 1 if it runs now, 0 if cancelled/failed. */
+u8 client_argon2_start(struct Argon2_parms* prms, u8* output_tag){
+
+    u8 status = 0;
+
+    pthread_mutex_lock(&argon2_job_mutex);
+
+    if(argon2_cancel_requested){
+        printf("[OK]  Client: Argon2 cancelled before it even started.\n");
+        goto label_cleanup;
+    }
+
+    if(!Argon2_START( &argon2_job, prms, output_tag
+                     ,client_argon2_progress, NULL, NULL
+                    )
+      )
+    {
+        goto label_cleanup;
+    }
+
+    argon2_job_running = 1;
+    status = 1;
+
+label_cleanup:
+
+    pthread_mutex_unlock(&argon2_job_mutex);
+
+    return status;
+}
+
+/* Wait for the job started above to end, return its ARGON2_RESULT_*. */
+u8 client_argon2_wait(void){
+
+    u8 result = Argon2_WAIT(&argon2_job);
+
+    pthread_mutex_lock(&argon2_job_mutex);
+    argon2_job_running = 0;
+    pthread_mutex_unlock(&argon2_job_mutex);
+
+    if(result == ARGON2_RESULT_CANCELLED){
+        printf("[OK]  Client: Argon2 was cancelled.\n");
+    }
+    else if(result != ARGON2_RESULT_DONE){
+        printf("[ERR] Client: Argon2 failed to run.\n");
+    }
+
+    return result;
+}
+
 /* Initialize stuff needed for the Unix Sockets API. */
 
 /* Attempt to establish a connection with the Rosetta server. */
@@ -208,6 +677,13 @@ u8 self_init(u8* password, int password_len){
     u8 argon2_output_tag[ARGON_HASH_LEN];
     u8 V[chacha_key_len];
     u8 decrypted_privkey_buf[PRIVKEY_LEN];
+    u8 saved_header[SAVEFILE_HEADER_LEN];
+
+    u32 saved_version;
+    u32 saved_argon2_p;
+    u32 saved_argon2_m;
+    u32 saved_argon2_t;
+    u32 saved_key_type = PK_TYPE_FFDH3072;
 
     FILE* savefile = NULL;
 
@@ -233,6 +709,68 @@ u8 self_init(u8* password, int password_len){
     
     /* Read savefile in the same order that Registration writes it in. */
 
+    /* First comes the versioned header with the Argon2 parameters. */
+    if(   fread(saved_header, 1, SAVEFILE_V2_HEADER_LEN, savefile) 
+       != SAVEFILE_V2_HEADER_LEN
+       || memcmp(saved_header, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN) != 0
+      )
+    {
+        printf("[ERR] Client: savefile is from an old version. Register "
+               "again.\n"
+              );
+        status = 0;
+        goto label_cleanup;
+    }
+
+    memcpy(&saved_version,  saved_header + SAVEFILE_MAGIC_LEN + 0,  4);
+    memcpy(&saved_argon2_p, saved_header + SAVEFILE_MAGIC_LEN + 4,  4);
+    memcpy(&saved_argon2_m, saved_header + SAVEFILE_MAGIC_LEN + 8,  4);
+    memcpy(&saved_argon2_t, saved_header + SAVEFILE_MAGIC_LEN + 12, 4);
+
+    if(saved_version != SAVEFILE_VERSION && saved_version != 2){
+        printf("[ERR] Client: savefile version %u, we only read versions 2 "
+               "and %u. Register again.\n", saved_version, SAVEFILE_VERSION
+              );
+        status = 0;
+        goto label_cleanup;
+    }
+
+    /* Version 3 and up also say what kind of keys they hold. */
+    if(saved_version >= 3){
+
+        if(   fread( saved_header + SAVEFILE_V2_HEADER_LEN, 1
+                    ,SAVEFILE_HEADER_LEN - SAVEFILE_V2_HEADER_LEN, savefile
+                   )
+           != SAVEFILE_HEADER_LEN - SAVEFILE_V2_HEADER_LEN
+          )
+        {
+            printf("[ERR] Client: couldn't get key type from savefile.\n");
+            status = 0;
+            goto label_cleanup;
+        }
+
+        memcpy(&saved_key_type, saved_header + SAVEFILE_MAGIC_LEN + 16, 4);
+    }
+
+    if(saved_key_type != PK_TYPE_FFDH3072){
+        printf("[ERR] Client: savefile holds keys of type %u, but logins "
+               "only support FFDH-3072 keys so far.\n", saved_key_type
+              );
+        status = 0;
+        goto label_cleanup;
+    }
+
+    own_key_type = saved_key_type;
+
+    if(   saved_argon2_p == 0 || saved_argon2_p > 0xFFFFFF
+       || saved_argon2_t == 0 || saved_argon2_m < 8 * saved_argon2_p
+      )
+    {
+        printf("[ERR] Client: savefile has invalid Argon2 parameters.\n");
+        status = 0;
+        goto label_cleanup;
+    }
+
     /* First is Nonce for decrypting the saved private key. */
     if(fread(saved_nonce, 1, LONG_NONCE_LEN, savefile) != LONG_NONCE_LEN){
         printf("[ERR] Client: couldn't get nonce from savefile[0].\n");
@@ -305,10 +843,10 @@ u8 self_init(u8* password, int password_len){
 
     /* Fill in the parameters to Argon2. */
 
-    prms.p = 4;                 /* How many threads to use.             */
+    prms.p = saved_argon2_p;    /* How many threads to use.             */
     prms.T = ARGON_HASH_LEN;    /* How many bytes of output we want.    */
-    prms.m = 2097000;           /* How many kibibytes of memory to use. */  
-    prms.t = 1;                 /* How many passes Argon2 should do.    */
+    prms.m = saved_argon2_m;    /* How many kibibytes of memory to use. */  
+    prms.t = saved_argon2_t;    /* How many passes Argon2 should do.    */
     prms.v = 0x13;              /* Constant in Argon2 spec.             */
     prms.y = 0x02;              /* Constant in Argon2 spec.             */
              
@@ -367,7 +905,65 @@ u8 self_init(u8* password, int password_len){
     }
     printf("\n\n");
 
-    Argon2_MAIN(&prms, argon2_output_tag);
+    if(!client_argon2_start(&prms, argon2_output_tag)){
+        status = 0;
+        goto label_cleanup;
+    }
+
+    /* While Argon2 runs, get on with what doesn't need the private key. */
+
+    /* Load other BigInts needed for the cryptography to work and be secure. */
+    
+    /* Diffie-Hellman modulus M, 3071-bit prime positive integer. */                        
+    M = get_BIGINT_from_DAT(3072, "../bin/saved_M.dat", 3071, MAX_BIGINT_SIZ);
+
+    if(M == NULL){
+        printf("[ERR] Client: Failed to get M from DAT file.\n\n");
+        status = 0;
+        goto label_cancel_argon2;
+    }
+
+    /* 320-bit prime exactly dividing M-1, making M cryptographically strong. */
+    Q = get_BIGINT_from_DAT(320, "../bin/saved_Q.dat", 320,  MAX_BIGINT_SIZ);
+
+    if(Q == NULL){
+        printf("[ERR] Client: Failed to get Q from DAT file.\n\n");
+        status = 0;
+        goto label_cancel_argon2;
+    }
+
+    /* Diffie-Hellman generator G = 2^((M-1)/Q) */
+    G = get_BIGINT_from_DAT(3072, "../bin/saved_G.dat", 3071, MAX_BIGINT_SIZ);
+
+    if(G == NULL){
+        printf("[ERR] Client: Failed to get G from DAT file.\n\n");
+        status = 0;
+        goto label_cancel_argon2;
+    }
+
+    /* Montgomery Form of G, since we use Montgomery Modular Multiplication. */
+    Gm = get_BIGINT_from_DAT(3072, "../bin/saved_Gm.dat", 3071, MAX_BIGINT_SIZ);
+
+    if(Gm == NULL){
+        printf("[ERR] Client: Failed to get Gm from DAT file.\n\n");
+        status = 0;
+        goto label_cancel_argon2;
+    }
+
+    /* Grab the server's public key. */
+    server_pubkey = 
+    get_BIGINT_from_DAT(3072, "../bin/server_pubkey.dat", 3071, MAX_BIGINT_SIZ);
+
+    if(server_pubkey == NULL){
+        printf("[ERR] Client: Failed to get server pubkey from DAT file.\n\n");
+        status = 0;
+        goto label_cancel_argon2;
+    }
+
+    if(client_argon2_wait() != ARGON2_RESULT_DONE){
+        status = 0;
+        goto label_cleanup;
+    }
 
     /* Let V be the leftmost 32 (chacha_key_len) bytes of Argon2's output hash.
      * Use V as a key in ChaCha20, along with the saved 16-byte Nonce 
@@ -394,78 +990,30 @@ u8 self_init(u8* password, int password_len){
     bigint_create(&own_pubkey, MAX_BIGINT_SIZ, 0);
     memcpy(own_pubkey.bits, saved_pubkey, PUBKEY_LEN);     
     own_pubkey.used_bits = get_used_bits(saved_pubkey, PUBKEY_LEN); 
-    own_pubkey.free_bits = MAX_BIGINT_SIZ - own_pubkey.used_bits;   
-
-    printf("[OK] Client: Checking decrypted private key...\n");
-
-    /* Compute a public key with that private key and M, Q, G. If it's the same
-     * as the public key stored on the filesystem, the private key was 
-     * decrypted successfully, with the original correct password.
-     */
-
-    save_BIGINT_to_DAT("temp_priv.dat", &own_privkey);
-
-    calculated_A = gen_pub_key(PRIVKEY_LEN, "temp_priv.dat", MAX_BIGINT_SIZ);
-
-    system("rm temp_priv.dat");
-
-    /* Now compare the calculated and the saved public keys. */
-    if(bigint_compare2(calculated_A, &own_pubkey) != 2){
-        printf("[ERR] Client: Password did NOT lead to correct privkey.\n\n");
-        status = 0;
-        goto label_cleanup;
-    }
-    else{
-        printf("[OK]  Client: Password unlocked the private key correctly!\n");
-    }
-    /* Load other BigInts needed for the cryptography to work and be secure. */
-    
-    /* Diffie-Hellman modulus M, 3071-bit prime positive integer. */                        
-    M = get_BIGINT_from_DAT(3072, "../bin/saved_M.dat", 3071, MAX_BIGINT_SIZ);
-
-    if(M == NULL){
-        printf("[ERR] Client: Failed to get M from DAT file.\n\n");
-        status = 0;
-        goto label_cleanup;
-    }
+    own_pubkey.free_bits = MAX_BIGINT_SIZ - own_pubkey.used_bits;   
 
-    /* 320-bit prime exactly dividing M-1, making M cryptographically strong. */
-    Q = get_BIGINT_from_DAT(320, "../bin/saved_Q.dat", 320,  MAX_BIGINT_SIZ);
+    printf("[OK] Client: Checking decrypted private key...\n");
 
-    if(Q == NULL){
-        printf("[ERR] Client: Failed to get Q from DAT file.\n\n");
-        status = 0;
-        goto label_cleanup;
-    }
+    /* Compute a public key with that private key and M, Q, G. If it's the same
+     * as the public key stored on the filesystem, the private key was 
+     * decrypted successfully, with the original correct password.
+     */
 
-    /* Diffie-Hellman generator G = 2^((M-1)/Q) */
-    G = get_BIGINT_from_DAT(3072, "../bin/saved_G.dat", 3071, MAX_BIGINT_SIZ);
+    save_BIGINT_to_DAT("temp_priv.dat", &own_privkey);
 
-    if(G == NULL){
-        printf("[ERR] Client: Failed to get G from DAT file.\n\n");
-        status = 0;
-        goto label_cleanup;
-    }
+    calculated_A = gen_pub_key(PRIVKEY_LEN, "temp_priv.dat", MAX_BIGINT_SIZ);
 
-    /* Montgomery Form of G, since we use Montgomery Modular Multiplication. */
-    Gm = get_BIGINT_from_DAT(3072, "../bin/saved_Gm.dat", 3071, MAX_BIGINT_SIZ);
+    system("rm temp_priv.dat");
 
-    if(Gm == NULL){
-        printf("[ERR] Client: Failed to get Gm from DAT file.\n\n");
+    /* Now compare the calculated and the saved public keys. */
+    if(bigint_compare2(calculated_A, &own_pubkey) != 2){
+        printf("[ERR] Client: Password did NOT lead to correct privkey.\n\n");
         status = 0;
         goto label_cleanup;
     }
-
-    /* Grab the server's public key. */
-    server_pubkey = 
-    get_BIGINT_from_DAT(3072, "../bin/server_pubkey.dat", 3071, MAX_BIGINT_SIZ);
-
-    if(server_pubkey == NULL){
-        printf("[ERR] Client: Failed to get server pubkey from DAT file.\n\n");
-        status = 0;
-        goto label_cleanup;
+    else{
+        printf("[OK]  Client: Password unlocked the private key correctly!\n");
     }
-
     /* Initialize the shared secret with the server. */   
     bigint_create(&server_pubkey_mont,   MAX_BIGINT_SIZ, 0);  
     bigint_create(&server_shared_secret, MAX_BIGINT_SIZ, 0);    
@@ -556,6 +1104,13 @@ u8 self_init(u8* password, int password_len){
     
     printf("[OK]  Client: Connect() call finished, won't be re-attempted.\n");
 
+    goto label_cleanup;
+
+label_cancel_argon2:
+
+    /* Argon2 has our stack buffers. Don't leave before it's done with them. */
+    client_argon2_cancel();
+    client_argon2_wait();
     
 label_cleanup:
 
@@ -604,11 +1159,25 @@ void release_handshake_memory_region(){
     Client ----> Server
 
 ================================================================================
-|        PACKET_ID_00         |   Client's short-term public key in the clear  |
-|=============================|================================================|
-|       SMALL_FIELD_LEN       |                    PUBKEY_LEN                  |
+|  PACKET_ID_00   |            Client's short-term public key in clear         |
+|=================|============================================================|
+| SMALL_FIELD_LEN |                        PUBKEY_LEN                          |
+--------------------------------------------------------------------------------
+
+   That's for FFDH-3072 keys, which every Rosetta server knows. Keys of any
+   other type are to go in a typed login instead, so no server ever gets a
+   packet 00 it doesn't know the layout of:
+
+================================================================================
+|  PACKET_ID_05   |    key type     | Client's short-term public key in clear  |
+|=================|=================|==========================================|
+| SMALL_FIELD_LEN | SMALL_FIELD_LEN |    public key length of the key type     |
 --------------------------------------------------------------------------------
 
+   The key type tells the server which public-key backend our keys are for,
+   so it can refuse a login it can't do before any work goes into it. There's
+   nothing but FFDH-3072 to log in with yet, see own_key_type, so we only
+   ever send packet 00 for now.
 */
 u8 construct_msg_00(void){
 
@@ -698,9 +1267,7 @@ u8 process_msg_00(u8* msg_buf){
 
     u64 handshake_buf_key_offset;
     u64 handshake_buf_nonce_offset;
-    const u64 B = 64;
-    const u64 L = 64;
-    const u64 reply_len = SMALL_FIELD_LEN + PUBKEY_LEN + HMAC_TRUNC_BYTES;
+    const u64 reply_len = (2 * SMALL_FIELD_LEN) + PUBKEY_LEN + HMAC_TRUNC_BYTES;
 
     u32 tempbuf_write_offset;
     u32 shared_secret_read_offset;
@@ -713,26 +1280,12 @@ u8 process_msg_00(u8* msg_buf){
     bigint *a_s = (bigint*)(temp_handshake_buf);
 
     u8 status = 1;    
-    u8 K0[B];
-    u8 ipad[B];
-    u8 opad[B];
-    u8 K0_XOR_ipad_TEXT[B + PUBKEY_LEN];
-    u8 BLAKE2B_output[L];   
-    u8 last_BLAKE2B_input[B + L];
-    u8 K0_XOR_ipad[B];
-    u8 K0_XOR_opad[B];
     u8 reply_buf[reply_len];
     u8 auth_status;
     u8 auth_buf[INIT_AUTH_LEN + SIGNATURE_LEN];
 
-    memset(K0,                  0, B);
-    memset(ipad,                0, B);
-    memset(opad,                0, B);
-    memset(K0_XOR_ipad_TEXT,    0, B + PUBKEY_LEN);
-    memset(BLAKE2B_output,      0, L);   
-    memset(last_BLAKE2B_input,  0, B + L);
-    memset(K0_XOR_ipad,         0, B);
-    memset(K0_XOR_opad,         0, B);
+    struct BLAKE2B_MAC_ctx mac_ctx;
+
     memset(reply_buf,           0, reply_len);
     memset(auth_buf,            0, INIT_AUTH_LEN + SIGNATURE_LEN);
 
@@ -767,8 +1320,8 @@ u8 process_msg_00(u8* msg_buf){
     if(   ((bigint_compare2(&zero, &B_s)) != 3) 
         || 
           ((bigint_compare2(M, &B_s)) != 1)
-        //||
-        // (check_pubkey_form(&B_sM, M, Q) == 0) 
+        ||
+          (check_pubkey_form(&B_sM, M, Q) == 0)
       )
     {
         printf("[ERR] Client: Server's short-term public key is invalid.\n");
@@ -925,151 +1478,45 @@ u8 process_msg_00(u8* msg_buf){
     /* But generating 64 1s in a row with no 0s should be extremely rare.   */       
     ++(*((u64*)(temp_handshake_buf + handshake_buf_nonce_offset)));
        
-    /* Only thing left to construct is the HMAC authenticator now. */ 
-    memset(opad, 0x5c, B);
-    memset(ipad, 0x36, B);
+    /* Only thing left to construct is the MAC authenticator now. */ 
     
-    /*  Use what's already in the locked memory region to compute HMAC and 
-     *  to decrypt the user's long-term public key
-     *
-     *  Server uses KAB_s to compute the same HMAC on A_x (client's long-term
-     *  public key in encrypted form) as the client did. 
+    /*  Use what's already in the locked memory region to compute the MAC.
      *
-     *  HMAC parameters here:
-     *
-     *  B    = input block size in bytes of BLAKE2B = 64
-     *  H    = hash function to be used - unkeyed BLAKE2B
-     *  ipad = buffer of the 0x36 byte repeated B=64 times
-     *  K    = key KAB_s
-     *  K_0  = K after pre-processing to form a B=64-byte key.
-     *  L    = output block size in bytes of BLAKE2B = 64
-     *  opad = buffer of the 0x5c byte repeated B=64 times
-     *  text = A_x
+     *  Client uses KAB_s as the key of keyed BLAKE2b to compute a MAC of 
+     *  HMAC_TRUNC_BYTES bytes on A_x (our long-term public key in encrypted
+     *  form). The server computes the same MAC to authenticate A_x.
      */    
-       
-    /* Step 3 of HMAC construction: HMAC key (KAB) 0-extended to B bytes. */
-    memcpy( K0
-           ,temp_handshake_buf + (3 * sizeof(bigint))
-           ,SESSION_KEY_LEN
-          ); 
-
-    printf("[DEBUG] Client: HMAC Step 3 produced K0: 64 bytes:\n");
-
-    for(u32 i = 0; i < B; ++i){
-        printf("%03u ", K0[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 4 of HMAC construction */
-    for(u64 i = 0; i < B; ++i){
-        K0_XOR_ipad[i] = (K0[i] ^ ipad[i]);
-    }       
-
-    printf("[DEBUG] Client: HMAC Step 4 produced K0_XOR_ipad: 64 bytes:\n");
-
-    for(u32 i = 0; i < B; ++i){
-        printf("%03u ", K0_XOR_ipad[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* step 5 of HMAC construction */
-    memcpy(K0_XOR_ipad_TEXT, K0_XOR_ipad, B);
-    memcpy(K0_XOR_ipad_TEXT + B, reply_buf + SMALL_FIELD_LEN, PUBKEY_LEN);
-    
-    printf("[DEBUG] Client: HMAC Step 5 produced K0_XOR_ipad_TEXT: 448 bytes:\n");
-
-    for(u32 i = 0; i < B + PUBKEY_LEN; ++i){
-        printf("%03u ", K0_XOR_ipad_TEXT[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* step 6 of HMAC construction */
-    /* Call BLAKE2B on K0_XOR_ipad_TEXT */ 
-    BLAKE2B_INIT(K0_XOR_ipad_TEXT, B + PUBKEY_LEN, 0, L, BLAKE2B_output);       
-
-    printf("[DEBUG] Client: HMAC Step 6 produced BLAKE2B_output: 64 bytes:\n");
-
-    for(u32 i = 0; i < L; ++i){
-        printf("%03u ", BLAKE2B_output[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 7 of HMAC construction */
-    for(u64 i = 0; i < B; ++i){
-        K0_XOR_opad[i] = (K0[i] ^ opad[i]);
-    }   
-    
-    printf("[DEBUG] Client: HMAC Step 7 produced K0_XOR_opad: 64 bytes:\n");
-
-    for(u32 i = 0; i < B; ++i){
-        printf("%03u ", K0_XOR_opad[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 8 of HMAC construction */
-    /* Combine first BLAKE2B output buffer with K0_XOR_opad. */
-    /* B + L bytes total length */
-    memcpy(last_BLAKE2B_input + 0, K0_XOR_opad,    B);
-    memcpy(last_BLAKE2B_input + B, BLAKE2B_output, L);    
-    
-   printf("[DEBUG] Client: HMAC Step 8 produced last_BLAKE2B_input: 192 bytes:\n");
-
-    for(u32 i = 0; i < B + L; ++i){
-        printf("%03u ", last_BLAKE2B_input[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 9 of HMAC construction */ 
-    /* Call BLAKE2B on the combined buffer in step 8. */
-    BLAKE2B_INIT(last_BLAKE2B_input, B + L, 0, L, BLAKE2B_output);
-
-   printf("[DEBUG] Client: HMAC Step 9 produced BLAKE2B_output: 64 bytes:\n");
-
-    for(u32 i = 0; i < L; ++i){
-        printf("%03u ", BLAKE2B_output[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
+    BLAKE2B_MAC_INIT( &mac_ctx
+                     ,temp_handshake_buf + (3 * sizeof(bigint))
+                     ,SESSION_KEY_LEN
+                     ,HMAC_TRUNC_BYTES
+                    );
+
+    BLAKE2B_MAC( &mac_ctx
+                ,reply_buf + SMALL_FIELD_LEN
+                ,PUBKEY_LEN
+                ,reply_buf + HMAC_reply_offset
+               );
+
+    memset(&mac_ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
+
+    /* Ask for a session resumption ticket and session MACs, or neither. */
+    if(want_resume_ticket){
+        *((u64*)(reply_buf + HMAC_reply_offset + HMAC_TRUNC_BYTES)) |=
+                                                            RESUME_WANT_TICKET;
     }
-    printf("\n\n");
 
-    /* Take the HMAC_TRUNC_BYTES leftmost bytes to form the HMAC output. */
-    memcpy(reply_buf + HMAC_reply_offset, BLAKE2B_output, HMAC_TRUNC_BYTES);
-
-    printf("[DEBUG] Client: Placed these 8 bytes of HMAC in packet:\n\n");
-
-    for(u32 i = 0; i < HMAC_TRUNC_BYTES; ++i){
-        printf("%03u ", BLAKE2B_output[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
+    if(use_session_macs){
+        *((u64*)(reply_buf + HMAC_reply_offset + HMAC_TRUNC_BYTES)) |=
+                                                       LOGIN_WANT_SESSION_MACS;
     }
-    printf("\n\n");  
 
 /*  Now send the reply back to the Rosetta server:
 
 ================================================================================
-|  packet ID 01   | Client's encrypted long-term PubKey |  HMAC authenticator  |
-|=================|=====================================|======================|
-| SMALL_FIELD_LEN |             PUBKEY_LEN              |   HMAC_TRUNC_BYTES   |
+| packet ID 01 | Client's encrypted long-term PubKey | MAC authentic.|  Flags  |
+|==============|=====================================|===============|=========|
+|  SMALL_LEN   |             PUBKEY_LEN              |HMAC_TRUNC_BYTE|SMALL_LEN|
 --------------------------------------------------------------------------------
 
 */
@@ -1118,25 +1565,38 @@ label_cleanup:
     Server ----> Client
   
 ================================================================================
-| packet ID 01 |  user_ix  |                    SIGNATURE                      | 
-|==============|===========|===================================================|
-|  SMALL_LEN   | SMALL_LEN |                     SIG_LEN                       |
+| packet ID 01 | Flags agreed |  user_ix  |  SIGNATURE  | Resumption ticket if |
+|==============|==============|===========|=============|======================|
+|  SMALL_LEN   |  SMALL_LEN   | SMALL_LEN |   SIG_LEN   | agreed, TICKET_LEN   |
 --------------------------------------------------------------------------------
 
+ The flags are the ones we asked for that the server agreed to, and the
+ signature is over the packet ID and them. A server from before the flags
+ leaves them out and signs the packet ID alone, so we tell by the length.
 */
 
-u8 process_msg_01(u8* msg){
+u8 process_msg_01(u8* msg, u64 msg_len){
 
     u64 nonce_offset;
     u64 key_offset;
+    u64 ix_offset = 2 * SMALL_FIELD_LEN;
+    u64 flags_agreed;
     
     u8 status = 1;
 
+    /* A server from before the flags: no session MACs, and no ticket either. */
+    if(   msg_len == (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN
+       || msg_len == (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN + RESUME_TICKET_LEN
+      )
+    {
+        ix_offset = SMALL_FIELD_LEN;
+    }
+
     /* Validate the incoming signature with the server's long-term public key
-     * on packet_ID_01 (for now... later it will be of the whole payload).
+     * on packet_ID_01 and the flags, if it sent any.
      */    
     
-    status = authenticate_server(msg, SMALL_FIELD_LEN, (2 * SMALL_FIELD_LEN));
+    status = authenticate_server(msg, ix_offset, ix_offset + SMALL_FIELD_LEN);
 
     if(status != 1){
         printf("[ERR] Client: Invalid signature in process_msg_01. Drop.\n");
@@ -1151,7 +1611,7 @@ u8 process_msg_01(u8* msg){
     
     key_offset = (3 * sizeof(bigint)) + (1 * SESSION_KEY_LEN);  
                  
-    CHACHA20( msg + SMALL_FIELD_LEN                    /* text - encrypted ix */
+    CHACHA20( msg + ix_offset                          /* text - encrypted ix */
              ,SMALL_FIELD_LEN                          /* text_len in bytes   */
              ,(u32*)(temp_handshake_buf + nonce_offset)/* Nonce ptr           */
              ,(u32)(SHORT_NONCE_LEN / sizeof(u32))     /* nonceLen in uint32s */
@@ -1163,6 +1623,36 @@ u8 process_msg_01(u8* msg){
     printf("[OK]  Client: Server told us Login was successful!\n");
     printf("              Tell GUI to tell user the good news!\n\n");   
     printf("[OK]  Client: Server told us our user index is: %lu\n\n", own_ix);
+
+    flags_agreed = 0;
+
+    if(ix_offset != SMALL_FIELD_LEN){
+        memcpy(&flags_agreed, msg + SMALL_FIELD_LEN, SMALL_FIELD_LEN);
+    }
+
+    /* If it agreed to session MACs, it made the same keys on its side. */
+    release_session_macs();
+
+    if(use_session_macs && (flags_agreed & LOGIN_WANT_SESSION_MACS)){
+        init_session_macs(temp_handshake_buf + (3 * sizeof(bigint)));
+        printf("[OK]  Client: Server agreed to session MACs.\n\n");
+    }
+
+    /* Keep the ticket, if we got one, for if our connection drops. */
+    session_ticket_valid = 0;
+
+    if(   (flags_agreed & RESUME_WANT_TICKET)
+       && msg_len ==   ix_offset + SMALL_FIELD_LEN + SIGNATURE_LEN
+                     + RESUME_TICKET_LEN
+      )
+    {
+        memcpy( session_ticket
+               ,msg + ix_offset + SMALL_FIELD_LEN + SIGNATURE_LEN
+               ,RESUME_TICKET_LEN
+              );
+        session_ticket_valid = 1;
+    }
+
 label_cleanup:            
  
     release_handshake_memory_region();
@@ -1233,8 +1723,6 @@ u8 construct_msg_10( unsigned char* requested_userid
     const u64 signed_len            = (4 * SMALL_FIELD_LEN) + ONE_TIME_KEY_LEN;
     const u64 send_len              = signed_len + SIGNATURE_LEN;
 
-    FILE* ran_file = NULL;
-
     u8 status = 1;
     u8 send_K[ONE_TIME_KEY_LEN];
     u8 send_buf[send_len];
@@ -1260,16 +1748,8 @@ u8 construct_msg_10( unsigned char* requested_userid
      * server already expects a signature of the whole payload.
      */  
 
-    ran_file = fopen("/dev/urandom", "r");
-    
-    if(!ran_file){
-        printf("[ERR] Client: Couldn't open urandom. Abort msg_10 creation.\n");
-        status = 0;
-        goto label_cleanup;
-    }       
-
-    if( (fread(send_K, 1, ONE_TIME_KEY_LEN, ran_file)) != ONE_TIME_KEY_LEN){
-        printf("[ERR] Client: Couldn't read urandom. Abort msg_10 creation.\n");
+    if( ! CSPRNG_GET_BYTES(send_K, ONE_TIME_KEY_LEN) ){
+        printf("[ERR] Client: Couldn't draw key K. Abort msg_10 creation.\n");
         status = 0;
         goto label_cleanup;
     }
@@ -1368,10 +1848,6 @@ u8 construct_msg_10( unsigned char* requested_userid
 
 label_cleanup:
     
-    if(ran_file){
-        fclose(ran_file);
-    }
-    
     free(one.bits);
     free(aux1.bits);
     
@@ -1470,8 +1946,6 @@ u8 construct_msg_20( unsigned char* requested_userid
     const u64 signed_len            = (4 * SMALL_FIELD_LEN) + ONE_TIME_KEY_LEN;
     const u64 send_len              = signed_len + SIGNATURE_LEN;
 
-    FILE* ran_file = NULL;
-
     u8 status = 1;
     u8 send_K[ONE_TIME_KEY_LEN];
     u8 send_buf[send_len];
@@ -1497,16 +1971,8 @@ u8 construct_msg_20( unsigned char* requested_userid
      * server already expects or should expect a signature of the whole payload.
      */  
 
-    ran_file = fopen("/dev/urandom", "r");
-    
-    if(!ran_file){
-        printf("[ERR] Client: Couldn't open urandom. Abort msg_20 creation.\n");
-        status = 0;
-        goto label_cleanup;
-    }       
-
-    if( (fread(send_K, 1, ONE_TIME_KEY_LEN, ran_file)) != ONE_TIME_KEY_LEN){
-        printf("[ERR] Client: Couldn't read urandom. Abort msg_20 creation.\n");
+    if( ! CSPRNG_GET_BYTES(send_K, ONE_TIME_KEY_LEN) ){
+        printf("[ERR] Client: Couldn't draw key K. Abort msg_20 creation.\n");
         status = 0;
         goto label_cleanup;
     }
@@ -1603,10 +2069,6 @@ u8 construct_msg_20( unsigned char* requested_userid
      
 label_cleanup:
     
-    if(ran_file){
-        fclose(ran_file);
-    }
-    
     free(one.bits);
     free(aux1.bits);
     
@@ -1783,6 +2245,20 @@ u8 process_msg_20(u8* msg, u64 msg_len){
 
         bigint_create(&(roommates[i].guest_pubkey_mont), MAX_BIGINT_SIZ, 0);  
         Get_Mont_Form(this_pubkey, &(roommates[i].guest_pubkey_mont), M);
+
+        /* Don't do a DH with a key that isn't in the Q-order subgroup. Forget
+         * the whole room then, we'd rather join again than half of it.
+         */
+        if(check_pubkey_form(&(roommates[i].guest_pubkey_mont), M, Q) == 0){
+            printf("[ERR] Client: A guest's public key is invalid. Drop.\n"
+                   "              Tell GUI to tell user to try join again.\n\n"
+                  );
+            num_roommates = 0;
+            next_free_roommate_slot = 0;
+            roommate_slots_bitmask = 0;
+            status = 0;
+            goto label_cleanup;
+        }
         
         roommates[i].guest_nonce_counter = 0;
         
@@ -1816,6 +2292,8 @@ u8 process_msg_20(u8* msg, u64 msg_len){
            ,temp_shared_secret.bits + (2 * SESSION_KEY_LEN)
            ,LONG_NONCE_LEN
         );
+
+        init_guest_mac(i);
     }
 
 label_cleanup:
@@ -1965,6 +2443,17 @@ u8 process_msg_21(u8* msg){
 
     bigint_create(&(roommates[guest_ix].guest_pubkey_mont), MAX_BIGINT_SIZ, 0);  
     Get_Mont_Form(this_pubkey, &(roommates[guest_ix].guest_pubkey_mont), M);
+
+    if(check_pubkey_form(&(roommates[guest_ix].guest_pubkey_mont), M, Q) == 0){
+        printf("[ERR] Client: New guest's public key is invalid. Drop.\n\n");
+        roommate_slots_bitmask     &= ~BITMASK_BIT_ON_AT(guest_ix);
+        roommate_key_usage_bitmask &= ~BITMASK_BIT_ON_AT(guest_ix);
+        free(this_pubkey->bits);
+        free(roommates[guest_ix].guest_pubkey_mont.bits);
+        memset(&(roommates[guest_ix]), 0, sizeof(struct roommate));
+        status = 0;
+        goto label_cleanup;
+    }
     
     roommates[guest_ix].guest_nonce_counter = 0;
     
@@ -1993,6 +2482,8 @@ u8 process_msg_21(u8* msg){
         ,LONG_NONCE_LEN
     );
 
+    init_guest_mac(guest_ix);
+
 label_cleanup:
     
     free(one.bits);
@@ -2009,46 +2500,74 @@ label_cleanup:
  Main packet structure:
  
 ================================================================================
-| packetID 30 |  user_ix  |  TXT_LEN   |    AD   |          Signature1         | 
-|=============|===========|============|=========|=============================|
-|  SMALL_LEN  | SMALL_LEN | SMALL_LEN  | L bytes |            SIG_LEN          |
+| packetID 30 |  user_ix  |  TXT_LEN  |    AD   |  encr_msg  |   Signature1    |
+|=============|===========|===========|=========|============|=================|
+|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes |  TXT_LEN   |     SIG_LEN     |
 --------------------------------------------------------------------------------
 
  AD - Associated Data, of length L bytes: From T = 1 to (num_guests - 1):
 
 ================================================================================
-| guestID_1 | encr_key_1 | encr_msg_1| ... |guestID_T | encr_key_T | encr_msg_T| 
-|===========|============|===========|=====|==========|============|===========|
-| SMALL_LEN |  X bytes   |  TXT_LEN  | ... |SMALL_LEN |  X bytes   |  TXT_LEN  |
+|  guestID_1  |  encr_key_1  |  ...  |   guestID_T   |         encr_key_T      |
+|=============|==============|=======|===============|=========================|
+|  SMALL_LEN  |   X bytes    |  ...  |   SMALL_LEN   |          X bytes        |
 --------------------------------------------------------------------------------
 
- L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN + TXT_LEN)
+ L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN)
  X = ONE_TIME_KEY_LEN
 
+ The message is encrypted only once, with a one-time key K of its own, and
+ only K is encrypted for each guest, with our session key and Nonce with them.
+ So the packet grows by 40 bytes per guest, not by 40 bytes plus the whole
+ message, and the server relaying it to everyone isn't quadratic in the text.
+ A new K for every message means there's no room key to change when people
+ join or leave - whoever isn't in the room right now just doesn't get a K.
+
+ If use_room_macs is on and we have session MACs with the server, it goes
+ out as type_31 instead, with no signature at all. Each guest's slot gets a room MAC tag after their
+ K (see init_guest_mac()), so the guest knows it's from us with one keyed
+ hash, and the server gets our session MAC in place of Signature1:
+
+================================================================================
+| packetID 31 |  user_ix  |  TXT_LEN  |    AD   |  encr_msg  | counter |  MAC  |
+|=============|===========|===========|=========|============|=========|=======|
+|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes |  TXT_LEN   |  SMALL  |SES_MAC|
+--------------------------------------------------------------------------------
+
+ AD slot:  |  guestID  |  encr_key  |  room MAC tag  |
+           | SMALL_LEN |     X      | SESSION_MAC_LEN|
+
+ L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN + MAC_LEN)
+
 */
 u8 construct_msg_30(unsigned char* text_msg, u64 text_msg_len){
 
-    u64 L = num_roommates * (SMALL_FIELD_LEN + ONE_TIME_KEY_LEN + text_msg_len);
-    u64 payload_len = L + (3 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
+    u8  mac_mode = use_room_macs && session_macs_ready;
+    u64 AD_slot_len = 
+        SMALL_FIELD_LEN + ONE_TIME_KEY_LEN + (mac_mode ? SESSION_MAC_LEN : 0);
+    u64 auth_len = mac_mode ? SESSION_MAC_AUTH_LEN : SIGNATURE_LEN;
+    u64 L = num_roommates * AD_slot_len;
+    u64 payload_len = L + text_msg_len + (3 * SMALL_FIELD_LEN) + auth_len;
     u64 AD_write_offset = 0;
-    u64 signed_len = payload_len - SIGNATURE_LEN;
+    u64 signed_len = payload_len - auth_len;
 
-    u8* associated_data = (u8*)calloc(1, L);
     u8* payload = (u8*)calloc(1, payload_len);
+    u8* associated_data = payload + (3 * SMALL_FIELD_LEN);
     u8  send_K[ONE_TIME_KEY_LEN];
+    u8  msg_nonce[SHORT_NONCE_LEN];
+    u8  msg_digest[ROOM_DIGEST_LEN];
+    u8  mac_input[ROOM_MAC_INPUT_LEN];
     u8  status = 1;
+    u8  sent;
 
     u32* chacha_key = NULL;
 
-    FILE* ran_file = NULL;
-
     bigint guest_nonce_bigint;
     bigint one;
     bigint aux1;
 
-    size_t ret_val;
-
-    memset(send_K, 0, ONE_TIME_KEY_LEN);
+    memset(send_K,    0, ONE_TIME_KEY_LEN);
+    memset(msg_nonce, 0, SHORT_NONCE_LEN);
 
     bigint_create(&one,  MAX_BIGINT_SIZ, 1);
     bigint_create(&aux1, MAX_BIGINT_SIZ, 0);
@@ -2057,29 +2576,39 @@ u8 construct_msg_30(unsigned char* text_msg, u64 text_msg_len){
     (u8*)calloc(1, ((size_t)((double)MAX_BIGINT_SIZ/(double)8)));
 
     /* Construct the first 3 sections of the payload. */
-    *((u64*)(payload + (0 * SMALL_FIELD_LEN))) = PACKET_ID_30; 
+    *((u64*)(payload + (0 * SMALL_FIELD_LEN))) = 
+        mac_mode ? PACKET_ID_31 : PACKET_ID_30; 
     *((u64*)(payload + (1 * SMALL_FIELD_LEN))) = own_ix;
     *((u64*)(payload + (2 * SMALL_FIELD_LEN))) = text_msg_len;
 
     /* Generate the one-time key K to encrypt the text message with.          */
     /* An encrypted version of key K itself is sent to all receivers.         */
     /* It's encrypted with the pair of symmetric session keys (KAB, KBA)      */
-    ran_file = fopen("/dev/urandom", "r");
-    
-    if(!ran_file){
-        printf("[ERR] Client: Couldn't open urandom in msg 30 constructor.\n");
+    if( ! CSPRNG_GET_BYTES(send_K, ONE_TIME_KEY_LEN) ){
+        printf("[ERR] Client: Couldn't draw key K in msg 30 constructor.\n");
         printf("              Aborting transmission. Telling GUI system.\n\n");
         status = 0;
         goto label_cleanup;
     }
-    
-    ret_val = fread(send_K, 1, ONE_TIME_KEY_LEN, ran_file);
-    
-    if(ret_val != ONE_TIME_KEY_LEN){
-        printf("[ERR] Client: Couldn't read urandom in msg 30 constructor.\n");
-        printf("              Aborting transmission. Telling GUI system.\n\n");
-        status = 0;
-        goto label_cleanup;
+
+    /* Encrypt and place the text message, once, with K. K is never used for
+     * anything else, so the all-zero Nonce is fine with it. It goes first, as
+     * the room MAC tags in the AD are over its hash.
+     */
+    CHACHA20( 
+        text_msg                             /* text - the text msg   */
+       ,text_msg_len                         /* text_len in bytes     */
+       ,(u32*)(msg_nonce)                    /* Nonce (short)         */
+       ,(u32)(SHORT_NONCE_LEN / sizeof(u32)) /* nonce_len in uint32_ts*/
+       ,(u32*)(send_K)                       /* chacha Key - K        */
+       ,(u32)(ONE_TIME_KEY_LEN / sizeof(u32))/* Key_len in uint32_ts  */
+       ,associated_data + L                  /* output target buffer  */
+    );
+
+    if(mac_mode){
+        BLAKE2B_INIT( associated_data + L, text_msg_len, 0, ROOM_DIGEST_LEN
+                     ,msg_digest
+                    );
     }
 
     /* Construct the Associated Data within the payload. */
@@ -2123,29 +2652,40 @@ u8 construct_msg_30(unsigned char* text_msg, u64 text_msg_len){
             /* Increment nonce as many times as counter says for this guest. */
             for(u64 j = 0; j < roommates[i].guest_nonce_counter; ++j){
                 bigint_add_fast(&guest_nonce_bigint, &one, &aux1);
+                bigint_equate2(&guest_nonce_bigint, &aux1);
             }
 
-            AD_write_offset += ONE_TIME_KEY_LEN;
-
-            /* Keep the Nonce with this guest symmetric. */
-            bigint_add_fast(&guest_nonce_bigint, &one, &aux1);
-            bigint_equate2(&guest_nonce_bigint, &aux1);
-            ++(roommates[i].guest_nonce_counter);
-
-            /* Now encrypt and place the text message with K. */
+            /* Encrypt and place key K for this guest. */
             CHACHA20( 
-                text_msg                             /* text - the text msg   */
-               ,text_msg_len                         /* text_len in bytes     */
-               ,(u32*)(guest_nonce_bigint.bits)      /* Nonce (short)         */
-               ,(u32)(SHORT_NONCE_LEN / sizeof(u32)) /* nonce_len in uint32_ts*/
+                send_K                               /* text - one-time key K */
+               ,ONE_TIME_KEY_LEN                     /* text_len in bytes     */
+               ,(u32*)(guest_nonce_bigint.bits)      /* Nonce (long)          */
+               ,(u32)(LONG_NONCE_LEN / sizeof(u32))  /* nonce_len in uint32_ts*/
                ,chacha_key                           /* chacha Key            */
-               ,(u32)(ONE_TIME_KEY_LEN / sizeof(u32))/* Key_len in uint32_ts  */
+               ,(u32)(SESSION_KEY_LEN / sizeof(u32)) /* Key_len in uint32_ts  */
                ,associated_data + AD_write_offset    /* output target buffer  */
             );
 
-            AD_write_offset += text_msg_len;
+            /* Tag this guest's slot, with the counter their K went with. */
+            if(mac_mode){
+                room_mac_input( mac_input, own_user_id
+                               ,roommates[i].guest_user_id, text_msg_len
+                               ,roommates[i].guest_nonce_counter
+                               ,associated_data + AD_write_offset, msg_digest
+                              );
+
+                BLAKE2B_MAC( &(roommates[i].guest_mac_ctx)
+                            ,mac_input, ROOM_MAC_INPUT_LEN
+                            ,associated_data + AD_write_offset 
+                                             + ONE_TIME_KEY_LEN
+                           );
+
+                AD_write_offset += SESSION_MAC_LEN;
+            }
+
+            AD_write_offset += ONE_TIME_KEY_LEN;
 
-            /* Increment our Nonce with this guest again to keep it symmetric */
+            /* Keep the Nonce with this guest symmetric. */
             ++(roommates[i].guest_nonce_counter);
 
             memset(
@@ -2156,12 +2696,23 @@ u8 construct_msg_30(unsigned char* text_msg, u64 text_msg_len){
         }
     }
 
-    /* Now calculate a cryptographic signature of the whole packet's payload. */
-    
-    Signature_GENERATE( M, Q, Gm, payload, signed_len
-                       ,(payload + signed_len)
-                       ,&own_privkey, PRIVKEY_LEN
-                      );
+    /* Now calculate a cryptographic signature of the whole packet's payload,
+     * unless session MACs vouch for it to the server and room MACs to guests.
+     *
+     * It's over the packet as our guests will get it, with our userID where
+     * our user_ix goes, since the server swaps the two before relaying it.
+     * The server checks it the same way. Then our user_ix goes back in.
+     */
+    if(!mac_mode){
+        memcpy(payload + SMALL_FIELD_LEN, own_user_id, SMALL_FIELD_LEN);
+
+        Signature_GENERATE( M, Q, Gm, payload, signed_len
+                           ,(payload + signed_len)
+                           ,&own_privkey, PRIVKEY_LEN
+                          );
+
+        *((u64*)(payload + SMALL_FIELD_LEN)) = own_ix;
+    }
 
     /* Ready to send the constructed packet to the Rosetta server now. */
 
@@ -2175,7 +2726,14 @@ u8 construct_msg_30(unsigned char* text_msg, u64 text_msg_len){
         goto label_cleanup;
     }
 */
-    if(send(own_socket_fd, payload, payload_len, 0) == -1){
+    if(mac_mode){
+        sent = session_mac_send(payload, signed_len);
+    }
+    else{
+        sent = (send(own_socket_fd, payload, payload_len, 0) != -1);
+    }
+
+    if(!sent){
         printf("[ERR] Client: Couldn't send constructed packet 30.\n");
         printf("              Which is the request to send a text message\n");
         printf("              Tell GUI to tell the user about this!\n\n");
@@ -2188,15 +2746,15 @@ u8 construct_msg_30(unsigned char* text_msg, u64 text_msg_len){
 
 label_cleanup:
 
+    explicit_bzero(send_K,    ONE_TIME_KEY_LEN);
+    explicit_bzero(mac_input, ROOM_MAC_INPUT_LEN);
+
     free(guest_nonce_bigint.bits);
     free(one.bits);
     free(aux1.bits);
 
-    free(associated_data);
     free(payload);
 
-    if(ran_file != NULL) { fclose(ran_file); }
-
     return status;
 }
 
@@ -2207,22 +2765,30 @@ label_cleanup:
  Main packet structure:
  
 ================================================================================
-| packetID 30 | sender_id |  TXT_LEN  |    AD   |     Sign1     |    Sign2     |  
-|=============|===========|===========|=========|===============|==============|
-|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes |    SIG_LEN    |   SIG_LEN    |
+| packetID 30 | sender_id |  TXT_LEN  |    AD   | encr_msg |  Sign1  |  Sign2  |
+|=============|===========|===========|=========|==========|=========|=========|
+|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes | TXT_LEN  | SIG_LEN | SIG_LEN |
 --------------------------------------------------------------------------------
 
  AD - Associated Data, of length L bytes: From T = 1 to (num_guests - 1):
 
 ================================================================================
-| guestID_1 | encr_key_1 | encr_msg_1| ... |guestID_T | encr_key_T | encr_msg_T| 
-|===========|============|===========|=====|==========|============|===========|
-| SMALL_LEN |  X bytes   |  TXT_LEN  | ... |SMALL_LEN |  X bytes   |  TXT_LEN  |
+|  guestID_1  |  encr_key_1  |  ...  |   guestID_T   |         encr_key_T      |
+|=============|==============|=======|===============|=========================|
+|  SMALL_LEN  |   X bytes    |  ...  |   SMALL_LEN   |          X bytes        |
 --------------------------------------------------------------------------------
 
- L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN + TXT_LEN)
+ L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN)
  X = ONE_TIME_KEY_LEN
 
+ Everyone gets the same encr_msg, encrypted with the sender's one-time key K,
+ and finds their own copy of K in the AD. See construct_msg_30().
+
+ A type_31 is the same without Sign1 and Sign2 at the end, and with a room MAC
+ tag after each encr_key in the AD, see init_guest_mac(). L is then:
+
+ L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN + MAC_LEN)
+
 */
 u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
 
@@ -2234,11 +2800,12 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
      *  - Find the offset of the sender client's signature, Sign1. Validate it.
      *  - Iterate over the associated data's slots to find our own userID.
      *  - Use our key KAB/KBA and symmetric Nonce with sender to decrypt key K.
-     *  - Use key K and our symmetric Nonce with sender to decrypt the message.
+     *  - Use key K to decrypt the message everyone in the room got.
      *  - Tell the GUI system to display the message from the sender. 
      */
 
     const u64 text_len  = *((u64*)(payload + (2 * SMALL_FIELD_LEN)));
+    const u8  mac_mode  = (*((u64*)payload) == PACKET_ID_31);
     u64 AD_slot_len;
     u64 AD_len;
     u64 our_AD_slot = MAX_CLIENTS + 1;
@@ -2247,6 +2814,7 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
     u64 sender_ix = MAX_CLIENTS + 1;
     u64 s_offset;
     u64 e_offset;
+    u64 sign1_prehash_id;
 
     u32* chacha_key;
 
@@ -2255,9 +2823,12 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
 
     u8* AD_pointer = payload + (3 * SMALL_FIELD_LEN);
     u8* our_K_pointer;
-    u8* our_msg_pointer;
+    u8* msg_pointer;
     u8* decrypted_msg = (u8*)calloc(1, text_len);
     u8  decrypted_key[ONE_TIME_KEY_LEN];
+    u8  msg_nonce[SHORT_NONCE_LEN];
+    u8  msg_digest[ROOM_DIGEST_LEN];
+    u8  mac_input[ROOM_MAC_INPUT_LEN];
     u8  status = 1;
 
     bigint *recv_e = NULL;
@@ -2273,6 +2844,7 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
     (u8*)calloc(1, ((size_t)((double)MAX_BIGINT_SIZ/(double)8)));
 
     memset(decrypted_key, 0, ONE_TIME_KEY_LEN);
+    memset(msg_nonce,     0, SHORT_NONCE_LEN);
     memset(temp_user_id,  0, SMALL_FIELD_LEN);
 
     if(text_len < 1 || text_len > MAX_TXT_LEN) {
@@ -2283,13 +2855,18 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
         goto label_cleanup;
     }
 
-    AD_slot_len  = SMALL_FIELD_LEN + ONE_TIME_KEY_LEN + text_len;
+    AD_slot_len  = SMALL_FIELD_LEN + ONE_TIME_KEY_LEN;
+
+    if(mac_mode){
+        AD_slot_len += SESSION_MAC_LEN;
+    }
+
     AD_len       = num_roommates * AD_slot_len;
-    sign2_offset = (3 * SMALL_FIELD_LEN) + SIGNATURE_LEN + AD_len;
+    sign2_offset = (3 * SMALL_FIELD_LEN) + AD_len + text_len + SIGNATURE_LEN;
     sign1_offset = sign2_offset - SIGNATURE_LEN;
 
     /* Find the index of the guest with this userID. */
-    for(u64 i = 0; i <= num_roommates - 2; ++i){
+    for(u64 i = 0; i <= MAX_CLIENTS - 2; ++i){
         if( roommate_slots_bitmask & BITMASK_BIT_ON_AT(i) ){
             
             /* if userIDs match. */
@@ -2312,49 +2889,62 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
         goto label_cleanup;
     }
 
-    /* Validate the authenticity of the server AND the sending client. */
-    
-    status = authenticate_server(payload, sign2_offset, sign2_offset);    
+    /* A type_31 carries no signatures. The poll reply it came in has already
+     * checked out as the server's, and the room MAC tag in our AD slot, that
+     * we check as soon as we've found it below, vouches for the sender.
+     */
+    if(!mac_mode){
 
-    if(status != 1){
-        printf("[ERR] Client: Invalid server signature in process_msg_30.\n\n");
-        status = 0;   
-        goto label_cleanup;    
-    }  
+        /* Validate the authenticity of the server AND the sending client. */
 
-    /* Now the sender client's signature. */
+        status = authenticate_server(payload, sign2_offset, sign2_offset);    
 
-    /* Reconstruct the sender's signature as the two BigInts that make it up. */
-    s_offset = sign1_offset;
-    e_offset = (sign1_offset + sizeof(bigint) + PRIVKEY_LEN);    
+        if(status != 1){
+            printf("[ERR] Client: Invalid server signature in msg_30.\n\n");
+            status = 0;   
+            goto label_cleanup;    
+        }  
 
-    recv_s = (bigint*)(payload + s_offset);
-    recv_e = (bigint*)(payload + e_offset);  
+        /* Now the sender client's signature. */
 
-    recv_s->bits = (u8*)calloc(1, MAX_BIGINT_SIZ);
-    recv_e->bits = (u8*)calloc(1, MAX_BIGINT_SIZ);
+        /* Reconstruct the sender's signature as the two BigInts in it. */
+        s_offset = sign1_offset;
+        e_offset = (sign1_offset + sizeof(bigint) + PRIVKEY_LEN);    
 
-    memcpy( recv_s->bits
-           ,payload + (sign1_offset + sizeof(bigint))
-           ,PRIVKEY_LEN
-    );
-    
-    memcpy( recv_e->bits
-           ,payload + (sign1_offset + (2*sizeof(bigint)) + PRIVKEY_LEN)
-           ,PRIVKEY_LEN
-    );
-       
-    /* Verify the sender's cryptographic signature. */
-    status = Signature_VALIDATE(
-                     Gm, &(roommates[sender_ix].guest_pubkey_mont)
-                    ,M, Q, recv_s, recv_e
-                    ,(payload + sign1_offset), sign1_offset
-    ); 
+        sign1_prehash_id = Signature_GET_PREHASH_ID(payload + s_offset);
 
-    if(status != 1) {
-        printf("[ERR] Client: Invalid sender signature in msg_30 Drop.\n\n");
-        status = 0;
-        goto label_cleanup;
+        recv_s = (bigint*)(payload + s_offset);
+        recv_e = (bigint*)(payload + e_offset);  
+
+        recv_s->bits = (u8*)calloc(1, MAX_BIGINT_SIZ);
+        recv_e->bits = (u8*)calloc(1, MAX_BIGINT_SIZ);
+
+        memcpy( recv_s->bits
+               ,payload + (sign1_offset + sizeof(bigint))
+               ,PRIVKEY_LEN
+        );
+
+        memcpy( recv_e->bits
+               ,payload + (sign1_offset + (2*sizeof(bigint)) + PRIVKEY_LEN)
+               ,PRIVKEY_LEN
+        );
+
+        /* Verify the sender's cryptographic signature. It's over everything
+         * before it, exactly as we got it, see construct_msg_30().
+         */
+        status = Signature_VALIDATE(
+                         Gm, &(roommates[sender_ix].guest_pubkey_mont)
+                        ,M, Q, recv_s, recv_e
+                        ,payload, sign1_offset, sign1_prehash_id
+        ); 
+
+        if(status != 1) {
+            printf("[ERR] Client: Invalid sender signature in msg_30. "
+                   "Drop.\n\n"
+                  );
+            status = 0;
+            goto label_cleanup;
+        }
     }
 
     /* Now that the packet seems legit, find our slot in the associated data. */
@@ -2379,12 +2969,15 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
 
     /* Extract the encrypted key and message from our slot in associated data */
 
-    /* Decide whether to encrypt with session key KAB or with KBA. */
+    /* Decrypt with the key they encrypted with - the one we don't send with,
+     * see roommate_key_usage_bitmask. Their bit for us is the opposite of
+     * ours for them, so they picked the other one of KAB and KBA.
+     */
     if( roommate_key_usage_bitmask & BITMASK_BIT_ON_AT(sender_ix) ){
-        chacha_key = (u32*)(roommates[sender_ix].guest_KAB);
+        chacha_key = (u32*)(roommates[sender_ix].guest_KBA);
     }
     else{
-        chacha_key = (u32*)(roommates[sender_ix].guest_KBA);
+        chacha_key = (u32*)(roommates[sender_ix].guest_KAB);
     }
 
     /* Another instance of a manual BigInt constructor from mem :( */
@@ -2412,7 +3005,29 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
     }
 
     our_K_pointer = AD_pointer + (our_AD_slot * AD_slot_len) + SMALL_FIELD_LEN;
-    our_msg_pointer = our_K_pointer + ONE_TIME_KEY_LEN;
+    msg_pointer   = AD_pointer + AD_len;
+
+    /* Our room MAC tag with the sender, over the counter we're at with them. */
+    if(mac_mode){
+        BLAKE2B_INIT(msg_pointer, text_len, 0, ROOM_DIGEST_LEN, msg_digest);
+
+        room_mac_input( mac_input, roommates[sender_ix].guest_user_id
+                       ,own_user_id, text_len
+                       ,roommates[sender_ix].guest_nonce_counter
+                       ,our_K_pointer, msg_digest
+                      );
+
+        if(BLAKE2B_MAC_VERIFY( &(roommates[sender_ix].guest_mac_ctx)
+                              ,mac_input, ROOM_MAC_INPUT_LEN
+                              ,our_K_pointer + ONE_TIME_KEY_LEN
+                             ) != 1
+          )
+        {
+            printf("[ERR] Client: Invalid room MAC tag in msg_31. Drop.\n\n");
+            status = 0;
+            goto label_cleanup;
+        }
+    }
 
     /* Place this guest's encrypted one-time ChaCha key. */
     CHACHA20( 
@@ -2427,21 +3042,18 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
 
     ++roommates[sender_ix].guest_nonce_counter;
 
-    bigint_add_fast(&guest_nonce_bigint, &one, &aux1);
-    bigint_equate2(&guest_nonce_bigint, &aux1);   
-
-    /* Place this guest's encrypted one-time ChaCha key. */
+    /* Decrypt the message with K. It's only ever used with the zero Nonce. */
     CHACHA20( 
-        our_msg_pointer                       /* text - recv (encr) MSG */
+        msg_pointer                           /* text - recv (encr) MSG */
        ,text_len                              /* text_len in bytes      */
-       ,(u32*)(guest_nonce_bigint.bits)       /* Nonce (short), counter */
+       ,(u32*)(msg_nonce)                     /* Nonce (short)          */
        ,(u32)(SHORT_NONCE_LEN / sizeof(u32))  /* nonce_len in uint32_ts */
        ,(u32*)decrypted_key                   /* chacha Key             */
        ,(u32)(ONE_TIME_KEY_LEN / sizeof(u32)) /* Key_len in uint32_ts   */
        ,decrypted_msg                         /* output target buffer   */
     );
 
-    ++roommates[sender_ix].guest_nonce_counter;
+    explicit_bzero(decrypted_key, ONE_TIME_KEY_LEN);
 
     /* Displayed name format in GUI is always "xxxxNAME: MSG"            */
     /* Always 8 chars space for username and max_txt_len for msg, 1 row. */
@@ -2451,8 +3063,8 @@ u8 process_msg_30(u8* payload, u8* name_with_msg_string, u64* result_chars){
 
     /* Construct the string with name and message to be displayed on the GUI. */
     memcpy(name_with_msg_string, payload + SMALL_FIELD_LEN, SMALL_FIELD_LEN);
-    memcpy(name_with_msg_string, GUI_string_helper, 2);
-    memcpy(name_with_msg_string, decrypted_msg, text_len);
+    memcpy(name_with_msg_string + SMALL_FIELD_LEN, GUI_string_helper, 2);
+    memcpy(name_with_msg_string + SMALL_FIELD_LEN + 2, decrypted_msg, text_len);
 
 label_cleanup:
 
@@ -2491,6 +3103,8 @@ u8 construct_msg_40(void){
     const u64 payload_len = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
 
     u8 status = 1;
+    u8 sent;
+    u8 mac_mode = session_macs_ready;
     u8 payload[payload_len];
 
     memset(payload, 0, payload_len);
@@ -2500,11 +3114,15 @@ u8 construct_msg_40(void){
 
     //memcpy((payload + SMALL_FIELD_LEN), &own_ix, SMALL_FIELD_LEN);
 
-    /* Compute a cryptographic signature so Rosetta server authenticates us. */
-    Signature_GENERATE( 
-        M, Q, Gm, payload, 2 * SMALL_FIELD_LEN, 
-        payload + (2 * SMALL_FIELD_LEN), &own_privkey, PRIVKEY_LEN
-    );
+    /* With session MACs, tag it (and send it) instead of signing it. */
+    if(!mac_mode){
+
+        /* Compute a cryptographic signature so Rosetta server trusts us. */
+        Signature_GENERATE( 
+            M, Q, Gm, payload, 2 * SMALL_FIELD_LEN, 
+            payload + (2 * SMALL_FIELD_LEN), &own_privkey, PRIVKEY_LEN
+        );
+    }
 
     /* Connect to the Rosetta server. */
     /*
@@ -2517,7 +3135,14 @@ u8 construct_msg_40(void){
     }
 */
     /* Transmit our request to the Rosetta server. */
-    if(send(own_socket_fd, payload, payload_len, 0) == -1){
+    if(mac_mode){
+        sent = session_mac_send(payload, 2 * SMALL_FIELD_LEN);
+    }
+    else{
+        sent = (send(own_socket_fd, payload, payload_len, 0) != -1);
+    }
+
+    if(!sent){
         printf("[ERR] Client: Couldn't poll the server for anything new.\n\n");
         status = 0;
         goto label_cleanup;
@@ -2542,13 +3167,21 @@ label_cleanup:
 |=================|============================================================|
 | SMALL_FIELD_LEN |                        SIGNATURE_LEN                       |
 --------------------------------------------------------------------------------
+
+   Or with mac_mode, our poll having been a session-MAC'd one, the counter and
+   MAC tag in place of the signature. See init_session_macs().
 */
-u8 process_msg_40(u8* payload){
+u8 process_msg_40(u8* payload, u8 mac_mode){
 
     u8 status; 
 
-    /* Verify the server's signature first. */
-    status = authenticate_server(payload, SMALL_FIELD_LEN, SMALL_FIELD_LEN);
+    /* Verify the server's signature or session MAC first. */
+    if(mac_mode){
+        status = authenticate_server_mac(payload, SMALL_FIELD_LEN);
+    }
+    else{
+        status = authenticate_server(payload, SMALL_FIELD_LEN, SMALL_FIELD_LEN);
+    }
 
     if(status != 1){
         printf("[ERR] Client: Invalid signature in process_msg_40. Drop.\n\n");
@@ -2592,7 +3225,7 @@ u8 process_msg_50(u8* payload){
     }
 
     /* Find the index of the guest with this userID. */
-    for(u64 i = 0; i <= num_roommates - 2; ++i){
+    for(u64 i = 0; i <= MAX_CLIENTS - 2; ++i){
         if( roommate_slots_bitmask & BITMASK_BIT_ON_AT(i) ){
             
             /* if userID matches the one in payload */
@@ -2652,25 +3285,10 @@ label_cleanup:
     return status; 
 }
 
-/* Tell the Rosetta server that the user wants to leave the chatroom.
- 
- Client ----> Server
-  
-================================================================================
-| packet ID 50 |  user_ix  |                    SIGNATURE                      | 
-|==============|===========|===================================================|
-|  SMALL_LEN   | SMALL_LEN |                     SIG_LEN                       |
---------------------------------------------------------------------------------
-
-*/
-u8 construct_msg_50(void){
-
-    const u64 payload_len = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
-
-    u8 status = 1;
-    u8 payload[payload_len];
-
-    memset(payload, 0, payload_len);
+/* Forget everyone in our room and all keys we had with them. For whenever
+ * we're no longer in a room, however we came to leave it.
+ */
+void forget_roommates(void){
 
     for(u64 i = 0; i <= MAX_CLIENTS - 2; ++i){
 
@@ -2697,17 +3315,48 @@ u8 construct_msg_50(void){
     num_roommates              = 0;
     next_free_roommate_slot    = 0;
 
+    return;
+}
+
+/* Tell the Rosetta server that the user wants to leave the chatroom.
+ 
+ Client ----> Server
+  
+================================================================================
+| packet ID 50 |  user_ix  |                    SIGNATURE                      | 
+|==============|===========|===================================================|
+|  SMALL_LEN   | SMALL_LEN |                     SIG_LEN                       |
+--------------------------------------------------------------------------------
+
+*/
+u8 construct_msg_50(void){
+
+    const u64 payload_len = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
+
+    u8 status = 1;
+    u8 sent;
+    u8 mac_mode = session_macs_ready;
+    u8 payload[payload_len];
+
+    memset(payload, 0, payload_len);
+
+    forget_roommates();
+
     memset(own_user_id, 0, SMALL_FIELD_LEN);
 
     *((u64*)(payload)) = PACKET_ID_50;
 
     memcpy((payload + SMALL_FIELD_LEN), &own_ix, SMALL_FIELD_LEN);
 
-    /* Compute a cryptographic signature so Rosetta server authenticates us. */
-    Signature_GENERATE( 
-        M, Q, Gm, payload, 2 * SMALL_FIELD_LEN, 
-        payload + (2 * SMALL_FIELD_LEN), &own_privkey, PRIVKEY_LEN
-    );
+    /* With session MACs, tag it (and send it) instead of signing it. */
+    if(!mac_mode){
+
+        /* Compute a cryptographic signature so Rosetta server trusts us. */
+        Signature_GENERATE( 
+            M, Q, Gm, payload, 2 * SMALL_FIELD_LEN, 
+            payload + (2 * SMALL_FIELD_LEN), &own_privkey, PRIVKEY_LEN
+        );
+    }
 
     /* Connect to the Rosetta server. */
     /*
@@ -2720,7 +3369,14 @@ u8 construct_msg_50(void){
     }
 */
     /* Transmit our request to the Rosetta server. */
-    if(send(own_socket_fd, payload, payload_len, 0) == -1){
+    if(mac_mode){
+        sent = session_mac_send(payload, 2 * SMALL_FIELD_LEN);
+    }
+    else{
+        sent = (send(own_socket_fd, payload, payload_len, 0) != -1);
+    }
+
+    if(!sent){
         printf("[ERR] Client: Couldn't send request to leave the room.\n\n");
         status = 0;
         goto label_cleanup;
@@ -2761,30 +3417,7 @@ u8 process_msg_51(u8* payload){
         goto label_cleanup;           
     }
 
-    for(u64 i = 0; i <= MAX_CLIENTS - 2; ++i){
-
-        /* Make sure we deallocate any memory pointed to by pointers contained
-         * in the struct itself or by pointers in an object that's part of the
-         * struct BEFORE we zero out the descriptor itself.
-         */
-        if(roommate_slots_bitmask & BITMASK_BIT_ON_AT(i)){
-            memset(roommates[i].guest_user_id, 0, SMALL_FIELD_LEN);
-            free(roommates[i].guest_pubkey.bits);
-            free(roommates[i].guest_pubkey_mont.bits);
-            free(roommates[i].guest_KBA);
-            free(roommates[i].guest_KAB);
-            free(roommates[i].guest_Nonce);
-        }
-    }
-
-    /* Now zero out all global descriptors without the risk of memory leaks. */
-    memset(roommates, 0, (roommates_arr_siz * sizeof(struct roommate)));
-    
-    /* Reset the two global guest bitmasks and other bookkeeping information. */
-    roommate_slots_bitmask     = 0;
-    roommate_key_usage_bitmask = 0;
-    num_roommates              = 0;
-    next_free_roommate_slot    = 0;
+    forget_roommates();
 
     /* Cleanup. */
 label_cleanup:
@@ -2810,6 +3443,8 @@ u8 construct_msg_60(void){
     const u64 payload_len = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
 
     u8 status = 1;
+    u8 sent;
+    u8 mac_mode = session_macs_ready;
     u8 payload[payload_len];
 
     memset(payload, 0, payload_len);
@@ -2818,11 +3453,15 @@ u8 construct_msg_60(void){
 
     memcpy((payload + SMALL_FIELD_LEN), &own_ix, SMALL_FIELD_LEN);
 
-    /* Compute a cryptographic signature so Rosetta server authenticates us. */
-    Signature_GENERATE( 
-        M, Q, Gm, payload, 2 * SMALL_FIELD_LEN, 
-        payload + (2 * SMALL_FIELD_LEN), &own_privkey, PRIVKEY_LEN
-    );
+    /* With session MACs, tag it (and send it) instead of signing it. */
+    if(!mac_mode){
+
+        /* Compute a cryptographic signature so Rosetta server trusts us. */
+        Signature_GENERATE( 
+            M, Q, Gm, payload, 2 * SMALL_FIELD_LEN, 
+            payload + (2 * SMALL_FIELD_LEN), &own_privkey, PRIVKEY_LEN
+        );
+    }
 
     own_ix = 0;
 
@@ -2837,7 +3476,14 @@ u8 construct_msg_60(void){
     }
 */
     /* Transmit our request to the Rosetta server. */
-    if(send(own_socket_fd, payload, payload_len, 0) == -1){
+    if(mac_mode){
+        sent = session_mac_send(payload, 2 * SMALL_FIELD_LEN);
+    }
+    else{
+        sent = (send(own_socket_fd, payload, payload_len, 0) != -1);
+    }
+
+    if(!sent){
         printf("[ERR] Client: Couldn't send request to get logged off.\n\n");
         status = 0;
         goto label_cleanup;
@@ -2846,6 +3492,8 @@ u8 construct_msg_60(void){
         printf("[OK]  Client: Told the server we wanna get logged off.\n\n");
     }
 
+    release_session_macs();
+
 label_cleanup: 
 
     /* No function cleanup yet. Keep the label for completeness. */
@@ -2853,8 +3501,14 @@ label_cleanup:
     return status; 
 }
 
+/* It's further down, with the login it's a shortcut for. */
+u8 resume_session(void);
+
 void* begin_polling(void* input){
 
+    /* A thread function has to take it, but we've no use for it. */
+    (void)input;
+
     /* Construct the poll packet only once, and keep sending it. */
     
     u8  ret;
@@ -2870,6 +3524,9 @@ void* begin_polling(void* input){
 
     int64_t bytes_read;
 
+    u8  mac_mode;
+    u64 auth_len;
+
     struct timespec ts;
     ts.tv_sec  = 0;
     ts.tv_nsec = 200000000; /* 200,000,000 nanoseconds = 0.2 seconds */
@@ -2880,6 +3537,10 @@ void* begin_polling(void* input){
 
         printf("[OK] Client: Sending a poll request to the server!\n");
 
+        /* The reply comes back authenticated the same way as our poll. */
+        mac_mode = session_macs_ready;
+        auth_len = mac_mode ? SESSION_MAC_AUTH_LEN : SIGNATURE_LEN;
+
         ret = construct_msg_40();
 
         if(ret != 1){
@@ -2890,9 +3551,35 @@ void* begin_polling(void* input){
         /* Wait for server to tell us if there's anything for us unreceived. */
         bytes_read = recv(own_socket_fd, received_buf, MAX_MSG_LEN, 0);
 
+        /* The server hung up on us or the connection broke. Try to get our
+         * session back on a new one. If that doesn't work out, we're logged
+         * out, and there's nothing left to poll for.
+         */
+        if(bytes_read == 0 || (bytes_read == -1 && errno != EINTR)){
+
+            printf("[ERR] Client: Lost the connection to the server.\n\n");
+
+            if(resume_session() == 1){
+
+                if(session_status_hook){
+                    session_status_hook(SESSION_RESUMED);
+                }
+
+                goto loop_cleanup;
+            }
+
+            printf("[ERR] Client: Couldn't resume, stopped polling.\n\n");
+
+            if(session_status_hook){
+                session_status_hook(SESSION_LOST);
+            }
+
+            break;
+        }
+
         if( bytes_read == -1 
             || 
-            bytes_read < (int64_t)(SIGNATURE_LEN + SMALL_FIELD_LEN)
+            bytes_read < (int64_t)(auth_len + SMALL_FIELD_LEN)
           )
         {
             printf( "[ERR] Client: Failed to receive server's poll reply!\n\n");
@@ -2902,7 +3589,7 @@ void* begin_polling(void* input){
         /* Call the appropriate function depending on server's response. */
         if( *((u64*)(received_buf)) == PACKET_ID_40 ){
             printf("[OK] Client: Server said nothing new after polling.\n\n");
-            process_msg_40(received_buf);
+            process_msg_40(received_buf, mac_mode);
         }
 /*
 
@@ -2930,8 +3617,13 @@ void* begin_polling(void* input){
                 read_ix += block_len + SMALL_FIELD_LEN;
             }
 
-            /* Verify the cryptographic signature now. */
-            ret = authenticate_server(received_buf, read_ix, read_ix); 
+            /* Verify the cryptographic signature or session MAC now. */
+            if(mac_mode){
+                ret = authenticate_server_mac(received_buf, read_ix);
+            }
+            else{
+                ret = authenticate_server(received_buf, read_ix, read_ix); 
+            }
 
             if(ret != 1){
                 printf("[ERR] Client: Bad signature in polling reply.\n\n");   
@@ -2941,7 +3633,7 @@ void* begin_polling(void* input){
             /* Start at first message contents. */
             read_ix = 3 * SMALL_FIELD_LEN;
             
-            /* Valid pending message types: 50, 51, 21, 30 */
+            /* Valid pending message types: 50, 51, 21, 30, 31 */
 
             /* packet_ID and signature are valid - process each pending MSG. */
             for(u64 i = 0; i < pending_messages; ++i){
@@ -2966,7 +3658,10 @@ void* begin_polling(void* input){
                     read_ix += SMALL_FIELD_LEN + curr_msg_len;
                     continue;
                 }
-                else if(curr_msg_type == PACKET_ID_30){
+                else if(   curr_msg_type == PACKET_ID_30
+                        || curr_msg_type == PACKET_ID_31
+                       )
+                {
                     process_msg_30( received_buf + read_ix
                                    ,text_message_line
                                    ,&obtained_text_message_line_len
@@ -2989,6 +3684,8 @@ loop_cleanup:
         memset(received_buf, 0, MAX_MSG_LEN);
     }
 
+    free(received_buf);
+
     return NULL; 
 }
 
@@ -3011,7 +3708,12 @@ u8 reg(u8* password, int password_len){
     const u64 argon2_len_Salt = ARGON_STRING_LEN + 64;
     u64 save_offset = 0;
     const u64 save_len = 
-    ARGON_STRING_LEN + PUBKEY_LEN + PRIVKEY_LEN + LONG_NONCE_LEN;
+      SAVEFILE_HEADER_LEN 
+    + ARGON_STRING_LEN + PUBKEY_LEN + PRIVKEY_LEN + LONG_NONCE_LEN;
+
+    const u32 savefile_version = SAVEFILE_VERSION;
+    const u32 key_type = PK_TYPE_FFDH3072;
+    u32 argon2_p32, argon2_m32, argon2_t32;
 
     u8 status = 1;
     u8 privkey_buf          [PRIVKEY_LEN];
@@ -3026,8 +3728,7 @@ u8 reg(u8* password, int password_len){
 
     /* Salt = S || BLAKE2B{64}(A) */
     /* S is a random 8 byte string, so Salt length is 64+8 = 72 bytes. */
-    /* Access /dev/urandom for random 8-byte string S for Argon2 Salt. */
-    FILE* ranfile   = NULL;
+    /* Draw a random 8-byte string S for Argon2 Salt. */
     FILE* user_save = NULL;
 
     struct Argon2_parms prms;
@@ -3066,12 +3767,23 @@ u8 reg(u8* password, int password_len){
      *                      ChaCha20, to encrypt the user's private key.
      */
         
-    /* Fill in the parameters to Argon2. */
+    /* Fill in the parameters to Argon2. Let calibration on this machine
+     * pick p, m and t, so that logging in takes about ARGON2_TARGET_MS.
+     * If it can't, fall back to the parameters we always used to hard-code.
+     */
+
+    if( ! Argon2_CALIBRATE(ARGON2_TARGET_MS, ARGON2_MAX_MEM_KIB, &prms) ){
+        printf("[ERR] Client: Argon2 calibration failed, using defaults.\n");
+        prms.p = DEFAULT_ARGON2_P;
+        prms.m = DEFAULT_ARGON2_M;
+        prms.t = DEFAULT_ARGON2_T;
+    }
+
+    printf("[OK]  Client: Argon2 calibrated to p=%lu m=%lu KiB t=%lu\n\n"
+           ,prms.p, prms.m, prms.t
+          );
 
-    prms.p = 4;                 /* How many threads to use.             */
     prms.T = ARGON_HASH_LEN;    /* How many bytes of output we want.    */
-    prms.m = 2097000;           /* How many kibibytes of memory to use. */  
-    prms.t = 1;                 /* How many passes Argon2 should do.    */
     prms.v = 0x13;              /* Constant in Argon2 spec.             */
     prms.y = 0x02;              /* Constant in Argon2 spec.             */
              
@@ -3087,14 +3799,8 @@ u8 reg(u8* password, int password_len){
     /* Salt = S || BLAKE2B{64}(client's long-term public key)           */
     /* S is a random 8 byte string, so Salt length is 64+8 = 72 bytes.  */
 
-    ranfile = fopen("/dev/urandom", "r");
-
-    if(   (!ranfile) 
-       || (fread(argon2_salt_string, 1, ARGON_STRING_LEN, ranfile) 
-          != ARGON_STRING_LEN) 
-      )
-    {
-        printf("[ERR] Client: Reg failed to read urandom for salt string.\n\n");
+    if( ! CSPRNG_GET_BYTES(argon2_salt_string, ARGON_STRING_LEN) ){
+        printf("[ERR] Client: Reg failed to draw random salt string.\n\n");
         status = 0;
         goto label_cleanup;
     }
@@ -3142,7 +3848,13 @@ u8 reg(u8* password, int password_len){
     }
     printf("\n\n");
 
-    Argon2_MAIN(&prms, argon2_output_tag);
+    if(   !client_argon2_start(&prms, argon2_output_tag)
+       || client_argon2_wait() != ARGON2_RESULT_DONE
+      )
+    {
+        status = 0;
+        goto label_cleanup;
+    }
 
     /* Registration step 3: Let V be the leftmost 32 bytes of Argon2's hash.
      *                      Use V as a key in ChaCha20, along with a 
@@ -3154,8 +3866,8 @@ u8 reg(u8* password, int password_len){
     memcpy(V, argon2_output_tag, chacha_key_len);
 
     /* Get the Nonce. */
-    if(fread(chacha_nonce_buf, 1, LONG_NONCE_LEN, ranfile) != LONG_NONCE_LEN){
-        printf("[ERR] Client: Reg failed to read urandom. Alert GUI.\n\n");
+    if( ! CSPRNG_GET_BYTES(chacha_nonce_buf, LONG_NONCE_LEN) ){
+        printf("[ERR] Client: Reg failed to draw random nonce. Alert GUI.\n\n");
         status = 0;
         goto label_cleanup;
     }   
@@ -3187,6 +3899,22 @@ u8 reg(u8* password, int password_len){
 
     /* Prepare a buffer containing all the stuff to be saved for easy write. */
 
+    argon2_p32 = (u32)prms.p;
+    argon2_m32 = (u32)prms.m;
+    argon2_t32 = (u32)prms.t;
+
+    memcpy(user_save_buf + save_offset, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN);
+
+    save_offset += SAVEFILE_MAGIC_LEN;
+
+    memcpy(user_save_buf + save_offset, &savefile_version, 4);
+    memcpy(user_save_buf + save_offset + 4,  &argon2_p32, 4);
+    memcpy(user_save_buf + save_offset + 8,  &argon2_m32, 4);
+    memcpy(user_save_buf + save_offset + 12, &argon2_t32, 4);
+    memcpy(user_save_buf + save_offset + 16, &key_type,   4);
+
+    save_offset += 5 * sizeof(u32);
+
     memcpy(user_save_buf + save_offset, chacha_nonce_buf, LONG_NONCE_LEN);
 
     save_offset += LONG_NONCE_LEN;
@@ -3212,7 +3940,8 @@ u8 reg(u8* password, int password_len){
         }
     }
     printf("\n\n");
-    printf("[DEBUG] REG: It has 4 parts that are placed like so:\n\n");
+    printf("[DEBUG] REG: It has 5 parts that are placed like so:\n\n");
+    printf("[DEBUG] REG: Header (Argon2) : size = 24  bytes.\n");
     printf("[DEBUG] REG: ChaCha20  Nonce  : size = 16  bytes.\n");
     printf("[DEBUG] REG: Encrypted privkey: size = 40  bytes.\n");
     printf("[DEBUG] REG: Plaintext pubkey : size = 384 bytes.\n");
@@ -3228,10 +3957,6 @@ label_cleanup:
 
     system("rm temp_privkey.dat");
 
-    if(ranfile){ 
-        fclose(ranfile);   
-    }
-
     if(user_save){ 
         fclose(user_save); 
     }
@@ -3242,7 +3967,7 @@ label_cleanup:
 u8 login(u8* password, int password_len){
 
     u8 status;
-    u8 msg_buf[MAX_TXT_LEN];
+    u8 msg_buf[MAX_TXT_LEN + RESUME_TICKET_LEN];
 
     ssize_t bytes_read;
 
@@ -3306,9 +4031,9 @@ u8 login(u8* password, int password_len){
         status = 3;
     }
 
-    memset(msg_buf, 0, MAX_TXT_LEN);
+    memset(msg_buf, 0, sizeof(msg_buf));
 
-    bytes_read = recv(own_socket_fd, msg_buf, MAX_TXT_LEN, 0);
+    bytes_read = recv(own_socket_fd, msg_buf, sizeof(msg_buf), 0);
 
     if(bytes_read == -1){
         printf("[ERR] Client: Couldn't receive a reply to msg_01.\n\n");
@@ -3321,7 +4046,7 @@ u8 login(u8* password, int password_len){
 
         printf("[OK]  Client: Rosetta server told us login succeeded!\n\n");
 
-        if ((status = process_msg_01(msg_buf)) != 1){
+        if ((status = process_msg_01(msg_buf, (u64)bytes_read)) != 1){
             printf("[ERR] Client: process_msg_01 failed. Abort login.\n\n");
             return 0;
         }
@@ -3351,6 +4076,197 @@ u8 login(u8* password, int password_len){
     return status;
 }
 
+/* Our connection to the server dropped, but we were logged in and got a
+ * session resumption ticket then. Try to get that session back without the
+ * whole login handshake - no exponentiations on either side.
+ *
+ * The poller thread calls it when it sees the connection drop. It swaps our
+ * socket out, so nothing else may be using the socket at the time.
+ *
+ * Returns 1 if the session is back, with a new user_ix and, like after a
+ * login, in no room yet - the server took us out of ours with the old
+ * session, so we forget it here too. Returns 0 if not, for whatever reason -
+ * then just call login() as usual, the ticket is gone either way.
+ */
+
+/* 
+    Client ----> Server
+ 
+================================================================================
+| packet ID 03 | timestamp | Client nonce | Resumption ticket |   Ticket MAC   |
+|==============|===========|==============|===================|================|
+|  SMALL_LEN   | SMALL_LEN |   NONCE_LEN  |    TICKET_LEN     | SESSION_MAC_LEN|
+--------------------------------------------------------------------------------
+
+    Server ----> Client
+  
+================================================================================
+| ID 03 | user_ix | Client nonce | Server nonce | New ticket |       MAC       |
+|=======|=========|==============|==============|============|=================|
+| SMALL |  SMALL  |  NONCE_LEN   |  NONCE_LEN   | TICKET_LEN | SESSION_MAC_LEN |
+--------------------------------------------------------------------------------
+
+    or, if the server won't resume it:
+
+================================================================================
+| packet ID 04 |                         SIGNATURE                             |
+|==============|===============================================================|
+|  SMALL_LEN   |                          SIG_LEN                              |
+--------------------------------------------------------------------------------
+
+ * Our MAC is keyed with KAB, the server's with KBA.
+*/
+u8 resume_session(void){
+
+    const u64 send_len =   (2 * SMALL_FIELD_LEN) + RESUME_NONCE_LEN
+                         + RESUME_TICKET_LEN + SESSION_MAC_LEN;
+    const u64 reply_len =   (2 * SMALL_FIELD_LEN) + (2 * RESUME_NONCE_LEN)
+                          + RESUME_TICKET_LEN + SESSION_MAC_LEN;
+    const u64 ticket_offset = (2 * SMALL_FIELD_LEN) + RESUME_NONCE_LEN;
+
+    u64 timestamp = (u64)time(NULL);
+
+    u8 status = 0;
+    u8 send_buf[send_len];
+    u8 reply_buf[reply_len];
+
+    ssize_t bytes_read;
+
+    struct BLAKE2B_MAC_ctx mac_ctx;
+
+    if(!session_ticket_valid){
+        printf("[ERR] Client: No resumption ticket, do a full login.\n\n");
+        return 0;
+    }
+
+    /* It's good for one try only, the server remembers it was redeemed. */
+    session_ticket_valid = 0;
+
+    memset(send_buf,  0, send_len);
+    memset(reply_buf, 0, reply_len);
+
+    *((u64*)(send_buf)) = PACKET_ID_03;
+
+    memcpy(send_buf + SMALL_FIELD_LEN, &timestamp, SMALL_FIELD_LEN);
+
+    if( ! CSPRNG_GET_BYTES(send_buf + (2 * SMALL_FIELD_LEN), RESUME_NONCE_LEN)){
+        printf("[ERR] Client: Couldn't draw a resumption nonce.\n\n");
+        goto label_cleanup;
+    }
+
+    memcpy(send_buf + ticket_offset, session_ticket, RESUME_TICKET_LEN);
+
+    BLAKE2B_KEYED( KAB, SESSION_KEY_LEN
+                  ,send_buf, ticket_offset + RESUME_TICKET_LEN
+                  ,SESSION_MAC_LEN, send_buf + ticket_offset + RESUME_TICKET_LEN
+                 );
+
+    /* The old socket is dead. Get a new one and connect it. */
+    if(own_socket_fd != -1){
+        close(own_socket_fd);
+    }
+
+    own_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(own_socket_fd == -1){
+        printf("[ERR] Client: socket() failed for resumption.\n\n");
+        perror("errno:");
+        goto label_cleanup;
+    }
+
+    if( connect(own_socket_fd, (struct sockaddr*)&servaddr, sizeof(servaddr))
+        == -1 
+      )
+    {
+        printf("[ERR] Client: Couldn't reconnect to the Rosetta server.\n");
+        perror("connect() failed, errno: ");
+        goto label_cleanup;
+    }
+
+    if(send(own_socket_fd, send_buf, send_len, 0) == -1){
+        printf("[ERR] Client: Couldn't send the resumption request.\n\n");
+        goto label_cleanup;
+    }
+
+    bytes_read = recv(own_socket_fd, reply_buf, reply_len, 0);
+
+    if(bytes_read == (ssize_t)(SMALL_FIELD_LEN + SIGNATURE_LEN)
+       && *((u64*)reply_buf) == PACKET_ID_04
+      )
+    {
+        if(authenticate_server(reply_buf, SMALL_FIELD_LEN, SMALL_FIELD_LEN)==1){
+            printf("[OK]  Client: Server won't resume, do a full login.\n\n");
+        }
+        goto label_cleanup;
+    }
+
+    if(bytes_read != (ssize_t)reply_len || *((u64*)reply_buf) != PACKET_ID_03){
+        printf("[ERR] Client: Unexpected reply to resumption request.\n\n");
+        goto label_cleanup;
+    }
+
+    BLAKE2B_MAC_INIT(&mac_ctx, KBA, SESSION_KEY_LEN, SESSION_MAC_LEN);
+
+    if(    BLAKE2B_MAC_VERIFY( &mac_ctx
+                              ,reply_buf, reply_len - SESSION_MAC_LEN
+                              ,reply_buf + reply_len - SESSION_MAC_LEN
+                             ) != 1
+        || memcmp( reply_buf + (2 * SMALL_FIELD_LEN)
+                  ,send_buf  + (2 * SMALL_FIELD_LEN)
+                  ,RESUME_NONCE_LEN
+                 ) != 0
+      )
+    {
+        printf("[ERR] Client: Resumption reply isn't from the server.\n\n");
+        memset(&mac_ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
+        goto label_cleanup;
+    }
+
+    memset(&mac_ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
+
+    memcpy(&own_ix, reply_buf + SMALL_FIELD_LEN, SMALL_FIELD_LEN);
+
+    /* The server counts its nonces for us from the start again, as on a
+     * login, so we do too.
+     */
+    memset(nonce_bigint.bits, 0, MAX_BIGINT_SIZ / 8);
+
+    memcpy( nonce_bigint.bits
+           ,server_shared_secret.bits + (2 * SESSION_KEY_LEN)
+           ,LONG_NONCE_LEN
+          ); 
+          
+    nonce_bigint.used_bits = get_used_bits(nonce_bigint.bits, LONG_NONCE_LEN);
+    nonce_bigint.free_bits = MAX_BIGINT_SIZ - nonce_bigint.used_bits;
+
+    server_nonce_counter = 0;
+
+    /* Client nonce || server nonce, right next to each other in the reply. */
+    init_session_macs(reply_buf + (2 * SMALL_FIELD_LEN));
+
+    memcpy( session_ticket
+           ,reply_buf + (2 * SMALL_FIELD_LEN) + (2 * RESUME_NONCE_LEN)
+           ,RESUME_TICKET_LEN
+          );
+
+    session_ticket_valid = 1;
+
+    forget_roommates();
+
+    memset(own_user_id, 0, SMALL_FIELD_LEN);
+
+    status = 1;
+
+    printf("[OK]  Client: Session resumed! Our user index is: %lu\n\n", own_ix);
+
+label_cleanup:
+
+    explicit_bzero(send_buf,  send_len);
+    explicit_bzero(reply_buf, reply_len);
+
+    return status;
+}
+
 u8 make_new_chatroom(unsigned char* roomid, int roomid_len,
                      unsigned char* userid, int userid_len
                     )
@@ -3,6 +3,9 @@
 #include <adxintrin.h> /* for _addcarryx_u64() */
 #include "bigint.h"
 #include <time.h> /* for basic performance measurements */
+#include <sys/random.h> /* for getrandom() */
+#include <errno.h>
+#include <sys/mman.h> /* for Argon2's huge page working memory */
 
 /* Constants used in the implementation of Montgomery Modular Multiplication. */
 #define MONT_LIMB_SIZ 8                   /* Bytes in a Montgomery-space limb */
@@ -38,15 +41,21 @@ struct Argon2_parms{
     uint64_t len_X; /* Length of associated data in bytes.    <= (2^32) - 1  */   
 }; 
 
-/* Offsets into the input memory buffer for Argon2's multithreading function. */
-#define OFFSET_r  (sizeof(block_t*) + (0 * sizeof(uint64_t)))
-#define OFFSET_l  (sizeof(block_t*) + (1 * sizeof(uint64_t)))
-#define OFFSET_sl (sizeof(block_t*) + (2 * sizeof(uint64_t)))
-#define OFFSET_md (sizeof(block_t*) + (3 * sizeof(uint64_t)))
-#define OFFSET_t  (sizeof(block_t*) + (4 * sizeof(uint64_t)))
-#define OFFSET_y  (sizeof(block_t*) + (5 * sizeof(uint64_t)))
-#define OFFSET_p  (sizeof(block_t*) + (6 * sizeof(uint64_t)))
-#define OFFSET_q  (sizeof(block_t*) + (7 * sizeof(uint64_t)))
+/* What a worker needs to transform one segment of one lane of Argon2's
+ * memory matrix B[][]. One per lane. Only the worker that owns the lane ever
+ * touches it while Argon2 runs, updating r and sl as it goes.
+ */
+struct Argon2_lane_ctx{
+    block_t** B;  /* Pointers to the start of each lane (row) of B[][].      */
+    uint64_t  r;  /* Current pass number.                                    */
+    uint64_t  l;  /* This lane's number.                                     */
+    uint64_t  sl; /* Current slice number.                                   */
+    uint64_t  md; /* m', the total number of 1024-byte blocks in B[][].      */
+    uint64_t  t;  /* Total number of passes.                                 */
+    uint64_t  y;  /* Argon2 type.                                            */
+    uint64_t  p;  /* Total number of lanes.                                  */
+    uint64_t  q;  /* Number of 1024-byte blocks in one lane.                 */
+};
 
 /* Initialization vector of constants for BLAKE2b. Defined in the RFC spec. */
 const uint64_t BLAKE2B_IV[8] = {
@@ -341,6 +350,135 @@ void CHACHA20( uint8_t*  plaintext, uint32_t txt_len
     return;
 }
 
+/*****************************************************************************/
+/*              CHACHA20-BASED RANDOM NUMBER GENERATOR (DRBG)                */
+/*                                                                           */
+/*  Each thread owns a ChaCha20 keystream generator seeded from getrandom(). */
+/*  Random bytes are handed out of a buffer of keystream blocks, so asking   */
+/*  for a one-time key costs a memcpy, not an fopen/fread/fclose on urandom. */
+/*****************************************************************************/
+
+#define CSPRNG_BUF_BLOCKS   16
+#define CSPRNG_BUF_LEN      (64 * CSPRNG_BUF_BLOCKS)
+#define CSPRNG_RESEED_BYTES (1024 * 1024)
+
+struct CSPRNG_state{
+    u32 key[8];
+    u32 nonce[3];
+    u32 counter;
+    u8  buf[CSPRNG_BUF_LEN];
+    u64 buf_pos;
+    u64 bytes_since_seed;
+    u8  seeded;
+};
+
+__thread struct CSPRNG_state csprng_state;
+
+/* Draw a fresh ChaCha20 key and nonce for this thread's generator straight
+ * from the kernel. Returns 1 on success, 0 if getrandom() gave up on us.
+ */
+u8 CSPRNG_RESEED(void){
+
+    struct CSPRNG_state* st = &csprng_state;
+
+    u8   seed[sizeof(st->key) + sizeof(st->nonce)];
+    u64  got = 0;
+    long ret;
+
+    while(got < sizeof(seed)){
+
+        ret = getrandom(seed + got, sizeof(seed) - got, 0);
+
+        if(ret < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            printf("[ERR] Cryptolib: CSPRNG - getrandom() failed.\n\n");
+            memset(seed, 0, sizeof(seed));
+            return 0;
+        }
+        got += (u64)ret;
+    }
+
+    memcpy(st->key,   seed,                   sizeof(st->key));
+    memcpy(st->nonce, seed + sizeof(st->key), sizeof(st->nonce));
+    memset(seed, 0, sizeof(seed));
+
+    st->counter          = 0;
+    st->buf_pos          = CSPRNG_BUF_LEN; /* Nothing buffered yet. */
+    st->bytes_since_seed = 0;
+    st->seeded           = 1;
+
+    return 1;
+}
+
+/* Fill the buffer with the next CSPRNG_BUF_BLOCKS keystream blocks. The first
+ * 32 bytes immediately become the next key and are wiped from the buffer, so
+ * a later memory leak of this state can't be used to go back and recompute
+ * bytes that were already handed out (fast key erasure).
+ */
+void CSPRNG_REFILL(void){
+
+    struct CSPRNG_state* st = &csprng_state;
+
+    for(u64 i = 0; i < CSPRNG_BUF_BLOCKS; ++i){
+        CHACHA_BLOCK_FUNC( st->key,      8
+                          ,&st->counter, 1
+                          ,st->nonce,    3
+                          ,(u32*)(st->buf + (64 * i))
+                         );
+        ++(st->counter);
+    }
+
+    memcpy(st->key, st->buf, sizeof(st->key));
+    memset(st->buf, 0, sizeof(st->key));
+
+    st->counter = 0;
+    st->buf_pos = sizeof(st->key);
+
+    return;
+}
+
+/* Write len random bytes into out. Returns 1 on success, 0 on failure, in
+ * which case out must not be used - same contract the old fread() had.
+ */
+u8 CSPRNG_GET_BYTES(u8* out, u64 len){
+
+    struct CSPRNG_state* st = &csprng_state;
+
+    u64 chunk;
+
+    if( (!st->seeded) || (st->bytes_since_seed >= CSPRNG_RESEED_BYTES) ){
+        if(!CSPRNG_RESEED()){
+            return 0;
+        }
+    }
+
+    while(len > 0){
+
+        if(st->buf_pos == CSPRNG_BUF_LEN){
+            CSPRNG_REFILL();
+        }
+
+        chunk = CSPRNG_BUF_LEN - st->buf_pos;
+
+        if(chunk > len){
+            chunk = len;
+        }
+
+        /* Handed-out bytes don't stay behind in the buffer. */
+        memcpy(out, st->buf + st->buf_pos, chunk);
+        memset(st->buf + st->buf_pos, 0, chunk);
+
+        st->buf_pos          += chunk;
+        st->bytes_since_seed += chunk;
+        out                  += chunk;
+        len                  -= chunk;
+    }
+
+    return 1;
+}
+
 /*****************************************************************************/
 /*                   BLAKE2B IMPLEMENTATION BEGINS                           */
 /*                                                                           */
@@ -388,9 +526,16 @@ void BLAKE2B_F(uint64_t* h, uint64_t* m, uint64_t t, uint8_t f){
     v[12] ^= t;
     v[13] ^= 0;
 
-    if(f){ 
+    /* Bit 0 of f is the final block flag. Bit 1 is the last node flag, which
+     * only the tree hashing mode (BLAKE2bp) ever sets.
+     */
+    if(f & 1){ 
         v[14] = ~v[14]; 
     }
+
+    if(f & 2){
+        v[15] = ~v[15];
+    }
     
     for(uint8_t i = 0; i < 12; ++i){
         memcpy(s, (BLAKE2B_sigma[i % 12]), (16*sizeof(uint64_t)));
@@ -461,12 +606,9 @@ void BLAKE2B(uint64_t** d, uint64_t ll, uint64_t kk,
  * This function is the one that will be called by whoever
  * wants to use BLAKE2B in the first place. 
  *
- * NOTE: In the security scheme of my secure chat app, all uses
- *       of BLAKE2B are without a key, kk=0. So I will hardcode
- *       kk=0 for now because it gets complicated with it and
- *       the RFC reference implementation differs from the 
- *       provided pseudocode in the same document, which I'm
- *       following in order to implement this algorithm.
+ * NOTE: This is the UNKEYED interface, so kk is hardcoded to 0.
+ *       For keyed hashing (MACs) use BLAKE2B_MAC_INIT and
+ *       BLAKE2B_MAC below, which precompute the keyed state.
  *
  * The caller must provide:
  * m  - the raw message input.
@@ -520,1398 +662,5302 @@ void BLAKE2B_INIT(u8* m, u64 ll, u64 kk, u64 nn, u8* rr){
 
     return;
 }
-    
-/*****************************************************************************/
-/*                   Argon2id IMPLEMENTATION BEGINS                          */
-/*                                                                           */
-/*     The implementation is based on RFC 9106's theoretical description.    */
-/*****************************************************************************/ 
 
-/* NOTE: The arithmetic operations here are done modulo 2^64. 
- *       Since we're working with uint64_t's, this simply
- *       means we can let overflow happen and ignore it. 
+/* Keyed BLAKE2b, used as a MAC (RFC 7693 section 2.5 and 3.3).
+ *
+ * The key kk (1 to 64 bytes) is zero-padded to a full 128-byte block and
+ * processed as the very first data block, so everything the key contributes
+ * to the hash is fixed once the key is known. That means the whole keyed
+ * initial state can be computed ONCE per session key and kept in a context
+ * object, and then authenticating a message only costs one compression per
+ * 128 bytes of it, with no per-message setup and no heap allocations at all.
+ *
+ * This replaces the old HMAC construction (K0 XOR ipad / opad and two full
+ * passes of unkeyed BLAKE2b), which BLAKE2b was designed to make unnecessary.
+ *
+ * h_keyed is the state after compressing the key block (t = 128, not final).
+ * It's only usable if at least one message byte follows. For an empty message
+ * the key block itself is the final block, so keep the untouched parameter
+ * state h_param and the padded key block around for that one rare case.
  */
-void Argon2_GB(uint64_t *a, uint64_t *b, uint64_t *c, uint64_t *d){
+struct BLAKE2B_MAC_ctx{
+    u64 h_param  [8];  /* Chaining value after parameter block, before key. */
+    u64 h_keyed  [8];  /* Chaining value after the padded key block.        */
+    u64 key_block[16]; /* The key, zero-padded to one 128-byte block.       */
+    u64 nn;            /* How many bytes of output (tag length) we want.    */
+};
 
-    /*  In third ADD operand, take only the 32 least significant bits of a and b
-     *
-     *  Do this by: First dereferencing the pointer to its 64-bit version
-     *              Then  casting that to an unsigned 32-bit integer
-     *              Then  reading the result
-     *              Then  casting the result back to an unsigned 64-bit integer.
-     *
-     *  Assumes little-endian byte ordering in the machine of course.          
-     */
-    *a = (*a) + (*b) + ((u64)2 * ((u64)((u32)(*a))) * ((u64)((u32)(*b))));
-           
-    *d = (*d) ^ (*a);
-    
-    uint64_roll_right(d, 32);
-    
-    *c = (*c) + (*d) + ((u64)2 * ((u64)((u32)(*c))) * ((u64)((u32)(*d))));
-           
-    *b = (*b) ^ (*c);
-    
-    uint64_roll_right(b, 24);
-    
-    *a = (*a) + (*b) + ((u64)2 * ((u64)((u32)(*a))) * ((u64)((u32)(*b))));   
-             
-    *d = (*d) ^ (*a);
-    
-    uint64_roll_right(d, 16);
-    
-    *c = (*c) + (*d) + ((u64)2 * ((u64)((u32)(*c))) * ((u64)((u32)(*d))));   
-           
-    *b = (*b) ^ (*c);
-    
-    uint64_roll_right(b, 63);
-    
-    return;
-}
-    
-/* Takes eight 16-byte inputs and constructs a 2D array of 4x4 uint64_t's.  
- * Input is in the form of a 128-byte contiguous memory block.
- * It comes from rows or columns of the 2D array of 8x8 16-byte numbers
- * that was constructed in Argon2's G() from its 1024-byte input. 
+/* Precompute the keyed state. Call once per key, reuse for every message.
  *
- * NOTE: 2D arrays[][] are simply contiguos 1D arrays in memory, where
- *       the next row starts right beside the previous row, literally
- *       the immediate memory address. We can use this in our implementation
- *       by utilizing careful pointer programming. 
+ * key - the secret key, kk bytes.
+ * kk  - key length in bytes. Must be in [1, 64].
+ * nn  - tag length in bytes. Must be in [1, 64]. It is mixed into the
+ *       parameter block, so a tag of nn bytes is NOT simply a truncation
+ *       of the 64-byte tag. Both endpoints must agree on nn.
+ *
+ * Returns 1 on success, 0 on invalid lengths.
  */
-void Argon2_P(uint8_t* input_128){
- 
-    /* To make the calls to GB() more elegant, prepare
-     * the matrix of 4x4 uint64_t's in advance.
-     */
-    u64* matrix[16];
-    
-    for(size_t i = 0; i < 16; ++i){
-        matrix[i] = (uint64_t*)(input_128 + (i * 8));
+u8 BLAKE2B_MAC_INIT(struct BLAKE2B_MAC_ctx* ctx, u8* key, u64 kk, u64 nn){
+
+    if(kk < 1 || kk > 64 || nn < 1 || nn > 64){
+        printf("[ERR] Cryptolib: Invalid key or tag length for BLAKE2b MAC.\n");
+        return 0;
     }
-    
-    Argon2_GB((matrix[0]), (matrix[4]), (matrix[8]),  (matrix[12]));
-    Argon2_GB((matrix[1]), (matrix[5]), (matrix[9]),  (matrix[13]));
-    Argon2_GB((matrix[2]), (matrix[6]), (matrix[10]), (matrix[14]));
-    Argon2_GB((matrix[3]), (matrix[7]), (matrix[11]), (matrix[15]));
-    Argon2_GB((matrix[0]), (matrix[5]), (matrix[10]), (matrix[15]));
-    Argon2_GB((matrix[1]), (matrix[6]), (matrix[11]), (matrix[12]));
-    Argon2_GB((matrix[2]), (matrix[7]), (matrix[8]),  (matrix[13]));
-    Argon2_GB((matrix[3]), (matrix[4]), (matrix[9]),  (matrix[14]));
 
-    
-    return;
+    memset(ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
+
+    memcpy(ctx->h_param, BLAKE2B_IV, 8 * sizeof(uint64_t));
+    ctx->h_param[0] ^= 0x01010000 ^ (kk << 8) ^ nn;
+
+    memcpy(ctx->key_block, key, kk);
+
+    memcpy(ctx->h_keyed, ctx->h_param, 8 * sizeof(uint64_t));
+    BLAKE2B_F(ctx->h_keyed, ctx->key_block, 128, 0);
+
+    ctx->nn = nn;
+
+    return 1;
 }
 
-/* Compression function G() for Argon2. 
- *
- * Takes two 1024-byte blocks as input (X, Y).
- * Outputs one resulting 1024-byte block.
- *
- * Pass a pointer to where the output 1024-byte block is.
- *
- * Does not change the input memory blocks X and Y directly.
+/* Compute the keyed BLAKE2b tag of message m of ll bytes into tag (ctx->nn
+ * bytes). The context is not modified, so one context can be shared by many
+ * threads authenticating under the same key.
  */
-void Argon2_G(uint8_t* X, uint8_t* Y, uint8_t* out_1024){
+void BLAKE2B_MAC(struct BLAKE2B_MAC_ctx* ctx, u8* m, u64 ll, u8* tag){
+
+    u64 h[8];
+    u64 block[16];
+    u64 full_blocks;
+    u64 last_len;
+
+    /* Empty message - the padded key block is the final block. */
+    if(ll == 0){
+        memcpy(h, ctx->h_param, 8 * sizeof(uint64_t));
+        BLAKE2B_F(h, ctx->key_block, 128, 1);
+        memcpy(tag, h, ctx->nn);
+        return;
+    }
 
-    uint8_t matrix_R[1024];
-    uint8_t R_transformed[1024];
-    uint8_t Q_columns[1024];
-    uint8_t matrix_Z[1024];
-    size_t i; 
-    size_t j;
-    
-    for(i = 0; i < 1024; ++i){
-        matrix_R[i] = X[i] ^ Y[i]; 
-    }    
+    memcpy(h, ctx->h_keyed, 8 * sizeof(uint64_t));
 
-    /*  R is used at the end, so save it. Pass a copy of it to P() 
-     *  which itself will be transformed twice by P(), first into
-     *  matrix Q, then Q into matrix Z.
-     */
-    memcpy(R_transformed, matrix_R, 1024);
-    
-    /*  Use P() to transform matrix R into matrix Q.     
-     *  Each ROW of matrix R is fed as the input to P(), 
-     *  producing the respective rows of matrix Q.
-     */
-    for(i = 0; i < 8; ++i){
-        Argon2_P(R_transformed + (i * 128));  
-    }
-    
-    /*  Now further transform matrix Q into matrix Z.   
-     *  Each COLUMN of matrix Q is fed as input to P(), 
-     *  producing the respective columns of matrix Z.
-     *
-     *  Since columns are not contiguous in memory, we 
-     *  form new 128-byte buffers to serve as the 128-byte
-     *  contiguous memory block input to transformation P(),
-     *  the transformed output buffers we will use to construct 
-     *  matrix Z at the end.
-     */
-    for(i = 0; i < 8; ++i){ /* for each of the 8 rows in Q */
-        for(j = 0; j < 8; ++j){ /* for each 16-byte register in that row */
-            memcpy( Q_columns     + (j * 128) + (i * 16)
-                   ,R_transformed + (i * 128) + (j * 16)
-                   ,16
-                  );
-        }                    
-    }   
-    
-    /* Now that we have the columns of Q in eight contiguous 128-byte byffers,
-     * we are ready to feed them in P() transformation.
-     */
-    for(i = 0; i < 8; ++i){
-        Argon2_P(Q_columns + (i * 128));
-    }   
-    
-    /* Reconstruct the contiguous rows of Z. This is the final matrix. */
-    for(i = 0; i < 8; ++i){ /* for each column of matrix Q */
-        for(j = 0; j < 8; ++j){ /* for each 16-byte register in that column */
-            memcpy( matrix_Z  + (j * 128) + (i * 16)
-                   ,Q_columns + (i * 128) + (j * 16)
-                   ,16
-                  );
-        }                    
-    }   
-    
-    /* Final output is (matrix R XOR matrix Z). */
-    for(i = 0; i < 1024; ++i){
-        out_1024[i] = matrix_R[i] ^ matrix_Z[i];
+    /* All blocks but the last one are full 128-byte ones. */
+    full_blocks = (ll - 1) / 128;
+    last_len    = ll - (full_blocks * 128);
+
+    for(u64 i = 0; i < full_blocks; ++i){
+        memcpy(block, m + (i * 128), 128);
+        BLAKE2B_F(h, block, 128 + ((i + 1) * 128), 0);
     }
-   
+
+    memset(block, 0, 128);
+    memcpy(block, m + (full_blocks * 128), last_len);
+    BLAKE2B_F(h, block, 128 + ll, 1);
+
+    memcpy(tag, h, ctx->nn);
+
+    memset(block, 0, 128);
+    memset(h, 0, 8 * sizeof(uint64_t));
+
     return;
 }
-    
-void Argon2_H_dash(uint8_t* input,   uint8_t* output
-                  ,uint32_t out_len, uint64_t in_len
-                  )
-{  
-    /* We allocate memory for (r+1) 64-byte V[i]'s.                  
-     * We pass a pointer to the next 64-byte memory block V[i] 
-     * as the output destination of BLAKE2b.
-     */
-    uint32_t   r = ceil(out_len / 32) - 2;
-    block64_t* V = (block64_t*)calloc(1, (r+1) * sizeof(block64_t));
 
-    uint8_t*   H_input = (u8*)calloc(1, 4 + in_len);
-    
-    memcpy(H_input + 0, &out_len, sizeof(uint32_t)); 
-    memcpy(H_input + 4, input,    in_len); 
+/* Compute the tag of m and compare it against recv_tag in constant time, so
+ * a forger can't learn how many leading tag bytes they got right from timing.
+ *
+ * Returns 1 if the tags match, 0 if they don't.
+ */
+u8 BLAKE2B_MAC_VERIFY(struct BLAKE2B_MAC_ctx* ctx, u8* m, u64 ll, u8* recv_tag){
 
-    memset(output, 0, out_len);
+    u8 tag[64];
+    u8 diff = 0;
 
-    if(out_len <= 64){ 
-        BLAKE2B_INIT(H_input, (4 + in_len), 0, out_len, output);
+    BLAKE2B_MAC(ctx, m, ll, tag);
+
+    for(u64 i = 0; i < ctx->nn; ++i){
+        diff |= (tag[i] ^ recv_tag[i]);
     }
-    else{
-        
-        BLAKE2B_INIT(H_input, (4 + in_len), 0, 64, V[0].block_data);
 
-        for(uint64_t i = 1; i <= r-1; ++i){
-            BLAKE2B_INIT(V[i-1].block_data, 64, 0, 64, V[i].block_data);  
-        }
-        
-        BLAKE2B_INIT(
-                      V[r-1].block_data, 64, 0,
-                      (out_len-(32*r)), V[r].block_data
-                    );    
-
-        /* Construct a buffer of concatenated W1 || W2 ... || Wr || V_(r+1)  
-         * and place this result in the output target buffer of H_dash here. 
-         * Note, Wi is the 32 least significant bytes of 64-byte Vi. 
-         */ 
-        
-        /* Output buffer's size must be ((r * 4) + 8) bytes. Preallocated. */
-        for(uint64_t i = 0; i <= r-1; ++i){
-            memcpy(output + (32*i), V[i].block_data, 32);
-        }    
+    memset(tag, 0, 64);
+
+    return (diff == 0);
+}
 
-        memcpy(output + (32*r), V[r].block_data, 64);
+/* One-shot keyed BLAKE2b for callers that only ever use a key once. */
+void BLAKE2B_KEYED(u8* key, u64 kk, u8* m, u64 ll, u64 nn, u8* rr){
 
-        
+    struct BLAKE2B_MAC_ctx ctx;
+
+    if(BLAKE2B_MAC_INIT(&ctx, key, kk, nn) != 1){
+        return;
     }
 
-    /* Cleanup. */
-    free(H_input);
-    free(V);
+    BLAKE2B_MAC(&ctx, m, ll, rr);
+
+    memset(&ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
 
     return;
 }
 
-void argon2_initJ1J2_blockpool_for2i(u8* Z, block_t* blocks, u64 num_blocks){
+/* Streaming unkeyed BLAKE2b.
+ *
+ * For input that comes in pieces, like Argon2's H0 which is a dozen fields
+ * one after another, feed each piece to BLAKE2B_STREAM_UPDATE as it is
+ * instead of first concatenating them all into one heap buffer. Nothing is
+ * allocated, the whole state lives in the struct.
+ *
+ * The last 1 to 128 bytes fed in are always held back in block[], since
+ * until BLAKE2B_STREAM_FINAL we can't know whether they're the final block.
+ */
+struct BLAKE2B_stream{
+    u64 h[8];
+    u64 block[16];
+    u64 t;         /* Bytes compressed into h so far.         */
+    u64 buf_len;   /* Bytes waiting in block[].               */
+    u64 nn;        /* How many bytes of output we want, 1-64. */
+};
 
-    /* We are about to compute ( q / (128*SL) ) 1024-byte blocks. SL=4 slices.*/
-    /* Allocate memory for them after working out exactly how many to compute.*/
-    uint64_t G_inner_counter = 0;
+void BLAKE2B_STREAM_INIT(struct BLAKE2B_stream* st, u64 nn){
 
-    /* Some helpers for constructing the input to the usage of G() here. */
-    u8 zero1024[1024];
-    u8 zero968[968];
-               
-    /* Remember, Argon2 G() takes two 1024-byte blocks and outputs one block. */
-    u8 G_inner_input_2[1024]; /* 2nd arg. of inner G() call.  */
+    memcpy(st->h, BLAKE2B_IV, 8 * sizeof(uint64_t));
+    st->h[0] ^= 0x01010000 ^ nn;
 
-    u8 G_inner_output[1024];  /* outout of inner G() call,    */
-                              /* which is input to outer G(). */
+    memset(st->block, 0, 128);
 
-    memset(zero1024, 0, 1024);
-    memset(zero968,  0, 968 ); 
+    st->t       = 0;
+    st->buf_len = 0;
+    st->nn      = nn;
 
-    /* Initialize the buffer for 2nd input block to inner call of G(). */
-    memcpy(G_inner_input_2, Z, 6*sizeof(uint64_t));
-           
-    memcpy(G_inner_input_2 + (7*sizeof(uint64_t))
-          ,zero968
-          ,968
-          );
-          
-    /* Generate the 1024-byte blocks. */      
-    for(uint64_t i = 0; i < num_blocks; ++i){
-    
-        /* Increment the counter inside 2nd input to inner G() call. */
-        ++G_inner_counter;
-        
-        memcpy(G_inner_input_2 + (6*sizeof(uint64_t))
-              ,&G_inner_counter
-              ,sizeof(uint64_t)
-              );
-    
-        /* First do the inner G(), whose output is 2nd input to outer G(). */
-        Argon2_G(zero1024, G_inner_input_2, G_inner_output);
-        
-        /* Now the outer G() that generates this actual 1024-byte block. */
-        Argon2_G(zero1024, G_inner_output, (uint8_t*)(&(blocks[i])));  
-    }
-      
-    return; 
-} 
+    return;
+}
 
-uint64_t Argon2_getLZ(uint64_t r, uint64_t sl,  uint64_t cur_lane, 
-                      uint64_t p, uint32_t J_1, uint32_t J_2, 
-                      uint64_t n, uint64_t q,   uint64_t computed_blocks)
-{
-    u64 W_siz;
-    u64 x;
-    u64 y;
-    u64 zz;
-    u64 l_ix;
-    u64 z_ix;
-    u64 start_z_ix;
+void BLAKE2B_STREAM_UPDATE(struct BLAKE2B_stream* st, const u8* m, u64 len){
 
-    /* Get the lane index from which we will take blocks. */  
-    if(r == 0 && sl == 0){
-        l_ix = cur_lane;
-    }
-    else{
-        l_ix = J_2 % p;
-    }     
-    
-    /* Compute the size of W */
-    if(l_ix != cur_lane){
-    
-        W_siz = sl * n;  
-              
-        if(computed_blocks == 0){
-            --W_siz;
+    u64 take;
+
+    while(len > 0){
+
+        /* A full block is waiting and there's more after it, so it's not the
+         * final one. Compress it now.
+         */
+        if(st->buf_len == 128){
+            st->t += 128;
+            BLAKE2B_F(st->h, st->block, st->t, 0);
+            st->buf_len = 0;
         }
+
+        take = 128 - st->buf_len;
+
+        if(take > len){
+            take = len;
+        }
+
+        memcpy(((u8*)st->block) + st->buf_len, m, take);
+
+        st->buf_len += take;
+        m           += take;
+        len         -= take;
     }
-    else{
-    
-        W_siz = (sl * n) + computed_blocks;        
-        --W_siz; 
-    }
-    
-    /* Now pick one block index from W[]. This will be z in B[l][z]. */
-    start_z_ix = l_ix * q;
-    x  = (u64)(((double)(J_1 * J_1)) / (double)4294967296);
-    y  = (u64)(((double)(W_siz * x)) / (double)4294967296);
-    zz = W_siz - 1 - y;
-    z_ix = start_z_ix + zz; 
-  
-    return z_ix;
+
+    return;
 }
 
-/*  Each thread processes one segment of the Argon2 memory matrix B[][].
- *  A segment is the intersection of one of the 4 vertical slices, with
- *  a row. Therefore one segment contains many 1024-byte blocks. To be
- *  precise, ( (m' / p) / 4) 1024-byte blocks in a single segment.
+void BLAKE2B_STREAM_FINAL(struct BLAKE2B_stream* st, u8* out){
+
+    /* Zero-pad the final block. */
+    memset(((u8*)st->block) + st->buf_len, 0, 128 - st->buf_len);
+
+    st->t += st->buf_len;
+
+    BLAKE2B_F(st->h, st->block, st->t, 1);
+
+    memcpy(out, st->h, st->nn);
+
+    explicit_bzero(st, sizeof(struct BLAKE2B_stream));
+
+    return;
+}
+
+/* Multi-buffer BLAKE2b.
  *
- *  The operation of a single thread is the following:
- * 
- *  - Begin the loop that transforms each 1024-byte block in this segment.
- *
- *    Each cycle of that loop does the following:
+ * Hashes several INDEPENDENT messages at the same time, one message per SIMD
+ * lane: 8 lanes with AVX-512, 4 lanes with AVX2. Word j of the state vector
+ * v[] of every message lives in the same vector register, so one vector G
+ * function does the work of 4 or 8 scalar ones, and the per-message cost of
+ * the 12 rounds (which is all of the cost for the small inputs Rosetta hashes,
+ * like prehashes, H(a||PH) and H(R||PH)) drops by about the number of lanes.
  *
- *      - Compute J_1 and J_2 in one of 2 ways, using the provided thread input.
- *      - Use J_1 and J_2 to compute indices l and z.
- *      - Call compression function G(), transforming this 1024-byte block.
+ * The messages can have different lengths and different output lengths. A
+ * lane whose message has no more blocks simply has its chaining value frozen
+ * while the longer messages in the other lanes carry on.
  *
- *  Input buffer contains: Pointer to start of this thread's segment in B[][], 
- *                         as well as: r, l, sl, m', t, y, p, q; as uint64_t's.
+ * Without AVX2 this falls back to plain one-at-a-time BLAKE2B_INIT calls.
  */
-void* argon2_transform_segment(void* thread_input){
-   
-    u64 J_1 = 0;
-    u64 J_2 = 0;
-    u64 z_ix;
-    u64 n;
-    u64 j;
-    u64 j_start;
-    u64 j_end;
-    u64 computed_blocks = 0;
-    u64 cur_lane = *((uint64_t*)( ((uint8_t*)thread_input) + OFFSET_l  ));
-    u64 q        = *((uint64_t*)( ((uint8_t*)thread_input) + OFFSET_q  ));
-    u64 sl       = *((uint64_t*)( ((uint8_t*)thread_input) + OFFSET_sl ));
-    u64 r        = *((uint64_t*)( ((uint8_t*)thread_input) + OFFSET_r  ));
-    u64 p        = *((uint64_t*)( ((uint8_t*)thread_input) + OFFSET_p  ));
-    u64 md       = *((uint64_t*)( ((uint8_t*)thread_input) + OFFSET_md ));
-    u64 num_blocks = ceil((double)q / (double)(128 * 4));
-
-    /* The first thing in the thread's input buffer
-     * is a pointer to an array of pointers, each pointing to the start of 
-     * the respective lane in the working memory matrix B[][].
-     *
-     * First ever actual necessary use of a triple pointer. Wow.
-     */
-    block_t** B = *((block_t***)(thread_input));
-    block_t*  G_input_one;
-    block_t*  G_input_two;
-    block_t*  G_output;
-    block_t   old_block;
-    block_t*  J1J2blockpool = (block_t*)calloc(1, num_blocks * (1024));   
-    
-    u8 Z_buf[6 * sizeof(uint64_t)];
-    
-    memcpy(Z_buf, ((uint8_t*)thread_input) + OFFSET_r, (6 * sizeof(uint64_t)));
+#if defined(__AVX512F__)
 
-    /* Determine the start and end control values of this thread's j-loop.    
-     * In short, which quarter of this thread's row we're transforming,      
-     * in terms of THE INDICES of 1024-byte blocks where the 0th block is
-     * the very first block OF THIS LANE, not at the start of B[][]. 
-     *         
-     * This is in contrast to index z, which is the index of a 1024-byte block
-     * relative to the START OF B[][], not to the start of any particular lane.
-     */
+#define BLAKE2B_MB_LANES 8
 
-    /* Let n be the number of 1024-byte blocks in one segment = (m' / p)/4. */
-    n = (md / p) / 4;
-   
-    /* First block transformed relative to lane start will be (n * (sl + 0))  */
-    /* Last  block transformed relative to lane start will be (n * (sl + 1))-1*/  
-    j_start = n *  sl;
-    j_end   = n * (sl + 1);  
-    
-    if(r > 0){
-        goto label_further_passes;
-    }
-    
-    /* If at first slice (sl=0), we will do 2 fewer cycles of threaded loop, */
-    /* as the first 2 loop cycles in pass 0 are hardcoded and different.     */
-    if(sl == 0){
-        j_start = 2;
-        computed_blocks = 2;
-    } 
-    
-    argon2_initJ1J2_blockpool_for2i(Z_buf, J1J2blockpool, num_blocks); 
-    
-    for(j = j_start; j < j_end; ++j){
+typedef __m512i b2b_vec_t;
 
-        /* If pass number r=0 and slice number sl=0,1:  */
-        /* compute 32-bit values J_1, J_2 for Argon2i.  */
-        if( r == 0 && sl < 2 ){
-          
-            /* Extract J_1 and J_2. */
-            J_1 = *((u32*)(&(J1J2blockpool[0])));
-            
-            /* Offset is in terms of BYTES now! */
-            J_2 = *((u32*)(((u8*)J1J2blockpool) + (num_blocks * 512)));   
-        }   
-        /* Otherwise: get J_1, J_2 for Argon2d. */
-        else{
-            J_1 = *(((u32*)(&(B[cur_lane][j-1]))) + 0);
-            J_2 = *(((u32*)(&(B[cur_lane][j-1]))) + 1);
-        }
-        
-        z_ix = Argon2_getLZ(r, sl, cur_lane, p, J_1, J_2, n, q,computed_blocks);
-     
-        /* Now we're ready for this loop cycle's call to G(). */
-        
-        /* Prepare input arguments of G().
-         * These will be pointers directly to the two 1024-byte blocks
-         * that will be read by G() as its algorithmic input, and one
-         * pointer directly to the start of the 1024-byte block that
-         * G() will transform. They are of type block_t*
-         */
-        
-        /* j is the index of the block we're about to transform in this
-         * loop cycle RELATIVE TO THE START OF THE CURRENT LANE!!!
-         */ 
-        G_input_one = (B[0] + (cur_lane*q)) + (j-1);
-        G_output    = (B[0] + (cur_lane*q)) + (j);
-        
-        /* On the other hand, z is the index of the block we feed as second
-         * input to G() RELATIVE TO THE START OF B[][] ITSELF!! Not relative
-         * to the start of lane l_ix. l_ix was already taken into account
-         * when computing index z. It's relative to start of B[][].
-         */
-     
-        
-        G_input_two = B[0] + z_ix;
-        
-        Argon2_G((u8*)G_input_one, (u8*)G_input_two, (u8*)G_output); 
-        
-        ++computed_blocks;       
-    }
+#define B2B_MB_LOAD(p)      _mm512_load_si512((const void*)(p))
+#define B2B_MB_STORE(p, x)  _mm512_store_si512((void*)(p), (x))
+#define B2B_MB_SET1(x)      _mm512_set1_epi64((long long)(x))
+#define B2B_MB_ADD(a, b)    _mm512_add_epi64((a), (b))
+#define B2B_MB_XOR(a, b)    _mm512_xor_si512((a), (b))
+#define B2B_MB_AND(a, b)    _mm512_and_si512((a), (b))
+#define B2B_MB_ANDNOT(a, b) _mm512_andnot_si512((a), (b))
+#define B2B_MB_ROR32(x)     _mm512_ror_epi64((x), 32)
+#define B2B_MB_ROR24(x)     _mm512_ror_epi64((x), 24)
+#define B2B_MB_ROR16(x)     _mm512_ror_epi64((x), 16)
+#define B2B_MB_ROR63(x)     _mm512_ror_epi64((x), 63)
 
-    goto label_finish_segment;
-    
-label_further_passes:   
-    /* Always compute them for Argon2d here, as pass number r > 0 always. */
-    
-    /* STRANGE THING IN RFC EXPLANATION:
-     *
-     * It asks you to compute J_1 and J_2 for Argon2d for further passes, and
-     * this includes the process of computing the 0th block of the lane, but
-     * for Argon2d, J_1 and J_2 are the first and next 32 bits of the previous
-     * block, but in this case we're already at block index [0], so what did 
-     * they mean here as the previous block?? Do we use this block or go back
-     * one lane up or what?? 
-     *
-     * UPDATE: For now I just assume they're basing the block from which we 
-     *         take bytes for J1 and J2 on the first argument to G(), not 
-     *         the target block. Which would mean for block 0 here we take 
-     *         bytes from the LAST block of that lane for J1 and J2.
-     */
-     if(sl == 0){
-        J_1 = (uint64_t)*(((uint32_t*)(&(B[cur_lane][q-1]))) + 0);  
-        J_2 = (uint64_t)*(((uint32_t*)(&(B[cur_lane][q-1]))) + 1);
-        
-        /* We're populating W[] (the set of block indices we pick from when
-         * computing indices l and z) in this case from all blocks in this
-         * lane. I think? The RFC doesn't say anything specific about this.
-         */
-        computed_blocks = n;
-        sl = 3;
-        z_ix = Argon2_getLZ(r, sl, cur_lane, p, J_1, J_2, n, q,computed_blocks);
-        
-        G_input_one = (B[0] + (cur_lane*q)) + (q-1);
-        G_output    = (B[0] + (cur_lane*q));
-        G_input_two =  B[0] + z_ix;
-        
-        /* Before we let G() write to the output block, copy it over and save it
-         * here so we can later XOR the result G() wrote there with the old
-         * block that was there before G() overwrote it. XORing it with its old
-         * contents is the NEW NEW block that will ultimately reside there.
-         */
-        memcpy(&old_block, G_output, sizeof(block_t));
-      
-        Argon2_G((u8*)G_input_one, (u8*)G_input_two, (u8*)G_output); 
-                
-        /* XOR the result of G() with the old block. This is now the new block*/
-        for(size_t xr = 0; xr < 128; ++xr){
-            ((uint64_t*)G_output)[xr] ^= ((uint64_t*)(&old_block))[xr];
-        }  
+#elif defined(__AVX2__)
 
-        /* If at first slice (sl=0), we will do 1 cycle less of threaded loop */
-        /* as the first 1024-byte block in passes 1+ is hardcoded.            */
-        j_start = 1;
-        computed_blocks = 1;
-        sl = 0;
-    } 
+#define BLAKE2B_MB_LANES 4
 
-    for(j = j_start; j < j_end; ++j){
+typedef __m256i b2b_vec_t;
 
-        J_1 = (uint64_t)*(((uint32_t*)(&(B[cur_lane][j-1]))) + 0);  
-        J_2 = (uint64_t)*(((uint32_t*)(&(B[cur_lane][j-1]))) + 1);
+#define B2B_MB_LOAD(p)      _mm256_load_si256((const __m256i*)(p))
+#define B2B_MB_STORE(p, x)  _mm256_store_si256((__m256i*)(p), (x))
+#define B2B_MB_SET1(x)      _mm256_set1_epi64x((long long)(x))
+#define B2B_MB_ADD(a, b)    _mm256_add_epi64((a), (b))
+#define B2B_MB_XOR(a, b)    _mm256_xor_si256((a), (b))
+#define B2B_MB_AND(a, b)    _mm256_and_si256((a), (b))
+#define B2B_MB_ANDNOT(a, b) _mm256_andnot_si256((a), (b))
 
-        z_ix = Argon2_getLZ(r, sl, cur_lane, p, J_1, J_2, n, q,computed_blocks);
+/* No 64-bit rotate in AVX2. Rotations by whole bytes are byte shuffles. */
+#define B2B_MB_ROR32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
 
-        G_input_one = (B[0] + (cur_lane*q)) + (j-1);
-        G_output    = (B[0] + (cur_lane*q)) + (j);       
-        G_input_two =  B[0] + z_ix;
-                
-        /* Before we let G() write to the output block, copy it over and save it
-         * here so we can later XOR the result G() wrote there with the old
-         * block that was there before G() overwrote it. XORing it with its old
-         * contents is the NEW NEW block that will ultimately reside there.
-         */
-        memcpy(&old_block, G_output, sizeof(block_t));
-        
-        Argon2_G((u8*)G_input_one, (u8*)G_input_two, (u8*)G_output); 
-        
-        /* XOR the result of G() with the old block. This is now the new block*/
-        for(size_t xr = 0; xr < 128; ++xr){
-            ((u64*)G_output)[xr] ^= ((u64*)(&old_block))[xr];
-        }  
-        
-        ++computed_blocks;           
-    }    
-    
-label_finish_segment:
+#define B2B_MB_ROR24(x) _mm256_shuffle_epi8((x), _mm256_setr_epi8(    \
+         3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,         \
+         3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
 
-    free(J1J2blockpool); 
+#define B2B_MB_ROR16(x) _mm256_shuffle_epi8((x), _mm256_setr_epi8(    \
+         2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,         \
+         2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
 
-    return NULL;
-}
-   
-void Argon2_MAIN(struct Argon2_parms* parms, uint8_t* output_tag){
-    
-    void** thread_inputs;
+#define B2B_MB_ROR63(x) \
+        _mm256_or_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
 
-    pthread_t* argon2_thread_ids;
+#else
 
-    /* Length of input to the generator of 64-byte H0, BLAKE2B() in our case. */
-    u64 H0_input_len =  (10 * sizeof(u32))
-                       + parms->len_P + parms->len_S
-                       + parms->len_K + parms->len_X
-                     ;
+#define BLAKE2B_MB_LANES 1
 
-    /* How many 1024-byte blocks in B. */
-    u64 m_dash = 4 * parms->p * floor(parms->m / (4 * parms->p));
-    
-    /* How many columns in B. Also size of one row in 1024-byte blocks. */
-    /* Each column intersecting a row is one 1024-byte block.           */
-    u64 q = m_dash / parms->p;  
+#endif
+
+/* One independent message for the multi-buffer interface. */
+struct BLAKE2B_MB_job{
+    u8* m;   /* The raw message input.                                  */
+    u64 ll;  /* Length in bytes of the input message.                   */
+    u64 nn;  /* How many bytes of output we want. Must be in [1, 64].   */
+    u8* rr;  /* Result buffer. Must have been allocated with nn bytes.  */
+};
 
-    u64 r = 0;  
+/* What one lane of the multi-buffer engine hashes. A plain BLAKE2b message
+ * is the special case of contiguous blocks, the sequential-mode parameter
+ * block and no last node flag. The leaves of BLAKE2bp use the rest: their
+ * blocks are interleaved with the other leaves' blocks in the input, they
+ * have tree parameters, and the last leaf sets the last node flag.
+ */
+struct BLAKE2B_MB_lane{
+    u8* m;          /* Start of this lane's first block.                   */
+    u64 ll;         /* Total bytes hashed by this lane.                    */
+    u64 nn;         /* How many bytes of output we want from this lane.    */
+    u8* rr;         /* Result buffer, nn bytes.                            */
+    u64 stride;     /* Bytes from the start of one block to the next one.  */
+    u64 param[3];   /* First 3 words of the parameter block, RFC 7693 2.8 */
+    u64 last_node;  /* All 1s if this is the last node of its tree level.  */
+};
 
-    /* Input to the generator of H0. */
-    u8* H0_input = (u8*)calloc(1, H0_input_len);
+/* Hash a single lane with the scalar compression function. */
+void BLAKE2B_LANE(struct BLAKE2B_MB_lane* lane){
 
-    u8  final_block_C[sizeof(block_t)];
-    u8  H0[64];
-    u8* working_memory;
-    u8  B_init_buf[64 + 4 + 4];
+    u64 h[8];
+    u64 block[16];
+    u64 dd = (lane->ll == 0) ? 1 : ((lane->ll + 127) / 128);
+    u64 len;
 
-    u32 zero = 0;
-    u32 one = 1;
+    memcpy(h, BLAKE2B_IV, 8 * sizeof(uint64_t));
 
-    size_t H0_in_offset;
-    size_t thread_in_offset;
+    for(uint8_t i = 0; i < 3; ++i){
+        h[i] ^= lane->param[i];
+    }
 
-    block_t** B;
+    for(u64 i = 0; i < dd; ++i){
 
-    /* Construct the input buffer to H{64}() that generates 64-byte H0. */
-    /* The order has to be exactly as specified in the RFC.             */
+        memset(block, 0, 128);
 
-    memcpy(H0_input +  0, &(parms->p),     4);
-    memcpy(H0_input +  4, &(parms->T),     4);
-    memcpy(H0_input +  8, &(parms->m),     4);
-    memcpy(H0_input + 12, &(parms->t),     4);
-    memcpy(H0_input + 16, &(parms->v),     4);
-    memcpy(H0_input + 20, &(parms->y),     4);
-    memcpy(H0_input + 24, &(parms->len_P), 4);
+        len = (i == dd - 1) ? (lane->ll - (i * 128)) : 128;
 
-    H0_in_offset = 28;
+        memcpy(block, lane->m + (i * lane->stride), len);
 
-    memcpy((H0_input + H0_in_offset), parms->P, parms->len_P);
-    
-    H0_in_offset += parms->len_P;
-    
-    memcpy(H0_input + H0_in_offset, &(parms->len_S), 4);
-    
-    H0_in_offset += 4;
-    
-    memcpy((H0_input + H0_in_offset), parms->S, parms->len_S);
-    
-    H0_in_offset += parms->len_S;
-    
-    memcpy(H0_input + H0_in_offset, &(parms->len_K), 4);
-    
-    H0_in_offset += 4;
-    
-    if(parms->len_K){
-        memcpy((H0_input + H0_in_offset), parms->K, parms->len_K);
-        H0_in_offset += parms->len_K; 
-    }
-    
-    memcpy(H0_input + H0_in_offset, &(parms->len_X), 4);
-    
-    H0_in_offset += 4;
-    
-    if(parms->len_X){
-        memcpy((H0_input + H0_in_offset), parms->X, parms->len_X);
-        H0_in_offset += parms->len_X;  
+        if(i == dd - 1){
+            BLAKE2B_F(h, block, lane->ll, (lane->last_node ? 3 : 1));
+        }
+        else{
+            BLAKE2B_F(h, block, (i + 1) * 128, 0);
+        }
     }
-    
-    /* The offset also tells us the total length of the input to H{64}() now.*/
-    
-    /* Generate H_0 now. */
-    BLAKE2B_INIT(H0_input, H0_in_offset, 0, 64, H0);
 
-    /* Construct the working memory of Argon2 now. */
-                          
-    /* The best we can do to help simplify the pointer arithmetic here is to 
-     * set a pointer to each row of the B[][] memory matrix. Each row consists
-     * of many 1024-byte blocks, but at least we will be able to directly use
-     * the [index] notation when accessing B[][] for the "get to row X" part
-     * as described in the Argon2 RFC specification, ie the first bracket.
-     *
-     * For the second bracket where B[][] is used in the specification, we will
-     * use a specially defined struct that only has a 1024-byte array in it
-     * and typedef'd as block_t. This changes the behind-the-scenes multiplier
-     * of the C compiler's pointer arithmetic to (* 1024), just like it would
-     * do (* 4) behind the scenes for a pointer to uint32_t.
-     *
-     * To work inside a particular 1024-byte block, we will likely need actual
-     * carefully written pointer arithmetic.
-     */
-    
-    /* Allocate the working memory matrix of Argon2. */
-    working_memory = (u8*)calloc(1, m_dash * sizeof(block_t));
-    
-    /* Split the memory matrix into p rows by setting pointers to the 
-     * start of each row. Each row has many 1024-byte blocks. 
-     */
-    B = (block_t**)calloc(1, parms->p * sizeof(block_t*));
-    
-    /* Set a pointer to the start of each row in the memory matrix. */
-    for(uint64_t i = 0; i < parms->p; ++i){
-        B[i] = (block_t*)(working_memory + (i * (q * sizeof(block_t))));
+    memcpy(lane->rr, h, lane->nn);
+
+    return;
+}
+
+#if BLAKE2B_MB_LANES > 1
+
+#define B2B_MB_G(v, a, b, c, d, x, y)                       \
+do{                                                         \
+    v[a] = B2B_MB_ADD(B2B_MB_ADD(v[a], v[b]), (x));         \
+    v[d] = B2B_MB_ROR32(B2B_MB_XOR(v[d], v[a]));            \
+    v[c] = B2B_MB_ADD(v[c], v[d]);                          \
+    v[b] = B2B_MB_ROR24(B2B_MB_XOR(v[b], v[c]));            \
+    v[a] = B2B_MB_ADD(B2B_MB_ADD(v[a], v[b]), (y));         \
+    v[d] = B2B_MB_ROR16(B2B_MB_XOR(v[d], v[a]));            \
+    v[c] = B2B_MB_ADD(v[c], v[d]);                          \
+    v[b] = B2B_MB_ROR63(B2B_MB_XOR(v[b], v[c]));            \
+}while(0)
+
+/* The compression function F, on all lanes at once. Lane i of t, f and l are
+ * the byte counter, the final block flag and the last node flag of lane i.
+ * The flags are all 1s or all 0s. Lanes that are 0 in the active mask get
+ * their chaining value left alone.
+ */
+void BLAKE2B_F_MB(b2b_vec_t* h, b2b_vec_t* m, b2b_vec_t t, b2b_vec_t f
+                 ,b2b_vec_t l, b2b_vec_t active)
+{
+    b2b_vec_t v[16];
+    const uint64_t* s;
+
+    for(uint8_t i = 0; i < 8; ++i){
+        v[i]     = h[i];
+        v[i + 8] = B2B_MB_SET1(BLAKE2B_IV[i]);
     }
-    
-    /* Now where B[x][y] is used in the RFC specification, here in this
-     * implementation it too can be written as B[x][y], which would mean
-     * to the compiler "start from contents of memory address B, wherein is a
-     * pointer to a 1024-byte block. Go +x such pointers into B, to get to the
-     * actual row x in Argon2's working memory matrix B[][]. Then from
-     * this pointer to a 1024-byte block, go +y such blocks, to the 
-     * exact 1024-byte block you need and dereference the pointer to it." 
-     *
-     * All while keeping the entire memory (all p rows of 1024-byte blocks)
-     * contiguous in the process memory as required in the RFC specification
-     * in order for the security of the hashing algorithm to work.
-     */
-        
-    memcpy(B_init_buf + 0 , H0, 64); 
-    memcpy(B_init_buf + 64, &zero, 4);
 
+    /* Same as the scalar version, the high 64 bits of t are always zero. */
+    v[12] = B2B_MB_XOR(v[12], t);
+    v[14] = B2B_MB_XOR(v[14], f);
+    v[15] = B2B_MB_XOR(v[15], l);
+
+    for(uint8_t i = 0; i < 12; ++i){
+        s = BLAKE2B_sigma[i];
 
+        B2B_MB_G(v, 0, 4, 8,  12, m[s[0]],  m[s[1]]);
+        B2B_MB_G(v, 1, 5, 9,  13, m[s[2]],  m[s[3]]);
+        B2B_MB_G(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+        B2B_MB_G(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
 
-    for(uint32_t i = 0; i < parms->p; ++i){
-        memcpy(B_init_buf + 64 + 4, &i, 4);   
-        Argon2_H_dash(B_init_buf, (uint8_t*)&(B[i][0]), 1024, (64+4+4));
+        B2B_MB_G(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+        B2B_MB_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        B2B_MB_G(v, 2, 7, 8,  13, m[s[12]], m[s[13]]);
+        B2B_MB_G(v, 3, 4, 9,  14, m[s[14]], m[s[15]]);
     }
-    
-    memcpy(B_init_buf + 64, &one, 4);
-    
-    for(uint32_t i = 0; i < parms->p; ++i){
-        memcpy(B_init_buf + 64 + 4, &i, 4); 
-        Argon2_H_dash(B_init_buf, (uint8_t*)&(B[i][1]), 1024, (64+4+4));
+
+    for(uint8_t i = 0; i < 8; ++i){
+        h[i] = B2B_MB_XOR(
+                   B2B_MB_AND(active, B2B_MB_XOR(h[i], B2B_MB_XOR(v[i], v[i+8])))
+                  ,B2B_MB_ANDNOT(active, h[i])
+               );
     }
 
-    /* Counter that keeps track of which Argon2 pass we are currently on. */
-    r = 0;
-    
-    /* Each of the 4 vertical slices is computed and finished before the next
-     * slice's threads can begin. All threads process their 1/4 rows in that
-     * slice in parallel.
+    return;
+}
+
+/* Hash up to BLAKE2B_MB_LANES lanes at once. Unused lanes stay idle. */
+void BLAKE2B_MB_GROUP(struct BLAKE2B_MB_lane* lanes, u64 num_lanes){
+
+    u64 words [16][BLAKE2B_MB_LANES] __attribute__((aligned(64)));
+    u64 t_arr    [BLAKE2B_MB_LANES]  __attribute__((aligned(64)));
+    u64 f_arr    [BLAKE2B_MB_LANES]  __attribute__((aligned(64)));
+    u64 l_arr    [BLAKE2B_MB_LANES]  __attribute__((aligned(64)));
+    u64 act_arr  [BLAKE2B_MB_LANES]  __attribute__((aligned(64)));
+    u64 block    [16];
+    u64 dd       [BLAKE2B_MB_LANES];
+    u64 max_dd = 0;
+    u64 offset;
+    u64 len;
+
+    b2b_vec_t h[8];
+    b2b_vec_t m[16];
+
+    /* Number of 128-byte blocks per lane. An empty message is still hashed
+     * as one all-zero block, as the RFC says.
      */
-    
-    /* Create p thread_id's - one for each thread we will run. */
-    argon2_thread_ids = (pthread_t*)calloc(1, parms->p * sizeof(pthread_t));
-    
-    /* Offset into the input buffer of Argon2 threads. */
-    thread_in_offset = 0;
-    
-    /* Allocate input buffers for each thread.                    */
-    /* Each input buffer will contain a pointer and 8 uint64_t's. */
-    thread_inputs = (void**)calloc(1, parms->p * sizeof(void*));
-    
-    for(uint32_t i = 0; i < parms->p; ++i){
-        thread_inputs[i] = calloc(1, sizeof(block_t*) + (8 * sizeof(uint64_t)));
+    for(u64 j = 0; j < BLAKE2B_MB_LANES; ++j){
+
+        if(j < num_lanes){
+            dd[j] = (lanes[j].ll == 0) ? 1 : ((lanes[j].ll + 127) / 128);
+        }
+        else{
+            dd[j] = 0;
+        }
+
+        if(dd[j] > max_dd){
+            max_dd = dd[j];
+        }
     }
-    
-label_start_pass:
 
-    // printf("ARGON2id at CURRENT PASS r = %lu\n", r);
-     
-    for (uint64_t sl = 0; sl < 4; ++sl){ /* slice number. */
-        //printf("\tARGON2id at CURRENT SLICE sl = %lu\n", sl);
-        for(uint64_t i = 0; i < parms->p; ++i){ /* lane/thread number. */
-           // printf("\t\tARGON2id now starting LANE = %lu\n", i);        
-            /*  Third for-loop 3.1 that will:                            
-             *  Set loose a thread for each row of blocks in the matrix.    
-             *  21845 1024-byte blocks will be processed by each thread. 
-             *  provided 2 gigibytes of memory usage and 24 threads.     
-             *
-             *  Each thread will call G() in a for-loop going over each
-             *  1024-block in that segment of the working memory matrix.
-             * 
-             *  For that reason, each thread will need INPUT:
-             * 
-             *  - Pointer to start of segment to be transformed by that thread,
-             *    based on which we will take G()'s i/o 1024-byte blocks.
-             *  - Parameters that are constant during a thread's operatrion for
-             *    computing J_1 and J_2 for Argon2i: r, l, sl, m', t, y, p, q
-             *       
-             *  Third for-loop 3.2 that will join all threads before the  
-             *  the next set of threads can be set loose on next vertical 
-             *  slice (set of segments, each of which is a set of 1024-byte 
-             *  blocks) of the working memory matrix B[][].
-             */
-             
-             
-            /* Populate this thread's input buffer before starting it. */
-            
-            /* First is a pointer to the start of the memory matrix B[][]. */
-            *((block_t***)(((u8*)(thread_inputs[i])) + 0)) = B;
-            
-            /* Offset in bytes into the thread's input buffer. */
-            thread_in_offset = sizeof(block_t*);
-           
-            
-            /* Second is r, the current pass number. */
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = r;   
-            thread_in_offset += sizeof(u64);
-            
-            /* Third is l, the current lane number. */
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = i;
-            thread_in_offset += sizeof(u64);
-            
-            /* Fourth is sl, the current slice number. */ 
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = sl;
-            thread_in_offset += sizeof(u64);
-            
-            /* Now m', the total number of 1024-byte blocks in the matrix. */
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = m_dash;   
-            thread_in_offset += sizeof(u64);
-            
-            /* Sixth is t, the total number of passes. */
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = parms->t;
-            thread_in_offset += sizeof(u64);
-            
-            /* Seventh is y, the Argon2 type. */
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = parms->y;
-            thread_in_offset += sizeof(u64);
-            
-            /* Eighth is p, the total number of threads Argon2 should use. */
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = parms->p;
-            thread_in_offset += sizeof(u64);
-            
-            /* Ninth is q, the total number of 1024-byte blocks in 1 row. */
-            *((u64*)(((u8*)(thread_inputs[i])) + thread_in_offset)) = q;
-            thread_in_offset += sizeof(u64);
-            
-            /* Now that the input buffer for this thread is ready, start it. */
-            pthread_create(
-                 &(argon2_thread_ids[i])
-                ,NULL
-                ,argon2_transform_segment
-                ,thread_inputs[i]
-            );
+    /* Per-lane parameter blocks. */
+    for(uint8_t i = 0; i < 8; ++i){
+        for(u64 j = 0; j < BLAKE2B_MB_LANES; ++j){
+            t_arr[j] = BLAKE2B_IV[i];
+            if(i < 3 && j < num_lanes){
+                t_arr[j] ^= lanes[j].param[i];
+            }
         }
-        
-        /* After the previous loop starts all threads, this loop joins them. 
-         * All segments of this slice of the memory matrix must be finished 
-         * before any thread can start processing its segment of next slice.
-         */
-        for(uint64_t i = 0; i < parms->p; ++i){
-            pthread_join(argon2_thread_ids[i], NULL);    
-        } 
-        printf("------------- ARGON2: Slice %lu finished. -------------\n", sl);
-    } /* End of one slice. */
-
-    /*
-    printf("END OF PASS [%lu] BLOCK 0:\n\n", r);
-       for(uint32_t i = 0; i < 1024; ++i){
-        if(i % 16 == 0 && i > 0){printf("\n");}
-        printf("%02x ", ( ((uint8_t*)(&(B[0][0])))[i] )) ;
-    }
-    printf("\n\n"); 
-    printf("END OF PASS [%lu] BLOCK 31:\n\n", r);
-       for(uint32_t i = 0; i < 1024; ++i){
-        if(i % 16 == 0 && i > 0){printf("\n");}
-        printf("%02x ", ( ((uint8_t*)(&(B[3][7])))[i] )) ;
+        h[i] = B2B_MB_LOAD(t_arr);
     }
-    printf("\n\n"); 
-    */
 
-    /* Finished all 4 slices of a pass. Increment pass number.*/
-    ++r;
-    
-    /* If Argon2 is to perform more than the zeroth pass, do them. */
-    if (r < parms->t){
-        goto label_start_pass;    
-    }
-    
-    /* Done with all required passes. */
-    /* Compute final 1024-byte block C by XORing the last block of every lane.*/ 
- 
-    memcpy(final_block_C, &(B[0][q-1]), 1024);
-    
-    /*
-    printf("last column blocks of B[][] at end of 1st pass:\n");
-    for(size_t ln = 0; ln < parms->p; ++ln){
-            printf("LAST 1024-byte BLOCK IN LANE %lu:\n", ln);
-               for(uint32_t i = 0; i < 1024; ++i){
-                if(i % 16 == 0 && i > 0){printf("\n");}
-                printf("%02x ", ( ((uint8_t*)(&(B[ln][q-1])))[i] )) ;
+    for(u64 i = 0; i < max_dd; ++i){
+
+        for(u64 j = 0; j < BLAKE2B_MB_LANES; ++j){
+
+            memset(block, 0, 128);
+
+            t_arr  [j] = 0;
+            f_arr  [j] = 0;
+            l_arr  [j] = 0;
+            act_arr[j] = 0;
+
+            if(i < dd[j]){
+
+                offset = i * 128;
+                len    = (i == dd[j] - 1) ? (lanes[j].ll - offset) : 128;
+
+                memcpy(block, lanes[j].m + (i * lanes[j].stride), len);
+
+                act_arr[j] = ~((u64)0);
+
+                if(i == dd[j] - 1){
+                    t_arr[j] = lanes[j].ll;
+                    f_arr[j] = ~((u64)0);
+                    l_arr[j] = lanes[j].last_node;
+                }
+                else{
+                    t_arr[j] = offset + 128;
+                }
+            }
+
+            /* Transpose: word w of lane j's block goes to lane j of m[w]. */
+            for(u64 w = 0; w < 16; ++w){
+                words[w][j] = block[w];
             }
-            printf("\n\n");  
-     
-    }
-    */    
-        
-    for(size_t ln = 1; ln < parms->p; ++ln){
-    
-    /*
-        printf("\n\n***** final block before XORing with last block of ln"
-               " = %lu *****\n\n"
-              ,ln);
-        
-        for(uint32_t i = 0; i < 1024; ++i){
-            if(i % 16 == 0 && i > 0){printf("\n");}
-            printf("%02x ", (uint8_t)final_block_C[i]);
         }
-        printf("\n\n");  
-        */
-           
-        for(size_t xr = 0; xr < 128; ++xr){
-           ((uint64_t*)(final_block_C))[xr] ^= ((uint64_t*)(&(B[ln][q-1])))[xr];  
-        }        
+
+        for(u64 w = 0; w < 16; ++w){
+            m[w] = B2B_MB_LOAD(words[w]);
+        }
+
+        BLAKE2B_F_MB( h, m
+                     ,B2B_MB_LOAD(t_arr)
+                     ,B2B_MB_LOAD(f_arr)
+                     ,B2B_MB_LOAD(l_arr)
+                     ,B2B_MB_LOAD(act_arr)
+                    );
     }
-       
-    /* Finally, feed final block C to H' producing Tag-length bytes of output:
-     * Result = H'{T}(C)
-     */
-     /*
-    printf("\n\n***** input 1024-byte block to H_dash calling B2B: *****\n\n");
-    
-    for(uint32_t i = 0; i < 1024; ++i){
-        if(i % 16 == 0 && i > 0){printf("\n");}
-        printf("%02x ", (uint8_t)final_block_C[i]);
+
+    /* Transpose back and hand out the first nn bytes of each lane's h. */
+    for(uint8_t i = 0; i < 8; ++i){
+        B2B_MB_STORE(words[i], h[i]);
     }
-    printf("\n\n");     
-    */
-    Argon2_H_dash(final_block_C, output_tag, parms->T, 1024);
 
-    /* Cleanup. */    
-    for(uint32_t i = 0; i < parms->p; ++i){
-        free(thread_inputs[i]); 
-    }    
-    free(thread_inputs);
-    free(B);
-    free(working_memory);
-    free(H0_input);
-    free(argon2_thread_ids);
+    for(u64 j = 0; j < num_lanes; ++j){
+        for(uint8_t i = 0; i < 8; ++i){
+            block[i] = words[i][j];
+        }
+        memcpy(lanes[j].rr, block, lanes[j].nn);
+    }
 
     return;
 }
 
+#endif
 
-/* The caller must have made sure in advance that X and Y are each L-limb, 
- * L being the number of (non-zero-padded) limbs in the Montgomery modulus N.
- *
- * If X and Y are Montgomery representatives of A and B, then this algorithm
- * computes R, the Montgomery representative of (A*B).
- *
- * This algorithm can also be used to convert from base-2 of a number to the
- * base-beta Montgomery representative of the same number, and also to go
- * back from Montgomery representative to base-2.
- *
- * I use base-2^64 Montgomery representatives, which means beta=2^64. This leads
- * to having 64-bit limbs in the Montgomery representatives of numbers. It also
- * leads to having 64-bit MUL and ADD operations, which are not directly 
- * supported in C, instead most C compilers provide intrinsics for it, which we
- * make use of here to boost performance. Here, L = ceil(N_used_bits / 64).
- *
- * Note: beta is ignored everywhere where we'd multiply by it, so don't even
- *       pass it here.
- */
-void Montgomery_MUL(bigint* X, bigint* Y, bigint* N, bigint* R){
+/* Hash num_lanes lanes, BLAKE2B_MB_LANES at a time if we have SIMD. */
+void BLAKE2B_MB_LANES_RUN(struct BLAKE2B_MB_lane* lanes, u64 num_lanes){
 
-    u8 C;
-    u8 D;
+#if BLAKE2B_MB_LANES > 1
+    u64 this_group;
 
-    unsigned long long  Ul;
-    unsigned long long  Uh;
-    unsigned long long  Vl;
-    unsigned long long  Vh;
-    unsigned long long  W;
-    unsigned long long  q;
-    unsigned long long* T;
+    for(u64 i = 0; i < num_lanes; i += BLAKE2B_MB_LANES){
 
-    bigint R_aux;
+        this_group = num_lanes - i;
 
-    bigint_create(&R_aux, R->size_bits, 0);
-    
-    /* Set R = 0, all of its (L+1) limbs. Limb indices [0] to [L] inclusive. */
-    bigint_nullify(R);
-    
-    /* T: 3-limb variable */ 
-    /* q: 1-limb variable */
-    
-    /* Optimization: Keep T in the memory of R->bits in limbs [L+1] to [L+3]. */
-    /* Set the pointer to point to the right memory region of R's bit buffer  */
-    T = (unsigned long long*)(R->bits + ((MONT_L + 1) * MONT_LIMB_SIZ)); 
-    
-    memset(T, 0, (3 * MONT_LIMB_SIZ));
-    
-    for(uint64_t i = 0; i < MONT_L; ++i){
+        if(this_group > BLAKE2B_MB_LANES){
+            this_group = BLAKE2B_MB_LANES;
+        }
 
-        /* 2. */
-        Ul = _mulx_u64(  *((u64*)(Y->bits + (i * MONT_LIMB_SIZ)))
-                        ,*((u64*)(X->bits))
-                        ,&Uh
-                      );
-                      
-        C = _addcarryx_u64((u8)0, Ul, *((u64*)R->bits), &Ul);
-        
-        Uh += (u64)C;
+        BLAKE2B_MB_GROUP(lanes + i, this_group);
+    }
+#else
+    for(u64 i = 0; i < num_lanes; ++i){
+        BLAKE2B_LANE(lanes + i);
+    }
+#endif
 
-        *(T + 0) = Ul;
-        *(T + 1) = Uh;
-        *(T + 2) = 0;    
-        
-        /* 3. */
-        q = _mulx_u64((u64)MONT_MU, *(T + 0), &Uh);
-        
-        /* 3.5:  T += q*n0. */
-        Vl = _mulx_u64(q, *((u64*)(N->bits + (0*MONT_LIMB_SIZ))), &Vh);
-        
-        C = _addcarryx_u64( (u8)0, *(T + 0), Vl, (T + 0) );
-        
-        D = _addcarryx_u64( C, *(T + 1), Vh, (T + 1) );
-    
-        *(T + 2) += (u64)D;
-    
-        /* 4. */
-        for(u64 j = 1; j < MONT_L; ++j){
+    return;
+}
 
-            /* Compute T limb by limb. */
-            Ul = _mulx_u64(q, *((u64*)(N->bits + (j*MONT_LIMB_SIZ))), &Uh);
-            
-            
-            Vl = _mulx_u64( *((u64*)(Y->bits + (i * MONT_LIMB_SIZ)))
-                           ,*((u64*)(X->bits + (j * MONT_LIMB_SIZ)))
-                           ,&Vh
-                          );
-                          
-            C = _addcarryx_u64((u8)0
-                              ,Ul
-                              ,*((u64*)(R->bits + (j * MONT_LIMB_SIZ)))
-                              ,&Ul
-                              );              
-                          
-            Uh += (u64)C;              
-                          
-            D = _addcarryx_u64((u8)0, Vl, *(T + 1), &Vl);
-            
-            C = _addcarryx_u64((u8)0, Ul, Vl, (T + 0));
-            
-            D = _addcarryx_u64(D, Uh, Vh, &W);
-            
-            C = _addcarryx_u64(C, W, *(T + 2), (T + 1));
-            
-            *(T + 2) = (u64)C + (u64)D;
-                      
-            /* Set r_(j-1) = t_0  */
-            *((u64*)(R->bits + ((j-1) * MONT_LIMB_SIZ))) = *(T + 0);
+/* Hash num_jobs independent messages, BLAKE2B_MB_LANES at a time.
+ * Gives exactly the same output as calling BLAKE2B_INIT on each of them.
+ */
+void BLAKE2B_MB(struct BLAKE2B_MB_job* jobs, u64 num_jobs){
+
+    struct BLAKE2B_MB_lane lanes[BLAKE2B_MB_LANES];
+
+    u64 this_group;
+
+    for(u64 i = 0; i < num_jobs; i += BLAKE2B_MB_LANES){
+
+        this_group = num_jobs - i;
+
+        if(this_group > BLAKE2B_MB_LANES){
+            this_group = BLAKE2B_MB_LANES;
         }
 
-        /* 5. */        
-        C = _addcarryx_u64( (u8)0
-                   ,*(T + 1)
-                   ,*((u64*)(R->bits+(MONT_L * MONT_LIMB_SIZ)))
-                   , (T + 0)
-                  );
-       
-        *(T + 1) = (u64)C + *(T + 2); 
-        *(T + 2) = 0;
-        
-        /* 6. */ 
-        *((u64*)(R->bits+((MONT_L - 1) * MONT_LIMB_SIZ))) = *(T + 0);
-        *((u64*)(R->bits+( MONT_L      * MONT_LIMB_SIZ))) = *(T + 1);    
-    }
+        memset(lanes, 0, sizeof(lanes));
 
-    memset((u8*)T, 0, 3 * MONT_LIMB_SIZ);
+        for(u64 j = 0; j < this_group; ++j){
+            lanes[j].m        = jobs[i + j].m;
+            lanes[j].ll       = jobs[i + j].ll;
+            lanes[j].nn       = jobs[i + j].nn;
+            lanes[j].rr       = jobs[i + j].rr;
+            lanes[j].stride   = 128;
+            lanes[j].param[0] = 0x01010000 ^ jobs[i + j].nn;
+        }
 
-    /* 7. */
-    R->used_bits = get_used_bits(R->bits, (u32)(R->size_bits / 8));
-    
-    R->free_bits = R->size_bits - R->used_bits;
-    
-    if ( *((u64*)(R->bits + (MONT_L * MONT_LIMB_SIZ))) != 0){ 
-        bigint_equate2(&R_aux, R);        
-        bigint_sub2(&R_aux, N, R);
+        BLAKE2B_MB_LANES_RUN(lanes, this_group);
     }
-    
-    free(R_aux.bits);
-    
+
     return;
 }
 
-/* Practical method to convert a number to Montgomery Form.
- *  
- * To find the Montgomery form (mod M) of A, do the following:
+/* BLAKE2bp - the 4-way parallel tree mode of BLAKE2b, as in the reference
+ * implementation by the BLAKE2 authors (fanout 4, depth 2, inner length 64).
  *
- *  Call Montgomery MUL mod M with input 1 set to (beta^(2*L) mod M), the other 
- *  input set to A itself (in normal positional notation). The output of this
- *  will in fact be a valid Montgomery representative of A.
- * 
- *  Note: Sometimes a Montgomery form of a number can be larger than the number
- *        itself in regular positional notation. This is fine and is still a
- *        valid Montgomery form of that number. Also, a number can have several
- *        valid Montgomery forms, not necessarily just one. I think.
+ * The input's 128-byte blocks are dealt out to 4 leaves like cards: block i
+ * goes to leaf (i mod 4). The 4 leaves are ordinary BLAKE2b instances that
+ * differ only in their parameter blocks, so they all run at the same time in
+ * the lanes of the multi-buffer engine. The root then hashes the 4 leaf
+ * digests, which is only 256 bytes no matter how big the input was.
+ *
+ * Its output is NOT the same as BLAKE2b's of the same input. It's a different
+ * hash function, so whoever checks must know which one was used.
  */
-void Get_Mont_Form(bigint* src, bigint* target, bigint* M){
+#define BLAKE2BP_LEAVES 4
 
-    bigint two;
-    bigint sixtyfour;
-    bigint beta;
-    bigint two_L;
-    bigint aux;
+void BLAKE2BP(u8* m, u64 ll, u64 nn, u8* rr){
 
-    bigint_create(&two,       M->size_bits, 2 );  
-    bigint_create(&sixtyfour, M->size_bits, 64);
-    bigint_create(&beta,      M->size_bits, 0 );
-    bigint_create(&aux,       M->size_bits, 0 );
-    bigint_create(&two_L,     M->size_bits, 2 * MONT_L );
-    bigint_nullify(target);
-
-    /* beta = 2^64 for 64-bit Montgomery limbs. */
-    bigint_pow(&two, &sixtyfour, &beta);
-
-    /* aux = beta^(2*L) mod M */
-    bigint_mod_pow(&beta, &two_L, M, &aux);
+    struct BLAKE2B_MB_lane leaves[BLAKE2BP_LEAVES];
+    struct BLAKE2B_MB_lane root;
 
-    /* Now generate the source's Montgomery form. */
-    Montgomery_MUL(&aux, src, M, target);
-
-    target->used_bits = get_used_bits(target->bits, (uint32_t)(M->size_bits/8));
-    target->free_bits = target->size_bits - target->used_bits;
-    
-    printf("[OK] Cryptolib: Montgomery Form computed successfully.\n");
+    const u64 tree_param0 = nn | (BLAKE2BP_LEAVES << 16) | (2 << 24);
 
-    /* Cleanup. */
+    u64 full_blocks = ll / 128;
+    u64 rem_bytes   = ll % 128;
+    u8  leaf_digests[BLAKE2BP_LEAVES * 64];
 
-    free(two.bits);
-    free(sixtyfour.bits);
-    free(beta.bits);
-    free(aux.bits);
-    free(two_L.bits);
+    memset(leaves, 0, sizeof(leaves));
+    memset(&root,  0, sizeof(root));
 
-    return;
-}
+    for(u64 i = 0; i < BLAKE2BP_LEAVES; ++i){
 
-/* Computes B^P mod M using Montgomery Modular Multiplication. Result goes in R.
- * The base B must be in Montgomery Form. 
- * The result R is NOT the Montgomery Form of the result of powering, it
- * is the actual result in regular positional notation.
- *
- * Note: This function is somewhat general, but not fully general - it computes
- *          any modular powering mod M using Montgomery Multiplication, and the
- *       parameters that depend on the modulus M (MU and L) are defined at
- *         the top of this file. However, it won't work for modular powering mod
- *       some other number, other than M, which for the purposes of the secure
- *       chat system this library was originally written for is global static.
- *         If a function for modular POW mod M using Montgomery Multiplication
- *         for a different modulus is needed, you have to change the Montgomery
- *       parameters MU and L - they are different for each Montgomery modulus.
- */
-void MONT_POW_modM(bigint* B, bigint* P, bigint* M, bigint* R){
+        /* This leaf's share of full blocks, plus the partial last block. */
+        leaves[i].ll = 128 * ( (full_blocks / BLAKE2BP_LEAVES)
+                              +((full_blocks % BLAKE2BP_LEAVES) > i ? 1 : 0)
+                             );
 
-    u32 bit = 0;
-    
-    bigint X;
-    bigint Y;
-    bigint R_1;
-    bigint one;
-    bigint div_res;
+        if(rem_bytes > 0 && (full_blocks % BLAKE2BP_LEAVES) == i){
+            leaves[i].ll += rem_bytes;
+        }
 
-    bigint_create(&X,       M->size_bits, 0);
-    bigint_create(&Y,       M->size_bits, 0);
-    bigint_create(&R_1,     M->size_bits, 0);
-    bigint_create(&one,     M->size_bits, 1);
-    bigint_create(&div_res, M->size_bits, 0);
+        leaves[i].m         = m + (i * 128);
+        leaves[i].nn        = 64;
+        leaves[i].rr        = leaf_digests + (i * 64);
+        leaves[i].stride    = BLAKE2BP_LEAVES * 128;
+        leaves[i].param[0]  = tree_param0;
+        leaves[i].param[1]  = i;          /* node offset                 */
+        leaves[i].param[2]  = (64 << 8);  /* node depth 0, inner len 64  */
+        leaves[i].last_node = (i == BLAKE2BP_LEAVES - 1) ? ~((u64)0) : 0;
+    }
 
-    /* X and Y both become equal to the passed base B */
-    bigint_equate2(&X, B);
-    bigint_equate2(&Y, B);
+    BLAKE2B_MB_LANES_RUN(leaves, BLAKE2BP_LEAVES);
 
-    for(int64_t i = (int64_t)(P->used_bits - 2); i >= 0; --i){     
-       
-        Montgomery_MUL(&Y, &Y, M, R);     
-        bigint_equate2(&Y, R);
- 
-        if( (BIGINT_GET_BIT(*P, i, bit)) == 1 ){
-            Montgomery_MUL(&Y, &X, M, R);      
-            bigint_equate2(&Y, R);        
-        }
-    }
-    
-    Montgomery_MUL(&one, R, M, &R_1);
-    bigint_div2(&R_1, M, &div_res, R);    
+    root.m         = leaf_digests;
+    root.ll        = BLAKE2BP_LEAVES * 64;
+    root.nn        = nn;
+    root.rr        = rr;
+    root.stride    = 128;
+    root.param[0]  = tree_param0;
+    root.param[1]  = 0;
+    root.param[2]  = 1 | (64 << 8);   /* node depth 1, inner len 64  */
+    root.last_node = ~((u64)0);
 
-    free(X.bits); 
-    free(Y.bits); 
-    free(R_1.bits);
-    free(one.bits); 
-    free(div_res.bits);
+    BLAKE2B_LANE(&root);
 
     return;
 }
 
-/* Generate a cryptographic signature of a sender's message
- * according to the method pioneered by Claus-Peter Schnorr.
- *
- * PH = BLAKE2B{64}(data);
- *  k = (BLAKE2B{64}(a || PH) mod (Q-1)) + 1;
- *  R = G^k mod M;
- *  e = trunc{bitwidth(Q)}(BLAKE2B{64}(R || PH));
- *  s = ((k - (a * e)) mod Q;
- *
- * where M is a 3071-bit prime number, Q is a 320-bit prime
- * number which exactly dibides (M-1), G = 2^((M-1)/Q) mod M,
- * and a is the private key of the message sender. 
- *
- * The signature itself is (s,e).
- */ 
-void Signature_GENERATE(bigint* M, bigint* Q, bigint* Gmont
-                       ,u8* data, u64 data_len, u8* signature
-                       ,bigint* private_key, u64 key_len_bytes
-                       )
-{
-    u32 offset = 0;
+/*****************************************************************************/
+/*                   Argon2id IMPLEMENTATION BEGINS                          */
+/*                                                                           */
+/*     The implementation is based on RFC 9106's theoretical description.    */
+/*****************************************************************************/ 
 
-    bigint second_btb_outnum;
-    bigint one;
-    bigint Q_minus_one;
-    bigint reduced_btb_res;
-    bigint k;
-    bigint R; 
-    bigint e;
-    bigint s;
-    bigint div_res;
-    bigint aux1;
-    bigint aux2;
-    bigint aux3;
-        
-    const u64 prehash_len = 64;
-    u64 len_key_PH = prehash_len + key_len_bytes;
-    u64 R_used_bytes;
-    u64 len_Rused_PH;
-    
-    u8  second_btb_outbuf[64];
-    u8  prehash[prehash_len];
-    u8* second_btb_inbuf;
-    u8* R_with_prehash;
-    u8 third_btb_outbuf[64];
+/* NOTE: The arithmetic operations here are done modulo 2^64. 
+ *       Since we're working with uint64_t's, this simply
+ *       means we can let overflow happen and ignore it. 
+ */
+void Argon2_GB(uint64_t *a, uint64_t *b, uint64_t *c, uint64_t *d){
 
-    bigint_create(&second_btb_outnum, M->size_bits, 0);
-    bigint_create(&Q_minus_one,       M->size_bits, 0);
-    bigint_create(&reduced_btb_res,   M->size_bits, 0);
-    bigint_create(&div_res,           M->size_bits, 0);
-    bigint_create(&one,               M->size_bits, 1);
-    bigint_create(&k,                 M->size_bits, 0);
-    bigint_create(&R,                 M->size_bits, 0);
-    bigint_create(&e,                 M->size_bits, 0);
-    bigint_create(&s,                 M->size_bits, 0);
-    bigint_create(&aux1,              M->size_bits, 0);
-    bigint_create(&aux2,              M->size_bits, 0);
-    bigint_create(&aux3,              M->size_bits, 0);
-    
-    memset(prehash, 0, prehash_len);
-         
-    BLAKE2B_INIT(data, data_len, 0, prehash_len, prehash);
-        
-    second_btb_inbuf = (u8*)calloc(1, key_len_bytes + prehash_len);
-        
-    memcpy(second_btb_inbuf, private_key->bits, key_len_bytes);
-    memcpy(second_btb_inbuf + key_len_bytes, prehash, prehash_len);
-    
-    BLAKE2B_INIT(second_btb_inbuf, len_key_PH, 0, 64, second_btb_outbuf);
-    
-    /* Now compute k. */  
-    memcpy(second_btb_outnum.bits, second_btb_outbuf, 64);
+    /*  In third ADD operand, take only the 32 least significant bits of a and b
+     *
+     *  Do this by: First dereferencing the pointer to its 64-bit version
+     *              Then  casting that to an unsigned 32-bit integer
+     *              Then  reading the result
+     *              Then  casting the result back to an unsigned 64-bit integer.
+     *
+     *  Assumes little-endian byte ordering in the machine of course.          
+     */
+    *a = (*a) + (*b) + ((u64)2 * ((u64)((u32)(*a))) * ((u64)((u32)(*b))));
+           
+    *d = (*d) ^ (*a);
     
-    second_btb_outnum.used_bits = get_used_bits(second_btb_outnum.bits, 64);
+    uint64_roll_right(d, 32);
     
-    second_btb_outnum.free_bits = 
-      second_btb_outnum.size_bits - second_btb_outnum.used_bits;
+    *c = (*c) + (*d) + ((u64)2 * ((u64)((u32)(*c))) * ((u64)((u32)(*d))));
+           
+    *b = (*b) ^ (*c);
     
-    bigint_sub2(Q, &one, &Q_minus_one);    
-    bigint_div2(&second_btb_outnum, &Q_minus_one, &div_res, &reduced_btb_res);  
-    bigint_add_fast(&reduced_btb_res, &one, &k);  /* <----- k */ 
+    uint64_roll_right(b, 24);
     
-    /* Now compute R. */
+    *a = (*a) + (*b) + ((u64)2 * ((u64)((u32)(*a))) * ((u64)((u32)(*b))));   
+             
+    *d = (*d) ^ (*a);
     
-    MONT_POW_modM(Gmont, &k, M, &R); 
-        
-    R_used_bytes = R.used_bits;
+    uint64_roll_right(d, 16);
     
-    while(R_used_bytes % 8 != 0){
-        ++R_used_bytes;
-    }
+    *c = (*c) + (*d) + ((u64)2 * ((u64)((u32)(*c))) * ((u64)((u32)(*d))));   
+           
+    *b = (*b) ^ (*c);
     
-    R_used_bytes /= 8;
+    uint64_roll_right(b, 63);
     
-    /* Now compute e. */
-    R_with_prehash = (u8*)calloc(1, R_used_bytes + prehash_len);
-         
-    memcpy(R_with_prehash, R.bits, R_used_bytes);
-    memcpy(R_with_prehash + R_used_bytes, prehash, prehash_len);
+    return;
+}
     
-    len_Rused_PH = R_used_bytes + prehash_len;
+/* Permutation P() of Argon2. Takes eight 16-byte registers and views them as
+ * a 4x4 matrix of uint64_t's v[0] .. v[15], then runs GB() on its columns and
+ * diagonals, same as a BLAKE2b round.
+ *
+ * The registers don't have to be contiguous. They start at base and each next
+ * one is reg_stride uint64_t's further. A row of G()'s 8x8 matrix of 16-byte
+ * registers is then (base = start of row, reg_stride = 2) and a column is
+ * (base = start of column, reg_stride = 16), so there's no need to copy the
+ * columns out into separate buffers and back.
+ */
+void Argon2_P(uint64_t* base, uint64_t reg_stride){
+ 
+    /* To make the calls to GB() more elegant, prepare
+     * the matrix of 4x4 uint64_t's in advance.
+     */
+    u64* matrix[16];
     
-    BLAKE2B_INIT(R_with_prehash, len_Rused_PH, 0, 64, third_btb_outbuf);
+    for(size_t i = 0; i < 8; ++i){
+        matrix[(2 * i) + 0] = base + (i * reg_stride) + 0;
+        matrix[(2 * i) + 1] = base + (i * reg_stride) + 1;
+    }
     
-    memcpy(e.bits, third_btb_outbuf, 40);
+    Argon2_GB((matrix[0]), (matrix[4]), (matrix[8]),  (matrix[12]));
+    Argon2_GB((matrix[1]), (matrix[5]), (matrix[9]),  (matrix[13]));
+    Argon2_GB((matrix[2]), (matrix[6]), (matrix[10]), (matrix[14]));
+    Argon2_GB((matrix[3]), (matrix[7]), (matrix[11]), (matrix[15]));
+    Argon2_GB((matrix[0]), (matrix[5]), (matrix[10]), (matrix[15]));
+    Argon2_GB((matrix[1]), (matrix[6]), (matrix[11]), (matrix[12]));
+    Argon2_GB((matrix[2]), (matrix[7]), (matrix[8]),  (matrix[13]));
+    Argon2_GB((matrix[3]), (matrix[4]), (matrix[9]),  (matrix[14]));
 
-    e.used_bits = get_used_bits(e.bits, 40);
-    e.free_bits = e.size_bits - e.used_bits;
-        
-    /* Lastly, compute s = ( k + ((Q-a)×e) ) mod Q */
-    bigint_sub2(Q, private_key, &aux1);
+    return;
+}
 
-    bigint_mul_fast(&aux1, &e, &aux2);
-   
-    bigint_add_fast(&aux2, &k, &aux3);
-    
-    bigint_div2(&aux3, Q, &div_res, &s);
+/* Compression function G() for Argon2. 
+ *
+ * Takes two 1024-byte blocks as input (X, Y).
+ * Outputs one resulting 1024-byte block.
+ *
+ * Pass a pointer to where the output 1024-byte block is.
+ *
+ * Does not change the input memory blocks X and Y directly.
+ *
+ * There are three versions of it below - this plain C one, one on AVX2 and
+ * one on AVX-512 registers. Argon2_G() picks the best one the CPU supports.
+ */
+void Argon2_G_SCALAR(uint8_t* X, uint8_t* Y, uint8_t* out_1024){
+
+    u64 matrix_R[128];
+    u64 matrix_Z[128];
+    size_t i; 
     
-    /* signature buffer must have been allocated with exactly 
-     * ( (2 * sizeof(bigint)) + (2 * bytewidth(Q)) )
-     * bytes of memory. No checks performed for performance.
+    for(i = 0; i < 128; ++i){
+        matrix_R[i] = ((u64*)X)[i] ^ ((u64*)Y)[i]; 
+    }    
+
+    /*  R is used at the end, so save it. P() transforms a copy of it in place,
+     *  first its rows into matrix Q, then the columns of Q into matrix Z.
      */
+    memcpy(matrix_Z, matrix_R, 1024);
     
-    memcpy(signature + offset, &s, sizeof(bigint));
-    offset += sizeof(bigint);
-    memcpy(signature + offset, s.bits, 40);
-    offset += 40;
-    memcpy(signature + offset, &e, sizeof(bigint));
-    offset += sizeof(bigint);
-    memcpy(signature + offset, e.bits, 40);
+    for(i = 0; i < 8; ++i){
+        Argon2_P(matrix_Z + (i * 16), 2);  
+    }
     
-    /* Cleanup. */
-    free(second_btb_outnum.bits);
-    free(one.bits); 
-    free(Q_minus_one.bits); 
-    free(reduced_btb_res.bits); 
-    free(k.bits); 
-    free(R.bits); 
-    free(s.bits);    
-    free(div_res.bits); 
-    free(aux1.bits); 
-    free(aux2.bits); 
-    free(aux3.bits);
-    free(e.bits);  
-    free(second_btb_inbuf); 
-    free(R_with_prehash); 
-     
+    for(i = 0; i < 8; ++i){
+        Argon2_P(matrix_Z + (i * 2), 16);
+    }   
+    
+    /* Final output is (matrix R XOR matrix Z). */
+    for(i = 0; i < 128; ++i){
+        ((u64*)out_1024)[i] = matrix_R[i] ^ matrix_Z[i];
+    }
+   
     return;
 }
 
-/* To verify against public key A and whatever was signed, the receiver:
- *
- *  0. checks that 0 <= s < Q, and that e has the expected bitwidth (that of Q).
- *  1. Computes the prehash PH as in step 0. above.
- *  2. Computes R = (G^s * A^e) mod M.
- *  3. Computes BLAKE2B{64}(R||PH), truncated to bitwidth of Q. 
- *     Check that this is equal to e. If it is, validation passed. 
- *     In any other circumstance, the validation fails.
+/* The SIMD versions of G(). Each one runs GB() on all four columns (and then
+ * all four diagonals) of P()'s 4x4 matrix at once: the matrix rows are held
+ * in four registers A, B, C, D, and the diagonals are lined up by rotating
+ * the uint64_t's within B, C and D, running GB() again, and rotating back.
  *
- *   RETURNS: 1 if signature is valid for this message, 0 for invalid signature.
+ * AVX2 does one P() per round of registers. AVX-512 does two at a time - one
+ * in each 256-bit half, and permutex works within each half separately.
  *
+ * They are compiled for their instruction sets with target attributes and
+ * only ever called when the CPU says it has them, so the rest of the program
+ * can still run on a machine without AVX2 or AVX-512.
  */
-uint8_t Signature_VALIDATE( bigint* Gmont, bigint* Amont, bigint* M, bigint* Q
-                           ,bigint* s, bigint* e, u8* data, u32 data_len)
-{
-    const u64 prehash_len = 64;
-    u64       R_used_bytes;
-    u64       len_Rused_PH;
+#define ARGON2_ROT_R24_AVX2                                          \
+_mm256_setr_epi8( 3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10 \
+                 ,3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10 \
+                )
+
+#define ARGON2_ROT_R16_AVX2                                          \
+_mm256_setr_epi8( 2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9 \
+                 ,2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9 \
+                )
+
+/* x = x + y + 2 * lo32(x) * lo32(y), the BlaMka step of GB(). */
+#define ARGON2_BLAMKA_AVX2(x, y, t)                                   \
+    t = _mm256_mul_epu32((x), (y));                                   \
+    x = _mm256_add_epi64(_mm256_add_epi64((x), (y)),                  \
+                         _mm256_add_epi64(t, t));
+
+#define ARGON2_GB_AVX2(A, B, C, D, t)                                 \
+    ARGON2_BLAMKA_AVX2(A, B, t);                                      \
+    D = _mm256_xor_si256(D, A);                                       \
+    D = _mm256_shuffle_epi32(D, _MM_SHUFFLE(2, 3, 0, 1));             \
+    ARGON2_BLAMKA_AVX2(C, D, t);                                      \
+    B = _mm256_xor_si256(B, C);                                       \
+    B = _mm256_shuffle_epi8(B, ARGON2_ROT_R24_AVX2);                  \
+    ARGON2_BLAMKA_AVX2(A, B, t);                                      \
+    D = _mm256_xor_si256(D, A);                                       \
+    D = _mm256_shuffle_epi8(D, ARGON2_ROT_R16_AVX2);                  \
+    ARGON2_BLAMKA_AVX2(C, D, t);                                      \
+    B = _mm256_xor_si256(B, C);                                       \
+    B = _mm256_xor_si256(_mm256_srli_epi64(B, 63), _mm256_add_epi64(B, B));
+
+#define ARGON2_P_AVX2(A, B, C, D, t)                                  \
+    ARGON2_GB_AVX2(A, B, C, D, t);                                    \
+    B = _mm256_permute4x64_epi64(B, _MM_SHUFFLE(0, 3, 2, 1));         \
+    C = _mm256_permute4x64_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));         \
+    D = _mm256_permute4x64_epi64(D, _MM_SHUFFLE(2, 1, 0, 3));         \
+    ARGON2_GB_AVX2(A, B, C, D, t);                                    \
+    B = _mm256_permute4x64_epi64(B, _MM_SHUFFLE(2, 1, 0, 3));         \
+    C = _mm256_permute4x64_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));         \
+    D = _mm256_permute4x64_epi64(D, _MM_SHUFFLE(0, 3, 2, 1));
+
+/* Two 16-byte registers of a column of G()'s matrix, lo and hi, as one. */
+#define ARGON2_LOAD_2x128(lo, hi)                                     \
+_mm256_inserti128_si256(                                              \
+    _mm256_castsi128_si256(_mm_load_si128((__m128i*)(lo))),           \
+    _mm_load_si128((__m128i*)(hi)), 1                                 \
+)
+
+#define ARGON2_STORE_2x128(lo, hi, x)                                 \
+    _mm_store_si128((__m128i*)(lo), _mm256_castsi256_si128(x));       \
+    _mm_store_si128((__m128i*)(hi), _mm256_extracti128_si256(x, 1));
+
+__attribute__((target("avx2")))
+void Argon2_G_AVX2(uint8_t* X, uint8_t* Y, uint8_t* out_1024){
+
+    __m256i matrix_R[32];
+    __m256i matrix_Z[32];
+    __m256i A;
+    __m256i B;
+    __m256i C;
+    __m256i D;
+    __m256i t;
+
+    u64* Z = (u64*)matrix_Z;
+
+    for(size_t i = 0; i < 32; ++i){
+        matrix_R[i] = _mm256_xor_si256(
+                           _mm256_loadu_si256((__m256i*)(X + (32 * i)))
+                          ,_mm256_loadu_si256((__m256i*)(Y + (32 * i)))
+                      );
+        matrix_Z[i] = matrix_R[i];
+    }
 
-    u8  retval = 1;    
-    u8  prehash[prehash_len];   
-    u8* R_with_prehash = NULL;
-    u8  blake2b_outbuf[64];
+    /* Rows: each row is 128 contiguous bytes - four whole registers. */
+    for(size_t i = 0; i < 8; ++i){
+        ARGON2_P_AVX2( matrix_Z[(4 * i) + 0], matrix_Z[(4 * i) + 1]
+                      ,matrix_Z[(4 * i) + 2], matrix_Z[(4 * i) + 3], t
+                     );
+    }
 
-    bigint R;
-    bigint R_aux1;
-    bigint R_aux2;
-    bigint R_aux3;
-    bigint div_res;
-    bigint val_e;
-    
-    memset(prehash, 0, prehash_len);
+    /* Columns: column i's 16-byte registers are 128 bytes apart in Z. */
+    for(size_t i = 0; i < 8; ++i){
 
-    bigint_create(&R,       M->size_bits, 0);
-    bigint_create(&R_aux1,  M->size_bits, 0);
-    bigint_create(&R_aux2,  M->size_bits, 0);
-    bigint_create(&R_aux3,  M->size_bits, 0);
-    bigint_create(&div_res, M->size_bits, 0); 
-    bigint_create(&val_e,   M->size_bits, 0);
+        A = ARGON2_LOAD_2x128(Z + (2 * i) + (16 * 0), Z + (2 * i) + (16 * 1));
+        B = ARGON2_LOAD_2x128(Z + (2 * i) + (16 * 2), Z + (2 * i) + (16 * 3));
+        C = ARGON2_LOAD_2x128(Z + (2 * i) + (16 * 4), Z + (2 * i) + (16 * 5));
+        D = ARGON2_LOAD_2x128(Z + (2 * i) + (16 * 6), Z + (2 * i) + (16 * 7));
 
-    if(bigint_compare2(s, Q) != 3){
-        printf("[WARN] Cryptolib: sig_validate: input s != input Q.\n");
-        goto label_cleanup;        
+        ARGON2_P_AVX2(A, B, C, D, t);
+
+        ARGON2_STORE_2x128(Z + (2 * i) + (16 * 0), Z + (2 * i) + (16 * 1), A);
+        ARGON2_STORE_2x128(Z + (2 * i) + (16 * 2), Z + (2 * i) + (16 * 3), B);
+        ARGON2_STORE_2x128(Z + (2 * i) + (16 * 4), Z + (2 * i) + (16 * 5), C);
+        ARGON2_STORE_2x128(Z + (2 * i) + (16 * 6), Z + (2 * i) + (16 * 7), D);
     }
 
-    /* Compute the signature validation prehash. Same as during generation. */ 
-      
-    BLAKE2B_INIT(data, data_len, 0, prehash_len, prehash);
-      
-    MONT_POW_modM(Gmont, s, M, &R_aux1); 
-    MONT_POW_modM(Amont, e, M, &R_aux2);
-    
-    bigint_mul_fast(&R_aux1, &R_aux2, &R_aux3);
+    /* Final output is (matrix R XOR matrix Z). */
+    for(size_t i = 0; i < 32; ++i){
+        _mm256_storeu_si256( (__m256i*)(out_1024 + (32 * i))
+                            ,_mm256_xor_si256(matrix_R[i], matrix_Z[i])
+                           );
+    }
 
-    bigint_div2(&R_aux3, M, &div_res, &R);
-        
-    R_used_bytes = R.used_bits;
-      
-    while(R_used_bytes % 8 != 0){
-        ++R_used_bytes;
+    return;
+}
+
+#define ARGON2_BLAMKA_AVX512(x, y, t)                                 \
+    t = _mm512_mul_epu32((x), (y));                                   \
+    x = _mm512_add_epi64(_mm512_add_epi64((x), (y)),                  \
+                         _mm512_add_epi64(t, t));
+
+#define ARGON2_GB_AVX512(A, B, C, D, t)                               \
+    ARGON2_BLAMKA_AVX512(A, B, t);                                    \
+    D = _mm512_ror_epi64(_mm512_xor_si512(D, A), 32);                 \
+    ARGON2_BLAMKA_AVX512(C, D, t);                                    \
+    B = _mm512_ror_epi64(_mm512_xor_si512(B, C), 24);                 \
+    ARGON2_BLAMKA_AVX512(A, B, t);                                    \
+    D = _mm512_ror_epi64(_mm512_xor_si512(D, A), 16);                 \
+    ARGON2_BLAMKA_AVX512(C, D, t);                                    \
+    B = _mm512_ror_epi64(_mm512_xor_si512(B, C), 63);
+
+#define ARGON2_P_AVX512(A, B, C, D, t)                                \
+    ARGON2_GB_AVX512(A, B, C, D, t);                                  \
+    B = _mm512_permutex_epi64(B, _MM_SHUFFLE(0, 3, 2, 1));            \
+    C = _mm512_permutex_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));            \
+    D = _mm512_permutex_epi64(D, _MM_SHUFFLE(2, 1, 0, 3));            \
+    ARGON2_GB_AVX512(A, B, C, D, t);                                  \
+    B = _mm512_permutex_epi64(B, _MM_SHUFFLE(2, 1, 0, 3));            \
+    C = _mm512_permutex_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));            \
+    D = _mm512_permutex_epi64(D, _MM_SHUFFLE(0, 3, 2, 1));
+
+/* 32 bytes at lo into the low half of a register, 32 bytes at hi into the
+ * high half, and back.
+ */
+#define ARGON2_LOAD_2x256(lo, hi)                                     \
+_mm512_inserti64x4(                                                   \
+    _mm512_castsi256_si512(_mm256_load_si256((__m256i*)(lo))),        \
+    _mm256_load_si256((__m256i*)(hi)), 1                              \
+)
+
+#define ARGON2_STORE_2x256(lo, hi, x)                                 \
+    _mm256_store_si256((__m256i*)(lo), _mm512_castsi512_si256(x));    \
+    _mm256_store_si256((__m256i*)(hi), _mm512_extracti64x4_epi64(x, 1));
+
+/* Swaps the middle two 16-byte registers: [a b c d] <-> [a c b d]. Turns two
+ * rows' worth of two adjacent columns into two whole columns' worth of rows.
+ */
+#define ARGON2_SWAP_MID_128(x) \
+    _mm512_shuffle_i64x2((x), (x), _MM_SHUFFLE(3, 1, 2, 0))
+
+__attribute__((target("avx512f")))
+void Argon2_G_AVX512(uint8_t* X, uint8_t* Y, uint8_t* out_1024){
+
+    __m512i matrix_R[16];
+    __m512i matrix_Z[16];
+    __m512i A;
+    __m512i B;
+    __m512i C;
+    __m512i D;
+    __m512i t;
+
+    u64* Z = (u64*)matrix_Z;
+
+    for(size_t i = 0; i < 16; ++i){
+        matrix_R[i] = _mm512_xor_si512(
+                           _mm512_loadu_si512((void*)(X + (64 * i)))
+                          ,_mm512_loadu_si512((void*)(Y + (64 * i)))
+                      );
+        matrix_Z[i] = matrix_R[i];
     }
+
+    /* Rows 2i and 2i+1 together - one in each half of the registers. */
+    for(size_t i = 0; i < 4; ++i){
+
+        A = ARGON2_LOAD_2x256(Z + (32 * i) +  0, Z + (32 * i) + 16);
+        B = ARGON2_LOAD_2x256(Z + (32 * i) +  4, Z + (32 * i) + 20);
+        C = ARGON2_LOAD_2x256(Z + (32 * i) +  8, Z + (32 * i) + 24);
+        D = ARGON2_LOAD_2x256(Z + (32 * i) + 12, Z + (32 * i) + 28);
+
+        ARGON2_P_AVX512(A, B, C, D, t);
+
+        ARGON2_STORE_2x256(Z + (32 * i) +  0, Z + (32 * i) + 16, A);
+        ARGON2_STORE_2x256(Z + (32 * i) +  4, Z + (32 * i) + 20, B);
+        ARGON2_STORE_2x256(Z + (32 * i) +  8, Z + (32 * i) + 24, C);
+        ARGON2_STORE_2x256(Z + (32 * i) + 12, Z + (32 * i) + 28, D);
+    }
+
+    /* Columns 2i and 2i+1 together. Matrix rows 2k and 2k+1 of both columns
+     * are 32 contiguous bytes each, the middle swap sorts them by column.
+     */
+    for(size_t i = 0; i < 4; ++i){
+
+        A = ARGON2_LOAD_2x256(Z + (4 * i) +  0, Z + (4 * i) +  16);
+        B = ARGON2_LOAD_2x256(Z + (4 * i) + 32, Z + (4 * i) +  48);
+        C = ARGON2_LOAD_2x256(Z + (4 * i) + 64, Z + (4 * i) +  80);
+        D = ARGON2_LOAD_2x256(Z + (4 * i) + 96, Z + (4 * i) + 112);
+
+        A = ARGON2_SWAP_MID_128(A);
+        B = ARGON2_SWAP_MID_128(B);
+        C = ARGON2_SWAP_MID_128(C);
+        D = ARGON2_SWAP_MID_128(D);
+
+        ARGON2_P_AVX512(A, B, C, D, t);
+
+        A = ARGON2_SWAP_MID_128(A);
+        B = ARGON2_SWAP_MID_128(B);
+        C = ARGON2_SWAP_MID_128(C);
+        D = ARGON2_SWAP_MID_128(D);
+
+        ARGON2_STORE_2x256(Z + (4 * i) +  0, Z + (4 * i) +  16, A);
+        ARGON2_STORE_2x256(Z + (4 * i) + 32, Z + (4 * i) +  48, B);
+        ARGON2_STORE_2x256(Z + (4 * i) + 64, Z + (4 * i) +  80, C);
+        ARGON2_STORE_2x256(Z + (4 * i) + 96, Z + (4 * i) + 112, D);
+    }
+
+    /* Final output is (matrix R XOR matrix Z). */
+    for(size_t i = 0; i < 16; ++i){
+        _mm512_storeu_si512( (void*)(out_1024 + (64 * i))
+                            ,_mm512_xor_si512(matrix_R[i], matrix_Z[i])
+                           );
+    }
+
+    return;
+}
+
+/* The version of G() this CPU will use. Picked once, by Argon2_G_SELECT(). */
+void (*Argon2_G_impl)(uint8_t*, uint8_t*, uint8_t*) = NULL;
+
+const char* Argon2_G_impl_name = "none";
+
+void Argon2_G_SELECT(void){
+
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx512f")){
+        Argon2_G_impl      = Argon2_G_AVX512;
+        Argon2_G_impl_name = "avx512";
+    }
+    else if(__builtin_cpu_supports("avx2")){
+        Argon2_G_impl      = Argon2_G_AVX2;
+        Argon2_G_impl_name = "avx2";
+    }
+    else{
+        Argon2_G_impl      = Argon2_G_SCALAR;
+        Argon2_G_impl_name = "scalar";
+    }
+
+    return;
+}
+
+/* Argon2_MAIN() selects before starting any threads, so this check only ever
+ * triggers when G() is used on its own, like in the tests.
+ */
+void Argon2_G(uint8_t* X, uint8_t* Y, uint8_t* out_1024){
+
+    if(!Argon2_G_impl){
+        Argon2_G_SELECT();
+    }
+
+    Argon2_G_impl(X, Y, out_1024);
+
+    return;
+}
     
-    R_used_bytes /= 8;
-    
-    /* Last step:                                                       */
-    /* Computes val_e = BLAKE2B{64}(R||PH), truncated to bitwidth of Q. */
-    /* Check that this is equal to e. If it is, validation has passed.  */
-     
-    R_with_prehash = (u8*)calloc(1, R_used_bytes + prehash_len);
-         
-    memcpy(R_with_prehash, R.bits, R_used_bytes);
-    memcpy(R_with_prehash + R_used_bytes, prehash, prehash_len);
-    
-    len_Rused_PH = R_used_bytes + prehash_len; 
+/* Argon2's variable-length hash H'{T}(input), RFC 9106 section 3.3:
+ *
+ *   T <= 64:  H'(X) = H{T}(LE32(T) || X)
+ *   else:     r = ceil(T/32) - 2
+ *             V_1 = H{64}(LE32(T) || X),  V_i = H{64}(V_(i-1)) for i = 2..r
+ *             V_(r+1) = H{T - 32r}(V_r)
+ *             H'(X) = W_1 || W_2 || ... || W_r || V_(r+1)
+ *
+ * where W_i is the first 32 bytes of V_i. Each V_i is written straight out
+ * as soon as it's made, only the latest one is kept around, on the stack.
+ */
+void Argon2_H_dash(uint8_t* input,   uint8_t* output
+                  ,uint32_t out_len, uint64_t in_len
+                  )
+{  
+    struct BLAKE2B_stream st;
+
+    u8 V[64];
+
+    uint32_t r = ((out_len + 31) / 32) - 2;
+
+    if(out_len <= 64){ 
+        BLAKE2B_STREAM_INIT(&st, out_len);
+        BLAKE2B_STREAM_UPDATE(&st, (u8*)&out_len, sizeof(uint32_t));
+        BLAKE2B_STREAM_UPDATE(&st, input, in_len);
+        BLAKE2B_STREAM_FINAL(&st, output);
+        return;
+    }
         
-    BLAKE2B_INIT(R_with_prehash, len_Rused_PH, 0, 64, blake2b_outbuf);
+    BLAKE2B_STREAM_INIT(&st, 64);
+    BLAKE2B_STREAM_UPDATE(&st, (u8*)&out_len, sizeof(uint32_t));
+    BLAKE2B_STREAM_UPDATE(&st, input, in_len);
+    BLAKE2B_STREAM_FINAL(&st, V);
 
-    memcpy(val_e.bits, blake2b_outbuf, 40);
+    memcpy(output, V, 32);
 
-    val_e.used_bits = get_used_bits(val_e.bits, 40);
-    val_e.free_bits = val_e.size_bits - val_e.used_bits;
+    for(uint64_t i = 1; i < r; ++i){
+        BLAKE2B_STREAM_INIT(&st, 64);
+        BLAKE2B_STREAM_UPDATE(&st, V, 64);
+        BLAKE2B_STREAM_FINAL(&st, V);
+
+        memcpy(output + (32*i), V, 32);
+    }
+
+    /* V_(r+1) is only as long as what's left of the output, T - 32r bytes. */
+    BLAKE2B_STREAM_INIT(&st, out_len - (32*r));
+    BLAKE2B_STREAM_UPDATE(&st, V, 64);
+    BLAKE2B_STREAM_FINAL(&st, output + (32*r));
+
+    explicit_bzero(V, 64);
+
+    return;
+}
+
+/* Produce the next Argon2i address block, as RFC 9106 section 3.4.1.2 says:
+ *
+ *     address block = G( ZERO(1024), G( ZERO(1024), Z || counter || ZERO(968) ))
+ *
+ * where Z is (r, l, sl, m', t, y) and the counter is increased by one before
+ * every new address block. address_input holds Z || counter || ZERO(968) for
+ * the whole segment - the counter lives in its 7th uint64_t. Each address
+ * block gives the (J_1, J_2) pairs for the next 128 blocks of the segment.
+ */
+void argon2_next_address_block(u8* address_input, block_t* address_block){
+
+    /* Remember, Argon2 G() takes two 1024-byte blocks and outputs one block. */
+    u8 zero1024[1024];
+    u8 G_inner_output[1024];  /* outout of inner G() call,    */
+                              /* which is input to outer G(). */
+
+    memset(zero1024, 0, 1024);
+
+    /* Increment the counter inside 2nd input to inner G() call. */
+    ++( *((u64*)(address_input + (6 * sizeof(uint64_t)))) );
+
+    /* First do the inner G(), whose output is 2nd input to outer G(). */
+    Argon2_G(zero1024, address_input, G_inner_output);
+
+    /* Now the outer G() that generates the actual 1024-byte address block. */
+    Argon2_G(zero1024, G_inner_output, (u8*)address_block);
+
+    return;
+}
+
+/* What picking a reference block needs to know about the current segment.
+ * It's the same for every block of a segment, so it's worked out once per
+ * segment, not once per block.
+ *
+ * W is the set of blocks a reference block can be taken from. In the first
+ * pass, it's all blocks computed so far. In later passes, it's the last 3
+ * segments of the lane, counting back from the current one, which wraps
+ * around to the lane's end. On top of that, of the current lane, the block
+ * just before the current one is left out. Of other lanes, the last block
+ * of their previous segment is left out if we're at the very start of ours
+ * - it may not be finished yet.
+ */
+struct Argon2_ref_area{
+    u64 cur_lane;
+    u64 p;
+    u64 q;
+    u64 W_base;   /* |W| before the current segment's blocks are counted. */
+    u64 W_start;  /* Index in the lane where W begins.                    */
+    u8  own_lane; /* Pass 0, slice 0 only references its own lane.        */
+};
+
+void argon2_ref_area_init( struct Argon2_ref_area* area
+                          ,u64 r, u64 sl, u64 cur_lane, u64 p, u64 n, u64 q
+                         )
+{
+    area->cur_lane = cur_lane;
+    area->p        = p;
+    area->q        = q;
+    area->own_lane = (r == 0 && sl == 0);
+    area->W_start  = 0;
+
+    if(r == 0){
+        area->W_base = sl * n;
+    }
+    else{
+        area->W_base = q - n;
+
+        if(sl < 3){
+            area->W_start = (sl + 1) * n;
+        }
+    }
+
+    return;
+}
+
+/* Map (J_1, J_2) of the block at index seg_ix of its segment to the index,
+ * relative to the start of B[][], of its reference block. All integer, as in
+ * RFC 9106 section 3.4.2:
+ *
+ *     x = J_1^2 / 2^32,  y = (|W| * x) / 2^32,  zz = |W| - 1 - y
+ *
+ * J_1^2 needs all 64 bits. So does |W| * x, but no more: m is under 2^32
+ * kibibytes, so |W| is under 2^32 blocks, and x is under 2^32 too.
+ */
+uint64_t Argon2_getLZ( const struct Argon2_ref_area* area
+                      ,uint32_t J_1, uint32_t J_2, uint64_t seg_ix
+                     )
+{
+    u64 W_siz;
+    u64 x;
+    u64 y;
+    u64 zz;
+    u64 l_ix;
+
+    /* Get the lane index from which we will take blocks. */  
+    if(area->own_lane){
+        l_ix = area->cur_lane;
+    }
+    else{
+        l_ix = J_2 % area->p;
+    }     
     
-    if( bigint_compare2(e, &val_e) != 2 ){
-        printf("[WARN] Cryptolib: SIG_VAL: val_e != passed e. Ret 0.\n");
-        
-        printf("Passed e:\n");
-        bigint_print_info(e);
-        bigint_print_bits(e);
-        
-        printf("Computed val_e:\n");
-        bigint_print_info(&val_e);
-        bigint_print_bits(&val_e);
-        
-        retval = 0;
+    /* Compute the size of W */
+    if(l_ix != area->cur_lane){
+        W_siz = area->W_base - (seg_ix == 0);
     }
- 
-label_cleanup:
+    else{
+        W_siz = area->W_base + seg_ix - 1;
+    }
+    
+    /* Now pick one block index from W[]. This will be z in B[l][z]. */
+    x  = ((u64)J_1 * (u64)J_1) >> 32;
+    y  = (W_siz * x) >> 32;
+    zz = area->W_start + (W_siz - 1 - y);
 
-    free(R.bits);
-    free(R_aux1.bits);
-    free(R_aux2.bits);
-    free(R_aux3.bits);
-    free(div_res.bits); 
-    free(val_e.bits);
+    /* W_start and the offset into W are each under q, no need for a % q. */
+    if(zz >= area->q){
+        zz -= area->q;
+    }
+  
+    return (l_ix * area->q) + zz;
+}
 
-    if(R_with_prehash != NULL){
-        free(R_with_prehash);
+/* How many blocks ahead of the current one the reference block is prefetched,
+ * when it's known in advance.
+ */
+#define ARGON2_PREFETCH_DIST 2
+
+/* Start pulling a 1024-byte block into the cache, one 64-byte line at a time.*/
+void argon2_prefetch_block(block_t* block){
+
+    for(u64 i = 0; i < sizeof(block_t); i += 64){
+        _mm_prefetch(((const char*)block) + i, _MM_HINT_T0);
     }
 
-    return retval;
-}
\ No newline at end of file
+    return;
+}
+
+/*  Each thread processes one segment of the Argon2 memory matrix B[][].
+ *  A segment is the intersection of one of the 4 vertical slices, with
+ *  a row. Therefore one segment contains many 1024-byte blocks. To be
+ *  precise, ( (m' / p) / 4) 1024-byte blocks in a single segment.
+ *
+ *  The operation of a single thread is the following:
+ * 
+ *  - Begin the loop that transforms each 1024-byte block in this segment.
+ *
+ *    Each cycle of that loop does the following:
+ *
+ *      - Compute J_1 and J_2 in one of 2 ways, using the provided thread input.
+ *      - Use J_1 and J_2 to compute indices l and z.
+ *      - Call compression function G(), transforming this 1024-byte block.
+ *
+ *  The lane context holds the pointers to the lanes of B[][], as well as
+ *  r, l, sl, m', t, y, p, q.
+ */
+void argon2_transform_segment(struct Argon2_lane_ctx* ctx){
+   
+    u64 J_1 = 0;
+    u64 J_2 = 0;
+    u64 z_ix;
+    u64 n;
+    u64 j;
+    u64 j_start;
+    u64 j_end;
+    u64 computed_blocks = 0;
+    u64 cur_lane = ctx->l;
+    u64 q        = ctx->q;
+    u64 sl       = ctx->sl;
+    u64 r        = ctx->r;
+    u64 p        = ctx->p;
+    u64 md       = ctx->md;
+    u64 seg_ix;
+    u64 prev_ix;
+    u64 addr_ix;
+    u64 addr_end = 0;
+
+    /* Reference block indices of the blocks the current address block is for.
+     * Only used in the data-independent (Argon2i) slices.
+     */
+    u64 ref_ixs[128];
+
+    struct Argon2_ref_area area;
+
+    /* An array of pointers, each pointing to the start of 
+     * the respective lane in the working memory matrix B[][].
+     */
+    block_t** B = ctx->B;
+    block_t*  G_input_one;
+    block_t*  G_input_two;
+    block_t*  G_output;
+    block_t   old_block;
+    block_t   address_block;
+    
+    /* Z || counter || ZERO(968), the input to Argon2i address generation. */
+    u8 address_input[1024];
+    
+    memset(address_input, 0, 1024);
+    
+    ((u64*)address_input)[0] = ctx->r;
+    ((u64*)address_input)[1] = ctx->l;
+    ((u64*)address_input)[2] = ctx->sl;
+    ((u64*)address_input)[3] = ctx->md;
+    ((u64*)address_input)[4] = ctx->t;
+    ((u64*)address_input)[5] = ctx->y;
+
+    /* Determine the start and end control values of this thread's j-loop.    
+     * In short, which quarter of this thread's row we're transforming,      
+     * in terms of THE INDICES of 1024-byte blocks where the 0th block is
+     * the very first block OF THIS LANE, not at the start of B[][]. 
+     *         
+     * This is in contrast to index z, which is the index of a 1024-byte block
+     * relative to the START OF B[][], not to the start of any particular lane.
+     */
+
+    /* Let n be the number of 1024-byte blocks in one segment = (m' / p)/4. */
+    n = (md / p) / 4;
+
+    argon2_ref_area_init(&area, r, sl, cur_lane, p, n, q);
+   
+    /* First block transformed relative to lane start will be (n * (sl + 0))  */
+    /* Last  block transformed relative to lane start will be (n * (sl + 1))-1*/  
+    j_start = n *  sl;
+    j_end   = n * (sl + 1);  
+    
+    if(r > 0){
+        goto label_further_passes;
+    }
+    
+    /* If at first slice (sl=0), we will do 2 fewer cycles of threaded loop, */
+    /* as the first 2 loop cycles in pass 0 are hardcoded and different.     */
+    /* The segment's first address block isn't made at block index 0 then, */
+    /* so it has to be made here, before the loop starts at index 2.         */
+    if(sl == 0){
+        j_start = 2;
+        computed_blocks = 2;
+        argon2_next_address_block(address_input, &address_block);
+    } 
+    
+    for(j = j_start; j < j_end; ++j){
+
+        /* If pass number r=0 and slice number sl=0,1:  */
+        /* compute 32-bit values J_1, J_2 for Argon2i.  */
+        if( r == 0 && sl < 2 ){
+          
+            /* Index of this block relative to the start of the segment. */
+            seg_ix = j - (n * sl);
+            addr_ix = seg_ix % 128;
+            
+            /* Every 128 blocks, the address block runs out of (J_1, J_2). */
+            if(addr_ix == 0){
+                argon2_next_address_block(address_input, &address_block);
+            }
+            
+            /* Argon2i's reference blocks don't depend on the data, so as soon
+             * as we have an address block, work out the reference index of
+             * every block it covers. Then the reference block of a block a
+             * few steps ahead can be prefetched while G() works on this one,
+             * instead of every G() waiting on a cache miss to DRAM.
+             *
+             * In pass 0, computed_blocks is always the index in the segment.
+             */
+            if(addr_ix == 0 || j == j_start){
+                
+                addr_end = 128;
+                
+                if((seg_ix - addr_ix) + addr_end > n){
+                    addr_end = n - (seg_ix - addr_ix);
+                }
+                
+                for(u64 k = addr_ix; k < addr_end; ++k){
+                    
+                    /* J_1 and J_2 - low and high half of this block's u64. */
+                    J_1 = *(((u32*)(&address_block)) + (2 * k) + 0);
+                    J_2 = *(((u32*)(&address_block)) + (2 * k) + 1);
+                    
+                    ref_ixs[k] = Argon2_getLZ( &area, J_1, J_2
+                                              ,(seg_ix - addr_ix) + k
+                                             );
+                }
+                
+                for( u64 k = addr_ix
+                    ;k < addr_ix + ARGON2_PREFETCH_DIST && k < addr_end
+                    ;++k
+                   )
+                {
+                    argon2_prefetch_block(B[0] + ref_ixs[k]);
+                }
+            }
+            
+            z_ix = ref_ixs[addr_ix];
+            
+            if(addr_ix + ARGON2_PREFETCH_DIST < addr_end){
+                argon2_prefetch_block(
+                    B[0] + ref_ixs[addr_ix + ARGON2_PREFETCH_DIST]
+                );
+            }
+        }   
+        /* Otherwise: get J_1, J_2 for Argon2d. The reference block depends
+         * on the block G() has only just produced, nothing to look ahead to.
+         */
+        else{
+            J_1 = *(((u32*)(&(B[cur_lane][j-1]))) + 0);
+            J_2 = *(((u32*)(&(B[cur_lane][j-1]))) + 1);
+            
+            z_ix = Argon2_getLZ(&area, J_1, J_2, computed_blocks);
+        }
+     
+        /* Now we're ready for this loop cycle's call to G(). */
+        
+        /* Prepare input arguments of G().
+         * These will be pointers directly to the two 1024-byte blocks
+         * that will be read by G() as its algorithmic input, and one
+         * pointer directly to the start of the 1024-byte block that
+         * G() will transform. They are of type block_t*
+         */
+        
+        /* j is the index of the block we're about to transform in this
+         * loop cycle RELATIVE TO THE START OF THE CURRENT LANE!!!
+         */ 
+        G_input_one = (B[0] + (cur_lane*q)) + (j-1);
+        G_output    = (B[0] + (cur_lane*q)) + (j);
+        
+        /* On the other hand, z is the index of the block we feed as second
+         * input to G() RELATIVE TO THE START OF B[][] ITSELF!! Not relative
+         * to the start of lane l_ix. l_ix was already taken into account
+         * when computing index z. It's relative to start of B[][].
+         */
+     
+        
+        G_input_two = B[0] + z_ix;
+        
+        Argon2_G((u8*)G_input_one, (u8*)G_input_two, (u8*)G_output); 
+        
+        ++computed_blocks;       
+    }
+
+    goto label_finish_segment;
+    
+label_further_passes:   
+    /* Always compute them for Argon2d here, as pass number r > 0 always. 
+     *
+     * Every block is now made by XORing the result of G() into what's already
+     * there from the previous pass. The "previous block" of block 0 of a lane,
+     * both as first input to G() and as the source of J_1 and J_2, is the
+     * last block of that same lane, as in the RFC's reference implementation.
+     */
+    for(j = j_start; j < j_end; ++j){
+
+        if(j == 0){
+            prev_ix = q - 1;
+        }
+        else{
+            prev_ix = j - 1;
+        }
+
+        J_1 = (uint64_t)*(((uint32_t*)(&(B[cur_lane][prev_ix]))) + 0);  
+        J_2 = (uint64_t)*(((uint32_t*)(&(B[cur_lane][prev_ix]))) + 1);
+
+        z_ix = Argon2_getLZ(&area, J_1, J_2, computed_blocks);
+
+        G_input_one = (B[0] + (cur_lane*q)) + prev_ix;
+        G_output    = (B[0] + (cur_lane*q)) + (j);       
+        G_input_two =  B[0] + z_ix;
+                
+        /* Before we let G() write to the output block, copy it over and save it
+         * here so we can later XOR the result G() wrote there with the old
+         * block that was there before G() overwrote it. XORing it with its old
+         * contents is the NEW NEW block that will ultimately reside there.
+         */
+        memcpy(&old_block, G_output, sizeof(block_t));
+        
+        Argon2_G((u8*)G_input_one, (u8*)G_input_two, (u8*)G_output); 
+        
+        /* XOR the result of G() with the old block. This is now the new block*/
+        for(size_t xr = 0; xr < 128; ++xr){
+            ((u64*)G_output)[xr] ^= ((u64*)(&old_block))[xr];
+        }  
+        
+        ++computed_blocks;           
+    }    
+    
+label_finish_segment:
+
+    return;
+}
+   
+/* Argon2's working memory. With our client parameters it's about 2 GB, and
+ * G() reads it at random offsets, so with normal 4 KB pages every hash pays
+ * for half a million page faults and misses the TLB on almost every block.
+ *
+ * So it's mapped with huge pages: explicit 2 MB hugetlbfs pages if the system
+ * has reserved enough of them, otherwise a 2 MB aligned normal mapping with
+ * transparent huge pages asked for via madvise(), otherwise plain 4 KB pages.
+ * The lane workers pre-fault their own lanes in parallel before the first
+ * slice, and the whole thing is wiped before it's unmapped.
+ *
+ * Set argon2_use_hugepages to 0 to get the old behavior (4 KB pages, faulted
+ * in lazily) - the benchmarks use that for comparison.
+ */
+#define ARGON2_HUGEPAGE_SIZ (2 * 1024 * 1024)
+
+#define ARGON2_MEM_HUGETLB 1
+#define ARGON2_MEM_THP     2
+#define ARGON2_MEM_4K      3
+
+u8 argon2_use_hugepages = 1;
+
+struct Argon2_memory{
+    u8* map_base;   /* What mmap() returned. munmap() needs it back.        */
+    u64 map_len;
+    u8* blocks;     /* Start of B[][], 2 MB aligned unless 4 KB pages.      */
+    u64 len;        /* Bytes of B[][] itself.                               */
+    u8  kind;       /* ARGON2_MEM_*                                         */
+};
+
+/* Returns 1 on success, 0 if not even plain pages could be mapped. */
+u8 argon2_mem_alloc(struct Argon2_memory* mem, u64 len){
+
+    u64 huge_len = 
+        ((len + ARGON2_HUGEPAGE_SIZ - 1) / ARGON2_HUGEPAGE_SIZ)
+        * ARGON2_HUGEPAGE_SIZ;
+
+    u64 align_pad;
+
+    void* map;
+
+    mem->len = len;
+
+    if(argon2_use_hugepages){
+
+        /* Explicit huge pages. Fails unless enough were reserved by admin. */
+        map = mmap( NULL, huge_len, PROT_READ | PROT_WRITE
+                   ,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+                  );
+
+        if(map != MAP_FAILED){
+            mem->map_base = (u8*)map;
+            mem->map_len  = huge_len;
+            mem->blocks   = (u8*)map;
+            mem->kind     = ARGON2_MEM_HUGETLB;
+            return 1;
+        }
+
+        /* Transparent huge pages. Map 2 MB extra so B[][] can start on a 
+         * 2 MB boundary, otherwise the kernel can't back its edges with them.
+         */
+        map = mmap( NULL, huge_len + ARGON2_HUGEPAGE_SIZ
+                   ,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+                  );
+
+        if(map != MAP_FAILED){
+
+            align_pad = (ARGON2_HUGEPAGE_SIZ 
+                         - ((u64)map % ARGON2_HUGEPAGE_SIZ)
+                        ) % ARGON2_HUGEPAGE_SIZ;
+
+            mem->map_base = (u8*)map;
+            mem->map_len  = huge_len + ARGON2_HUGEPAGE_SIZ;
+            mem->blocks   = (u8*)map + align_pad;
+            mem->kind     = ARGON2_MEM_THP;
+
+            /* If THP is off altogether this fails, which is fine. */
+            madvise(mem->blocks, huge_len, MADV_HUGEPAGE);
+
+            return 1;
+        }
+    }
+
+    map = mmap( NULL, len, PROT_READ | PROT_WRITE
+               ,MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+              );
+
+    if(map == MAP_FAILED){
+        printf("[ERR] Cryptolib: Argon2 couldn't map %lu bytes of memory.\n"
+               ,len
+              );
+        return 0;
+    }
+
+    /* The comparison baseline wants really small pages even if THP is on
+     * for every mapping system-wide.
+     */
+    madvise(map, len, MADV_NOHUGEPAGE);
+
+    mem->map_base = (u8*)map;
+    mem->map_len  = len;
+    mem->blocks   = (u8*)map;
+    mem->kind     = ARGON2_MEM_4K;
+
+    return 1;
+}
+
+/* Wipe B[][] - it's full of password-derived data - and give it back. */
+void argon2_mem_free(struct Argon2_memory* mem){
+
+    explicit_bzero(mem->blocks, mem->len);
+
+    munmap(mem->map_base, mem->map_len);
+
+    memset(mem, 0, sizeof(struct Argon2_memory));
+
+    return;
+}
+
+/* Asynchronous Argon2.
+ *
+ * With the client's parameters, a hash takes seconds and gigabytes, and
+ * Argon2_MAIN() blocks the whole time. Argon2_START() runs it on a thread
+ * of its own instead and returns right away. As each slice of each pass is
+ * finished, on_progress (if set) is told how many of the 4*t slices are done.
+ * At the end, on_done (if set) gets one of ARGON2_RESULT_*. Both are called
+ * on Argon2's thread, not the caller's.
+ *
+ * Argon2_CANCEL() makes it stop at the end of the slice being worked on. The
+ * working memory is wiped and unmapped as usual, and the tag is zeroed.
+ *
+ * Every started job must be collected with Argon2_WAIT(), which returns the
+ * same result as on_done. Until then, the job and the buffers its parameters
+ * point to (P, S, K, X, output tag) have to stay alive.
+ */
+#define ARGON2_RESULT_DONE      0
+#define ARGON2_RESULT_CANCELLED 1
+#define ARGON2_RESULT_FAILED    2
+
+struct Argon2_async;
+
+typedef void (*Argon2_progress_fn)( struct Argon2_async* async
+                                   ,u64 slices_done, u64 slices_total
+                                  );
+
+typedef void (*Argon2_done_fn)(struct Argon2_async* async, u8 result);
+
+struct Argon2_async{
+    struct Argon2_parms parms;
+    u8*                 output_tag;
+    Argon2_progress_fn  on_progress;
+    Argon2_done_fn      on_done;
+    void*               user_arg;    /* Whatever the callbacks need.        */
+    u8                  cancel;      /* Set by Argon2_CANCEL().             */
+    u8                  result;
+    pthread_t           thread;
+};
+
+/* Process-wide pool of Argon2 worker threads.
+ *
+ * Workers are created the first time Argon2 needs them and then stay around,
+ * sleeping on job_cv between hashes, instead of p new threads being created
+ * and joined for every slice of every pass. A hash is one job. The thread
+ * that called Argon2_MAIN() is worker 0 of it, and pool threads 1 .. W-1 join
+ * in, where W is the number of lanes p, capped at the number of online CPUs.
+ * Worker w owns lanes w, w+W, w+2W and so on, so p can be anything - it no
+ * longer needs one thread per lane. Workers wait for each other on a barrier
+ * at the end of every slice, as the next slice can reference any lane.
+ */
+struct Argon2_job{
+    struct Argon2_lane_ctx* lanes;
+    const u8*               H0;           /* To make lanes' first blocks.   */
+    pthread_barrier_t       slice_barrier;
+    u64                     num_workers;
+    u64                     workers_left; /* Pool workers still running it. */
+    u8                      prefault;     /* Touch lanes' pages up front.   */
+    struct Argon2_async*    async;        /* NULL if nobody's listening.    */
+    u64                     stop_after;   /* Slice count to cancel after.   */
+};
+
+struct Argon2_pool{
+    pthread_mutex_t    run_lock;  /* One Argon2 job at a time in the pool.   */
+    pthread_mutex_t    lock;      /* Protects everything below.              */
+    pthread_cond_t     job_cv;    /* Signalled when a new job is posted.     */
+    pthread_cond_t     done_cv;   /* Signalled when the workers finish it.   */
+    struct Argon2_job* job;
+    u64                job_gen;   /* Bumped for every new job posted.        */
+    u64                num_threads;
+};
+
+struct Argon2_pool argon2_pool = {
+     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+    ,PTHREAD_COND_INITIALIZER,  PTHREAD_COND_INITIALIZER
+    ,NULL, 0, 0
+};
+
+/* Optional timing of Argon2's insides, for the test harness. Point
+ * argon2_stats at one of these, with lane_ns pointing to p zeroed entries,
+ * and the next Argon2_MAIN adds its timings to it. NULL means don't time.
+ */
+struct Argon2_stats{
+    u64  slice_ns[4]; /* Wall time of each slice, summed over all passes. */
+    u64* lane_ns;     /* Time spent in G() work for each lane.            */
+};
+
+struct Argon2_stats* argon2_stats = NULL;
+
+u64 argon2_now_ns(void){
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((u64)now.tv_sec * 1000000000ULL) + (u64)now.tv_nsec;
+}
+
+/* Worker w's share of the job: its lanes, slice by slice, pass by pass. */
+void argon2_run_lanes(struct Argon2_job* job, u64 w){
+
+    struct Argon2_lane_ctx* lanes = job->lanes;
+    struct Argon2_stats*    stats = argon2_stats;
+
+    volatile u8* lane_mem;
+
+    u64 lane_len = lanes[0].q * sizeof(block_t);
+    u64 slice_start = 0;
+    u64 seg_start   = 0;
+    u64 slices_done = 0;
+
+    /* H0 || LE32(block index) || LE32(lane index), input to H'. */
+    u8  init_buf[64 + 4 + 4];
+    u32 init_ix;
+
+    memcpy(init_buf, job->H0, 64);
+
+    for(u64 l = w; l < lanes[0].p; l += job->num_workers){
+
+        /* Make the first two blocks of our lanes, as per the RFC:
+         *
+         *   B[l][0] = H'{1024}(H0 || LE32(0) || LE32(l))
+         *   B[l][1] = H'{1024}(H0 || LE32(1) || LE32(l))
+         */
+        init_ix = (u32)l;
+        memcpy(init_buf + 64 + 4, &init_ix, 4);
+
+        for(init_ix = 0; init_ix < 2; ++init_ix){
+            memcpy(init_buf + 64, &init_ix, 4);
+            Argon2_H_dash( init_buf, (u8*)&(lanes[l].B[l][init_ix])
+                          ,1024, sizeof(init_buf)
+                         );
+        }
+
+        /* Fault in the rest of the pages of our lanes now, all workers at
+         * once, instead of one at a time as G() first lands on them. The
+         * first page is already in, it holds the two blocks just made.
+         */
+        if(job->prefault){
+
+            lane_mem = (volatile u8*)(lanes[l].B[l]);
+
+            for(u64 off = 4096; off < lane_len; off += 4096){
+                lane_mem[off] = 0;
+            }
+        }
+    }
+
+    explicit_bzero(init_buf, sizeof(init_buf));
+
+    /* Every lane's first blocks must be there before the first slice. */
+    pthread_barrier_wait(&(job->slice_barrier));
+
+    for(u64 r = 0; r < lanes[0].t; ++r){
+        for(u64 sl = 0; sl < 4; ++sl){
+
+            if(stats && w == 0){
+                slice_start = argon2_now_ns();
+            }
+
+            for(u64 l = w; l < lanes[0].p; l += job->num_workers){
+                lanes[l].r  = r;
+                lanes[l].sl = sl;
+
+                if(stats){
+                    seg_start = argon2_now_ns();
+                }
+
+                argon2_transform_segment(&(lanes[l]));
+
+                /* Only this worker ever does lane l, no need to lock. */
+                if(stats){
+                    stats->lane_ns[l] += argon2_now_ns() - seg_start;
+                }
+            }
+
+            ++slices_done;
+
+            /* Worker 0 decides for everyone whether to stop after this slice.
+             * It says which slice to stop after, not just "stop", so that a
+             * worker still behind on this slice's barrier can't mistake
+             * a cancel meant for the next slice as meant for this one.
+             */
+            if(   w == 0 && job->async 
+               && __atomic_load_n(&(job->async->cancel), __ATOMIC_ACQUIRE)
+              )
+            {
+                __atomic_store_n(&(job->stop_after), slices_done
+                                 ,__ATOMIC_RELAXED
+                                );
+            }
+
+            /* All segments of this slice of the memory matrix must be 
+             * finished before anyone can start on a segment of the next one.
+             */
+            pthread_barrier_wait(&(job->slice_barrier));
+
+            if(stats && w == 0){
+                stats->slice_ns[sl] += argon2_now_ns() - slice_start;
+            }
+
+            if(   __atomic_load_n(&(job->stop_after), __ATOMIC_RELAXED) 
+               <= slices_done
+              )
+            {
+                return;
+            }
+
+            if(w == 0){
+                printf("------------- ARGON2: Slice %lu finished. "
+                       "-------------\n", sl
+                      );
+
+                if(job->async && job->async->on_progress){
+                    job->async->on_progress( job->async, slices_done
+                                            ,4 * lanes[0].t
+                                           );
+                }
+            }
+        }
+    }
+
+    return;
+}
+
+void* argon2_pool_worker(void* worker_ix){
+
+    struct Argon2_job* job;
+
+    u64 w        = (u64)worker_ix;
+    u64 seen_gen = 0;
+
+    while(1){
+
+        pthread_mutex_lock(&(argon2_pool.lock));
+
+        while(argon2_pool.job_gen == seen_gen){
+            pthread_cond_wait(&(argon2_pool.job_cv), &(argon2_pool.lock));
+        }
+
+        seen_gen = argon2_pool.job_gen;
+        job      = argon2_pool.job;
+
+        pthread_mutex_unlock(&(argon2_pool.lock));
+
+        /* Fewer lanes than pool threads this time - sit this one out. */
+        if(w >= job->num_workers){
+            continue;
+        }
+
+        argon2_run_lanes(job, w);
+
+        pthread_mutex_lock(&(argon2_pool.lock));
+
+        if(--(job->workers_left) == 0){
+            pthread_cond_signal(&(argon2_pool.done_cv));
+        }
+
+        pthread_mutex_unlock(&(argon2_pool.lock));
+    }
+
+    return NULL;
+}
+
+/* Run all passes over all lanes of B[][] on the worker pool. Blocks until
+ * the whole memory matrix is done, or the async job was cancelled. Returns
+ * 1 if it's done, 0 if cancelled.
+ */
+u8 argon2_pool_run( struct Argon2_lane_ctx* lanes, const u8* H0, u8 prefault
+                   ,struct Argon2_async* async
+                  )
+{
+
+    struct Argon2_job job;
+
+    pthread_t tid;
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    job.lanes       = lanes;
+    job.H0          = H0;
+    job.prefault    = prefault;
+    job.async       = async;
+    job.stop_after  = UINT64_MAX;
+    job.num_workers = lanes[0].p;
+
+    if(num_cpus > 0 && job.num_workers > (u64)num_cpus){
+        job.num_workers = (u64)num_cpus;
+    }
+
+    job.workers_left = job.num_workers - 1;
+
+    pthread_mutex_lock(&(argon2_pool.run_lock));
+
+    pthread_barrier_init(&(job.slice_barrier), NULL, (u32)job.num_workers);
+
+    pthread_mutex_lock(&(argon2_pool.lock));
+
+    /* Grow the pool if this job wants more workers than it has so far. */
+    while(argon2_pool.num_threads < job.num_workers - 1){
+
+        if(pthread_create( &tid, NULL, argon2_pool_worker
+                          ,(void*)(argon2_pool.num_threads + 1)
+                         ) != 0
+          )
+        {
+            /* Make do with the workers we have. */
+            printf("[ERR] Cryptolib: Argon2 couldn't create a worker thread."
+                   " Continuing with %lu.\n", argon2_pool.num_threads + 1
+                  );
+
+            pthread_barrier_destroy(&(job.slice_barrier));
+            job.num_workers  = argon2_pool.num_threads + 1;
+            job.workers_left = job.num_workers - 1;
+            pthread_barrier_init( &(job.slice_barrier), NULL
+                                 ,(u32)job.num_workers
+                                );
+            break;
+        }
+
+        pthread_detach(tid);
+        ++(argon2_pool.num_threads);
+    }
+
+    argon2_pool.job = &job;
+    ++(argon2_pool.job_gen);
+
+    pthread_cond_broadcast(&(argon2_pool.job_cv));
+    pthread_mutex_unlock(&(argon2_pool.lock));
+
+    /* This thread is worker 0. */
+    argon2_run_lanes(&job, 0);
+
+    /* Wait until every pool worker is out of the job before it goes away. */
+    pthread_mutex_lock(&(argon2_pool.lock));
+
+    while(job.workers_left > 0){
+        pthread_cond_wait(&(argon2_pool.done_cv), &(argon2_pool.lock));
+    }
+
+    argon2_pool.job = NULL;
+
+    pthread_mutex_unlock(&(argon2_pool.lock));
+
+    pthread_barrier_destroy(&(job.slice_barrier));
+
+    pthread_mutex_unlock(&(argon2_pool.run_lock));
+
+    return (job.stop_after == UINT64_MAX);
+}
+
+/* The actual hash, behind both Argon2_MAIN() and the async jobs. */
+u8 argon2_hash( struct Argon2_parms* parms, uint8_t* output_tag
+               ,struct Argon2_async* async
+              )
+{
+    
+    struct Argon2_lane_ctx* lanes;
+
+    /* How many 1024-byte blocks in B. */
+    u64 m_dash = 4 * parms->p * (parms->m / (4 * parms->p));
+    
+    /* How many columns in B. Also size of one row in 1024-byte blocks. */
+    /* Each column intersecting a row is one 1024-byte block.           */
+    u64 q = m_dash / parms->p;  
+
+    u8  final_block_C[sizeof(block_t)];
+    u8  H0[64];
+    u8* working_memory;
+
+    struct Argon2_memory  mem;
+    struct BLAKE2B_stream H0_stream;
+
+    u8 result = ARGON2_RESULT_DONE;
+
+    block_t** B;
+
+    /* Generate 64-byte H0 by streaming its input into BLAKE2b field by
+     * field, instead of first gluing it all together in one buffer.
+     * The order has to be exactly as specified in the RFC.
+     */
+    BLAKE2B_STREAM_INIT(&H0_stream, 64);
+
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->p),     4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->T),     4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->m),     4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->t),     4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->v),     4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->y),     4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->len_P), 4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, parms->P, parms->len_P);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->len_S), 4);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, parms->S, parms->len_S);
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->len_K), 4);
+    
+    if(parms->len_K){
+        BLAKE2B_STREAM_UPDATE(&H0_stream, parms->K, parms->len_K);
+    }
+    
+    BLAKE2B_STREAM_UPDATE(&H0_stream, (u8*)&(parms->len_X), 4);
+    
+    if(parms->len_X){
+        BLAKE2B_STREAM_UPDATE(&H0_stream, parms->X, parms->len_X);
+    }
+    
+    BLAKE2B_STREAM_FINAL(&H0_stream, H0);
+
+    /* Construct the working memory of Argon2 now. */
+                          
+    /* The best we can do to help simplify the pointer arithmetic here is to 
+     * set a pointer to each row of the B[][] memory matrix. Each row consists
+     * of many 1024-byte blocks, but at least we will be able to directly use
+     * the [index] notation when accessing B[][] for the "get to row X" part
+     * as described in the Argon2 RFC specification, ie the first bracket.
+     *
+     * For the second bracket where B[][] is used in the specification, we will
+     * use a specially defined struct that only has a 1024-byte array in it
+     * and typedef'd as block_t. This changes the behind-the-scenes multiplier
+     * of the C compiler's pointer arithmetic to (* 1024), just like it would
+     * do (* 4) behind the scenes for a pointer to uint32_t.
+     *
+     * To work inside a particular 1024-byte block, we will likely need actual
+     * carefully written pointer arithmetic.
+     */
+    
+    /* Allocate the working memory matrix of Argon2. Comes zeroed. */
+    if(!argon2_mem_alloc(&mem, m_dash * sizeof(block_t))){
+        memset(output_tag, 0, parms->T);
+        explicit_bzero(H0, 64);
+        return ARGON2_RESULT_FAILED;
+    }
+    
+    working_memory = mem.blocks;
+    
+    /* Split the memory matrix into p rows by setting pointers to the 
+     * start of each row. Each row has many 1024-byte blocks. 
+     */
+    B = (block_t**)calloc(1, parms->p * sizeof(block_t*));
+    
+    /* Set a pointer to the start of each row in the memory matrix. */
+    for(uint64_t i = 0; i < parms->p; ++i){
+        B[i] = (block_t*)(working_memory + (i * (q * sizeof(block_t))));
+    }
+    
+    /* Now where B[x][y] is used in the RFC specification, here in this
+     * implementation it too can be written as B[x][y], which would mean
+     * to the compiler "start from contents of memory address B, wherein is a
+     * pointer to a 1024-byte block. Go +x such pointers into B, to get to the
+     * actual row x in Argon2's working memory matrix B[][]. Then from
+     * this pointer to a 1024-byte block, go +y such blocks, to the 
+     * exact 1024-byte block you need and dereference the pointer to it." 
+     *
+     * All while keeping the entire memory (all p rows of 1024-byte blocks)
+     * contiguous in the process memory as required in the RFC specification
+     * in order for the security of the hashing algorithm to work.
+     *
+     * The first two blocks of each lane are made from H0 by the pool's 
+     * workers, each for its own lanes, before they start on the first slice.
+     */
+
+    /* Pick the SIMD version of G() now, before any threads can race on it. */
+    if(!Argon2_G_impl){
+        Argon2_G_SELECT();
+    }
+    
+    /* Each lane's context, constant for the whole hash except for the
+     * current pass r and slice sl, which its worker fills in as it goes.
+     */
+    lanes = (struct Argon2_lane_ctx*)
+            calloc(1, parms->p * sizeof(struct Argon2_lane_ctx));
+    
+    for(uint64_t i = 0; i < parms->p; ++i){
+        lanes[i].B  = B;
+        lanes[i].l  = i;
+        lanes[i].md = m_dash;
+        lanes[i].t  = parms->t;
+        lanes[i].y  = parms->y;
+        lanes[i].p  = parms->p;
+        lanes[i].q  = q;
+    }
+    
+    /* Each of the 4 vertical slices is computed and finished before the next
+     * slice can begin, for every pass. The worker pool processes all segments
+     * of a slice in parallel.
+     */
+    if(!argon2_pool_run(lanes, H0, (mem.kind != ARGON2_MEM_4K), async)){
+        memset(output_tag, 0, parms->T);
+        result = ARGON2_RESULT_CANCELLED;
+        goto label_cleanup;
+    }
+
+    /* Done with all required passes. */
+    /* Compute final 1024-byte block C by XORing the last block of every lane.*/ 
+ 
+    memcpy(final_block_C, &(B[0][q-1]), 1024);
+    
+    /*
+    printf("last column blocks of B[][] at end of 1st pass:\n");
+    for(size_t ln = 0; ln < parms->p; ++ln){
+            printf("LAST 1024-byte BLOCK IN LANE %lu:\n", ln);
+               for(uint32_t i = 0; i < 1024; ++i){
+                if(i % 16 == 0 && i > 0){printf("\n");}
+                printf("%02x ", ( ((uint8_t*)(&(B[ln][q-1])))[i] )) ;
+            }
+            printf("\n\n");  
+     
+    }
+    */    
+        
+    for(size_t ln = 1; ln < parms->p; ++ln){
+    
+    /*
+        printf("\n\n***** final block before XORing with last block of ln"
+               " = %lu *****\n\n"
+              ,ln);
+        
+        for(uint32_t i = 0; i < 1024; ++i){
+            if(i % 16 == 0 && i > 0){printf("\n");}
+            printf("%02x ", (uint8_t)final_block_C[i]);
+        }
+        printf("\n\n");  
+        */
+           
+        for(size_t xr = 0; xr < 128; ++xr){
+           ((uint64_t*)(final_block_C))[xr] ^= ((uint64_t*)(&(B[ln][q-1])))[xr];  
+        }        
+    }
+       
+    /* Finally, feed final block C to H' producing Tag-length bytes of output:
+     * Result = H'{T}(C)
+     */
+     /*
+    printf("\n\n***** input 1024-byte block to H_dash calling B2B: *****\n\n");
+    
+    for(uint32_t i = 0; i < 1024; ++i){
+        if(i % 16 == 0 && i > 0){printf("\n");}
+        printf("%02x ", (uint8_t)final_block_C[i]);
+    }
+    printf("\n\n");     
+    */
+    Argon2_H_dash(final_block_C, output_tag, parms->T, 1024);
+
+label_cleanup:
+
+    /* Cleanup. */    
+    free(lanes);
+    free(B);
+    
+    argon2_mem_free(&mem);
+    
+    explicit_bzero(final_block_C, sizeof(block_t));
+    explicit_bzero(H0, 64);
+
+    return result;
+}
+
+void Argon2_MAIN(struct Argon2_parms* parms, uint8_t* output_tag){
+
+    argon2_hash(parms, output_tag, NULL);
+
+    return;
+}
+
+void* argon2_async_thread(void* arg){
+
+    struct Argon2_async* async = (struct Argon2_async*)arg;
+
+    async->result = argon2_hash(&(async->parms), async->output_tag, async);
+
+    if(async->on_done){
+        async->on_done(async, async->result);
+    }
+
+    return NULL;
+}
+
+/* Start hashing in the background. Returns 1 if it started, 0 if not. */
+u8 Argon2_START( struct Argon2_async* async, struct Argon2_parms* parms
+                ,u8* output_tag
+                ,Argon2_progress_fn on_progress, Argon2_done_fn on_done
+                ,void* user_arg
+               )
+{
+    memcpy(&(async->parms), parms, sizeof(struct Argon2_parms));
+
+    async->output_tag  = output_tag;
+    async->on_progress = on_progress;
+    async->on_done     = on_done;
+    async->user_arg    = user_arg;
+    async->cancel      = 0;
+    async->result      = ARGON2_RESULT_FAILED;
+
+    if(pthread_create(&(async->thread), NULL, argon2_async_thread, async)){
+        printf("[ERR] Cryptolib: Couldn't start an Argon2 thread.\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Ask a running job to stop. Returns right away, Argon2_WAIT() for it. */
+void Argon2_CANCEL(struct Argon2_async* async){
+
+    __atomic_store_n(&(async->cancel), 1, __ATOMIC_RELEASE);
+
+    return;
+}
+
+/* Block until the job is over, then return its ARGON2_RESULT_*. */
+u8 Argon2_WAIT(struct Argon2_async* async){
+
+    pthread_join(async->thread, NULL);
+
+    return async->result;
+}
+
+/* Argon2 cost calibration.
+ *
+ * Hard-coding m, t and p makes slow machines wait a long time on every login
+ * and leaves headroom unused on fast ones. Instead, time Argon2_MAIN on this
+ * machine with a throwaway password and salt, and scale the cost until one
+ * hash takes about target_ms. Memory grows first, up to max_mem_kib, since
+ * that's what makes Argon2 expensive to attack. Only once the memory budget
+ * is all used up do we add more passes. p is set to all hardware threads.
+ *
+ * The caller stores what this picks next to whatever it encrypted with the
+ * hash, because the same parameters are needed to reproduce it later.
+ *
+ * Returns 1 on success, 0 if no trial hash could even get its memory.
+ */
+
+/* Smallest memory cost calibration will ever pick: 64 MiB. */
+#define ARGON2_CALIB_MIN_KIB 65536
+
+/* Most passes calibration goes to, once memory alone can't hit the target. */
+#define ARGON2_CALIB_MAX_PASSES 10
+
+/* Trial hashes to run at most, and the most one trial may scale the cost by.
+ * The cap keeps a badly noisy first trial from overshooting the target.
+ */
+#define ARGON2_CALIB_MAX_TRIALS 8
+#define ARGON2_CALIB_MAX_SCALE  8.0
+
+u8 Argon2_CALIBRATE(u64 target_ms, u64 max_mem_kib, struct Argon2_parms* out){
+
+    struct Argon2_parms trial;
+    struct timespec start, end;
+
+    u8  trial_P[16];
+    u8  trial_S[16];
+    u8  trial_tag[64];
+    u8  zero_tag[64];
+
+    long num_cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    long phys_pages  = sysconf(_SC_PHYS_PAGES);
+    long page_siz    = sysconf(_SC_PAGESIZE);
+
+    double elapsed_ms = 0;
+    double scale;
+
+    u64 next_m;
+    u64 next_t;
+
+    memset(&trial,        0, sizeof(struct Argon2_parms));
+    memset(trial_P,       0, sizeof(trial_P));
+    memset(trial_S,       0, sizeof(trial_S));
+    memset(zero_tag,      0, sizeof(zero_tag));
+
+    trial.p = 1;
+
+    if(num_cpus > 1){
+        trial.p = (u64)num_cpus;
+    }
+
+    /* p must fit in 24 bits as per the RFC. */
+    if(trial.p > 0xFFFFFF){
+        trial.p = 0xFFFFFF;
+    }
+
+    /* Never take more than half of the machine's physical memory. */
+    if(phys_pages > 0 && page_siz > 0){
+        if(max_mem_kib > ((u64)phys_pages * (u64)page_siz) / 2048){
+            max_mem_kib = ((u64)phys_pages * (u64)page_siz) / 2048;
+        }
+    }
+
+    if(max_mem_kib < 8 * trial.p){
+        max_mem_kib = 8 * trial.p;
+    }
+
+    trial.T = 64;
+    trial.m = ARGON2_CALIB_MIN_KIB;
+    trial.t = 1;
+    trial.v = 0x13;
+    trial.y = 0x02;
+    trial.P = trial_P;
+    trial.S = trial_S;
+    trial.len_P = sizeof(trial_P);
+    trial.len_S = sizeof(trial_S);
+
+    if(trial.m > max_mem_kib){
+        trial.m = max_mem_kib;
+    }
+
+    for(u64 i = 0; i < ARGON2_CALIB_MAX_TRIALS; ++i){
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Argon2_MAIN(&trial, trial_tag);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        /* Argon2_MAIN zeroes the tag if it couldn't get its memory. */
+        if(memcmp(trial_tag, zero_tag, 64) == 0){
+
+            if(i == 0){
+                printf("[ERR] Cryptolib: Argon2 calibration couldn't run.\n");
+                return 0;
+            }
+
+            /* Over the memory we can actually get. Stay at the last cost. */
+            break;
+        }
+
+        elapsed_ms =  ((double)(end.tv_sec  - start.tv_sec)  * 1000.0)
+                    + ((double)(end.tv_nsec - start.tv_nsec) / 1000000.0);
+
+        printf("[OK] Cryptolib: Argon2 calibration trial m=%lu t=%lu p=%lu"
+               " took %.0f ms.\n", trial.m, trial.t, trial.p, elapsed_ms
+              );
+
+        out->p = trial.p;
+        out->m = trial.m;
+        out->t = trial.t;
+
+        /* Within 10% of the target - good enough. */
+        if(elapsed_ms >= 0.9 * (double)target_ms){
+            break;
+        }
+
+        scale = (double)target_ms / elapsed_ms;
+
+        if(scale > ARGON2_CALIB_MAX_SCALE){
+            scale = ARGON2_CALIB_MAX_SCALE;
+        }
+
+        next_m = trial.m;
+        next_t = trial.t;
+
+        if(trial.m < max_mem_kib){
+            next_m = (u64)((double)trial.m * scale);
+
+            if(next_m > max_mem_kib){
+                next_m = max_mem_kib;
+            }
+        }
+        else{
+            next_t = (u64)ceil((double)trial.t * scale);
+
+            if(next_t > ARGON2_CALIB_MAX_PASSES){
+                next_t = ARGON2_CALIB_MAX_PASSES;
+            }
+        }
+
+        /* Can't go any further within the memory budget and pass limit. */
+        if(next_m == trial.m && next_t == trial.t){
+            break;
+        }
+
+        trial.m = next_m;
+        trial.t = next_t;
+    }
+
+    /* Overshot by more than 10%? Scale memory back down instead of running
+     * yet another trial, it's close enough to linear in m.
+     */
+    if(elapsed_ms > 1.1 * (double)target_ms && out->t == 1){
+
+        out->m = (u64)((double)out->m * ((double)target_ms / elapsed_ms));
+
+        if(   out->m < ARGON2_CALIB_MIN_KIB 
+           && max_mem_kib >= ARGON2_CALIB_MIN_KIB
+          )
+        {
+            out->m = ARGON2_CALIB_MIN_KIB;
+        }
+    }
+
+    if(out->m < 8 * out->p){
+        out->m = 8 * out->p;
+    }
+
+    explicit_bzero(trial_tag, sizeof(trial_tag));
+
+    return 1;
+}
+
+
+/* The caller must have made sure in advance that X and Y are each L-limb, 
+ * L being the number of (non-zero-padded) limbs in the Montgomery modulus N.
+ *
+ * If X and Y are Montgomery representatives of A and B, then this algorithm
+ * computes R, the Montgomery representative of (A*B).
+ *
+ * This algorithm can also be used to convert from base-2 of a number to the
+ * base-beta Montgomery representative of the same number, and also to go
+ * back from Montgomery representative to base-2.
+ *
+ * I use base-2^64 Montgomery representatives, which means beta=2^64. This leads
+ * to having 64-bit limbs in the Montgomery representatives of numbers. It also
+ * leads to having 64-bit MUL and ADD operations, which are not directly 
+ * supported in C, instead most C compilers provide intrinsics for it, which we
+ * make use of here to boost performance. Here, L = ceil(N_used_bits / 64).
+ *
+ * Note: beta is ignored everywhere where we'd multiply by it, so don't even
+ *       pass it here.
+ */
+void Montgomery_MUL(bigint* X, bigint* Y, bigint* N, bigint* R){
+
+    u8 C;
+    u8 D;
+
+    unsigned long long  Ul;
+    unsigned long long  Uh;
+    unsigned long long  Vl;
+    unsigned long long  Vh;
+    unsigned long long  W;
+    unsigned long long  q;
+    unsigned long long* T;
+
+    bigint R_aux;
+
+    bigint_create(&R_aux, R->size_bits, 0);
+    
+    /* Set R = 0, all of its (L+1) limbs. Limb indices [0] to [L] inclusive. */
+    bigint_nullify(R);
+    
+    /* T: 3-limb variable */ 
+    /* q: 1-limb variable */
+    
+    /* Optimization: Keep T in the memory of R->bits in limbs [L+1] to [L+3]. */
+    /* Set the pointer to point to the right memory region of R's bit buffer  */
+    T = (unsigned long long*)(R->bits + ((MONT_L + 1) * MONT_LIMB_SIZ)); 
+    
+    memset(T, 0, (3 * MONT_LIMB_SIZ));
+    
+    for(uint64_t i = 0; i < MONT_L; ++i){
+
+        /* 2. */
+        Ul = _mulx_u64(  *((u64*)(Y->bits + (i * MONT_LIMB_SIZ)))
+                        ,*((u64*)(X->bits))
+                        ,&Uh
+                      );
+                      
+        C = _addcarryx_u64((u8)0, Ul, *((u64*)R->bits), &Ul);
+        
+        Uh += (u64)C;
+
+        *(T + 0) = Ul;
+        *(T + 1) = Uh;
+        *(T + 2) = 0;    
+        
+        /* 3. */
+        q = _mulx_u64((u64)MONT_MU, *(T + 0), &Uh);
+        
+        /* 3.5:  T += q*n0. */
+        Vl = _mulx_u64(q, *((u64*)(N->bits + (0*MONT_LIMB_SIZ))), &Vh);
+        
+        C = _addcarryx_u64( (u8)0, *(T + 0), Vl, (T + 0) );
+        
+        D = _addcarryx_u64( C, *(T + 1), Vh, (T + 1) );
+    
+        *(T + 2) += (u64)D;
+    
+        /* 4. */
+        for(u64 j = 1; j < MONT_L; ++j){
+
+            /* Compute T limb by limb. */
+            Ul = _mulx_u64(q, *((u64*)(N->bits + (j*MONT_LIMB_SIZ))), &Uh);
+            
+            
+            Vl = _mulx_u64( *((u64*)(Y->bits + (i * MONT_LIMB_SIZ)))
+                           ,*((u64*)(X->bits + (j * MONT_LIMB_SIZ)))
+                           ,&Vh
+                          );
+                          
+            C = _addcarryx_u64((u8)0
+                              ,Ul
+                              ,*((u64*)(R->bits + (j * MONT_LIMB_SIZ)))
+                              ,&Ul
+                              );              
+                          
+            Uh += (u64)C;              
+                          
+            D = _addcarryx_u64((u8)0, Vl, *(T + 1), &Vl);
+            
+            C = _addcarryx_u64((u8)0, Ul, Vl, (T + 0));
+            
+            D = _addcarryx_u64(D, Uh, Vh, &W);
+            
+            C = _addcarryx_u64(C, W, *(T + 2), (T + 1));
+            
+            *(T + 2) = (u64)C + (u64)D;
+                      
+            /* Set r_(j-1) = t_0  */
+            *((u64*)(R->bits + ((j-1) * MONT_LIMB_SIZ))) = *(T + 0);
+        }
+
+        /* 5. */        
+        C = _addcarryx_u64( (u8)0
+                   ,*(T + 1)
+                   ,*((u64*)(R->bits+(MONT_L * MONT_LIMB_SIZ)))
+                   , (T + 0)
+                  );
+       
+        *(T + 1) = (u64)C + *(T + 2); 
+        *(T + 2) = 0;
+        
+        /* 6. */ 
+        *((u64*)(R->bits+((MONT_L - 1) * MONT_LIMB_SIZ))) = *(T + 0);
+        *((u64*)(R->bits+( MONT_L      * MONT_LIMB_SIZ))) = *(T + 1);    
+    }
+
+    memset((u8*)T, 0, 3 * MONT_LIMB_SIZ);
+
+    /* 7. */
+    R->used_bits = get_used_bits(R->bits, (u32)(R->size_bits / 8));
+    
+    R->free_bits = R->size_bits - R->used_bits;
+    
+    if ( *((u64*)(R->bits + (MONT_L * MONT_LIMB_SIZ))) != 0){ 
+        bigint_equate2(&R_aux, R);        
+        bigint_sub2(&R_aux, N, R);
+    }
+    
+    free(R_aux.bits);
+    
+    return;
+}
+
+/* Practical method to convert a number to Montgomery Form.
+ *  
+ * To find the Montgomery form (mod M) of A, do the following:
+ *
+ *  Call Montgomery MUL mod M with input 1 set to (beta^(2*L) mod M), the other 
+ *  input set to A itself (in normal positional notation). The output of this
+ *  will in fact be a valid Montgomery representative of A.
+ * 
+ *  Note: Sometimes a Montgomery form of a number can be larger than the number
+ *        itself in regular positional notation. This is fine and is still a
+ *        valid Montgomery form of that number. Also, a number can have several
+ *        valid Montgomery forms, not necessarily just one. I think.
+ */
+void Get_Mont_Form(bigint* src, bigint* target, bigint* M){
+
+    bigint two;
+    bigint sixtyfour;
+    bigint beta;
+    bigint two_L;
+    bigint aux;
+
+    bigint_create(&two,       M->size_bits, 2 );  
+    bigint_create(&sixtyfour, M->size_bits, 64);
+    bigint_create(&beta,      M->size_bits, 0 );
+    bigint_create(&aux,       M->size_bits, 0 );
+    bigint_create(&two_L,     M->size_bits, 2 * MONT_L );
+    bigint_nullify(target);
+
+    /* beta = 2^64 for 64-bit Montgomery limbs. */
+    bigint_pow(&two, &sixtyfour, &beta);
+
+    /* aux = beta^(2*L) mod M */
+    bigint_mod_pow(&beta, &two_L, M, &aux);
+
+    /* Now generate the source's Montgomery form. */
+    Montgomery_MUL(&aux, src, M, target);
+
+    target->used_bits = get_used_bits(target->bits, (uint32_t)(M->size_bits/8));
+    target->free_bits = target->size_bits - target->used_bits;
+    
+    printf("[OK] Cryptolib: Montgomery Form computed successfully.\n");
+
+    /* Cleanup. */
+
+    free(two.bits);
+    free(sixtyfour.bits);
+    free(beta.bits);
+    free(aux.bits);
+    free(two_L.bits);
+
+    return;
+}
+
+/* Computes B^P mod M using Montgomery Modular Multiplication. Result goes in R.
+ * The base B must be in Montgomery Form. 
+ * The result R is NOT the Montgomery Form of the result of powering, it
+ * is the actual result in regular positional notation.
+ *
+ * Note: This function is somewhat general, but not fully general - it computes
+ *          any modular powering mod M using Montgomery Multiplication, and the
+ *       parameters that depend on the modulus M (MU and L) are defined at
+ *         the top of this file. However, it won't work for modular powering mod
+ *       some other number, other than M, which for the purposes of the secure
+ *       chat system this library was originally written for is global static.
+ *         If a function for modular POW mod M using Montgomery Multiplication
+ *         for a different modulus is needed, you have to change the Montgomery
+ *       parameters MU and L - they are different for each Montgomery modulus.
+ */
+void MONT_POW_modM(bigint* B, bigint* P, bigint* M, bigint* R){
+
+    u32 bit = 0;
+    
+    bigint X;
+    bigint Y;
+    bigint R_1;
+    bigint one;
+    bigint div_res;
+
+    bigint_create(&X,       M->size_bits, 0);
+    bigint_create(&Y,       M->size_bits, 0);
+    bigint_create(&R_1,     M->size_bits, 0);
+    bigint_create(&one,     M->size_bits, 1);
+    bigint_create(&div_res, M->size_bits, 0);
+
+    /* X and Y both become equal to the passed base B */
+    bigint_equate2(&X, B);
+    bigint_equate2(&Y, B);
+
+    for(int64_t i = (int64_t)(P->used_bits - 2); i >= 0; --i){     
+       
+        Montgomery_MUL(&Y, &Y, M, R);     
+        bigint_equate2(&Y, R);
+ 
+        if( (BIGINT_GET_BIT(*P, i, bit)) == 1 ){
+            Montgomery_MUL(&Y, &X, M, R);      
+            bigint_equate2(&Y, R);        
+        }
+    }
+    
+    Montgomery_MUL(&one, R, M, &R_1);
+    bigint_div2(&R_1, M, &div_res, R);    
+
+    free(X.bits); 
+    free(Y.bits); 
+    free(R_1.bits);
+    free(one.bits); 
+    free(div_res.bits);
+
+    return;
+}
+
+/* R = X - Y on MONT_L-limb arrays. Returns the borrow out of the top limb,
+ * which is 1 if X < Y and R wrapped around. R may be X or Y.
+ */
+u8 Montgomery_SUB_LIMBS(const u64* X, const u64* Y, u64* R){
+
+    u64 x;
+    u64 y;
+    u8  borrow = 0;
+
+    for(u64 j = 0; j < MONT_L; ++j){
+        x      = X[j];
+        y      = Y[j];
+        R[j]   = x - y - borrow;
+        borrow = (x < y) | ((x == y) & borrow);
+    }
+
+    return borrow;
+}
+
+/* 128-bit products of two limbs. Not in ISO C, hence the __extension__. */
+__extension__ typedef unsigned __int128 u128;
+
+/* Add the 128-bit product x * y to a column sum kept in acc and acc_top, 192
+ * bits in all. Limb products summed a column at a time don't pass a carry
+ * from one to the next like a row at a time does, which is what makes the
+ * _LIMBS multiplications below about twice as fast as carrying row by row.
+ */
+#define MONT_COLUMN_ADD(acc, acc_top, x, y)                              \
+{                                                                        \
+    u128 prod_ = (u128)(x) * (u128)(y);                                  \
+    (acc) += prod_;                                                      \
+    (acc_top) += ((acc) < prod_);                                        \
+}
+
+/* Move a column sum on to the next column: its lowest limb is done with. */
+#define MONT_COLUMN_NEXT(acc, acc_top)                                   \
+{                                                                        \
+    (acc) = ((acc) >> 64) | ((u128)(acc_top) << 64);                     \
+    (acc_top) = 0;                                                       \
+}
+
+/* T has MONT_L + 1 limbs and is less than 2N. Take N away once if T >= N,
+ * and put the result, fully reduced, in R.
+ */
+void Montgomery_FINISH_LIMBS(const u64* T, const u64* N, u64* R){
+
+    u64 T_minus_N[MONT_L];
+
+    if(!Montgomery_SUB_LIMBS(T, N, T_minus_N) || T[MONT_L]){
+        memcpy(R, T_minus_N, MONT_L * MONT_LIMB_SIZ);
+    }
+    else{
+        memcpy(R, T, MONT_L * MONT_LIMB_SIZ);
+    }
+
+    return;
+}
+
+/* Montgomery multiplication straight on MONT_L-limb arrays, for hot loops
+ * that can't afford what Montgomery_MUL() does around the multiplication
+ * itself - calloc() a scratch BigInt, clear all 12800 bits of R and count its
+ * used bits one by one, on every call. Same MONT_MU and MONT_L as it uses.
+ *
+ * It goes a column of X * Y + m * N at a time (Koc's product scanning). Each
+ * of the low columns ends with picking the limb m[i] that zeroes it, each of
+ * the high ones is a limb of the result.
+ *
+ * X and Y must be fully reduced, less than N. So is R then. R may be X or Y.
+ */
+void Montgomery_MUL_LIMBS(const u64* X, const u64* Y, const u64* N, u64* R){
+
+    u64  m[MONT_L];
+    u64  T[MONT_L + 1];
+    u64  acc_top = 0;
+    u128 acc     = 0;
+
+    for(u64 i = 0; i < MONT_L; ++i){
+
+        for(u64 j = 0; j < i; ++j){
+            MONT_COLUMN_ADD(acc, acc_top, X[j], Y[i - j]);
+            MONT_COLUMN_ADD(acc, acc_top, m[j], N[i - j]);
+        }
+
+        MONT_COLUMN_ADD(acc, acc_top, X[i], Y[0]);
+
+        m[i] = (u64)acc * (u64)MONT_MU;
+
+        MONT_COLUMN_ADD(acc, acc_top, m[i], N[0]);
+        MONT_COLUMN_NEXT(acc, acc_top);
+    }
+
+    for(u64 i = MONT_L; i < (2 * MONT_L) - 1; ++i){
+
+        for(u64 j = i - MONT_L + 1; j < MONT_L; ++j){
+            MONT_COLUMN_ADD(acc, acc_top, X[j], Y[i - j]);
+            MONT_COLUMN_ADD(acc, acc_top, m[j], N[i - j]);
+        }
+
+        T[i - MONT_L] = (u64)acc;
+
+        MONT_COLUMN_NEXT(acc, acc_top);
+    }
+
+    T[MONT_L - 1] = (u64)acc;
+    T[MONT_L]     = (u64)(acc >> 64);
+
+    Montgomery_FINISH_LIMBS(T, N, R);
+
+    explicit_bzero(m, sizeof(m));
+
+    return;
+}
+
+/* R = X * X in Montgomery Form, like Montgomery_MUL_LIMBS(X, X, N, R) but in
+ * each column X[j] * X[i - j] and X[i - j] * X[j] are the same product, so
+ * it's worked out once and doubled - about half the partial products of X * X,
+ * though all of m * N still. Most of an exponentiation is squarings.
+ */
+void Montgomery_SQR_LIMBS(const u64* X, const u64* N, u64* R){
+
+    u64  m[MONT_L];
+    u64  T[MONT_L + 1];
+    u64  acc_top = 0;
+    u64  cross_top;
+    u64  lowest;
+    u128 acc     = 0;
+    u128 cross;
+
+    for(u64 i = 0; i < (2 * MONT_L) - 1; ++i){
+
+        lowest = (i < MONT_L) ? 0 : i - MONT_L + 1;
+
+        /* Each product of two different limbs, once, then doubled. */
+        cross     = 0;
+        cross_top = 0;
+
+        for(u64 j = lowest; j < i - j; ++j){
+            MONT_COLUMN_ADD(cross, cross_top, X[j], X[i - j]);
+        }
+
+        cross_top = (cross_top << 1) | (u64)(cross >> 127);
+        cross   <<= 1;
+
+        acc     += cross;
+        acc_top += cross_top + (acc < cross);
+
+        /* And the limb times itself, in the even columns. */
+        if((i & 1) == 0){
+            MONT_COLUMN_ADD(acc, acc_top, X[i / 2], X[i / 2]);
+        }
+
+        if(i < MONT_L){
+
+            for(u64 j = 0; j < i; ++j){
+                MONT_COLUMN_ADD(acc, acc_top, m[j], N[i - j]);
+            }
+
+            m[i] = (u64)acc * (u64)MONT_MU;
+
+            MONT_COLUMN_ADD(acc, acc_top, m[i], N[0]);
+        }
+        else{
+
+            for(u64 j = lowest; j < MONT_L; ++j){
+                MONT_COLUMN_ADD(acc, acc_top, m[j], N[i - j]);
+            }
+
+            T[i - MONT_L] = (u64)acc;
+        }
+
+        MONT_COLUMN_NEXT(acc, acc_top);
+    }
+
+    T[MONT_L - 1] = (u64)acc;
+    T[MONT_L]     = (u64)(acc >> 64);
+
+    Montgomery_FINISH_LIMBS(T, N, R);
+
+    explicit_bzero(m, sizeof(m));
+
+    return;
+}
+
+/* An exponent cut up into sliding windows for MONT_POW_LIMBS(), by
+ * MONT_EXP_RECODE(). Left to right, each window is an odd digit of at most
+ * MONT_WINDOW_BITS bits, and how many squarings come before multiplying by
+ * the base to that digit's power. The first window's squarings are 0, as it
+ * only picks where to start from. Zero bits after the last window are just
+ * squarings, as many as trailing_squarings.
+ *
+ * Exponents that are used over and over, like Q, only need doing once.
+ */
+#define MONT_WINDOW_BITS 5
+#define MONT_WINDOW_SIZ  (1 << (MONT_WINDOW_BITS - 1)) /* Odd powers only. */
+#define MONT_EXP_MAX_BITS (MONT_L * 64)
+
+struct Mont_exp{
+    u64 num_windows;
+    u64 trailing_squarings;
+    u16 squarings[MONT_EXP_MAX_BITS];
+    u8  digits   [MONT_EXP_MAX_BITS];
+};
+
+/* Cut P up into sliding windows into E. Returns 1 if it worked out, 0 if P is
+ * 0 or too long to be an exponent mod N at all.
+ */
+u8 MONT_EXP_RECODE(bigint* P, struct Mont_exp* E){
+
+    u64 bit;
+    u64 window_low;
+    u64 squarings = 0;
+    u64 digit;
+    u64 i;
+
+    if(P->used_bits == 0 || P->used_bits > MONT_EXP_MAX_BITS){
+        printf("[ERR] Cryptolib: Can't recode an exponent of %u bits.\n\n"
+               ,P->used_bits
+              );
+        return 0;
+    }
+
+    E->num_windows = 0;
+
+    i = P->used_bits;
+
+    while(i > 0){
+
+        --i;
+
+        BIGINT_GET_BIT(*P, i, bit);
+
+        if(bit == 0){
+            ++squarings;
+            continue;
+        }
+
+        /* Longest window from bit i down that fits and ends on a set bit. */
+        window_low = (i + 1 >= MONT_WINDOW_BITS) ? i + 1 - MONT_WINDOW_BITS : 0;
+
+        BIGINT_GET_BIT(*P, window_low, bit);
+
+        while(bit == 0){
+            ++window_low;
+            BIGINT_GET_BIT(*P, window_low, bit);
+        }
+
+        digit = 0;
+
+        for(u64 j = i + 1; j > window_low; --j){
+            BIGINT_GET_BIT(*P, j - 1, bit);
+            digit = (digit << 1) | bit;
+        }
+
+        E->squarings[E->num_windows] = 
+                   (E->num_windows == 0) ? 0 : squarings + (i - window_low + 1);
+        E->digits[E->num_windows] = (u8)digit;
+
+        ++(E->num_windows);
+
+        squarings = 0;
+        i = window_low;
+    }
+
+    E->trailing_squarings = squarings;
+
+    return 1;
+}
+
+/* R = B^P, all in Montgomery Form as MONT_L-limb arrays, B fully reduced mod
+ * N, P recoded by MONT_EXP_RECODE(). A table of the odd powers B^1, B^3 ..
+ * B^(2^w - 1) up front, then per window a squaring per bit and just the one
+ * multiplication, instead of a multiplication for every set bit of P.
+ */
+void MONT_POW_LIMBS(const u64* B, const struct Mont_exp* E, const u64* N
+                   ,u64* R
+                   )
+{
+    u64 table[MONT_WINDOW_SIZ][MONT_L];
+    u64 B_squared[MONT_L];
+    u64 Y[MONT_L];
+
+    /* table[k] = B^(2k + 1) */
+    memcpy(table[0], B, MONT_L * MONT_LIMB_SIZ);
+
+    Montgomery_SQR_LIMBS(B, N, B_squared);
+
+    for(u64 k = 1; k < MONT_WINDOW_SIZ; ++k){
+        Montgomery_MUL_LIMBS(table[k - 1], B_squared, N, table[k]);
+    }
+
+    memcpy(Y, table[E->digits[0] >> 1], MONT_L * MONT_LIMB_SIZ);
+
+    for(u64 w = 1; w < E->num_windows; ++w){
+
+        for(u64 k = 0; k < E->squarings[w]; ++k){
+            Montgomery_SQR_LIMBS(Y, N, Y);
+        }
+
+        Montgomery_MUL_LIMBS(Y, table[E->digits[w] >> 1], N, Y);
+    }
+
+    for(u64 k = 0; k < E->trailing_squarings; ++k){
+        Montgomery_SQR_LIMBS(Y, N, Y);
+    }
+
+    memcpy(R, Y, MONT_L * MONT_LIMB_SIZ);
+
+    explicit_bzero(table,     sizeof(table));
+    explicit_bzero(B_squared, sizeof(B_squared));
+    explicit_bzero(Y,         sizeof(Y));
+
+    return;
+}
+
+/* Which hash function computed the prehash PH of a signature. 
+ *
+ * Big payloads (a full type_30 message, or a PACKET_ID_41 poll reply with
+ * many pending messages in it) are prehashed with BLAKE2bp so all 4 of its
+ * leaves run in parallel, instead of on one long BLAKE2b chain. Small ones
+ * keep using plain BLAKE2b, where the tree mode would only add overhead.
+ *
+ * The signer writes which one it used into the first 8 bytes of the signature,
+ * the slot of the bits pointer of s's bigint header, which is meaningless on
+ * the receiver's side anyway and gets overwritten by it. Receivers read it
+ * with Signature_GET_PREHASH_ID() BEFORE they overwrite that slot, and pass it
+ * to Signature_VALIDATE(). Anything other than SIG_PREHASH_BLAKE2BP there, as
+ * in signatures made before the tree mode existed, means plain BLAKE2b.
+ */
+#define SIG_PREHASH_BLAKE2B          0x01
+#define SIG_PREHASH_BLAKE2BP         0x02
+#define SIG_PREHASH_BLAKE2BP_MIN_LEN 8192
+
+u64 Signature_CHOOSE_PREHASH(u64 data_len){
+    return (data_len >= SIG_PREHASH_BLAKE2BP_MIN_LEN) ? SIG_PREHASH_BLAKE2BP
+                                                      : SIG_PREHASH_BLAKE2B;
+}
+
+u64 Signature_GET_PREHASH_ID(u8* signature){
+    return *((u64*)signature);
+}
+
+void Signature_PREHASH(u64 prehash_id, u8* data, u64 data_len, u8* prehash){
+
+    if(prehash_id == SIG_PREHASH_BLAKE2BP){
+        BLAKE2BP(data, data_len, 64, prehash);
+    }
+    else{
+        BLAKE2B_INIT(data, data_len, 0, 64, prehash);
+    }
+
+    return;
+}
+
+/* Pools of precomputed exponent pairs (x, G^x mod M).
+ *
+ * A full 3072-bit modular exponentiation G^x mod M with a fresh random x
+ * shows up in two places that both run while a client waits on the server:
+ *
+ *  - Signature_GENERATE(), whose one expensive step is R = G^k mod M, and
+ *    none of it depends on what is being signed.
+ *
+ *  - The login handshake, where the server draws its short-term private
+ *    key b_s and computes its short-term public key B_s = G^b_s mod M,
+ *    before it can even get to the shared secret.
+ *
+ * So for each of them there's a pool: a thread of its own keeps up to
+ * pool_size pairs (x, G^x mod M) ready in locked memory, with x drawn at
+ * random from [1, Q-1]. The user takes a pair out, its slot gets wiped and
+ * it's left with the rest of its work. When the pool is empty, or it was
+ * started for other M, Q or G than the ones passed to the taker, that counts
+ * as a miss and the taker computes a pair itself, like before.
+ *
+ * Every pair is handed out exactly once - reusing a signing k for two
+ * different messages would give away the private key, and reusing a DH
+ * short-term key would tie two logins together.
+ *
+ * The refill thread computes up to refill_batch pairs at a time, then sleeps
+ * refill_interval_ms (if not 0) before the next batch, so how much of a CPU
+ * it takes can be capped. When the pool is full it sleeps until a pair is
+ * taken out.
+ */
+struct Exp_pool{
+    const char*     name;        /* For the messages we print about it.      */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  refill_cv;   /* Signalled when a pair is taken out.      */
+    pthread_t       thread;
+
+    bigint* M;                   /* What the pairs were computed for.        */
+    bigint* Q;
+    bigint* Gmont;
+
+    u8*     slots;               /* mmap()'d, mlock()'d if we were let to.   */
+    u64     slots_len;
+    u64     slot_len;            /* x's used_bits, G^x's used_bits, x, G^x.  */
+    u64     x_len;               /* Bytes of x in a slot, bytewidth of Q.    */
+    u64     Gx_len;              /* Bytes of G^x in a slot, bytewidth of M.  */
+    u8      locked;
+
+    u64     pool_size;
+    u64     count;               /* Ready pairs, in slots [0] to [count-1].  */
+    u64     refill_batch;
+    u64     refill_interval_ms;
+
+    u8      running;
+    u8      stop;
+
+    u64     hits;                /* Pairs taken out of the pool.             */
+    u64     misses;              /* Takers that had to compute their own.    */
+    u64     refilled;            /* Pairs ever put into the pool.            */
+};
+
+/* Signing nonces (k, R = G^k mod M), taken by Signature_GENERATE(). */
+struct Exp_pool sig_nonce_pool = {
+     "Nonce pool"
+    ,PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0
+    ,NULL, NULL, NULL
+    ,NULL, 0, 0, 0, 0, 0
+    ,0, 0, 0, 0
+    ,0, 0
+    ,0, 0, 0
+};
+
+/* Short-term Diffie-Hellman key pairs (b, B = G^b mod M) for logins. */
+struct Exp_pool dh_ephemeral_pool = {
+     "DH ephemeral key pool"
+    ,PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0
+    ,NULL, NULL, NULL
+    ,NULL, 0, 0, 0, 0, 0
+    ,0, 0, 0, 0
+    ,0, 0
+    ,0, 0, 0
+};
+
+struct Exp_pool_stats{
+    u64 available;
+    u64 pool_size;
+    u64 hits;
+    u64 misses;
+    u64 refilled;
+};
+
+/* Compute one random pair into the x and Gx bigints. Returns 0 if the CSPRNG
+ * failed us, 1 otherwise.
+ */
+u8 EXP_POOL_MAKE(bigint* M, bigint* Q, bigint* Gmont, bigint* x, bigint* Gx){
+
+    u8 rand_buf[64];
+    u8 made = 0;
+
+    bigint rand_num;
+    bigint one;
+    bigint Q_minus_one;
+    bigint div_res;
+    bigint reduced;
+
+    bigint_create(&rand_num,    M->size_bits, 0);
+    bigint_create(&one,         M->size_bits, 1);
+    bigint_create(&Q_minus_one, M->size_bits, 0);
+    bigint_create(&div_res,     M->size_bits, 0);
+    bigint_create(&reduced,     M->size_bits, 0);
+
+    if(!CSPRNG_GET_BYTES(rand_buf, 64)){
+        goto label_cleanup;
+    }
+
+    /* x = (64 random bytes mod (Q-1)) + 1, same reduction as the signer's. */
+    memcpy(rand_num.bits, rand_buf, 64);
+
+    rand_num.used_bits = get_used_bits(rand_num.bits, 64);
+    rand_num.free_bits = rand_num.size_bits - rand_num.used_bits;
+
+    bigint_sub2(Q, &one, &Q_minus_one);
+    bigint_div2(&rand_num, &Q_minus_one, &div_res, &reduced);
+    bigint_add_fast(&reduced, &one, x);
+
+    MONT_POW_modM(Gmont, x, M, Gx);
+
+    made = 1;
+
+label_cleanup:
+
+    explicit_bzero(rand_buf, 64);
+    explicit_bzero(rand_num.bits, rand_num.size_bits / 8);
+    explicit_bzero(reduced.bits, reduced.size_bits / 8);
+
+    free(rand_num.bits);
+    free(one.bits);
+    free(Q_minus_one.bits);
+    free(div_res.bits);
+    free(reduced.bits);
+
+    return made;
+}
+
+void* EXP_POOL_THREAD(void* arg){
+
+    struct Exp_pool* pool = (struct Exp_pool*)arg;
+    struct timespec next_batch;
+
+    bigint x;
+    bigint Gx;
+
+    u8* slot;
+
+    bigint_create(&x,  pool->M->size_bits, 0);
+    bigint_create(&Gx, pool->M->size_bits, 0);
+
+    while(1){
+
+        pthread_mutex_lock(&(pool->lock));
+
+        while(!pool->stop && pool->count == pool->pool_size){
+            pthread_cond_wait(&(pool->refill_cv), &(pool->lock));
+        }
+
+        if(pool->stop){
+            pthread_mutex_unlock(&(pool->lock));
+            break;
+        }
+
+        pthread_mutex_unlock(&(pool->lock));
+
+        /* The exponentiations are done without holding the lock, so takers
+         * can keep taking pairs out in the meantime.
+         */
+        for(u64 i = 0; i < pool->refill_batch; ++i){
+
+            if(!EXP_POOL_MAKE(pool->M, pool->Q, pool->Gmont, &x, &Gx)){
+                break;
+            }
+
+            pthread_mutex_lock(&(pool->lock));
+
+            if(pool->stop || pool->count == pool->pool_size){
+                pthread_mutex_unlock(&(pool->lock));
+                break;
+            }
+
+            slot = pool->slots + (pool->count * pool->slot_len);
+
+            memcpy(slot,     &(x.used_bits),  sizeof(u64));
+            memcpy(slot + 8, &(Gx.used_bits), sizeof(u64));
+            memcpy(slot + 16, x.bits, pool->x_len);
+            memcpy(slot + 16 + pool->x_len, Gx.bits, pool->Gx_len);
+
+            ++(pool->count);
+            ++(pool->refilled);
+
+            pthread_mutex_unlock(&(pool->lock));
+        }
+
+        explicit_bzero(x.bits, x.size_bits / 8);
+
+        if(!pool->refill_interval_ms){
+            continue;
+        }
+
+        /* Wait out the interval on the condition variable, not in a sleep,
+         * so that stopping the pool doesn't have to wait for it too.
+         */
+        clock_gettime(CLOCK_REALTIME, &next_batch);
+
+        next_batch.tv_sec  += pool->refill_interval_ms / 1000;
+        next_batch.tv_nsec += (pool->refill_interval_ms % 1000) * 1000000;
+
+        if(next_batch.tv_nsec >= 1000000000){
+            next_batch.tv_nsec -= 1000000000;
+            ++(next_batch.tv_sec);
+        }
+
+        pthread_mutex_lock(&(pool->lock));
+
+        while(!pool->stop){
+            if(pthread_cond_timedwait( &(pool->refill_cv), &(pool->lock)
+                                      ,&next_batch
+                                     ) == ETIMEDOUT
+              )
+            {
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&(pool->lock));
+    }
+
+    explicit_bzero(x.bits, x.size_bits / 8);
+
+    free(x.bits);
+    free(Gx.bits);
+
+    return NULL;
+}
+
+/* Start the pool for pairs with these M, Q and G (Montgomery form).
+ * They must stay alive until EXP_POOL_STOP(). Returns 1 if it was started,
+ * 0 if not, like when it's already running.
+ */
+u8 EXP_POOL_START( struct Exp_pool* pool, bigint* M, bigint* Q, bigint* Gmont
+                  ,u64 pool_size, u64 refill_batch, u64 refill_interval_ms
+                 )
+{
+    void* map;
+
+    if(pool->running || !pool_size || !refill_batch){
+        printf("[ERR] Cryptolib: %s already running or empty.\n\n"
+               ,pool->name
+              );
+        return 0;
+    }
+
+    pool->M     = M;
+    pool->Q     = Q;
+    pool->Gmont = Gmont;
+
+    pool->x_len    = (Q->used_bits + 7) / 8;
+    pool->Gx_len   = (M->used_bits + 7) / 8;
+    pool->slot_len = (2 * sizeof(u64)) + pool->x_len + pool->Gx_len;
+
+    pool->slots_len = pool_size * pool->slot_len;
+
+    map = mmap( NULL, pool->slots_len, PROT_READ | PROT_WRITE
+               ,MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+              );
+
+    if(map == MAP_FAILED){
+        printf("[ERR] Cryptolib: Couldn't map the %s.\n\n", pool->name);
+        return 0;
+    }
+
+    pool->slots = (u8*)map;
+
+    /* Secret x's must not end up in swap or in a core dump. Without the
+     * rights to lock that much memory, run anyway but say so.
+     */
+    pool->locked = (mlock(pool->slots, pool->slots_len) == 0);
+
+    if(!pool->locked){
+        printf("[WARN] Cryptolib: %s memory couldn't be locked.\n\n"
+               ,pool->name
+              );
+    }
+
+    madvise(pool->slots, pool->slots_len, MADV_DONTDUMP);
+
+    pool->pool_size          = pool_size;
+    pool->count              = 0;
+    pool->refill_batch       = refill_batch;
+    pool->refill_interval_ms = refill_interval_ms;
+    pool->stop               = 0;
+    pool->hits               = 0;
+    pool->misses             = 0;
+    pool->refilled           = 0;
+
+    if(pthread_create(&(pool->thread), NULL, EXP_POOL_THREAD, pool)){
+
+        printf("[ERR] Cryptolib: Couldn't start the %s thread.\n\n"
+               ,pool->name
+              );
+
+        if(pool->locked){
+            munlock(pool->slots, pool->slots_len);
+        }
+        munmap(pool->slots, pool->slots_len);
+        pool->slots = NULL;
+        return 0;
+    }
+
+    pool->running = 1;
+
+    return 1;
+}
+
+/* Stop the refill thread, wipe every unused pair and unmap the pool. */
+void EXP_POOL_STOP(struct Exp_pool* pool){
+
+    if(!pool->running){
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    pool->stop = 1;
+    pthread_cond_signal(&(pool->refill_cv));
+    pthread_mutex_unlock(&(pool->lock));
+
+    pthread_join(pool->thread, NULL);
+
+    pthread_mutex_lock(&(pool->lock));
+
+    explicit_bzero(pool->slots, pool->slots_len);
+
+    if(pool->locked){
+        munlock(pool->slots, pool->slots_len);
+    }
+    munmap(pool->slots, pool->slots_len);
+
+    pool->slots   = NULL;
+    pool->count   = 0;
+    pool->running = 0;
+
+    pthread_mutex_unlock(&(pool->lock));
+
+    return;
+}
+
+/* Take one pair out of the pool into x and Gx, for use with M, Q, Gmont.
+ * Returns 1 on a hit, 0 on a miss, in which case the caller computes its own.
+ */
+u8 EXP_POOL_TAKE( struct Exp_pool* pool, bigint* M, bigint* Q, bigint* Gmont
+                 ,bigint* x, bigint* Gx
+                )
+{
+    u8* slot;
+    u8  hit = 0;
+
+    pthread_mutex_lock(&(pool->lock));
+
+    if(!pool->running){
+        goto label_unlock;
+    }
+
+    if(pool->M != M || pool->Q != Q || pool->Gmont != Gmont || !pool->count){
+        ++(pool->misses);
+        goto label_unlock;
+    }
+
+    --(pool->count);
+
+    slot = pool->slots + (pool->count * pool->slot_len);
+
+    memset(x->bits,  0, x->size_bits  / 8);
+    memset(Gx->bits, 0, Gx->size_bits / 8);
+
+    memcpy(&(x->used_bits),  slot,     sizeof(u64));
+    memcpy(&(Gx->used_bits), slot + 8, sizeof(u64));
+    memcpy(x->bits, slot + 16, pool->x_len);
+    memcpy(Gx->bits, slot + 16 + pool->x_len, pool->Gx_len);
+
+    x->free_bits  = x->size_bits  - x->used_bits;
+    Gx->free_bits = Gx->size_bits - Gx->used_bits;
+
+    explicit_bzero(slot, pool->slot_len);
+
+    ++(pool->hits);
+    hit = 1;
+
+    pthread_cond_signal(&(pool->refill_cv));
+
+label_unlock:
+
+    pthread_mutex_unlock(&(pool->lock));
+
+    return hit;
+}
+
+void EXP_POOL_STATS(struct Exp_pool* pool, struct Exp_pool_stats* stats){
+
+    pthread_mutex_lock(&(pool->lock));
+
+    stats->available = pool->count;
+    stats->pool_size = pool->running ? pool->pool_size : 0;
+    stats->hits      = pool->hits;
+    stats->misses    = pool->misses;
+    stats->refilled  = pool->refilled;
+
+    pthread_mutex_unlock(&(pool->lock));
+
+    return;
+}
+
+/* The signing nonce pool, see above. */
+u8 Signature_NONCE_POOL_START( bigint* M, bigint* Q, bigint* Gmont
+                              ,u64 pool_size, u64 refill_batch
+                              ,u64 refill_interval_ms
+                             )
+{
+    return EXP_POOL_START( &sig_nonce_pool, M, Q, Gmont
+                          ,pool_size, refill_batch, refill_interval_ms
+                         );
+}
+
+void Signature_NONCE_POOL_STOP(void){
+    EXP_POOL_STOP(&sig_nonce_pool);
+}
+
+u8 Signature_NONCE_POOL_TAKE( bigint* M, bigint* Q, bigint* Gmont
+                             ,bigint* k, bigint* R
+                            )
+{
+    return EXP_POOL_TAKE(&sig_nonce_pool, M, Q, Gmont, k, R);
+}
+
+void Signature_NONCE_POOL_STATS(struct Exp_pool_stats* stats){
+    EXP_POOL_STATS(&sig_nonce_pool, stats);
+}
+
+/* The pool of short-term Diffie-Hellman key pairs, see above. */
+u8 DH_EPHEMERAL_POOL_START( bigint* M, bigint* Q, bigint* Gmont
+                           ,u64 pool_size, u64 refill_batch
+                           ,u64 refill_interval_ms
+                          )
+{
+    return EXP_POOL_START( &dh_ephemeral_pool, M, Q, Gmont
+                          ,pool_size, refill_batch, refill_interval_ms
+                         );
+}
+
+void DH_EPHEMERAL_POOL_STOP(void){
+    EXP_POOL_STOP(&dh_ephemeral_pool);
+}
+
+void DH_EPHEMERAL_POOL_STATS(struct Exp_pool_stats* stats){
+    EXP_POOL_STATS(&dh_ephemeral_pool, stats);
+}
+
+/* Get a fresh short-term key pair, priv_key random in [1, Q-1] and
+ * pub_key = G^priv_key mod M, out of the pool if it has one ready, or else
+ * computed right here. Both bigints must already have their bits allocated.
+ *
+ * RETURNS: 1 on success, 0 if the CSPRNG failed us.
+ */
+u8 DH_EPHEMERAL_KEYPAIR( bigint* M, bigint* Q, bigint* Gmont
+                        ,bigint* priv_key, bigint* pub_key
+                       )
+{
+    if(EXP_POOL_TAKE(&dh_ephemeral_pool, M, Q, Gmont, priv_key, pub_key)){
+        return 1;
+    }
+
+    return EXP_POOL_MAKE(M, Q, Gmont, priv_key, pub_key);
+}
+
+/* Generate a cryptographic signature of a sender's message
+ * according to the method pioneered by Claus-Peter Schnorr.
+ *
+ * PH = BLAKE2B{64}(data);
+ *  k = (BLAKE2B{64}(a || PH) mod (Q-1)) + 1;
+ *  R = G^k mod M;
+ *  e = trunc{bitwidth(Q)}(BLAKE2B{64}(R || PH));
+ *  s = ((k - (a * e)) mod Q;
+ *
+ * where M is a 3071-bit prime number, Q is a 320-bit prime
+ * number which exactly dibides (M-1), G = 2^((M-1)/Q) mod M,
+ * and a is the private key of the message sender. 
+ *
+ * The signature itself is (s,e). The BLAKE2B{64} of the prehash PH is
+ * BLAKE2bp instead for big data, see Signature_CHOOSE_PREHASH().
+ *
+ * If the nonce pool is running for these M, Q and G, k and R come out of it
+ * instead, k being random rather than derived from a and PH. See above.
+ */ 
+void Signature_GENERATE(bigint* M, bigint* Q, bigint* Gmont
+                       ,u8* data, u64 data_len, u8* signature
+                       ,bigint* private_key, u64 key_len_bytes
+                       )
+{
+    u32 offset = 0;
+
+    bigint second_btb_outnum;
+    bigint one;
+    bigint Q_minus_one;
+    bigint reduced_btb_res;
+    bigint k;
+    bigint R; 
+    bigint e;
+    bigint s;
+    bigint div_res;
+    bigint aux1;
+    bigint aux2;
+    bigint aux3;
+        
+    const u64 prehash_len = 64;
+    const u64 prehash_id  = Signature_CHOOSE_PREHASH(data_len);
+    u64 len_key_PH = prehash_len + key_len_bytes;
+    u64 R_used_bytes;
+    u64 len_Rused_PH;
+    
+    u8  second_btb_outbuf[64];
+    u8  prehash[prehash_len];
+    u8* second_btb_inbuf;
+    u8* R_with_prehash;
+    u8 third_btb_outbuf[64];
+
+    bigint_create(&second_btb_outnum, M->size_bits, 0);
+    bigint_create(&Q_minus_one,       M->size_bits, 0);
+    bigint_create(&reduced_btb_res,   M->size_bits, 0);
+    bigint_create(&div_res,           M->size_bits, 0);
+    bigint_create(&one,               M->size_bits, 1);
+    bigint_create(&k,                 M->size_bits, 0);
+    bigint_create(&R,                 M->size_bits, 0);
+    bigint_create(&e,                 M->size_bits, 0);
+    bigint_create(&s,                 M->size_bits, 0);
+    bigint_create(&aux1,              M->size_bits, 0);
+    bigint_create(&aux2,              M->size_bits, 0);
+    bigint_create(&aux3,              M->size_bits, 0);
+    
+    memset(prehash, 0, prehash_len);
+         
+    Signature_PREHASH(prehash_id, data, data_len, prehash);
+        
+    second_btb_inbuf = (u8*)calloc(1, key_len_bytes + prehash_len);
+
+    /* A pooled k and R = G^k spare us both the derivation and the POW. */
+    if(Signature_NONCE_POOL_TAKE(M, Q, Gmont, &k, &R)){
+        goto label_have_R;
+    }
+        
+    memcpy(second_btb_inbuf, private_key->bits, key_len_bytes);
+    memcpy(second_btb_inbuf + key_len_bytes, prehash, prehash_len);
+    
+    BLAKE2B_INIT(second_btb_inbuf, len_key_PH, 0, 64, second_btb_outbuf);
+    
+    /* Now compute k. */  
+    memcpy(second_btb_outnum.bits, second_btb_outbuf, 64);
+    
+    second_btb_outnum.used_bits = get_used_bits(second_btb_outnum.bits, 64);
+    
+    second_btb_outnum.free_bits = 
+      second_btb_outnum.size_bits - second_btb_outnum.used_bits;
+    
+    bigint_sub2(Q, &one, &Q_minus_one);    
+    bigint_div2(&second_btb_outnum, &Q_minus_one, &div_res, &reduced_btb_res);  
+    bigint_add_fast(&reduced_btb_res, &one, &k);  /* <----- k */ 
+    
+    /* Now compute R. */
+    
+    MONT_POW_modM(Gmont, &k, M, &R); 
+
+label_have_R:
+        
+    R_used_bytes = R.used_bits;
+    
+    while(R_used_bytes % 8 != 0){
+        ++R_used_bytes;
+    }
+    
+    R_used_bytes /= 8;
+    
+    /* Now compute e. */
+    R_with_prehash = (u8*)calloc(1, R_used_bytes + prehash_len);
+         
+    memcpy(R_with_prehash, R.bits, R_used_bytes);
+    memcpy(R_with_prehash + R_used_bytes, prehash, prehash_len);
+    
+    len_Rused_PH = R_used_bytes + prehash_len;
+    
+    BLAKE2B_INIT(R_with_prehash, len_Rused_PH, 0, 64, third_btb_outbuf);
+    
+    memcpy(e.bits, third_btb_outbuf, 40);
+
+    e.used_bits = get_used_bits(e.bits, 40);
+    e.free_bits = e.size_bits - e.used_bits;
+        
+    /* Lastly, compute s = ( k + ((Q-a)×e) ) mod Q */
+    bigint_sub2(Q, private_key, &aux1);
+
+    bigint_mul_fast(&aux1, &e, &aux2);
+   
+    bigint_add_fast(&aux2, &k, &aux3);
+    
+    bigint_div2(&aux3, Q, &div_res, &s);
+    
+    /* signature buffer must have been allocated with exactly 
+     * ( (2 * sizeof(bigint)) + (2 * bytewidth(Q)) )
+     * bytes of memory. No checks performed for performance.
+     */
+    
+    memcpy(signature + offset, &s, sizeof(bigint));
+    offset += sizeof(bigint);
+    memcpy(signature + offset, s.bits, 40);
+    offset += 40;
+    memcpy(signature + offset, &e, sizeof(bigint));
+    offset += sizeof(bigint);
+    memcpy(signature + offset, e.bits, 40);
+
+    /* Mark the prehash in the first bigint header's bits pointer slot, and
+     * don't send our own heap addresses over the network in the second one.
+     */
+    *((u64*)signature) = prehash_id;
+    memset(signature + sizeof(bigint) + 40, 0, sizeof(u64));
+    
+    /* Cleanup. */
+    free(second_btb_outnum.bits);
+    free(one.bits); 
+    free(Q_minus_one.bits); 
+    free(reduced_btb_res.bits); 
+    explicit_bzero(k.bits, k.size_bits / 8);
+    free(k.bits); 
+    free(R.bits); 
+    free(s.bits);    
+    free(div_res.bits); 
+    free(aux1.bits); 
+    free(aux2.bits); 
+    free(aux3.bits);
+    free(e.bits);  
+    free(second_btb_inbuf); 
+    free(R_with_prehash); 
+     
+    return;
+}
+
+/* Sign num_sigs independent messages with the same private key in one go.
+ *
+ * For when the server has several packets to sign in the same scheduling
+ * tick, like the TYPE_21 packets for everyone in a chatroom. Produces exactly
+ * the same signatures as num_sigs calls to Signature_GENERATE, but every
+ * BLAKE2b stage (PH, then a||PH, then R||PH) of all the signatures is done
+ * together through the multi-buffer BLAKE2b interface. Only the modular
+ * exponentiation R = G^k is still done one signature at a time, for those
+ * that can't take a precomputed pair out of the nonce pool.
+ *
+ * datas[i] of data_lens[i] bytes is signed into signatures[i], each of which
+ * must have been allocated as described in Signature_GENERATE.
+ */
+void Signature_GENERATE_BATCH(bigint* M, bigint* Q, bigint* Gmont
+                             ,u64 num_sigs, u8** datas, u64* data_lens
+                             ,u8** signatures
+                             ,bigint* private_key, u64 key_len_bytes
+                             )
+{
+    const u64 prehash_len = 64;
+    const u64 len_key_PH  = key_len_bytes + prehash_len;
+    const u64 R_buf_len   = (M->size_bits / 8) + prehash_len;
+
+    u64 R_used_bytes;
+    u64 offset;
+    u64 num_jobs = 0;
+
+    u8* prehashes = (u8*)calloc(num_sigs, prehash_len);
+    u8* key_PHs   = (u8*)calloc(num_sigs, len_key_PH);
+    u8* R_PHs     = (u8*)calloc(num_sigs, R_buf_len);
+    u8* btb_outs  = (u8*)calloc(num_sigs, 64);
+    bigint* ks    = (bigint*)calloc(num_sigs, sizeof(bigint));
+
+    struct BLAKE2B_MB_job* jobs =
+        (struct BLAKE2B_MB_job*)calloc(num_sigs, sizeof(struct BLAKE2B_MB_job));
+
+    bigint btb_outnum;
+    bigint one;
+    bigint Q_minus_one;
+    bigint reduced_btb_res;
+    bigint R;
+    bigint e;
+    bigint s;
+    bigint div_res;
+    bigint aux1;
+    bigint aux2;
+    bigint aux3;
+
+    bigint_create(&btb_outnum,      M->size_bits, 0);
+    bigint_create(&Q_minus_one,     M->size_bits, 0);
+    bigint_create(&reduced_btb_res, M->size_bits, 0);
+    bigint_create(&div_res,         M->size_bits, 0);
+    bigint_create(&one,             M->size_bits, 1);
+    bigint_create(&R,               M->size_bits, 0);
+    bigint_create(&e,               M->size_bits, 0);
+    bigint_create(&s,               M->size_bits, 0);
+    bigint_create(&aux1,            M->size_bits, 0);
+    bigint_create(&aux2,            M->size_bits, 0);
+    bigint_create(&aux3,            M->size_bits, 0);
+
+    bigint_sub2(Q, &one, &Q_minus_one);
+    bigint_sub2(Q, private_key, &aux1);
+
+    /* Stage 1: all the prehashes PH = BLAKE2B{64}(data). Big data gets its
+     * BLAKE2bp prehash on its own, which already fills the SIMD lanes.
+     */
+    for(u64 i = 0; i < num_sigs; ++i){
+
+        if(Signature_CHOOSE_PREHASH(data_lens[i]) == SIG_PREHASH_BLAKE2BP){
+            BLAKE2BP(datas[i], data_lens[i], prehash_len
+                    ,prehashes + (i * prehash_len)
+                    );
+            continue;
+        }
+
+        jobs[num_jobs].m  = datas[i];
+        jobs[num_jobs].ll = data_lens[i];
+        jobs[num_jobs].nn = prehash_len;
+        jobs[num_jobs].rr = prehashes + (i * prehash_len);
+        ++num_jobs;
+    }
+
+    BLAKE2B_MB(jobs, num_jobs);
+
+    /* Stage 2: all the BLAKE2B{64}(a || PH), then k = (that mod (Q-1)) + 1 */
+    for(u64 i = 0; i < num_sigs; ++i){
+
+        memcpy(key_PHs + (i * len_key_PH), private_key->bits, key_len_bytes);
+
+        memcpy( key_PHs + (i * len_key_PH) + key_len_bytes
+               ,prehashes + (i * prehash_len)
+               ,prehash_len
+              );
+
+        jobs[i].m  = key_PHs + (i * len_key_PH);
+        jobs[i].ll = len_key_PH;
+        jobs[i].nn = 64;
+        jobs[i].rr = btb_outs + (i * 64);
+    }
+
+    BLAKE2B_MB(jobs, num_sigs);
+
+    for(u64 i = 0; i < num_sigs; ++i){
+
+        bigint_create(&(ks[i]), M->size_bits, 0);
+
+        if(Signature_NONCE_POOL_TAKE(M, Q, Gmont, &(ks[i]), &R)){
+            goto label_have_R;
+        }
+
+        memset(btb_outnum.bits, 0, btb_outnum.size_bits / 8);
+        memcpy(btb_outnum.bits, btb_outs + (i * 64), 64);
+
+        btb_outnum.used_bits = get_used_bits(btb_outnum.bits, 64);
+        btb_outnum.free_bits = btb_outnum.size_bits - btb_outnum.used_bits;
+
+        bigint_div2(&btb_outnum, &Q_minus_one, &div_res, &reduced_btb_res);
+        bigint_add_fast(&reduced_btb_res, &one, &(ks[i]));
+
+        /* R = G^k mod M, then place R || PH for the third BLAKE2b. */
+        MONT_POW_modM(Gmont, &(ks[i]), M, &R);
+
+label_have_R:
+
+        R_used_bytes = R.used_bits;
+
+        while(R_used_bytes % 8 != 0){
+            ++R_used_bytes;
+        }
+
+        R_used_bytes /= 8;
+
+        memcpy(R_PHs + (i * R_buf_len), R.bits, R_used_bytes);
+
+        memcpy( R_PHs + (i * R_buf_len) + R_used_bytes
+               ,prehashes + (i * prehash_len)
+               ,prehash_len
+              );
+
+        jobs[i].m  = R_PHs + (i * R_buf_len);
+        jobs[i].ll = R_used_bytes + prehash_len;
+        jobs[i].nn = 64;
+        jobs[i].rr = btb_outs + (i * 64);
+    }
+
+    /* Stage 3: all the e = trunc{bitwidth(Q)}(BLAKE2B{64}(R || PH)). */
+    BLAKE2B_MB(jobs, num_sigs);
+
+    for(u64 i = 0; i < num_sigs; ++i){
+
+        memset(e.bits, 0, e.size_bits / 8);
+        memcpy(e.bits, btb_outs + (i * 64), 40);
+
+        e.used_bits = get_used_bits(e.bits, 40);
+        e.free_bits = e.size_bits - e.used_bits;
+
+        /* s = ( k + ((Q-a)×e) ) mod Q */
+        bigint_mul_fast(&aux1, &e, &aux2);
+        bigint_add_fast(&aux2, &(ks[i]), &aux3);
+        bigint_div2(&aux3, Q, &div_res, &s);
+
+        offset = 0;
+
+        memcpy(signatures[i] + offset, &s, sizeof(bigint));
+        offset += sizeof(bigint);
+        memcpy(signatures[i] + offset, s.bits, 40);
+        offset += 40;
+        memcpy(signatures[i] + offset, &e, sizeof(bigint));
+        offset += sizeof(bigint);
+        memcpy(signatures[i] + offset, e.bits, 40);
+
+        *((u64*)(signatures[i])) = Signature_CHOOSE_PREHASH(data_lens[i]);
+        memset(signatures[i] + sizeof(bigint) + 40, 0, sizeof(u64));
+
+        explicit_bzero(ks[i].bits, ks[i].size_bits / 8);
+        free(ks[i].bits);
+    }
+
+    /* Cleanup. */
+    free(btb_outnum.bits);
+    free(one.bits);
+    free(Q_minus_one.bits);
+    free(reduced_btb_res.bits);
+    free(R.bits);
+    free(s.bits);
+    free(e.bits);
+    free(div_res.bits);
+    free(aux1.bits);
+    free(aux2.bits);
+    free(aux3.bits);
+
+    /* The private key was copied into key_PHs. Don't leave it on the heap. */
+    memset(key_PHs, 0, num_sigs * len_key_PH);
+
+    free(prehashes);
+    free(key_PHs);
+    free(R_PHs);
+    free(btb_outs);
+    free(ks);
+    free(jobs);
+
+    return;
+}
+
+/* Cache of signatures of constant content.
+ *
+ * Quite a few server replies sign nothing but their own 8-byte packet ID -
+ * the empty poll reply PACKET_ID_40 above all, sent to every client several
+ * times a second. Signing the same bytes again only gives another valid
+ * signature of the same thing, so for these the signer keeps the first one
+ * it made and hands out a copy from then on.
+ *
+ * Entries are keyed by the prehash PH of the signed bytes, for the same
+ * M, Q, G and private key. The key is told apart by a BLAKE2b fingerprint of
+ * it, so signing with another key just misses and replaces an entry, and a
+ * key rotation needs nothing more than signing with the new key. No entry
+ * is ever tied to a client, so there's nothing to wipe when one leaves.
+ *
+ * Only meant for content that never changes - the callers decide that by
+ * calling Signature_GENERATE_CACHED() instead of Signature_GENERATE(). Data
+ * bigger than SIG_CACHE_MAX_DATA_LEN is always signed afresh.
+ */
+#define SIG_CACHE_SLOTS        16
+#define SIG_CACHE_MAX_DATA_LEN 64
+#define SIG_CACHE_SIG_LEN      ((2 * sizeof(bigint)) + (2 * 40))
+
+struct Signature_cache_entry{
+    u8      in_use;
+    bigint* M;
+    bigint* Q;
+    bigint* Gmont;
+    u8      key_fp[32];
+    u8      prehash[64];
+    u8      signature[SIG_CACHE_SIG_LEN];
+};
+
+struct Signature_cache{
+    pthread_mutex_t              lock;
+    u64                          next_victim;
+    u64                          hits;
+    u64                          misses;
+    struct Signature_cache_entry entries[SIG_CACHE_SLOTS];
+};
+
+struct Signature_cache sig_cache = {
+     PTHREAD_MUTEX_INITIALIZER, 0, 0, 0
+    ,{{0, NULL, NULL, NULL, {0}, {0}, {0}}}
+};
+
+/* Same as Signature_GENERATE(), but for constant content, see above. */
+void Signature_GENERATE_CACHED(bigint* M, bigint* Q, bigint* Gmont
+                              ,u8* data, u64 data_len, u8* signature
+                              ,bigint* private_key, u64 key_len_bytes
+                              )
+{
+    struct Signature_cache_entry* entry;
+
+    u8 key_fp[32];
+    u8 prehash[64];
+
+    if(data_len > SIG_CACHE_MAX_DATA_LEN){
+        Signature_GENERATE( M, Q, Gmont, data, data_len, signature
+                           ,private_key, key_len_bytes
+                          );
+        return;
+    }
+
+    BLAKE2B_INIT(private_key->bits, key_len_bytes, 0, 32, key_fp);
+
+    Signature_PREHASH( Signature_CHOOSE_PREHASH(data_len), data, data_len
+                      ,prehash
+                     );
+
+    pthread_mutex_lock(&(sig_cache.lock));
+
+    for(u64 i = 0; i < SIG_CACHE_SLOTS; ++i){
+
+        entry = &(sig_cache.entries[i]);
+
+        if(   entry->in_use
+           && entry->M == M && entry->Q == Q && entry->Gmont == Gmont
+           && memcmp(entry->key_fp,  key_fp,  32) == 0
+           && memcmp(entry->prehash, prehash, 64) == 0
+          )
+        {
+            memcpy(signature, entry->signature, SIG_CACHE_SIG_LEN);
+            ++(sig_cache.hits);
+            pthread_mutex_unlock(&(sig_cache.lock));
+            return;
+        }
+    }
+
+    ++(sig_cache.misses);
+
+    pthread_mutex_unlock(&(sig_cache.lock));
+
+    /* Sign it without holding the lock - that's the slow part. */
+    Signature_GENERATE( M, Q, Gmont, data, data_len, signature
+                       ,private_key, key_len_bytes
+                      );
+
+    pthread_mutex_lock(&(sig_cache.lock));
+
+    entry = &(sig_cache.entries[sig_cache.next_victim]);
+
+    sig_cache.next_victim = (sig_cache.next_victim + 1) % SIG_CACHE_SLOTS;
+
+    entry->in_use = 1;
+    entry->M      = M;
+    entry->Q      = Q;
+    entry->Gmont  = Gmont;
+
+    memcpy(entry->key_fp,    key_fp,    32);
+    memcpy(entry->prehash,   prehash,   64);
+    memcpy(entry->signature, signature, SIG_CACHE_SIG_LEN);
+
+    pthread_mutex_unlock(&(sig_cache.lock));
+
+    return;
+}
+
+/* Signing service: a queue of signature jobs served by a pool of worker
+ * threads, for callers that must not sit through a signature themselves.
+ *
+ * The server's packet handlers run with its global mutex held, so every
+ * other client used to wait behind each signature they made. Instead, a
+ * handler now fills in a Signature_job - what to sign, where the signature
+ * goes, and what to do with the result - and submits it, which never blocks.
+ * A worker signs it, then calls the job's on_done(), which is where the
+ * reply gets sent or queued up and the job freed.
+ *
+ * Workers sign in parallel, but on_done() calls run one at a time and in the
+ * order the jobs were submitted, so the replies come out in the same order
+ * as if each handler had signed inline. on_done() runs on the worker, with
+ * no lock of the service's held, and may take the caller's own locks.
+ *
+ * M, Q, Gmont and the private key are given once when the service starts
+ * and must stay alive until Signature_SERVICE_STOP().
+ */
+struct Signature_job{
+    u8*  data;                   /* What to sign.                            */
+    u64  data_len;
+    u8*  signature;              /* Where the SIGNATURE_LEN bytes go.        */
+
+    void (*on_done)(struct Signature_job* job);
+    void* user_arg;
+
+    u64  seq;                    /* Filled in by Signature_SERVICE_SUBMIT(). */
+    struct Signature_job* next;
+};
+
+#define SIG_SERVICE_MAX_WORKERS 16
+
+struct Signature_service{
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cv;     /* Signalled when a job is submitted.       */
+    pthread_cond_t  done_cv;     /* Signalled when a job's on_done() ran.    */
+    pthread_t       threads[SIG_SERVICE_MAX_WORKERS];
+    u64             num_workers;
+
+    bigint* M;
+    bigint* Q;
+    bigint* Gmont;
+    bigint* private_key;
+    u64     key_len_bytes;
+
+    struct Signature_job* head;  /* Oldest job nobody took yet.              */
+    struct Signature_job* tail;
+
+    u64     next_seq;            /* Given to the next job submitted.         */
+    u64     next_done_seq;       /* The job whose on_done() runs next.       */
+
+    u8      running;
+    u8      stop;
+
+    u64     queued;              /* Jobs nobody took yet.                    */
+    u64     max_queued;          /* Most jobs ever waiting at once.          */
+    u64     completed;
+};
+
+struct Signature_service sig_service = {
+     PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+    ,PTHREAD_COND_INITIALIZER, {0}, 0
+    ,NULL, NULL, NULL, NULL, 0
+    ,NULL, NULL
+    ,0, 0
+    ,0, 0
+    ,0, 0, 0
+};
+
+struct Signature_service_stats{
+    u64 workers;
+    u64 queued;
+    u64 max_queued;
+    u64 submitted;
+    u64 completed;
+};
+
+void* Signature_SERVICE_THREAD(void* arg){
+
+    struct Signature_service* svc = (struct Signature_service*)arg;
+    struct Signature_job*     job;
+
+    while(1){
+
+        pthread_mutex_lock(&(svc->lock));
+
+        while(!svc->head && !svc->stop){
+            pthread_cond_wait(&(svc->work_cv), &(svc->lock));
+        }
+
+        /* Stopping only once everything submitted has been done. */
+        if(!svc->head){
+            pthread_mutex_unlock(&(svc->lock));
+            break;
+        }
+
+        job = svc->head;
+        svc->head = job->next;
+
+        if(!svc->head){
+            svc->tail = NULL;
+        }
+
+        --(svc->queued);
+
+        pthread_mutex_unlock(&(svc->lock));
+
+        Signature_GENERATE( svc->M, svc->Q, svc->Gmont
+                           ,job->data, job->data_len, job->signature
+                           ,svc->private_key, svc->key_len_bytes
+                          );
+
+        /* Wait for every job submitted before this one to be done. Jobs are
+         * taken off the queue in order, so each of those is already on some
+         * worker and this can't wait forever.
+         */
+        pthread_mutex_lock(&(svc->lock));
+
+        while(job->seq != svc->next_done_seq){
+            pthread_cond_wait(&(svc->done_cv), &(svc->lock));
+        }
+
+        pthread_mutex_unlock(&(svc->lock));
+
+        /* May free the job, so don't touch it after. */
+        job->on_done(job);
+
+        pthread_mutex_lock(&(svc->lock));
+
+        ++(svc->next_done_seq);
+        ++(svc->completed);
+
+        pthread_cond_broadcast(&(svc->done_cv));
+        pthread_mutex_unlock(&(svc->lock));
+    }
+
+    return NULL;
+}
+
+/* Start num_workers signing threads for signatures with this group and key.
+ * Only one service can run at a time. Returns 1 if it was started, 0 if not.
+ */
+u8 Signature_SERVICE_START( bigint* M, bigint* Q, bigint* Gmont
+                           ,bigint* private_key, u64 key_len_bytes
+                           ,u64 num_workers
+                          )
+{
+    struct Signature_service* svc = &sig_service;
+
+    if(svc->running || !num_workers || num_workers > SIG_SERVICE_MAX_WORKERS){
+        printf("[ERR] Cryptolib: Signing service already running or asked "
+               "for %lu workers.\n\n", num_workers
+              );
+        return 0;
+    }
+
+    svc->M             = M;
+    svc->Q             = Q;
+    svc->Gmont         = Gmont;
+    svc->private_key   = private_key;
+    svc->key_len_bytes = key_len_bytes;
+
+    svc->head          = NULL;
+    svc->tail          = NULL;
+    svc->next_seq      = 0;
+    svc->next_done_seq = 0;
+    svc->stop          = 0;
+    svc->queued        = 0;
+    svc->max_queued    = 0;
+    svc->completed     = 0;
+    svc->num_workers   = 0;
+
+    for(u64 i = 0; i < num_workers; ++i){
+
+        if(pthread_create( &(svc->threads[i]), NULL
+                          ,Signature_SERVICE_THREAD, svc
+                         )
+          )
+        {
+            printf("[ERR] Cryptolib: Couldn't start signing worker %lu.\n\n"
+                   ,i
+                  );
+            break;
+        }
+
+        ++(svc->num_workers);
+    }
+
+    /* Fewer workers than asked for still serve every job, just slower. */
+    if(!svc->num_workers){
+        return 0;
+    }
+
+    svc->running = 1;
+
+    return 1;
+}
+
+/* Queue job up for signing. Never blocks on the signing itself. job must stay
+ * alive until its on_done() is called.
+ *
+ * RETURNS: 1 if the job was queued, 0 if the service isn't running, in which
+ *          case on_done() will never be called for it.
+ */
+u8 Signature_SERVICE_SUBMIT(struct Signature_job* job){
+
+    struct Signature_service* svc = &sig_service;
+
+    pthread_mutex_lock(&(svc->lock));
+
+    if(!svc->running || svc->stop){
+        pthread_mutex_unlock(&(svc->lock));
+        printf("[ERR] Cryptolib: Signing service isn't running.\n\n");
+        return 0;
+    }
+
+    job->seq  = (svc->next_seq)++;
+    job->next = NULL;
+
+    if(svc->tail){
+        svc->tail->next = job;
+    }
+    else{
+        svc->head = job;
+    }
+
+    svc->tail = job;
+
+    if(++(svc->queued) > svc->max_queued){
+        svc->max_queued = svc->queued;
+    }
+
+    pthread_cond_signal(&(svc->work_cv));
+    pthread_mutex_unlock(&(svc->lock));
+
+    return 1;
+}
+
+/* Finish every job already submitted, then stop the workers. */
+void Signature_SERVICE_STOP(void){
+
+    struct Signature_service* svc = &sig_service;
+
+    if(!svc->running){
+        return;
+    }
+
+    pthread_mutex_lock(&(svc->lock));
+    svc->stop = 1;
+    pthread_cond_broadcast(&(svc->work_cv));
+    pthread_mutex_unlock(&(svc->lock));
+
+    for(u64 i = 0; i < svc->num_workers; ++i){
+        pthread_join(svc->threads[i], NULL);
+    }
+
+    svc->num_workers = 0;
+    svc->running     = 0;
+
+    return;
+}
+
+void Signature_SERVICE_STATS(struct Signature_service_stats* stats){
+
+    struct Signature_service* svc = &sig_service;
+
+    pthread_mutex_lock(&(svc->lock));
+
+    stats->workers    = svc->num_workers;
+    stats->queued     = svc->queued;
+    stats->max_queued = svc->max_queued;
+    stats->submitted  = svc->next_seq;
+    stats->completed  = svc->completed;
+
+    pthread_mutex_unlock(&(svc->lock));
+
+    return;
+}
+
+/* To verify against public key A and whatever was signed, the receiver:
+ *
+ *  0. checks that 0 <= s < Q, and that e has the expected bitwidth (that of Q).
+ *  1. Computes the prehash PH as in step 0. above.
+ *  2. Computes R = (G^s * A^e) mod M.
+ *  3. Computes BLAKE2B{64}(R||PH), truncated to bitwidth of Q. 
+ *     Check that this is equal to e. If it is, validation passed. 
+ *     In any other circumstance, the validation fails.
+ *
+ *   prehash_id is what Signature_GET_PREHASH_ID() said about the signature.
+ *
+ *   RETURNS: 1 if signature is valid for this message, 0 for invalid signature.
+ *
+ */
+uint8_t Signature_VALIDATE( bigint* Gmont, bigint* Amont, bigint* M, bigint* Q
+                           ,bigint* s, bigint* e, u8* data, u32 data_len
+                           ,u64 prehash_id)
+{
+    const u64 prehash_len = 64;
+    u64       R_used_bytes;
+    u64       len_Rused_PH;
+
+    u8  retval = 1;    
+    u8  prehash[prehash_len];   
+    u8* R_with_prehash = NULL;
+    u8  blake2b_outbuf[64];
+
+    bigint R;
+    bigint R_aux1;
+    bigint R_aux2;
+    bigint R_aux3;
+    bigint div_res;
+    bigint val_e;
+    
+    memset(prehash, 0, prehash_len);
+
+    bigint_create(&R,       M->size_bits, 0);
+    bigint_create(&R_aux1,  M->size_bits, 0);
+    bigint_create(&R_aux2,  M->size_bits, 0);
+    bigint_create(&R_aux3,  M->size_bits, 0);
+    bigint_create(&div_res, M->size_bits, 0); 
+    bigint_create(&val_e,   M->size_bits, 0);
+
+    if(bigint_compare2(s, Q) != 3){
+        printf("[WARN] Cryptolib: sig_validate: input s != input Q.\n");
+        goto label_cleanup;        
+    }
+
+    /* Compute the signature validation prehash. Same as during generation. */ 
+      
+    Signature_PREHASH(prehash_id, data, data_len, prehash);
+      
+    MONT_POW_modM(Gmont, s, M, &R_aux1); 
+    MONT_POW_modM(Amont, e, M, &R_aux2);
+    
+    bigint_mul_fast(&R_aux1, &R_aux2, &R_aux3);
+
+    bigint_div2(&R_aux3, M, &div_res, &R);
+        
+    R_used_bytes = R.used_bits;
+      
+    while(R_used_bytes % 8 != 0){
+        ++R_used_bytes;
+    }
+    
+    R_used_bytes /= 8;
+    
+    /* Last step:                                                       */
+    /* Computes val_e = BLAKE2B{64}(R||PH), truncated to bitwidth of Q. */
+    /* Check that this is equal to e. If it is, validation has passed.  */
+     
+    R_with_prehash = (u8*)calloc(1, R_used_bytes + prehash_len);
+         
+    memcpy(R_with_prehash, R.bits, R_used_bytes);
+    memcpy(R_with_prehash + R_used_bytes, prehash, prehash_len);
+    
+    len_Rused_PH = R_used_bytes + prehash_len; 
+        
+    BLAKE2B_INIT(R_with_prehash, len_Rused_PH, 0, 64, blake2b_outbuf);
+
+    memcpy(val_e.bits, blake2b_outbuf, 40);
+
+    val_e.used_bits = get_used_bits(val_e.bits, 40);
+    val_e.free_bits = val_e.size_bits - val_e.used_bits;
+    
+    if( bigint_compare2(e, &val_e) != 2 ){
+        printf("[WARN] Cryptolib: SIG_VAL: val_e != passed e. Ret 0.\n");
+        
+        printf("Passed e:\n");
+        bigint_print_info(e);
+        bigint_print_bits(e);
+        
+        printf("Computed val_e:\n");
+        bigint_print_info(&val_e);
+        bigint_print_bits(&val_e);
+        
+        retval = 0;
+    }
+ 
+label_cleanup:
+
+    free(R.bits);
+    free(R_aux1.bits);
+    free(R_aux2.bits);
+    free(R_aux3.bits);
+    free(div_res.bits); 
+    free(val_e.bits);
+
+    if(R_with_prehash != NULL){
+        free(R_with_prehash);
+    }
+
+    return retval;
+}
+
+/******************************************************************************
+ *                      CURVE25519 PUBLIC-KEY BACKEND                         *
+ ******************************************************************************/
+
+/* Everything above does public-key work in the 3072-bit group M/Q/G, where
+ * one exponentiation is thousands of 48-limb Montgomery multiplications.
+ * Below is a second backend over the 255-bit curve of RFC 7748 / RFC 8032,
+ * whose field elements fit in five 64-bit limbs:
+ *
+ *  - X25519 key agreement, exactly as in RFC 7748 section 5.
+ *
+ *  - An EdDSA-style Schnorr signature on the twisted Edwards form of the
+ *    same curve, laid out like Ed25519 of RFC 8032, except every hash is
+ *    BLAKE2b-512 instead of SHA-512, because BLAKE2b is what we already
+ *    have. Signatures are therefore NOT interchangeable with Ed25519 ones.
+ *
+ * One 32-byte private key serves both. Its BLAKE2b-512 hash gives the secret
+ * scalar a (left half, clamped) and the nonce prefix (right half). The public
+ * key is the encoded Edwards point A = [a]B. For key agreement, A's y turns
+ * into the Montgomery u = (1 + y) / (1 - y) and goes into X25519 with a, so
+ * the same keypair gives the same shared secret as X25519(a, 9) would.
+ *
+ * Field elements mod p = 2^255 - 19 are 5 limbs of 51 bits, little-endian,
+ * and multiplication goes through 128-bit products. Limbs are allowed to run
+ * a few bits past 51 between operations. Only fe25519_tobytes() reduces all
+ * the way to the canonical value. Nothing here branches on or indexes by
+ * secret data.
+ */
+
+typedef u64 fe25519[5];
+
+#define FE25519_MASK ((((u64)1) << 51) - 1)
+
+/* Edwards curve constant d = -121665/121666, and 2*d, and sqrt(-1) mod p. */
+const fe25519 fe25519_d = {
+    0x34dca135978a3, 0x1a8283b156ebd, 0x5e7a26001c029, 0x739c663a03cbb,
+    0x52036cee2b6ff
+};
+
+const fe25519 fe25519_2d = {
+    0x69b9426b2f159, 0x35050762add7a, 0x3cf44c0038052, 0x6738cc7407977,
+    0x2406d9dc56dff
+};
+
+const fe25519 fe25519_sqrtm1 = {
+    0x61b274a0ea0b0, 0x0d5a5fc8f189d, 0x7ef5e9cbd0c60, 0x78595a6804c9e,
+    0x2b8324804fc1d
+};
+
+void fe25519_0(fe25519 h){
+    h[0] = 0; h[1] = 0; h[2] = 0; h[3] = 0; h[4] = 0;
+}
+
+void fe25519_1(fe25519 h){
+    h[0] = 1; h[1] = 0; h[2] = 0; h[3] = 0; h[4] = 0;
+}
+
+void fe25519_copy(fe25519 h, const fe25519 f){
+    h[0] = f[0]; h[1] = f[1]; h[2] = f[2]; h[3] = f[3]; h[4] = f[4];
+}
+
+/* Bring every limb back down to 51 bits plus at most a tiny carry in h[1]. */
+void fe25519_carry(fe25519 h){
+
+    u64 c;
+
+    c = h[0] >> 51; h[0] &= FE25519_MASK; h[1] += c;
+    c = h[1] >> 51; h[1] &= FE25519_MASK; h[2] += c;
+    c = h[2] >> 51; h[2] &= FE25519_MASK; h[3] += c;
+    c = h[3] >> 51; h[3] &= FE25519_MASK; h[4] += c;
+    c = h[4] >> 51; h[4] &= FE25519_MASK; h[0] += 19 * c;
+    c = h[0] >> 51; h[0] &= FE25519_MASK; h[1] += c;
+
+    return;
+}
+
+void fe25519_add(fe25519 h, const fe25519 f, const fe25519 g){
+
+    for(u64 i = 0; i < 5; ++i){
+        h[i] = f[i] + g[i];
+    }
+
+    fe25519_carry(h);
+
+    return;
+}
+
+/* f - g computed as f + 4p - g, so no limb ever goes below zero. */
+void fe25519_sub(fe25519 h, const fe25519 f, const fe25519 g){
+
+    h[0] = (f[0] + 0x1FFFFFFFFFFFB4) - g[0];
+    h[1] = (f[1] + 0x1FFFFFFFFFFFFC) - g[1];
+    h[2] = (f[2] + 0x1FFFFFFFFFFFFC) - g[2];
+    h[3] = (f[3] + 0x1FFFFFFFFFFFFC) - g[3];
+    h[4] = (f[4] + 0x1FFFFFFFFFFFFC) - g[4];
+
+    fe25519_carry(h);
+
+    return;
+}
+
+void fe25519_neg(fe25519 h, const fe25519 f){
+
+    fe25519 zero;
+
+    fe25519_0(zero);
+    fe25519_sub(h, zero, f);
+
+    return;
+}
+
+/* Schoolbook 5x5 limb product. Limbs that would land at 2^255 and above are
+ * folded back in multiplied by 19, since 2^255 = 19 mod p.
+ */
+void fe25519_mul(fe25519 h, const fe25519 f, const fe25519 g){
+
+    u128 r0, r1, r2, r3, r4;
+    u64  c;
+
+    u64 f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+    u64 g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+
+    u64 g1_19 = 19 * g1, g2_19 = 19 * g2, g3_19 = 19 * g3, g4_19 = 19 * g4;
+
+    r0 =   (u128)f0 * g0    + (u128)f1 * g4_19 + (u128)f2 * g3_19
+         + (u128)f3 * g2_19 + (u128)f4 * g1_19;
+
+    r1 =   (u128)f0 * g1    + (u128)f1 * g0    + (u128)f2 * g4_19
+         + (u128)f3 * g3_19 + (u128)f4 * g2_19;
+
+    r2 =   (u128)f0 * g2    + (u128)f1 * g1    + (u128)f2 * g0
+         + (u128)f3 * g4_19 + (u128)f4 * g3_19;
+
+    r3 =   (u128)f0 * g3    + (u128)f1 * g2    + (u128)f2 * g1
+         + (u128)f3 * g0    + (u128)f4 * g4_19;
+
+    r4 =   (u128)f0 * g4    + (u128)f1 * g3    + (u128)f2 * g2
+         + (u128)f3 * g1    + (u128)f4 * g0;
+
+    r1 += (u64)(r0 >> 51); h[0] = (u64)r0 & FE25519_MASK;
+    r2 += (u64)(r1 >> 51); h[1] = (u64)r1 & FE25519_MASK;
+    r3 += (u64)(r2 >> 51); h[2] = (u64)r2 & FE25519_MASK;
+    r4 += (u64)(r3 >> 51); h[3] = (u64)r3 & FE25519_MASK;
+
+    c    = (u64)(r4 >> 51);
+    h[4] = (u64)r4 & FE25519_MASK;
+
+    h[0] += 19 * c;
+    c     = h[0] >> 51;
+    h[0] &= FE25519_MASK;
+    h[1] += c;
+
+    return;
+}
+
+void fe25519_sq(fe25519 h, const fe25519 f){
+    fe25519_mul(h, f, f);
+}
+
+/* h = f squared k times in a row. */
+void fe25519_sq_times(fe25519 h, const fe25519 f, u64 k){
+
+    fe25519_sq(h, f);
+
+    for(u64 i = 1; i < k; ++i){
+        fe25519_sq(h, h);
+    }
+
+    return;
+}
+
+void fe25519_mul_small(fe25519 h, const fe25519 f, u64 n){
+
+    u128 r;
+    u64  c = 0;
+
+    for(u64 i = 0; i < 5; ++i){
+        r    = ((u128)f[i] * n) + c;
+        h[i] = (u64)r & FE25519_MASK;
+        c    = (u64)(r >> 51);
+    }
+
+    h[0] += 19 * c;
+    fe25519_carry(h);
+
+    return;
+}
+
+/* Swap f and g if b is 1, leave them alone if b is 0, without branching. */
+void fe25519_cswap(fe25519 f, fe25519 g, u64 b){
+
+    u64 mask = (u64)0 - b;
+    u64 x;
+
+    for(u64 i = 0; i < 5; ++i){
+        x     = mask & (f[i] ^ g[i]);
+        f[i] ^= x;
+        g[i] ^= x;
+    }
+
+    return;
+}
+
+/* Little-endian 32 bytes in, the top bit ignored, as RFC 7748 wants. */
+void fe25519_frombytes(fe25519 h, const u8* s){
+
+    u64 w[4];
+
+    memcpy(w, s, 32);
+
+    h[0] =  w[0]                         & FE25519_MASK;
+    h[1] = ((w[0] >> 51) | (w[1] << 13)) & FE25519_MASK;
+    h[2] = ((w[1] >> 38) | (w[2] << 26)) & FE25519_MASK;
+    h[3] = ((w[2] >> 25) | (w[3] << 39)) & FE25519_MASK;
+    h[4] =  (w[3] >> 12)                 & FE25519_MASK;
+
+    return;
+}
+
+/* Canonical little-endian encoding, fully reduced into [0, p). */
+void fe25519_tobytes(u8* s, const fe25519 f){
+
+    fe25519 h;
+    u64     q;
+    u64     w[4];
+
+    fe25519_copy(h, f);
+    fe25519_carry(h);
+    fe25519_carry(h);
+
+    /* Now h < 2^255 + a little. q is 1 exactly when h >= p. */
+    q = (h[0] + 19) >> 51;
+    q = (h[1] + q)  >> 51;
+    q = (h[2] + q)  >> 51;
+    q = (h[3] + q)  >> 51;
+    q = (h[4] + q)  >> 51;
+
+    /* Subtract p by adding 19 and dropping bit 255. */
+    h[0] += 19 * q;
+
+    h[1] += h[0] >> 51; h[0] &= FE25519_MASK;
+    h[2] += h[1] >> 51; h[1] &= FE25519_MASK;
+    h[3] += h[2] >> 51; h[2] &= FE25519_MASK;
+    h[4] += h[3] >> 51; h[3] &= FE25519_MASK;
+                        h[4] &= FE25519_MASK;
+
+    w[0] =  h[0]        | (h[1] << 51);
+    w[1] = (h[1] >> 13) | (h[2] << 38);
+    w[2] = (h[2] >> 26) | (h[3] << 25);
+    w[3] = (h[3] >> 39) | (h[4] << 12);
+
+    memcpy(s, w, 32);
+
+    return;
+}
+
+u8 fe25519_isnegative(const fe25519 f){
+
+    u8 s[32];
+
+    fe25519_tobytes(s, f);
+
+    return s[0] & 1;
+}
+
+u8 fe25519_iszero(const fe25519 f){
+
+    u8 s[32];
+    u8 acc = 0;
+
+    fe25519_tobytes(s, f);
+
+    for(u64 i = 0; i < 32; ++i){
+        acc |= s[i];
+    }
+
+    return (acc == 0);
+}
+
+/* Sets z11 = z^11 and returns z^(2^250 - 1). Shared by the two powers below,
+ * which only differ in how they finish off this addition chain.
+ */
+void fe25519_pow_2_250_1(fe25519 out, fe25519 z11, const fe25519 z){
+
+    fe25519 t0, t1, t2;
+
+    fe25519_sq(t0, z);                 /* z^2                */
+    fe25519_sq_times(t1, t0, 2);       /* z^8                */
+    fe25519_mul(t1, z, t1);            /* z^9                */
+    fe25519_mul(z11, t0, t1);          /* z^11               */
+    fe25519_sq(t0, z11);               /* z^22               */
+    fe25519_mul(t1, t1, t0);           /* z^(2^5 - 1)        */
+    fe25519_sq_times(t0, t1, 5);
+    fe25519_mul(t1, t0, t1);           /* z^(2^10 - 1)       */
+    fe25519_sq_times(t0, t1, 10);
+    fe25519_mul(t0, t0, t1);           /* z^(2^20 - 1)       */
+    fe25519_sq_times(t2, t0, 20);
+    fe25519_mul(t0, t2, t0);           /* z^(2^40 - 1)       */
+    fe25519_sq_times(t0, t0, 10);
+    fe25519_mul(t1, t0, t1);           /* z^(2^50 - 1)       */
+    fe25519_sq_times(t0, t1, 50);
+    fe25519_mul(t0, t0, t1);           /* z^(2^100 - 1)      */
+    fe25519_sq_times(t2, t0, 100);
+    fe25519_mul(t0, t2, t0);           /* z^(2^200 - 1)      */
+    fe25519_sq_times(t0, t0, 50);
+    fe25519_mul(out, t0, t1);          /* z^(2^250 - 1)      */
+
+    return;
+}
+
+/* out = z^(p - 2) = 1/z. Gives 0 for z = 0. */
+void fe25519_invert(fe25519 out, const fe25519 z){
+
+    fe25519 t, z11;
+
+    fe25519_pow_2_250_1(t, z11, z);
+    fe25519_sq_times(t, t, 5);         /* z^(2^255 - 32)     */
+    fe25519_mul(out, t, z11);          /* z^(2^255 - 21)     */
+
+    return;
+}
+
+/* out = z^((p - 5) / 8), the core of a square root mod p. */
+void fe25519_pow22523(fe25519 out, const fe25519 z){
+
+    fe25519 t, z11;
+
+    fe25519_pow_2_250_1(t, z11, z);
+    fe25519_sq_times(t, t, 2);         /* z^(2^252 - 4)      */
+    fe25519_mul(out, t, z);            /* z^(2^252 - 3)      */
+
+    return;
+}
+
+/* X25519 of RFC 7748 section 5: out = k * u on the Montgomery curve,
+ * u-coordinate only, via the constant-time Montgomery ladder. k gets clamped
+ * here, so callers pass any 32 bytes.
+ *
+ * RETURNS: 0 if the result is all zeros, meaning u was a point of small order
+ *          and there is no shared secret to be had. 1 otherwise.
+ */
+u8 X25519(const u8* k, const u8* u, u8* out){
+
+    fe25519 x1, x2, z2, x3, z3;
+    fe25519 A, AA, B, BB, E, C, D, DA, CB, t;
+
+    u8  e[32];
+    u8  acc = 0;
+    u64 swap = 0;
+    u64 bit;
+
+    memcpy(e, k, 32);
+
+    e[0]  &= 248;
+    e[31] &= 127;
+    e[31] |= 64;
+
+    fe25519_frombytes(x1, u);
+    fe25519_1(x2);
+    fe25519_0(z2);
+    fe25519_copy(x3, x1);
+    fe25519_1(z3);
+
+    for(int64_t pos = 254; pos >= 0; --pos){
+
+        bit   = (e[pos / 8] >> (pos & 7)) & 1;
+        swap ^= bit;
+
+        fe25519_cswap(x2, x3, swap);
+        fe25519_cswap(z2, z3, swap);
+
+        swap = bit;
+
+        fe25519_add(A, x2, z2);
+        fe25519_sq(AA, A);
+        fe25519_sub(B, x2, z2);
+        fe25519_sq(BB, B);
+        fe25519_sub(E, AA, BB);
+        fe25519_add(C, x3, z3);
+        fe25519_sub(D, x3, z3);
+        fe25519_mul(DA, D, A);
+        fe25519_mul(CB, C, B);
+
+        fe25519_add(t, DA, CB);
+        fe25519_sq(x3, t);
+        fe25519_sub(t, DA, CB);
+        fe25519_sq(t, t);
+        fe25519_mul(z3, x1, t);
+        fe25519_mul(x2, AA, BB);
+        fe25519_mul_small(t, E, 121665);
+        fe25519_add(t, AA, t);
+        fe25519_mul(z2, E, t);
+    }
+
+    fe25519_cswap(x2, x3, swap);
+    fe25519_cswap(z2, z3, swap);
+
+    fe25519_invert(z2, z2);
+    fe25519_mul(x2, x2, z2);
+    fe25519_tobytes(out, x2);
+
+    explicit_bzero(e, 32);
+
+    for(u64 i = 0; i < 32; ++i){
+        acc |= out[i];
+    }
+
+    return (acc != 0);
+}
+
+/* A point on the twisted Edwards curve -x^2 + y^2 = 1 + d*x^2*y^2 in extended
+ * coordinates: x = X/Z, y = Y/Z, x*y = T/Z.
+ */
+struct ge25519{
+    fe25519 X;
+    fe25519 Y;
+    fe25519 Z;
+    fe25519 T;
+};
+
+/* The base point B, with y = 4/5 and x even. */
+const struct ge25519 ge25519_base = {
+     {0x62d608f25d51a, 0x412a4b4f6592a, 0x75b7171a4b31d, 0x1ff60527118fe,
+      0x216936d3cd6e5}
+    ,{0x6666666666658, 0x4cccccccccccc, 0x1999999999999, 0x3333333333333,
+      0x6666666666666}
+    ,{1, 0, 0, 0, 0}
+    ,{0x68ab3a5b7dda3, 0x00eea2a5eadbb, 0x2af8df483c27e, 0x332b375274732,
+      0x67875f0fd78b7}
+};
+
+void ge25519_identity(struct ge25519* h){
+
+    fe25519_0(h->X);
+    fe25519_1(h->Y);
+    fe25519_1(h->Z);
+    fe25519_0(h->T);
+
+    return;
+}
+
+/* r = p + q. These formulas (add-2008-hwcd-3) are complete on this curve, so
+ * they work for doubling and for the identity too, with no special cases.
+ */
+void ge25519_add( struct ge25519* r, const struct ge25519* p
+                 ,const struct ge25519* q)
+{
+    fe25519 a, b, c, d, e, f, g, h, t;
+
+    fe25519_sub(a, p->Y, p->X);
+    fe25519_sub(t, q->Y, q->X);
+    fe25519_mul(a, a, t);
+    fe25519_add(b, p->Y, p->X);
+    fe25519_add(t, q->Y, q->X);
+    fe25519_mul(b, b, t);
+    fe25519_mul(c, p->T, q->T);
+    fe25519_mul(c, c, fe25519_2d);
+    fe25519_mul(d, p->Z, q->Z);
+    fe25519_add(d, d, d);
+    fe25519_sub(e, b, a);
+    fe25519_sub(f, d, c);
+    fe25519_add(g, d, c);
+    fe25519_add(h, b, a);
+
+    fe25519_mul(r->X, e, f);
+    fe25519_mul(r->Y, g, h);
+    fe25519_mul(r->T, e, h);
+    fe25519_mul(r->Z, f, g);
+
+    return;
+}
+
+/* r = 2p (dbl-2008-hwcd with a = -1), cheaper than adding p to itself.
+ * Each of e, f, g, h here is minus the E, F, G, H of those formulas, which
+ * saves a negation, and the signs cancel out in every product at the end.
+ */
+void ge25519_double(struct ge25519* r, const struct ge25519* p){
+
+    fe25519 a, b, c, e, f, g, h, t;
+
+    fe25519_sq(a, p->X);
+    fe25519_sq(b, p->Y);
+    fe25519_sq(c, p->Z);
+    fe25519_add(c, c, c);
+    fe25519_add(t, p->X, p->Y);
+    fe25519_sq(t, t);
+    fe25519_add(h, a, b);
+    fe25519_sub(e, h, t);
+    fe25519_sub(g, a, b);
+    fe25519_add(f, c, g);
+
+    fe25519_mul(r->X, e, f);
+    fe25519_mul(r->Y, g, h);
+    fe25519_mul(r->T, e, h);
+    fe25519_mul(r->Z, f, g);
+
+    return;
+}
+
+void ge25519_cswap(struct ge25519* p, struct ge25519* q, u64 b){
+
+    fe25519_cswap(p->X, q->X, b);
+    fe25519_cswap(p->Y, q->Y, b);
+    fe25519_cswap(p->Z, q->Z, b);
+    fe25519_cswap(p->T, q->T, b);
+
+    return;
+}
+
+/* r = [s]p for a 32-byte little-endian scalar s, constant time. A ladder
+ * that always does one addition and one doubling per bit, whatever the bit.
+ */
+void ge25519_scalarmult( struct ge25519* r, const struct ge25519* p
+                        ,const u8* s)
+{
+    struct ge25519 q;
+    struct ge25519 t;
+
+    u64 bit;
+
+    ge25519_identity(r);
+    memcpy(&q, p, sizeof(struct ge25519));
+
+    for(int64_t pos = 255; pos >= 0; --pos){
+
+        bit = (s[pos / 8] >> (pos & 7)) & 1;
+
+        ge25519_cswap(r, &q, bit);
+        ge25519_add(&t, &q, r);
+        memcpy(&q, &t, sizeof(struct ge25519));
+        ge25519_double(&t, r);
+        memcpy(r, &t, sizeof(struct ge25519));
+        ge25519_cswap(r, &q, bit);
+    }
+
+    explicit_bzero(&t, sizeof(struct ge25519));
+
+    return;
+}
+
+/* 32 bytes: y, little-endian, with the sign of x in the top bit. */
+void ge25519_tobytes(u8* s, const struct ge25519* h){
+
+    fe25519 recip, x, y;
+
+    fe25519_invert(recip, h->Z);
+    fe25519_mul(x, h->X, recip);
+    fe25519_mul(y, h->Y, recip);
+    fe25519_tobytes(s, y);
+
+    s[31] ^= (u8)(fe25519_isnegative(x) << 7);
+
+    return;
+}
+
+/* Decode a point for verification. Public data only, so this may branch.
+ *
+ * RETURNS: 1 if s is the canonical encoding of a point on the curve, else 0.
+ */
+u8 ge25519_frombytes(struct ge25519* h, const u8* s){
+
+    fe25519 u, v, v3, vxx, check;
+
+    u8 y_bytes[32];
+    u8 sign = s[31] >> 7;
+
+    fe25519_frombytes(h->Y, s);
+
+    /* y must be below p, or two encodings would decode to the same point. */
+    fe25519_tobytes(y_bytes, h->Y);
+    y_bytes[31] |= (u8)(sign << 7);
+
+    if(memcmp(y_bytes, s, 32) != 0){
+        return 0;
+    }
+
+    fe25519_1(h->Z);
+
+    /* x^2 = (y^2 - 1) / (d*y^2 + 1) = u / v. */
+    fe25519_sq(u, h->Y);
+    fe25519_mul(v, u, fe25519_d);
+    fe25519_sub(u, u, h->Z);
+    fe25519_add(v, v, h->Z);
+
+    /* x = u * v^3 * (u * v^7)^((p - 5) / 8) */
+    fe25519_sq(v3, v);
+    fe25519_mul(v3, v3, v);
+    fe25519_sq(h->X, v3);
+    fe25519_mul(h->X, h->X, v);
+    fe25519_mul(h->X, h->X, u);
+    fe25519_pow22523(h->X, h->X);
+    fe25519_mul(h->X, h->X, v3);
+    fe25519_mul(h->X, h->X, u);
+
+    fe25519_sq(vxx, h->X);
+    fe25519_mul(vxx, vxx, v);
+
+    fe25519_sub(check, vxx, u);
+
+    if( ! fe25519_iszero(check) ){
+
+        fe25519_add(check, vxx, u);
+
+        if( ! fe25519_iszero(check) ){
+            return 0;
+        }
+
+        fe25519_mul(h->X, h->X, fe25519_sqrtm1);
+    }
+
+    if(fe25519_iszero(h->X) && sign){
+        return 0;
+    }
+
+    if(fe25519_isnegative(h->X) != sign){
+        fe25519_neg(h->X, h->X);
+    }
+
+    fe25519_mul(h->T, h->X, h->Y);
+
+    return 1;
+}
+
+/* The order of the base point, little-endian bytes:
+ * L = 2^252 + 27742317777372353535851937790883648493
+ */
+const int64_t sc25519_L[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+    0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0,    0,    0,    0,    0,    0,    0,    0,
+    0,    0,    0,    0,    0,    0,    0,    0x10
+};
+
+/* r = x mod L, for x given as 64 signed byte-sized digits, little-endian.
+ * Digits are allowed to be way out of [0, 256) on the way in, like the sums
+ * of byte products sc25519_muladd() leaves there. Schoolbook, one byte at a
+ * time from the top, the way TweetNaCl does it.
+ */
+void sc25519_modL(u8* r, int64_t* x){
+
+    int64_t carry;
+    int64_t i, j;
+
+    for(i = 63; i >= 32; --i){
+
+        carry = 0;
+
+        for(j = i - 32; j < i - 12; ++j){
+            x[j] += carry - 16 * x[i] * sc25519_L[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry * 256;
+        }
+
+        x[j] += carry;
+        x[i]  = 0;
+    }
+
+    carry = 0;
+
+    for(j = 0; j < 32; ++j){
+        x[j] += carry - (x[31] >> 4) * sc25519_L[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+
+    for(j = 0; j < 32; ++j){
+        x[j] -= carry * sc25519_L[j];
+    }
+
+    for(i = 0; i < 32; ++i){
+        x[i + 1] += x[i] >> 8;
+        r[i] = (u8)(x[i] & 255);
+    }
+
+    return;
+}
+
+/* 64 bytes in, like a BLAKE2b-512 output, 32 bytes mod L out. */
+void sc25519_reduce(u8* r, const u8* s){
+
+    int64_t x[64];
+
+    for(u64 i = 0; i < 64; ++i){
+        x[i] = (int64_t)s[i];
+    }
+
+    sc25519_modL(r, x);
+
+    explicit_bzero(x, sizeof(x));
+
+    return;
+}
+
+/* r = (a * b + c) mod L, all 32-byte little-endian. */
+void sc25519_muladd(u8* r, const u8* a, const u8* b, const u8* c){
+
+    int64_t x[64];
+
+    memset(x, 0, sizeof(x));
+
+    for(u64 i = 0; i < 32; ++i){
+        x[i] = (int64_t)c[i];
+    }
+
+    for(u64 i = 0; i < 32; ++i){
+        for(u64 j = 0; j < 32; ++j){
+            x[i + j] += (int64_t)a[i] * (int64_t)b[j];
+        }
+    }
+
+    sc25519_modL(r, x);
+
+    explicit_bzero(x, sizeof(x));
+
+    return;
+}
+
+/* 1 if s < L, as a signature's S must be. */
+u8 sc25519_is_canonical(const u8* s){
+
+    for(int64_t i = 31; i >= 0; --i){
+        if(s[i] < sc25519_L[i]){
+            return 1;
+        }
+        if(s[i] > sc25519_L[i]){
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+#define CURVE25519_PRIVKEY_LEN 32
+#define CURVE25519_PUBKEY_LEN  32
+#define CURVE25519_SIG_LEN     64
+#define CURVE25519_SHARED_LEN  32
+
+/* BLAKE2b-512 of the private key: clamped scalar a in the left half, the
+ * nonce prefix in the right half.
+ */
+void curve25519_expand_privkey(const u8* privkey, u8* expanded){
+
+    struct BLAKE2B_stream st;
+
+    BLAKE2B_STREAM_INIT(&st, 64);
+    BLAKE2B_STREAM_UPDATE(&st, privkey, CURVE25519_PRIVKEY_LEN);
+    BLAKE2B_STREAM_FINAL(&st, expanded);
+
+    expanded[0]  &= 248;
+    expanded[31] &= 127;
+    expanded[31] |= 64;
+
+    return;
+}
+
+/* pubkey = encoding of [a]B for the a that privkey expands to. */
+void Curve25519_PUBKEY(const u8* privkey, u8* pubkey){
+
+    struct ge25519 A;
+
+    u8 expanded[64];
+
+    curve25519_expand_privkey(privkey, expanded);
+
+    ge25519_scalarmult(&A, &ge25519_base, expanded);
+    ge25519_tobytes(pubkey, &A);
+
+    explicit_bzero(expanded, 64);
+
+    return;
+}
+
+/* Draw a fresh private key and compute its public key.
+ *
+ * RETURNS: 1 on success, 0 if the CSPRNG failed and the keys must not be used.
+ */
+u8 Curve25519_KEYGEN(u8* privkey, u8* pubkey){
+
+    if( ! CSPRNG_GET_BYTES(privkey, CURVE25519_PRIVKEY_LEN) ){
+        printf("[ERR] Cryptolib: Curve25519 keygen couldn't get randomness.\n");
+        return 0;
+    }
+
+    Curve25519_PUBKEY(privkey, pubkey);
+
+    return 1;
+}
+
+/* k = BLAKE2b-512(R || A || data) mod L, the challenge of the signature. */
+void curve25519_challenge( const u8* R, const u8* pubkey, const u8* data
+                          ,u64 data_len, u8* k)
+{
+    struct BLAKE2B_stream st;
+
+    u8 hash[64];
+
+    BLAKE2B_STREAM_INIT(&st, 64);
+    BLAKE2B_STREAM_UPDATE(&st, R, 32);
+    BLAKE2B_STREAM_UPDATE(&st, pubkey, CURVE25519_PUBKEY_LEN);
+    BLAKE2B_STREAM_UPDATE(&st, data, data_len);
+    BLAKE2B_STREAM_FINAL(&st, hash);
+
+    sc25519_reduce(k, hash);
+
+    return;
+}
+
+/* Sign data with privkey, whose public key is pubkey. The 64-byte signature
+ * is R || S, where
+ *
+ *   r = BLAKE2b-512(prefix || data) mod L,   R = [r]B,
+ *   k = BLAKE2b-512(R || A || data) mod L,   S = (r + k*a) mod L.
+ *
+ * The nonce r is derived, not drawn, so a bad CSPRNG can't leak the key.
+ */
+void Curve25519_SIGN( const u8* privkey, const u8* pubkey
+                     ,const u8* data, u64 data_len, u8* signature)
+{
+    struct BLAKE2B_stream st;
+    struct ge25519        R;
+
+    u8 expanded[64];
+    u8 hash[64];
+    u8 r[32];
+    u8 k[32];
+
+    curve25519_expand_privkey(privkey, expanded);
+
+    BLAKE2B_STREAM_INIT(&st, 64);
+    BLAKE2B_STREAM_UPDATE(&st, expanded + 32, 32);
+    BLAKE2B_STREAM_UPDATE(&st, data, data_len);
+    BLAKE2B_STREAM_FINAL(&st, hash);
+
+    sc25519_reduce(r, hash);
+
+    ge25519_scalarmult(&R, &ge25519_base, r);
+    ge25519_tobytes(signature, &R);
+
+    curve25519_challenge(signature, pubkey, data, data_len, k);
+
+    sc25519_muladd(signature + 32, k, expanded, r);
+
+    explicit_bzero(expanded, 64);
+    explicit_bzero(hash, 64);
+    explicit_bzero(r, 32);
+
+    return;
+}
+
+/* Check signature = R || S over data against pubkey A: S must be below L,
+ * A must decode, and [S]B - [k]A must encode to exactly R.
+ *
+ * RETURNS: 1 if the signature is valid for this data, 0 otherwise.
+ */
+u8 Curve25519_VERIFY( const u8* pubkey, const u8* data, u64 data_len
+                     ,const u8* signature)
+{
+    struct ge25519 A;
+    struct ge25519 SB;
+    struct ge25519 kA;
+    struct ge25519 sum;
+
+    u8 k[32];
+    u8 check_R[32];
+
+    if( ! sc25519_is_canonical(signature + 32) ){
+        printf("[WARN] Cryptolib: Curve25519 verify: S is not below L.\n");
+        return 0;
+    }
+
+    if( ! ge25519_frombytes(&A, pubkey) ){
+        printf("[WARN] Cryptolib: Curve25519 verify: bad public key.\n");
+        return 0;
+    }
+
+    fe25519_neg(A.X, A.X);
+    fe25519_neg(A.T, A.T);
+
+    curve25519_challenge(signature, pubkey, data, data_len, k);
+
+    ge25519_scalarmult(&SB, &ge25519_base, signature + 32);
+    ge25519_scalarmult(&kA, &A, k);
+    ge25519_add(&sum, &SB, &kA);
+    ge25519_tobytes(check_R, &sum);
+
+    return (memcmp(check_R, signature, 32) == 0);
+}
+
+/* Shared secret between privkey and the peer's public key, both of the
+ * signing kind above. The peer's Edwards y becomes Montgomery u = (1+y)/(1-y)
+ * and then it's plain X25519 with our clamped scalar a.
+ *
+ * RETURNS: 1 on success, 0 if peer_pubkey is malformed or of small order.
+ */
+u8 Curve25519_AGREE( const u8* privkey, const u8* peer_pubkey
+                    ,u8* shared_secret)
+{
+    struct ge25519 P;
+
+    fe25519 one, num, den;
+
+    u8 expanded[64];
+    u8 u[32];
+    u8 status;
+
+    if( ! ge25519_frombytes(&P, peer_pubkey) ){
+        printf("[WARN] Cryptolib: Curve25519 agree: bad peer public key.\n");
+        return 0;
+    }
+
+    fe25519_1(one);
+    fe25519_add(num, one, P.Y);
+    fe25519_sub(den, one, P.Y);
+    fe25519_invert(den, den);
+    fe25519_mul(num, num, den);
+    fe25519_tobytes(u, num);
+
+    curve25519_expand_privkey(privkey, expanded);
+
+    status = X25519(expanded, u, shared_secret);
+
+    explicit_bzero(expanded, 64);
+
+    if(!status){
+        printf("[WARN] Cryptolib: Curve25519 agree: all-zero secret.\n");
+    }
+
+    return status;
+}
+
+/* Which public-key backend a key belongs to. This number is what goes into
+ * user_save.dat and into the typed login packet, so never renumber these.
+ *
+ * FFDH3072 is the M/Q/G group, through gen_pub_key(), Signature_GENERATE()
+ * and friends. CURVE25519 is the Curve25519_*() functions above, on byte
+ * strings of the CURVE25519_*_LEN sizes.
+ */
+#define PK_TYPE_FFDH3072   1
+#define PK_TYPE_CURVE25519 2
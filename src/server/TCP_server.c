@@ -25,9 +25,32 @@
 #define SHORT_NONCE_LEN  12
 #define LONG_NONCE_LEN   16
 #define HMAC_TRUNC_BYTES 8
+#define SESSION_MAC_LEN  32
 
 #define SIGNATURE_LEN  ((2 * sizeof(bigint)) + (2 * PRIVKEY_LEN))
 
+/* Pool of precomputed signing nonces (k, G^k), so the modular exponentiation
+ * of every signature we send happens ahead of time, off the request path.
+ * Up to NONCE_REFILL_BATCH pairs are computed, then the refill thread waits
+ * NONCE_REFILL_MS milliseconds before the next batch. 0 means no wait.
+ */
+#define NONCE_POOL_SIZ     256
+#define NONCE_REFILL_BATCH 8
+#define NONCE_REFILL_MS    0
+
+/* Same for the short-term Diffie-Hellman key pairs (b_s, B_s = G^b_s mod M)
+ * of the login handshake. Only one login runs at a time, so a shallow pool
+ * is enough to absorb a burst of them.
+ */
+#define DH_POOL_SIZ        16
+#define DH_REFILL_BATCH    4
+#define DH_REFILL_MS       0
+
+/* Worker threads signing our replies, so packet handlers - which run with
+ * the global mutex held - never have to sit through a signature themselves.
+ */
+#define SIG_SERVICE_WORKERS 4
+
 /* Memory region for short-term cryptographic artifacts for a login handshake */
 u8* temp_handshake_buf;
 
@@ -47,6 +70,19 @@ struct connected_client{
     bigint client_pubkey;
     bigint client_pubkey_mont;
     bigint shared_secret; 
+
+    /* Session-MAC mode, see authenticate_client_mac(). */
+    struct BLAKE2B_MAC_ctx mac_recv_ctx;     /* Client to server.          */
+    struct BLAKE2B_MAC_ctx mac_send_ctx;     /* Server to client.          */
+    u64                    mac_recv_counter; /* Last one we accepted.      */
+    u64                    mac_send_counter; /* Last one we sent.          */
+    u8                     macs_agreed;      /* Both sides said yes to it. */
+
+    /* The socket slot their connection is on. Not the same as their user
+     * slot - a resumed session gets a new socket, and sockets whose login
+     * failed never get a user slot at all.
+     */
+    u64 sock_ix;
 };
 
 struct chatroom{
@@ -71,6 +107,17 @@ u64 socket_status_bitmask = 0;
 u64 next_free_socket_ix = 1;
 
 u64 next_free_user_ix = 1;
+
+/* Bumped every time a user slot is freed. A reply signed on a worker thread
+ * remembers the epochs of the slots it's for, and is dropped for any slot
+ * that has since been freed, maybe even taken by someone else already.
+ */
+u64 client_epochs[MAX_CLIENTS];
+
+/* The same for socket slots, bumped every time one is released, for replies
+ * that go straight to a socket - a new connection can get the same slot.
+ */
+u64 socket_epochs[MAX_CLIENTS];
 u64 next_free_room_ix = 1;
 
 u8 server_privkey[PRIVKEY_LEN];
@@ -83,11 +130,15 @@ pthread_t conn_checker_threadID;
 #define PACKET_ID_00 0xAD0084FF0CC25B0E
 #define PACKET_ID_01 0xE7D09F1FEFEA708B
 #define PACKET_ID_02 0x146AAE4D100DAEEA
+#define PACKET_ID_03 0xCAF4D10C898C4FFC
+#define PACKET_ID_04 0xAB9DE36FCF840299
+#define PACKET_ID_05 0x3E91C7B25D0A64F9
 #define PACKET_ID_10 0x13C4A44F70842AC1
 #define PACKET_ID_11 0xAEFB70A4A8E610DF
 #define PACKET_ID_20 0x9FF4D1E0EAE100A5
 #define PACKET_ID_21 0x7C8124568ED45F1A
 #define PACKET_ID_30 0x9FFA7475DDC8B11C
+#define PACKET_ID_31 0x5E1B9C34A07D2F68
 #define PACKET_ID_40 0xCAFB1C01456DF7F0
 #define PACKET_ID_41 0xDC4F771C0B22FDAB
 #define PACKET_ID_50 0x41C20F0BB4E34890
@@ -132,11 +183,80 @@ bigint  server_privkey_bigint;
 
 struct sockaddr_in servaddr;
 
+/* Session resumption tickets.
+ *
+ * A client whose connection dropped used to have to redo the whole login:
+ * our short-term DH, Get_Mont_Form() of their long-term public key and the
+ * long-term shared secret exponentiation. On a flaky network many of them
+ * reconnect at once, and all our CPU goes into those exponentiations.
+ *
+ * So at login, a client can ask for a ticket (see process_msg_01()). It's
+ * everything we'd otherwise compute for them again, sealed under keys only
+ * we have, which live in memory only and die with the server process:
+ *
+================================================================================
+| ChaCha20 nonce  | Encrypted: expiry | PubKey | PubKey Mont | Secret |  MAC  |
+|=================|===================|========|=============|========|=======|
+| SHORT_NONCE_LEN |     SMALL_LEN     | PUBKEY | PUBKEY_LEN  |   80   |  32   |
+--------------------------------------------------------------------------------
+ *
+ * where Secret is the part of our long-term shared secret with them that
+ * gets used, KAB || KBA || long nonce, and the MAC is a keyed BLAKE2b of the
+ * ChaCha20 nonce and the ciphertext. When they reconnect, they send the
+ * ticket back in a PACKET_ID_03, and if it opens, isn't expired and they can
+ * prove they know the secret in it, they get their session back with no
+ * exponentiation on either side - see process_msg_03().
+ *
+ * A resumed session gets a new ticket with the expiry of the old one, so a
+ * full login is needed at least every RESUME_TICKET_LIFETIME seconds.
+ */
+#define RESUME_TICKET_SECRET_LEN ((2 * SESSION_KEY_LEN) + LONG_NONCE_LEN)
+
+#define RESUME_TICKET_BODY_LEN \
+        (SMALL_FIELD_LEN + (2 * PUBKEY_LEN) + RESUME_TICKET_SECRET_LEN)
+
+#define RESUME_TICKET_LEN \
+        (SHORT_NONCE_LEN + RESUME_TICKET_BODY_LEN + SESSION_MAC_LEN)
+
+#define RESUME_TICKET_LIFETIME 3600 /* Seconds. */
+#define RESUME_NONCE_LEN       32
+#define RESUME_MAX_SKEW        30   /* Seconds a resumption request is good. */
+#define RESUME_REPLAY_SLOTS    256
+#define RESUME_WANT_TICKET     0x01 /* Login flag - the client wants one.    */
+
+/* Login flag - the client wants session MACs, see authenticate_client_mac(). */
+#define LOGIN_WANT_SESSION_MACS 0x02
+#define LOGIN_FLAGS_KNOWN       (RESUME_WANT_TICKET | LOGIN_WANT_SESSION_MACS)
+
+u8 ticket_enc_key[SESSION_KEY_LEN];
+
+struct BLAKE2B_MAC_ctx ticket_mac_ctx;
+
+/* Tags of the tickets redeemed in the last RESUME_MAX_SKEW seconds or so, so
+ * the same resumption request can't be played to us twice.
+ */
+struct redeemed_ticket{
+    u8  tag[SESSION_MAC_LEN];
+    u64 when;
+};
+
+struct redeemed_ticket redeemed_tickets[RESUME_REPLAY_SLOTS];
+
+u64 resumes_accepted = 0;
+u64 resumes_refused  = 0;
+
 /* First thing done when we start the Rosetta server - initialize it. */
 u64 self_init(){
 
     FILE* privkey_dat;
 
+    u64 constant_replies[] = { PACKET_ID_01, PACKET_ID_02, PACKET_ID_04
+                              ,PACKET_ID_10, PACKET_ID_11, PACKET_ID_40
+                             };
+    u8  ticket_mac_key[SESSION_MAC_LEN];
+    u8  warmup_signature[SIGNATURE_LEN];
+    u64 login_ok_signed[2] = {PACKET_ID_01, 0};
+
     for(socklen_t i = 0; i < MAX_CLIENTS; ++i){
         clientLens[i] = sizeof(struct sockaddr_in);
     }
@@ -234,6 +354,75 @@ u64 self_init(){
         (3072, "../bin/server_pubkey.dat\0", 3071, MAX_BIGINT_SIZ);
     
     fclose(privkey_dat);
+
+    /* Not fatal - without the pool, signing computes its own G^k as before. */
+    if(!Signature_NONCE_POOL_START( M, Q, Gm, NONCE_POOL_SIZ
+                                   ,NONCE_REFILL_BATCH, NONCE_REFILL_MS
+                                  )
+      )
+    {
+        printf("[WARN] Server: Signing nonce pool couldn't be started.\n");
+    }
+
+    /* Not fatal either - logins then compute their own (b_s, B_s) pair. */
+    if(!DH_EPHEMERAL_POOL_START( M, Q, Gm, DH_POOL_SIZ
+                                ,DH_REFILL_BATCH, DH_REFILL_MS
+                               )
+      )
+    {
+        printf("[WARN] Server: DH ephemeral key pool couldn't be started.\n");
+    }
+
+    /* Resumption tickets are sealed under keys that only this run of the
+     * server ever has. Restarting it voids every ticket out there.
+     */
+    if(   !CSPRNG_GET_BYTES(ticket_enc_key, SESSION_KEY_LEN)
+       || !CSPRNG_GET_BYTES(ticket_mac_key, SESSION_MAC_LEN)
+      )
+    {
+        printf("[ERR] Server: Couldn't make resumption ticket keys.\n");
+        return 1;
+    }
+
+    BLAKE2B_MAC_INIT( &ticket_mac_ctx
+                     ,ticket_mac_key, SESSION_MAC_LEN, SESSION_MAC_LEN
+                    );
+
+    explicit_bzero(ticket_mac_key, SESSION_MAC_LEN);
+
+    /* Replies that are the same 8 bytes signed every time are still signed
+     * inline, from the signature cache. Fill it now, so it never misses, and
+     * no packet handler ever signs anything under the global mutex.
+     */
+    for(u64 i = 0; i < sizeof(constant_replies) / sizeof(u64); ++i){
+        Signature_GENERATE_CACHED( M, Q, Gm, (u8*)(&(constant_replies[i]))
+                                  ,SMALL_FIELD_LEN, warmup_signature
+                                  ,&server_privkey_bigint, PRIVKEY_LEN
+                                 );
+    }
+
+    /* And the Login-OK's packet ID with every set of flags we can agree to,
+     * which is what its signature is over for clients that send flags.
+     */
+    for(u64 flags = 0; flags <= LOGIN_FLAGS_KNOWN; ++flags){
+
+        login_ok_signed[1] = flags;
+
+        Signature_GENERATE_CACHED( M, Q, Gm, (u8*)login_ok_signed
+                                  ,2 * SMALL_FIELD_LEN, warmup_signature
+                                  ,&server_privkey_bigint, PRIVKEY_LEN
+                                 );
+    }
+
+    /* Every other signed reply goes through the signing service. */
+    if(!Signature_SERVICE_START( M, Q, Gm, &server_privkey_bigint
+                                ,PRIVKEY_LEN, SIG_SERVICE_WORKERS
+                               )
+      )
+    {
+        printf("[ERR] Server: Signing service couldn't start. Aborting.\n");
+        return 1;
+    }
     
     /* Initialize the mutex that will be used to prevent the main thread and
      * the connection checker thread from getting into a race condition.
@@ -273,7 +462,7 @@ u8 check_pubkey_exists(u8* pubkey_buf, u64 pubkey_siz){
 void add_pending_msg(u64 user_ix, u64 data_len, u8* data){
 
     /* Make sure the user has space in their list of pending messages. */
-    if(clients[user_ix].num_pending_msgs == MAX_PEND_MSGS){
+    if(clients[user_ix].num_pending_msgs >= MAX_PEND_MSGS){
         printf("[ERR] Server: No space for pend_msgs of userix[%lu]\n",user_ix);
         return;
     }
@@ -305,15 +494,184 @@ void add_pending_msg(u64 user_ix, u64 data_len, u8* data){
     
     clients[user_ix].pending_msg_sizes[clients[user_ix].num_pending_msgs] 
      = data_len;
+
+    ++(clients[user_ix].num_pending_msgs);
      
     return;    
 }
 
+/* A reply that's waiting on its signature from the signing service. Either
+ * sent straight to one socket, or added as a pending message of each target.
+ * Targets are socket slots for the first and user slots for the second, and
+ * their epochs are from socket_epochs[] and client_epochs[] to match.
+ */
+#define SIGNED_REPLY_SEND    1
+#define SIGNED_REPLY_PENDING 2
+
+struct signed_reply{
+    struct Signature_job job;
+    u8          kind;
+    u8*         buf;
+    u64         len;
+    u64         num_targets;
+    u64         targets[MAX_CLIENTS];
+    u64         target_epochs[MAX_CLIENTS];
+    const char* what;
+};
+
+/* Runs on a signing worker once the reply's signature is in place. */
+void signed_reply_done(struct Signature_job* job){
+
+    struct signed_reply* reply = (struct signed_reply*)job->user_arg;
+    u64  ix;
+    u64* epochs = (reply->kind == SIGNED_REPLY_SEND) ? socket_epochs
+                                                     : client_epochs;
+
+    pthread_mutex_lock(&mutex);
+
+    for(u64 i = 0; i < reply->num_targets; ++i){
+
+        ix = reply->targets[i];
+
+        /* They left while it was being signed - it's not theirs anymore. */
+        if(epochs[ix] != reply->target_epochs[i]){
+            printf("[WARN] Server: Dropped %s for a slot freed since.\n"
+                   ,reply->what
+                  );
+            continue;
+        }
+
+        if(reply->kind == SIGNED_REPLY_SEND){
+            if(send(client_socket_fd[ix], reply->buf, reply->len, 0) == -1){
+                printf("[ERR] Server: Couldn't send %s.\n", reply->what);
+            }
+            else{
+                printf("[OK]  Server: Sent %s.\n", reply->what);
+            }
+        }
+        else if(users_status_bitmask & (1ULL << (63ULL - ix))){
+            add_pending_msg(ix, reply->len, reply->buf);
+
+            printf("[OK]  Server: Added %s to user[%lu]'s pending MSGs.\n"
+                   ,reply->what, ix
+                  );
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    free(reply->buf);
+    free(reply);
+
+    return;
+}
+
+/* Have the signing service sign data and put the signature at the end of
+ * buf, the last SIGNATURE_LEN of its len bytes. Then buf gets sent to the
+ * socket of each target (SIGNED_REPLY_SEND), or added to their pending
+ * messages (SIGNED_REPLY_PENDING). data may lie inside buf, past len bytes.
+ *
+ * Takes over buf, which gets freed once the reply went out, so the caller
+ * must not touch it after. Called with the global mutex held.
+ */
+void submit_signed_reply( u8 kind, u64* targets, u64 num_targets
+                         ,u8* buf, u64 len, u8* data, u64 data_len
+                         ,const char* what
+                        )
+{
+    struct signed_reply* reply = calloc(1, sizeof(struct signed_reply));
+
+    u64* epochs = (kind == SIGNED_REPLY_SEND) ? socket_epochs : client_epochs;
+
+    reply->kind        = kind;
+    reply->buf         = buf;
+    reply->len         = len;
+    reply->num_targets = num_targets;
+    reply->what        = what;
+
+    for(u64 i = 0; i < num_targets; ++i){
+        reply->targets[i]       = targets[i];
+        reply->target_epochs[i] = epochs[targets[i]];
+    }
+
+    reply->job.data      = data;
+    reply->job.data_len  = data_len;
+    reply->job.signature = buf + (len - SIGNATURE_LEN);
+    reply->job.on_done   = signed_reply_done;
+    reply->job.user_arg  = reply;
+
+    if(!Signature_SERVICE_SUBMIT(&(reply->job))){
+        printf("[ERR] Server: Couldn't queue %s for signing.\n", what);
+        free(buf);
+        free(reply);
+    }
+
+    return;
+}
+
+/* Get user slot ix ready for a client that just logged in or resumed their
+ * session: not in a room, nothing pending, all counters at 0. Their keys are
+ * up to the caller.
+ */
+void init_user_slot(u64 ix){
+
+    clients[ix].room_ix          = 0;
+    clients[ix].num_pending_msgs = 0;
+    clients[ix].nonce_counter    = 0;
+    clients[ix].time_last_polled = clock();
+
+    for(size_t i = 0; i < MAX_PEND_MSGS; ++i){
+        clients[ix].pending_msgs[i] = calloc(1, MAX_MSG_LEN);
+    }
+    
+    memset( clients[ix].pending_msg_sizes
+           ,0
+           ,(MAX_PEND_MSGS * SMALL_FIELD_LEN)
+          );
+
+    return;
+}
+
+/* Mark user slot ix, which must be next_free_user_ix, as taken. */
+void claim_user_slot(u64 ix){
+
+    /* Reflect the new taken user slot in the global user status bitmask. */
+    users_status_bitmask |= (1ULL << (63ULL - ix));
+    
+    /*  Increment it one space to the right, since we're guaranteeing by
+     *  logic in the user erause algorithm that we're always filling in
+     *  a new user in the LEFTMOST possible empty slot.
+     *
+     *  If you're less than (max_users), look at this slot and to the right
+     *  in the bitmask for the next leftmost empty user slot index. If you're
+     *  equal to (max_users) then the maximum number of users are currently
+     *  using Rosetta. Can't let any more people in until one leaves.
+     *
+     *  Here you either reach MAX_CLIENTS, which on the next attempt to 
+     *  let a user in and fill out a user struct for them, will indicate
+     *  that the maximum number of people are currently using Rosetta, or
+     *  you reach a bit at an index less than MAX_CLIENTS that is 0 in the
+     *  global user slots status bitmask.
+     */
+    next_free_user_ix = ix + 1;
+    
+    while(next_free_user_ix < MAX_CLIENTS){
+        if(!( users_status_bitmask & (1ULL << (63ULL - next_free_user_ix)))){
+            break;
+        }
+        ++next_free_user_ix;
+    }
+
+    return;
+}
+
 void remove_user_from_room(u64 sender_ix){
 
     u8* reply_buf;
     u64 reply_len;
     u64 saved_room_ix = clients[sender_ix].room_ix;
+    u64 receiver_ixs[MAX_CLIENTS];
+    u64 num_receivers = 0;
 
     /* If it's not the owner, just tell the others that the person has left. */
     if(sender_ix != rooms[clients[sender_ix].room_ix].owner_ix){
@@ -329,12 +687,6 @@ void remove_user_from_room(u64 sender_ix){
                ,SMALL_FIELD_LEN
         );
         
-        /* Compute a signature so the clients can authenticate the server. */
-        Signature_GENERATE( M, Q, Gm, reply_buf, reply_len - SIGNATURE_LEN
-                           ,reply_buf + (reply_len - SIGNATURE_LEN)
-                           ,&server_privkey_bigint, PRIVKEY_LEN
-        );
-        
         /* Let the other room guests know that a user has left: TYPE_50 */
         for(u64 i = 0; i < MAX_CLIENTS; ++i){
             if(  
@@ -342,14 +694,18 @@ void remove_user_from_room(u64 sender_ix){
                && 
                  (clients[i].room_ix == clients[sender_ix].room_ix))
             {
-                add_pending_msg(i, reply_len, reply_buf);
-                
-                printf("[OK]  Server: Added pending message to user[%lu] that\n"
-                       "              user[%lu] left the room.\n",i,sender_ix
-                      );   
+                receiver_ixs[num_receivers] = i;
+                ++num_receivers;
             }
         }
         
+        /* Signed on a worker, which then adds it to their pending MSGs. */
+        submit_signed_reply( SIGNED_REPLY_PENDING, receiver_ixs, num_receivers
+                            ,reply_buf, reply_len
+                            ,reply_buf, reply_len - SIGNATURE_LEN
+                            ,"left-the-room notice (type 50)"
+                           );
+        
         /* Server bookkeeping - a guest has left the chatroom they were in. */
         /* In this case, simply decrement the number of guests in the room. */
         rooms[clients[sender_ix].room_ix].num_people -= 1;
@@ -370,12 +726,6 @@ void remove_user_from_room(u64 sender_ix){
         
         *((u64*)(reply_buf)) = PACKET_ID_51;
         
-        /* Compute a signature so the clients can authenticate the server. */
-        Signature_GENERATE( M, Q, Gm, reply_buf, reply_len - SIGNATURE_LEN
-                           ,reply_buf + (reply_len - SIGNATURE_LEN)
-                           ,&server_privkey_bigint, PRIVKEY_LEN
-        );
-        
         /* Let the other room guests know that they've been booted: TYPE_51 */
         for(u64 i = 0; i < MAX_CLIENTS; ++i){
             if(  
@@ -383,14 +733,18 @@ void remove_user_from_room(u64 sender_ix){
                && 
                  (clients[i].room_ix == clients[sender_ix].room_ix))
             {
-                printf("[OK]  Server: Adding pending MSG to user[%lu] that\n"
-                       "              they've been booted from the room.\n", i
-                      );   
-
-                add_pending_msg(i, reply_len, reply_buf);
+                receiver_ixs[num_receivers] = i;
+                ++num_receivers;
             }
         }
         
+        /* Signed on a worker, which then adds it to their pending MSGs. */
+        submit_signed_reply( SIGNED_REPLY_PENDING, receiver_ixs, num_receivers
+                            ,reply_buf, reply_len
+                            ,reply_buf, reply_len - SIGNATURE_LEN
+                            ,"booted-from-room notice (type 51)"
+                           );
+        
         /* Reflect in the global chatroom index array that the room is free. */
         rooms_status_bitmask &= ~(1ULL << (63ULL - clients[sender_ix].room_ix));
         
@@ -418,8 +772,6 @@ void remove_user_from_room(u64 sender_ix){
         }
     }
     
-    free(reply_buf);
-    
     return;
 }
 
@@ -439,9 +791,13 @@ u8 authenticate_client( u64 client_ix,  u8* signed_ptr
     
     u64 s_offset = sign_offset;
     u64 e_offset = (sign_offset + sizeof(bigint) + PRIVKEY_LEN);
+    u64 prehash_id;
    
     u8 ret;
     
+    /* Which prehash the sender used. Read it before its slot is overwritten. */
+    prehash_id = Signature_GET_PREHASH_ID(signed_ptr + s_offset);
+
     /* Reconstruct the sender's signature as the two BigInts that make it up. */
     recv_s = (bigint*)(signed_ptr + s_offset);
     recv_e = (bigint*)(signed_ptr + e_offset);    
@@ -478,12 +834,19 @@ u8 authenticate_client( u64 client_ix,  u8* signed_ptr
     /* Verify the sender's cryptographic signature. */
     ret = Signature_VALIDATE(
                      Gm, &(clients[client_ix].client_pubkey_mont)
-                    ,M, Q, recv_s, recv_e, signed_ptr, signed_len
+                    ,M, Q, recv_s, recv_e, signed_ptr, signed_len, prehash_id
     ); 
 
     free(recv_s->bits);
     free(recv_e->bits);
 
+    /* Put the prehash marker back. Some packets, like type_30 text messages,
+     * are forwarded to other clients with the sender's signature still in,
+     * and those clients need to know which prehash the sender used too.
+     */
+    *((u64*)(signed_ptr + s_offset)) = prehash_id;
+    memset(signed_ptr + e_offset, 0, sizeof(u64));
+
     return ret;
 }
 
@@ -492,111 +855,728 @@ u8 authenticate_client( u64 client_ix,  u8* signed_ptr
     Client ----> Server
 
 ================================================================================
-|        PACKET_ID_00         |   Client's short-term public key in the clear  |
-|=============================|================================================|
-|       SMALL_FIELD_LEN       |                    PUBKEY_LEN                  |
+|  PACKET_ID_00   |            Client's short-term public key in clear         |
+|=================|============================================================|
+| SMALL_FIELD_LEN |                        PUBKEY_LEN                          |
+--------------------------------------------------------------------------------
+
+   Or a typed login, for clients whose keys may be of another type:
+
+================================================================================
+|  PACKET_ID_05   |    key type     | Client's short-term public key in clear  |
+|=================|=================|==========================================|
+| SMALL_FIELD_LEN | SMALL_FIELD_LEN |    public key length of the key type     |
 --------------------------------------------------------------------------------
 
+   The key type says which public-key backend of cryptolib the client wants
+   the login and session to use (PK_TYPE_FFDH3072, PK_TYPE_CURVE25519). We
+   only do logins over the 3072-bit group for now, and refuse any other type.
+   A packet 00 always means the 3072-bit group, as it always has. pubkey_offset
+   says where the public key starts in whichever one we got.
 */
-void process_msg_00(u8* msg_buf, u64 sock_ix){
+/* Session-MAC mode for post-login control traffic.
+ *
+ * Once logged in, a client can authenticate its poll (40), leave room (50)
+ * and log off (60) packets with a keyed BLAKE2b tag instead of a signature:
+ *
+================================================================================
+| packet ID 40, 50 or 60 |  user_ix  |  counter  |          MAC tag           |
+|========================|===========|===========|============================|
+|       SMALL_LEN        | SMALL_LEN | SMALL_LEN |      SESSION_MAC_LEN       |
+--------------------------------------------------------------------------------
+ *
+ * The client picks the mode per packet, we tell which one it used by the
+ * packet's size, and reply to a MAC'd poll with MAC'd 40 and 41 replies too,
+ * the counter and tag taking the place of the signature at the end of them.
+ *
+ * The tag is over everything before it, counter included. There's one key
+ * per direction, derived at login from the long-term session key of that
+ * direction (KAB client to server, KBA server to client) and this login's
+ * one-time keys KAB_s || KBA_s, so no two sessions ever share a MAC key:
+ *
+ *   K_mac = BLAKE2B{32}(key = KAB or KBA, KAB_s || KBA_s || direction byte)
+ *
+ * Each direction has its own counter, starting at 1. Whoever receives only
+ * accepts counters above the last one it accepted, so nothing can be replayed.
+ * Signatures are still used for the login and for everything else.
+ *
+ * It's only on if both sides agreed to it at login. The client asks for it
+ * with LOGIN_WANT_SESSION_MACS in the flags of its 01 packet, and we say yes
+ * by echoing the flag back in our signed Login-OK, see process_msg_01().
+ * Clients that don't ask, or don't send flags at all, only ever sign. A
+ * resumed session always has it on - a client that knows how to resume knows
+ * how to do session MACs, and the resumption itself is MAC'd anyway.
+ */
+#define SESSION_MAC_DIR_C2S 0x01
+#define SESSION_MAC_DIR_S2C 0x02
 
-    bigint  zero;
-    bigint  Am; 
-    bigint* A_s;
-    bigint  b_s;
-    bigint* B_s = NULL;
-    bigint  X_s;
-            
-    u64  tempbuf_byte_offset = 0;
-    u64  replybuf_byte_offset = 0;
-        
-    u64 PACKET_ID02 = PACKET_ID_02;
-    u64 reply_len = SMALL_FIELD_LEN + PUBKEY_LEN + SIGNATURE_LEN;
+/* Counter and tag, what replaces SIGNATURE_LEN in a MAC'd packet. */
+#define SESSION_MAC_AUTH_LEN (SMALL_FIELD_LEN + SESSION_MAC_LEN)
 
-    u8* reply_buf = calloc(1, reply_len);
-    u8  signature_buf[SIGNATURE_LEN]; 
-    u8* PACKET_ID02_addr = (u8*)(&PACKET_ID02);
-    u8* Y_s;
+/* Point KAB and KBA at the long-term session keys in a client's shared
+ * secret. Same choice of KAB and KBA as in process_msg_10().
+ */
+void pick_session_keys( bigint* client_pubkey, u8* shared_secret_bits
+                       ,u8** KAB, u8** KBA
+                      )
+{
+    if(bigint_compare2(client_pubkey, server_pubkey_bigint) == 3){
+        *KBA = shared_secret_bits;
+        *KAB = shared_secret_bits + SESSION_KEY_LEN;
+    }
+    else{
+        *KAB = shared_secret_bits;
+        *KBA = shared_secret_bits + SESSION_KEY_LEN;
+    }
 
-    memset(signature_buf, 0, SIGNATURE_LEN);
+    return;
+}
 
-    /* If the login handshake memory region is locked, that means another
-     * client is currently in the process of logging in, and only one login
-     * is allowed at a time, so reject this login attempt now.
-     */
-    if(temp_handshake_memory_region_isLocked != 0){
-        printf(
-            "[OK] Server: Caught a login attempt in the middle of another!\n"
-            "             Rejecting this login attempt with packet_02.\n\n"
-        );
+/* Derive this session's pair of MAC keys for the client in slot client_ix,
+ * whose long-term shared secret is already in place. one_time_keys are the
+ * 2 * SESSION_KEY_LEN bytes only this session has - KAB_s || KBA_s of a
+ * login, or both sides' nonces of a resumption, see process_msg_03().
+ */
+void init_session_macs(u64 client_ix, u8* one_time_keys){
 
-        /* Construct the ROSETTA FULL reply message buffer */
-        reply_len = SMALL_FIELD_LEN + SIGNATURE_LEN;
-        free(reply_buf);
-        reply_buf = calloc(1, reply_len);
-    
-        *((u64*)(reply_buf)) = PACKET_ID_02;
-        
-        Signature_GENERATE( M, Q, Gm, PACKET_ID02_addr, SMALL_FIELD_LEN 
-                            ,reply_buf + SMALL_FIELD_LEN
-                           ,&server_privkey_bigint, PRIVKEY_LEN
-                          );
-                          
-/* A client tried logging in but should try later.
- 
-    Server ----> Client
-  
-================================================================================
-| packet ID 02 |                         SIGNATURE                             | 
-|==============|===============================================================|
-|  SMALL_LEN   |                          SIG_LEN                              |
---------------------------------------------------------------------------------
+    u8  mac_key[SESSION_MAC_LEN];
+    u8  kdf_input[(2 * SESSION_KEY_LEN) + 1];
+    u8* KAB;
+    u8* KBA;
 
-*/
-        
-        if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
-            printf("[ERR] Server: Couldn't send try-login-later message.\n");
-        }
-        else{
-            printf("[OK]  Server: Told client to try login later.\n");
-        }
+    pick_session_keys( &(clients[client_ix].client_pubkey)
+                      ,clients[client_ix].shared_secret.bits
+                      ,&KAB, &KBA
+                     );
 
-        free(reply_buf);
+    memcpy(kdf_input, one_time_keys, 2 * SESSION_KEY_LEN);
 
-        return;
-    } 
+    kdf_input[2 * SESSION_KEY_LEN] = SESSION_MAC_DIR_C2S;
 
-    /* Construct a bigint out of the client's short-term public key.          */
-    /* Here's where a constructor from a memory buffer and its length is good */
-    /* Find time to implement one as part of the BigInt library.              */
-    
-    /* Allocate any short-term keys and other cryptographic artifacts needed for
-     * the initial login handshake protocol in the designated memory region and
-     * lock it, disallowing another parallel login attempt to corrupt them.
-     */
-    temp_handshake_memory_region_isLocked = 1;
+    BLAKE2B_KEYED( KAB, SESSION_KEY_LEN, kdf_input, sizeof(kdf_input)
+                  ,SESSION_MAC_LEN, mac_key
+                 );
 
-    time_curr_login_initiated = clock();
+    BLAKE2B_MAC_INIT( &(clients[client_ix].mac_recv_ctx)
+                     ,mac_key, SESSION_MAC_LEN, SESSION_MAC_LEN
+                    );
 
-    bigint_create(&X_s, MAX_BIGINT_SIZ, 0);
-    
-    A_s = (bigint*)(temp_handshake_buf);
-    A_s->bits = calloc(1, MAX_BIGINT_SIZ);
+    kdf_input[2 * SESSION_KEY_LEN] = SESSION_MAC_DIR_S2C;
 
-    memcpy(A_s->bits, msg_buf + SMALL_FIELD_LEN, PUBKEY_LEN);
+    BLAKE2B_KEYED( KBA, SESSION_KEY_LEN, kdf_input, sizeof(kdf_input)
+                  ,SESSION_MAC_LEN, mac_key
+                 );
 
-    A_s->size_bits = MAX_BIGINT_SIZ;
-    
-    A_s->used_bits = get_used_bits(msg_buf + SMALL_FIELD_LEN, PUBKEY_LEN);
-                     
-    A_s->free_bits = A_s->size_bits - A_s->used_bits;
-    
+    BLAKE2B_MAC_INIT( &(clients[client_ix].mac_send_ctx)
+                     ,mac_key, SESSION_MAC_LEN, SESSION_MAC_LEN
+                    );
+
+    clients[client_ix].mac_recv_counter = 0;
+    clients[client_ix].mac_send_counter = 0;
+
+    explicit_bzero(mac_key,   SESSION_MAC_LEN);
+    explicit_bzero(kdf_input, sizeof(kdf_input));
+
+    return;
+}
+
+/* Check the session MAC of a client's packet whose counter is at
+ * counter_offset, with the tag right after it.
+ *
+ * Returns 1 if the tag is right and the counter is a new one, 0 otherwise.
+ */
+u8 authenticate_client_mac(u64 client_ix, u8* msg_buf, u64 counter_offset){
+
+    u64 counter;
+
+    if(   client_ix >= MAX_CLIENTS
+       || !(users_status_bitmask & (1ULL << (63ULL - client_ix)))
+      )
+    {
+        printf("[ERR] Server: Session MAC from a user slot not in use.\n\n");
+        return 0;
+    }
+
+    if(!clients[client_ix].macs_agreed){
+        printf("[ERR] Server: Session MAC from a client that didn't ask for "
+               "them at login.\n\n"
+              );
+        return 0;
+    }
+
+    if(BLAKE2B_MAC_VERIFY( &(clients[client_ix].mac_recv_ctx)
+                          ,msg_buf, counter_offset + SMALL_FIELD_LEN
+                          ,msg_buf + counter_offset + SMALL_FIELD_LEN
+                         ) != 1
+      )
+    {
+        printf("[ERR] Server: Session MAC tag doesn't match.\n\n");
+        return 0;
+    }
+
+    counter = *((u64*)(msg_buf + counter_offset));
+
+    if(counter <= clients[client_ix].mac_recv_counter){
+        printf("[ERR] Server: Replayed session MAC counter %lu.\n\n", counter);
+        return 0;
+    }
+
+    clients[client_ix].mac_recv_counter = counter;
+
+    return 1;
+}
+
+/* Put our next counter for this client at counter_offset in buf, and the tag
+ * over everything up to and including it right after it.
+ */
+void session_mac_seal(u64 client_ix, u8* buf, u64 counter_offset){
+
+    ++(clients[client_ix].mac_send_counter);
+
+    *((u64*)(buf + counter_offset)) = clients[client_ix].mac_send_counter;
+
+    BLAKE2B_MAC( &(clients[client_ix].mac_send_ctx)
+                ,buf, counter_offset + SMALL_FIELD_LEN
+                ,buf + counter_offset + SMALL_FIELD_LEN
+               );
+
+    return;
+}
+
+/* Seal the session of the client in slot client_ix into a ticket, which has
+ * to have RESUME_TICKET_LEN bytes. Returns 1 if it was made, 0 if not.
+ */
+u8 issue_resume_ticket(u64 client_ix, u64 expiry, u8* ticket){
+
+    u8  body[RESUME_TICKET_BODY_LEN];
+    u64 body_offset = 0;
+
+    memcpy(body, &expiry, SMALL_FIELD_LEN);
+    body_offset += SMALL_FIELD_LEN;
+
+    memcpy( body + body_offset
+           ,clients[client_ix].client_pubkey.bits
+           ,PUBKEY_LEN
+          );
+    body_offset += PUBKEY_LEN;
+
+    memcpy( body + body_offset
+           ,clients[client_ix].client_pubkey_mont.bits
+           ,PUBKEY_LEN
+          );
+    body_offset += PUBKEY_LEN;
+
+    memcpy( body + body_offset
+           ,clients[client_ix].shared_secret.bits
+           ,RESUME_TICKET_SECRET_LEN
+          );
+
+    if(!CSPRNG_GET_BYTES(ticket, SHORT_NONCE_LEN)){
+        printf("[ERR] Server: Couldn't draw a resumption ticket nonce.\n");
+        explicit_bzero(body, RESUME_TICKET_BODY_LEN);
+        return 0;
+    }
+
+    CHACHA20( body                                  /* text - session state */
+             ,RESUME_TICKET_BODY_LEN                /* text_len in bytes    */
+             ,(u32*)(ticket)                        /* Nonce                */
+             ,(u32)(SHORT_NONCE_LEN / sizeof(u32))  /* nonce_len in u32's   */
+             ,(u32*)(ticket_enc_key)                /* chacha Key           */
+             ,(u32)(SESSION_KEY_LEN / sizeof(u32))  /* Key_len in u32's     */
+             ,ticket + SHORT_NONCE_LEN              /* output target buffer */
+            );
+
+    BLAKE2B_MAC( &ticket_mac_ctx
+                ,ticket, SHORT_NONCE_LEN + RESUME_TICKET_BODY_LEN
+                ,ticket + SHORT_NONCE_LEN + RESUME_TICKET_BODY_LEN
+               );
+
+    explicit_bzero(body, RESUME_TICKET_BODY_LEN);
+
+    return 1;
+}
+
+/* Check a ticket is one of ours and not expired, then decrypt it into body.
+ * Returns 1 if it's good, 0 if not.
+ */
+u8 open_resume_ticket(u8* ticket, u8* body){
+
+    u64 expiry;
+
+    if(BLAKE2B_MAC_VERIFY( &ticket_mac_ctx
+                          ,ticket, SHORT_NONCE_LEN + RESUME_TICKET_BODY_LEN
+                          ,ticket + SHORT_NONCE_LEN + RESUME_TICKET_BODY_LEN
+                         ) != 1
+      )
+    {
+        printf("[ERR] Server: Resumption ticket isn't one of ours.\n");
+        return 0;
+    }
+
+    CHACHA20( ticket + SHORT_NONCE_LEN
+             ,RESUME_TICKET_BODY_LEN
+             ,(u32*)(ticket)
+             ,(u32)(SHORT_NONCE_LEN / sizeof(u32))
+             ,(u32*)(ticket_enc_key)
+             ,(u32)(SESSION_KEY_LEN / sizeof(u32))
+             ,body
+            );
+
+    memcpy(&expiry, body, SMALL_FIELD_LEN);
+
+    if(expiry <= (u64)time(NULL)){
+        printf("[ERR] Server: Resumption ticket has expired.\n");
+        explicit_bzero(body, RESUME_TICKET_BODY_LEN);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Remember a redeemed ticket's tag. Returns 0 if it was already redeemed, or
+ * too many were lately to remember one more, 1 if it's fine to go ahead.
+ */
+u8 redeem_resume_ticket(u8* tag, u64 now){
+
+    u64 free_slot = RESUME_REPLAY_SLOTS;
+
+    for(u64 i = 0; i < RESUME_REPLAY_SLOTS; ++i){
+
+        /* Requests that old get turned away by their timestamp anyway. */
+        if(redeemed_tickets[i].when + (2 * RESUME_MAX_SKEW) < now){
+            if(free_slot == RESUME_REPLAY_SLOTS){
+                free_slot = i;
+            }
+            continue;
+        }
+
+        if(memcmp(redeemed_tickets[i].tag, tag, SESSION_MAC_LEN) == 0){
+            printf("[ERR] Server: Resumption ticket was already redeemed.\n");
+            return 0;
+        }
+    }
+
+    if(free_slot == RESUME_REPLAY_SLOTS){
+        printf("[ERR] Server: Too many resumptions lately to take another.\n");
+        return 0;
+    }
+
+    memcpy(redeemed_tickets[free_slot].tag, tag, SESSION_MAC_LEN);
+    redeemed_tickets[free_slot].when = now;
+
+    return 1;
+}
+
+/* Tell a client their resumption didn't work out, so they do a full login.
+ 
+    Server ----> Client
+  
+================================================================================
+| packet ID 04 |                         SIGNATURE                             |
+|==============|===============================================================|
+|  SMALL_LEN   |                          SIG_LEN                              |
+--------------------------------------------------------------------------------
+
+*/
+void refuse_resumption(u64 sock_ix){
+
+    u64 PACKET_ID04 = PACKET_ID_04;
+    u8  reply_buf[SMALL_FIELD_LEN + SIGNATURE_LEN];
+
+    ++resumes_refused;
+
+    *((u64*)(reply_buf)) = PACKET_ID_04;
+
+    Signature_GENERATE_CACHED( M, Q, Gm, (u8*)(&PACKET_ID04), SMALL_FIELD_LEN
+                              ,reply_buf + SMALL_FIELD_LEN
+                              ,&server_privkey_bigint, PRIVKEY_LEN
+                             );
+
+    if(send(client_socket_fd[sock_ix], reply_buf, sizeof(reply_buf), 0) == -1){
+        printf("[ERR] Server: Couldn't send resumption-refused message.\n");
+    }
+    else{
+        printf("[OK]  Server: Told client to do a full login instead.\n");
+    }
+
+    return;
+}
+
+/* They're in the protocol's order of things, after the packet dispatcher. */
+void release_user_slot(u64 removing_user_ix);
+void release_socket(u64 sock_ix);
+
+/* A client who had a session with us reconnected and wants it back.
+ 
+    Client ----> Server
+ 
+================================================================================
+| packet ID 03 | timestamp | Client nonce | Resumption ticket |   Ticket MAC   |
+|==============|===========|==============|===================|================|
+|  SMALL_LEN   | SMALL_LEN |   NONCE_LEN  |    TICKET_LEN     | SESSION_MAC_LEN|
+--------------------------------------------------------------------------------
+
+ * The MAC is a keyed BLAKE2b over everything before it, with KAB from inside
+ * the ticket as the key. Only whoever logged in and got the ticket knows it.
+ * The timestamp and the replay ring make sure it can't be played again.
+ */
+void process_msg_03(u8* msg_buf, u64 sock_ix){
+
+    u64 timestamp;
+    u64 expiry;
+    u64 now = (u64)time(NULL);
+    u64 ticket_offset = (2 * SMALL_FIELD_LEN) + RESUME_NONCE_LEN;
+    u64 tag_offset    = ticket_offset + RESUME_TICKET_LEN;
+    u64 reply_len     =   (2 * SMALL_FIELD_LEN) + (2 * RESUME_NONCE_LEN)
+                        + RESUME_TICKET_LEN + SESSION_MAC_LEN;
+    u64 ix;
+    u64 old_sock_ix;
+    u64 reply_offset;
+
+    u8  body[RESUME_TICKET_BODY_LEN];
+    u8  one_time_keys[2 * RESUME_NONCE_LEN];
+    u8* pubkey_bits      = body + SMALL_FIELD_LEN;
+    u8* pubkey_mont_bits = pubkey_bits + PUBKEY_LEN;
+    u8* secret_bits      = pubkey_mont_bits + PUBKEY_LEN;
+    u8* KAB;
+    u8* KBA;
+    u8* reply_buf = NULL;
+
+    bigint pubkey_view;
+
+    struct BLAKE2B_MAC_ctx mac_ctx;
+
+    memset(&mac_ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
+
+    if(!open_resume_ticket(msg_buf + ticket_offset, body)){
+        refuse_resumption(sock_ix);
+        return;
+    }
+
+    memcpy(&expiry, body, SMALL_FIELD_LEN);
+
+    /* Just enough of a BigInt for pick_session_keys() to compare with ours. */
+    pubkey_view.bits      = pubkey_bits;
+    pubkey_view.size_bits = PUBKEY_LEN * 8;
+    pubkey_view.used_bits = get_used_bits(pubkey_bits, PUBKEY_LEN);
+    pubkey_view.free_bits = pubkey_view.size_bits - pubkey_view.used_bits;
+
+    pick_session_keys(&pubkey_view, secret_bits, &KAB, &KBA);
+
+    BLAKE2B_MAC_INIT(&mac_ctx, KAB, SESSION_KEY_LEN, SESSION_MAC_LEN);
+
+    if(BLAKE2B_MAC_VERIFY(&mac_ctx, msg_buf, tag_offset, msg_buf + tag_offset)
+       != 1
+      )
+    {
+        printf("[ERR] Server: Resumption request MAC doesn't match.\n");
+        goto label_refuse;
+    }
+
+    memcpy(&timestamp, msg_buf + SMALL_FIELD_LEN, SMALL_FIELD_LEN);
+
+    if(   timestamp + RESUME_MAX_SKEW < now
+       || timestamp > now + RESUME_MAX_SKEW
+      )
+    {
+        printf("[ERR] Server: Resumption request timestamp is off.\n");
+        goto label_refuse;
+    }
+
+    if(!redeem_resume_ticket( msg_buf + ticket_offset + SHORT_NONCE_LEN
+                                      + RESUME_TICKET_BODY_LEN
+                             ,now
+                            )
+      )
+    {
+        goto label_refuse;
+    }
+
+    /* Whoever had this session must have lost their connection, or they
+     * wouldn't be resuming it. Drop what's left of it, if we haven't yet.
+     *
+     * We're on the thread of the connection they resume it on. Their old one
+     * has its own thread, which we stop along with its socket - unless they
+     * resumed on the very same connection, then it's ours and stays as it is.
+     */
+    for(u64 i = 0; i < MAX_CLIENTS; ++i){
+        if(   (users_status_bitmask & (1ULL << (63ULL - i)))
+           && (memcmp(pubkey_bits, clients[i].client_pubkey.bits, PUBKEY_LEN)
+               == 0
+              )
+          )
+        {
+            old_sock_ix = clients[i].sock_ix;
+
+            printf("[OK]  Server: Dropping user[%lu]'s old session.\n", i);
+
+            release_user_slot(i);
+
+            if(old_sock_ix != sock_ix){
+                release_socket(old_sock_ix);
+            }
+        }
+    }
+
+    if(next_free_user_ix == MAX_CLIENTS){
+        printf("[ERR] Server: Not enough client slots to resume a session.\n");
+        goto label_refuse;
+    }
+
+    ix = next_free_user_ix;
+
+    init_user_slot(ix);
+
+    bigint_create(&(clients[ix].client_pubkey), MAX_BIGINT_SIZ, 0);
+    memcpy(clients[ix].client_pubkey.bits, pubkey_bits, PUBKEY_LEN);
+    clients[ix].client_pubkey.used_bits = pubkey_view.used_bits;
+    clients[ix].client_pubkey.free_bits = 
+                                   MAX_BIGINT_SIZ - pubkey_view.used_bits;
+
+    bigint_create(&(clients[ix].client_pubkey_mont), MAX_BIGINT_SIZ, 0);
+    memcpy(clients[ix].client_pubkey_mont.bits, pubkey_mont_bits, PUBKEY_LEN);
+    clients[ix].client_pubkey_mont.used_bits = 
+                                   get_used_bits(pubkey_mont_bits, PUBKEY_LEN);
+    clients[ix].client_pubkey_mont.free_bits = 
+                     MAX_BIGINT_SIZ - clients[ix].client_pubkey_mont.used_bits;
+
+    /* Only the start of the shared secret is ever used, and it's all we kept.
+     * The rest of it stays 0, it's never looked at.
+     */
+    bigint_create(&(clients[ix].shared_secret), MAX_BIGINT_SIZ, 0);
+    memcpy( clients[ix].shared_secret.bits
+           ,secret_bits
+           ,RESUME_TICKET_SECRET_LEN
+          );
+    clients[ix].shared_secret.used_bits = 
+                     get_used_bits(secret_bits, RESUME_TICKET_SECRET_LEN);
+    clients[ix].shared_secret.free_bits = 
+                     MAX_BIGINT_SIZ - clients[ix].shared_secret.used_bits;
+
+/* Their session is back. Let them know their new user_ix.
+ 
+    Server ----> Client
+  
+================================================================================
+| ID 03 | user_ix | Client nonce | Server nonce | New ticket |       MAC       |
+|=======|=========|==============|==============|============|=================|
+| SMALL |  SMALL  |  NONCE_LEN   |  NONCE_LEN   | TICKET_LEN | SESSION_MAC_LEN |
+--------------------------------------------------------------------------------
+
+ * The MAC is over everything before it, keyed with KBA. Both nonces are this
+ * session's one-time keys for its MAC keys, see init_session_macs().
+ */
+    reply_buf = calloc(1, reply_len);
+
+    *((u64*)(reply_buf)) = PACKET_ID_03;
+    reply_offset = SMALL_FIELD_LEN;
+
+    memcpy(reply_buf + reply_offset, &ix, SMALL_FIELD_LEN);
+    reply_offset += SMALL_FIELD_LEN;
+
+    memcpy( reply_buf + reply_offset
+           ,msg_buf + (2 * SMALL_FIELD_LEN)
+           ,RESUME_NONCE_LEN
+          );
+    reply_offset += RESUME_NONCE_LEN;
+
+    if(!CSPRNG_GET_BYTES(reply_buf + reply_offset, RESUME_NONCE_LEN)){
+        printf("[ERR] Server: Couldn't draw a resumption server nonce.\n");
+        goto label_undo_slot;
+    }
+    reply_offset += RESUME_NONCE_LEN;
+
+    memcpy(one_time_keys, msg_buf + (2 * SMALL_FIELD_LEN), RESUME_NONCE_LEN);
+    memcpy( one_time_keys + RESUME_NONCE_LEN
+           ,reply_buf + reply_offset - RESUME_NONCE_LEN
+           ,RESUME_NONCE_LEN
+          );
+
+    if(!issue_resume_ticket(ix, expiry, reply_buf + reply_offset)){
+        goto label_undo_slot;
+    }
+    reply_offset += RESUME_TICKET_LEN;
+
+    BLAKE2B_KEYED( KBA, SESSION_KEY_LEN, reply_buf, reply_offset
+                  ,SESSION_MAC_LEN, reply_buf + reply_offset
+                 );
+
+    init_session_macs(ix, one_time_keys);
+
+    clients[ix].macs_agreed = 1;
+    clients[ix].sock_ix     = sock_ix;
+
+    claim_user_slot(ix);
+
+    ++resumes_accepted;
+
+    if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
+        printf("[ERR] Server: Couldn't send Resumption-OK message.\n");
+    }
+    else{
+        printf("[OK]  Server: Resumed user[%lu]'s session, no DH needed.\n"
+               ,ix
+              );
+    }
+
+    goto label_cleanup;
+
+label_undo_slot:
+
+    for(size_t i = 0; i < MAX_PEND_MSGS; ++i){
+        free(clients[ix].pending_msgs[i]);
+    }
+
+    free(clients[ix].client_pubkey.bits);
+    free(clients[ix].client_pubkey_mont.bits);
+    free(clients[ix].shared_secret.bits);
+
+    memset(&(clients[ix]), 0, sizeof(struct connected_client));
+
+label_refuse:
+
+    refuse_resumption(sock_ix);
+
+label_cleanup:
+
+    explicit_bzero(body, RESUME_TICKET_BODY_LEN);
+    explicit_bzero(one_time_keys, sizeof(one_time_keys));
+    explicit_bzero(&mac_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+
+    free(reply_buf);
+
+    return;
+}
+
+/* Clear and unlock the login handshake memory region, freeing the bits of
+ * the three BigInts at its start: the client's short-term public key and our
+ * short-term key pair. Whichever of them a login got to.
+ */
+void release_handshake_region(void){
+
+    bigint* temp_ptr;
+
+    for(u64 i = 0; i < 3; ++i){
+        temp_ptr = (bigint*)(temp_handshake_buf + (i * sizeof(bigint)));
+        free(temp_ptr->bits);
+    }
+
+    explicit_bzero(temp_handshake_buf, TEMP_BUF_SIZ);
+
+    temp_handshake_memory_region_isLocked = 0;
+
+    printf("[OK]  Server: Handshake memory region has been released!\n\n");
+
+    return;
+}
+
+/* A client tried logging in but should try later.
+ 
+    Server ----> Client
+  
+================================================================================
+| packet ID 02 |                         SIGNATURE                             | 
+|==============|===============================================================|
+|  SMALL_LEN   |                          SIG_LEN                              |
+--------------------------------------------------------------------------------
+
+*/
+void send_try_login_later(u64 sock_ix){
+
+    u64 PACKET_ID02 = PACKET_ID_02;
+    u64 reply_len = SMALL_FIELD_LEN + SIGNATURE_LEN;
+
+    u8* reply_buf = calloc(1, reply_len);
+
+    *((u64*)(reply_buf)) = PACKET_ID_02;
+    
+    Signature_GENERATE_CACHED( M, Q, Gm, (u8*)(&PACKET_ID02), SMALL_FIELD_LEN
+                              ,reply_buf + SMALL_FIELD_LEN
+                              ,&server_privkey_bigint, PRIVKEY_LEN
+                             );
+
+    if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
+        printf("[ERR] Server: Couldn't send try-login-later message.\n");
+    }
+    else{
+        printf("[OK]  Server: Told client to try login later.\n");
+    }
+
+    free(reply_buf);
+
+    return;
+}
+
+void process_msg_00(u8* msg_buf, u64 sock_ix, u64 pubkey_offset){
+
+    bigint  zero;
+    bigint  Am; 
+    bigint* A_s;
+    bigint  b_s;
+    bigint* B_s = NULL;
+    bigint  X_s;
+            
+    u64  tempbuf_byte_offset = 0;
+    u64  replybuf_byte_offset = 0;
+        
+    u64 reply_len = SMALL_FIELD_LEN + PUBKEY_LEN + SIGNATURE_LEN;
+
+    /* Room past the reply for a copy of Y_s, for the signing worker to sign
+     * after temp_handshake_buf might have been reused by the next login.
+     */
+    u8* reply_buf = calloc(1, reply_len + INIT_AUTH_LEN);
+    u8* Y_s;
+
+    /* If the login handshake memory region is locked, that means another
+     * client is currently in the process of logging in, and only one login
+     * is allowed at a time, so reject this login attempt now.
+     */
+    if(temp_handshake_memory_region_isLocked != 0){
+        printf(
+            "[OK] Server: Caught a login attempt in the middle of another!\n"
+            "             Rejecting this login attempt with packet_02.\n\n"
+        );
+
+        send_try_login_later(sock_ix);
+
+        free(reply_buf);
+
+        return;
+    } 
+
+    /* Construct a bigint out of the client's short-term public key.          */
+    /* Here's where a constructor from a memory buffer and its length is good */
+    /* Find time to implement one as part of the BigInt library.              */
+    
+    /* Allocate any short-term keys and other cryptographic artifacts needed for
+     * the initial login handshake protocol in the designated memory region and
+     * lock it, disallowing another parallel login attempt to corrupt them.
+     */
+    temp_handshake_memory_region_isLocked = 1;
+
+    time_curr_login_initiated = time(NULL);
+
+    bigint_create(&X_s, MAX_BIGINT_SIZ, 0);
+    
+    A_s = (bigint*)(temp_handshake_buf);
+    A_s->bits = calloc(1, MAX_BIGINT_SIZ);
+
+    memcpy(A_s->bits, msg_buf + pubkey_offset, PUBKEY_LEN);
+
+    A_s->size_bits = MAX_BIGINT_SIZ;
+    
+    A_s->used_bits = get_used_bits(msg_buf + pubkey_offset, PUBKEY_LEN);
+                     
+    A_s->free_bits = A_s->size_bits - A_s->used_bits;
+    
     printf("[DEBUG] Server: Copied over client's short-term pubkey's bits:\n");
     printf("                (Before Get_Mong_Form) Its info and ALL bits:\n\n");
     bigint_print_info(A_s);
     bigint_print_all_bits(A_s);
 
-    /* Check that (0 < A_s < M) and that (A_s^(M/Q) mod M = 1) */
+    /* Check that (0 < A_s < M) and that (A_s^Q mod M = 1), so it's in the
+     * subgroup of order Q. check_pubkey_form() also turns away 1 and M-1.
+     */
     
     /* A "check non zero" function in the BigInt library would also be useful */
     
@@ -608,14 +1588,16 @@ void process_msg_00(u8* msg_buf, u64 sock_ix){
     if(   ((bigint_compare2(&zero, A_s)) != 3) 
         || 
           ((bigint_compare2(M, A_s)) != 1)
-        //||
-        //  (check_pubkey_form(&Am, M, Q) == 0) 
+        ||
+          (check_pubkey_form(&Am, M, Q) == 0)
       )
     {
         printf("[ERR] Server: Client's short-term public key is invalid.\n");
         printf("              Its info and ALL bits:\n\n");
         bigint_print_info(A_s);
         bigint_print_all_bits(A_s);
+        release_handshake_region();
+        send_try_login_later(sock_ix);
         goto label_cleanup;
     } 
     
@@ -639,23 +1621,31 @@ void process_msg_00(u8* msg_buf, u64 sock_ix){
      *  cryptographic artifacts in the memory region in total.
      */
 
-    /* Places only the BITS of the private key, not a BigInt object!! */
-    gen_priv_key(PRIVKEY_LEN, (temp_handshake_buf + sizeof(bigint)));
-   
+    /* The (b_s, B_s) pair comes ready-made out of the DH ephemeral key pool,
+     * so of the two exponentiations, only X_s is left to do in here. If the
+     * pool ran dry, the pair gets computed right here, like it used to.
+     */
     b_s.bits = (u8*)calloc(1, MAX_BIGINT_SIZ);
-    memcpy(b_s.bits, temp_handshake_buf + sizeof(bigint), PRIVKEY_LEN);
 
     b_s.size_bits = MAX_BIGINT_SIZ;
-    b_s.used_bits = get_used_bits(b_s.bits, PRIVKEY_LEN);
-    b_s.free_bits = b_s.size_bits - b_s.used_bits;
-    
-    memset(temp_handshake_buf + sizeof(bigint), 0,    PRIVKEY_LEN);
-    memcpy(temp_handshake_buf + sizeof(bigint), &b_s, sizeof(bigint));
+    b_s.used_bits = 0;
+    b_s.free_bits = MAX_BIGINT_SIZ;
 
-    /* Interface generating a pub_key needs priv_key in a file. TODO: change! */
-    save_BIGINT_to_DAT("temp_privkey.dat", &b_s);
-  
-    B_s = gen_pub_key(PRIVKEY_LEN, "temp_privkey.dat", MAX_BIGINT_SIZ);
+    B_s = (bigint*)calloc(1, sizeof(bigint));
+
+    bigint_create(B_s, MAX_BIGINT_SIZ, 0);
+
+    if(!DH_EPHEMERAL_KEYPAIR(M, Q, Gm, &b_s, B_s)){
+        printf("[ERR] Server: Couldn't get a short-term DH key pair.\n");
+        free(b_s.bits);
+        free(B_s->bits);
+        release_handshake_region();
+        send_try_login_later(sock_ix);
+        goto label_cleanup;
+    }
+
+    /* Place the server short-term priv_key in the locked memory region. */
+    memcpy(temp_handshake_buf + sizeof(bigint), &b_s, sizeof(bigint));
     
     /* Place the server short-term pub_key also in the locked memory region. */
     memcpy((temp_handshake_buf + (2 * sizeof(bigint))), B_s, sizeof(bigint));
@@ -711,15 +1701,6 @@ void process_msg_00(u8* msg_buf, u64 sock_ix){
     }
     printf("\n\n");
 
-    printf("[DEBUG] Server: Calling Signature_GENERATE now.\n\n");
-
-    /* Compute a signature of Y_s using LONG-TERM private key b, yielding SB. */
-    Signature_GENERATE( M, Q, Gm, Y_s, INIT_AUTH_LEN, signature_buf
-                       ,&server_privkey_bigint, PRIVKEY_LEN
-                      );
-
-
-
     /* Server sends in the clear (B_s, SB) to the client. */
     
     /* Find time to change the signature generation to only place the actual
@@ -749,17 +1730,19 @@ void process_msg_00(u8* msg_buf, u64 sock_ix){
 
     memcpy(reply_buf + replybuf_byte_offset, B_s->bits, PUBKEY_LEN);
     
-    replybuf_byte_offset += PUBKEY_LEN;
+    memcpy(reply_buf + reply_len, Y_s, INIT_AUTH_LEN);
 
-    memcpy(reply_buf + replybuf_byte_offset, signature_buf, SIGNATURE_LEN);
-    
-    /* Send the reply back to the client. */
-    if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
-        printf("[ERR] Server: Couldn't reply with PACKET_ID_00 msg.\n");
-    }
-    else{
-        printf("[OK]  Server: Replied to client with PACKET_ID_00 msg.\n");
-    }
+    /* The signature of Y_s using LONG-TERM private key b, yielding SB, gets
+     * computed on a signing worker, which then sends the reply to the client.
+     */
+    submit_signed_reply( SIGNED_REPLY_SEND, &sock_ix, 1
+                        ,reply_buf, reply_len
+                        ,reply_buf + reply_len, INIT_AUTH_LEN
+                        ,"PACKET_ID_00 reply"
+                       );
+
+    /* The signing worker frees it now. */
+    reply_buf = NULL;
       
 label_cleanup: 
 
@@ -772,8 +1755,6 @@ label_cleanup:
         free(B_s);
     }
 
-    system("rm temp_privkey.dat");
-  
     return;
 }
 /* A user who's logging in continued the login protocol, sending us their long
@@ -782,228 +1763,68 @@ label_cleanup:
     Client ----> Server
  
 ================================================================================
-|  packet ID 01   | Client's encrypted long-term PubKey |  HMAC authenticator  |
+|  packet ID 01   | Client's encrypted long-term PubKey |  MAC authenticator   |
 |=================|=====================================|======================|
 | SMALL_FIELD_LEN |             PUBKEY_LEN              |   HMAC_TRUNC_BYTES   |
 --------------------------------------------------------------------------------
 
+ * Newer clients put a SMALL_FIELD_LEN flags field after the MAC (has_flags).
+ * If it has RESUME_WANT_TICKET set, they get a session resumption ticket with
+ * the Login-OK reply, so the next time their connection drops they don't have
+ * to do all of this again - see process_msg_03(). If it has
+ * LOGIN_WANT_SESSION_MACS set, the session is in session-MAC mode, see
+ * authenticate_client_mac(). We echo back the flags we said yes to.
 */
-void process_msg_01(u8* msg_buf, u64 sock_ix){
+void process_msg_01(u8* msg_buf, u64 sock_ix, u8 has_flags, u64 login_flags){
 
     u64 handshake_buf_key_offset;
     u64 handshake_buf_nonce_offset;
-    const u64 B = 64;
-    const u64 L = 64;
     u64 PACKET_ID02 = PACKET_ID_02;
     u64 PACKET_ID01 = PACKET_ID_01; 
     u64 recv_HMAC_offset = SMALL_FIELD_LEN + PUBKEY_LEN;
     u64 reply_len;
+    u64 ix_offset;
+    u64 flags_agreed = login_flags & LOGIN_FLAGS_KNOWN;
     
     u8* PACKET_ID02_addr = (u8*)(&PACKET_ID02);
     u8* PACKET_ID01_addr = (u8*)(&PACKET_ID01);
-    u8  K0[B];
-    u8  ipad[B];
-    u8  opad[B];
-    u8  K0_XOR_ipad_TEXT[(B + PUBKEY_LEN)];
-    u8  BLAKE2B_output[L]; 
-    u8  last_BLAKE2B_input[B + L];
-    u8  K0_XOR_ipad[B];
-    u8  K0_XOR_opad[B];
-    u8  HMAC_output[HMAC_TRUNC_BYTES];
     u8  client_pubkey_buf[PUBKEY_LEN];
     u8* reply_buf = NULL;
-    
-    bigint* temp_ptr;
 
-    memset(K0, 0, B);
-    memset(K0_XOR_ipad_TEXT, 0, (B + PUBKEY_LEN));
-    memset(BLAKE2B_output, 0, L);
-    memset(last_BLAKE2B_input, 0, B + L);
-    memset(K0_XOR_ipad, 0, B);
-    memset(K0_XOR_opad, 0, B);
-    memset(HMAC_output, 0, HMAC_TRUNC_BYTES);
-    memset(client_pubkey_buf, 0, PUBKEY_LEN);
-
-    memset(opad, 0x5c, B);
-    memset(ipad, 0x36, B);
-    
-    printf("[DEBUG] Server: Printing received msg_01 of length %u bytes:\n",
-            SMALL_FIELD_LEN + PUBKEY_LEN + HMAC_TRUNC_BYTES
-    );
+    struct BLAKE2B_MAC_ctx mac_ctx;
 
-    for(u64 i = 0; i < SMALL_FIELD_LEN + PUBKEY_LEN + HMAC_TRUNC_BYTES; ++i){
-        printf("%03u ", (msg_buf)[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
+    memset(client_pubkey_buf, 0, PUBKEY_LEN);
 
-    /*  Use what's already in the locked memory region to compute HMAC and 
+    /*  Use what's already in the locked memory region to compute the MAC and 
      *  to decrypt the user's long-term public key
      *
-     *  Server uses KAB_s to compute the same HMAC on A_x (client's long-term
-     *  public key in encrypted form) as the client did. 
-     *
-     *  HMAC parameters here:
-     *
-     *  B    = input block size in bytes of BLAKE2B = 64
-     *  H    = hash function to be used - unkeyed BLAKE2B
-     *  ipad = buffer of the 0x36 byte repeated B=64 times
-     *  K    = key KAB_s
-     *  K_0  = K after pre-processing to form a B=64-byte key.
-     *  L    = output block size in bytes of BLAKE2B = 64
-     *  opad = buffer of the 0x5c byte repeated B=64 times
-     *  text = A_x
+     *  Server uses KAB_s as the key of keyed BLAKE2b to compute the same 
+     *  HMAC_TRUNC_BYTES-long MAC on A_x (client's long-term public key in 
+     *  encrypted form) as the client did. 
      */ 
-     
-    /* Step 3 of HMAC construction */
-    
-    /* Length of K is less than B so append 0s to it until it's long enough. */
-    /* This was done during K0's initialization. Now place the actual key.    */
-    memcpy( K0
-           ,temp_handshake_buf + (3 * sizeof(bigint))
-           ,SESSION_KEY_LEN
-          );
-
-    printf("[DEBUG] Server: HMAC Step 3 produced K0:\n");
-
-    for(u64 i = 0; i < B; ++i){
-        printf("%03u ", K0[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 4 of HMAC construction */
-    for(u64 i = 0; i < B; ++i){
-        K0_XOR_ipad[i] = (K0[i] ^ ipad[i]);
-    }
-    
-    printf("[DEBUG] Server: HMAC Step 4 produced K0_XOR_ipad: 64 bytes:\n");
-
-    for(u64 i = 0; i < B; ++i){
-        printf("%03u ", K0_XOR_ipad[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* step 5 of HMAC construction */
-    memcpy(K0_XOR_ipad_TEXT, K0_XOR_ipad, B);
-    memcpy(K0_XOR_ipad_TEXT + B, msg_buf + SMALL_FIELD_LEN, PUBKEY_LEN);
-    
-    printf("[DEBUG] Server: HMAC Step 5 produced K0_XOR_ipad_TEXT: 448 bytes:\n");
-
-    for(u64 i = 0; i < B + PUBKEY_LEN; ++i){
-        printf("%03u ", K0_XOR_ipad_TEXT[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* step 6 of HMAC construction */
-    /* Call BLAKE2B on K0_XOR_ipad_TEXT */ 
-    BLAKE2B_INIT(K0_XOR_ipad_TEXT, B + PUBKEY_LEN, 0, L, BLAKE2B_output);
-    
-    printf("[DEBUG] Server: HMAC Step 6 produced BLAKE2B_output: 64 bytes:\n");
-
-    for(u64 i = 0; i < L; ++i){
-        printf("%03u ", BLAKE2B_output[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 7 of HMAC construction */
-    for(u64 i = 0; i < B; ++i){
-        K0_XOR_opad[i] = (K0[i] ^ opad[i]);
-    }
-    
-   printf("[DEBUG] Server: HMAC Step 7 produced K0_XOR_opad: 64 bytes:\n");
-
-    for(u64 i = 0; i < B; ++i){
-        printf("%03u ", K0_XOR_opad[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 8 of HMAC construction */
-    /* Combine first BLAKE2B output buffer with K0_XOR_opad. */
-    /* B + L bytes total length */
-    memcpy(last_BLAKE2B_input + 0, K0_XOR_opad,    B);
-    memcpy(last_BLAKE2B_input + B, BLAKE2B_output, L);
-    
-   printf("[DEBUG] Server: HMAC Step 8 produced last_BLAKE2B_input: 192 bytes:\n");
-
-    for(u64 i = 0; i < B + L; ++i){
-        printf("%03u ", last_BLAKE2B_input[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Step 9 of HMAC construction */ 
-    /* Call BLAKE2B on the combined buffer in step 8. */
-    BLAKE2B_INIT(last_BLAKE2B_input, B + L, 0, L, BLAKE2B_output);
-    
-   printf("[DEBUG] Server: HMAC Step 9 produced BLAKE2B_output: 64 bytes:\n");
-
-    for(u32 i = 0; i < L; ++i){
-        printf("%03u ", BLAKE2B_output[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");
-
-    /* Take the HMAC_TRUNC_BYTES leftmost bytes to form the HMAC output. */
-    memcpy(HMAC_output, BLAKE2B_output, HMAC_TRUNC_BYTES);
-    
-    printf("[DEBUG] Server: Produced these 8 bytes of HMAC:\n");
-
-    for(u32 i = 0; i < HMAC_TRUNC_BYTES; ++i){
-        printf("%03u ", BLAKE2B_output[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-    printf("\n\n");  
-
-    printf("[DEBUG] Server: (1) To be checked against received HMAC 8 bytes\n");
-
-    for(u32 i = 0; i < HMAC_TRUNC_BYTES; ++i){
-        printf("%03u ", msg_buf[recv_HMAC_offset + i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
-    }
-
-    printf("[DEBUG] Server: (2) To be checked against received HMAC 8 bytes\n");
-
-    for(u32 i = 0; i < HMAC_TRUNC_BYTES; ++i){
-        printf("%03u ", (msg_buf + recv_HMAC_offset)[i]);
-        if(((i+1) % 8 == 0) && i > 6){
-            printf("\n");
-        }
+    BLAKE2B_MAC_INIT( &mac_ctx
+                     ,temp_handshake_buf + (3 * sizeof(bigint))
+                     ,SESSION_KEY_LEN
+                     ,HMAC_TRUNC_BYTES
+                    );
+
+    /* Now compare calculated MAC with the MAC the client sent us */
+    if( BLAKE2B_MAC_VERIFY( &mac_ctx
+                           ,msg_buf + SMALL_FIELD_LEN
+                           ,PUBKEY_LEN
+                           ,msg_buf + recv_HMAC_offset
+                          ) != 1
+      )
+    {
+        printf("[ERR] Server: MAC authentication codes don't match!\n\n");
+        printf("[OK]  Server: Discarding transmission.\n");
+        memset(&mac_ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
+        goto label_cleanup;
     }
 
-    /* Now compare calculated HMAC with the HMAC the client sent us */
-    for(u64 i = 0; i < HMAC_TRUNC_BYTES; ++i){
-        if(HMAC_output[i] != msg_buf[recv_HMAC_offset + i]){
-            printf("[ERR] Server: HMAC authentication codes don't match!\n\n");
-            printf("[OK]  Server: Discarding transmission.\n");
-            goto label_cleanup;
-        }
-    }
+    memset(&mac_ctx, 0, sizeof(struct BLAKE2B_MAC_ctx));
     
-    printf("[OK]  Server: HMAC authentication for logging-in client passed!\n");
+    printf("[OK]  Server: MAC authentication for logging-in client passed!\n");
     
     /*  Server uses KAB_s as key and 12-byte N_s as Nonce in ChaCha20 to
      *  decrypt A_x, revealing the client's long-term DH public key A.
@@ -1082,10 +1903,10 @@ void process_msg_01(u8* msg_buf, u64 sock_ix){
     
         *((u64*)(reply_buf)) = PACKET_ID_02;
         
-        Signature_GENERATE( M, Q, Gm, PACKET_ID02_addr, SMALL_FIELD_LEN 
-                            ,reply_buf + SMALL_FIELD_LEN
-                           ,&server_privkey_bigint, PRIVKEY_LEN
-                          );
+        Signature_GENERATE_CACHED( M, Q, Gm, PACKET_ID02_addr, SMALL_FIELD_LEN
+                                  ,reply_buf + SMALL_FIELD_LEN
+                                  ,&server_privkey_bigint, PRIVKEY_LEN
+                                 );
                           
 /* A client tried logging in but should try later.
  
@@ -1118,44 +1939,35 @@ void process_msg_01(u8* msg_buf, u64 sock_ix){
     /* It will contain the user index */
     /* Encrypt the index with chacha20 and KBA key and N_s nonce! */
     
-    /* Try using a chacha counter even with less than 64 bytes of input. */
-    reply_len  = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
+ 
+    /* Clients that sent flags get the ones we agreed to right after the ID. */
+    ix_offset  = has_flags ? (2 * SMALL_FIELD_LEN) : SMALL_FIELD_LEN;
+    reply_len  = ix_offset + SMALL_FIELD_LEN + SIGNATURE_LEN;
+
+    if(flags_agreed & RESUME_WANT_TICKET){
+        reply_len += RESUME_TICKET_LEN;
+    }
+
     reply_buf  = calloc(1, reply_len);
     
     *((u64*)(reply_buf)) = PACKET_ID_01;
     
     handshake_buf_key_offset  = (3 * sizeof(bigint)) + (1 * SESSION_KEY_LEN);
     
+    /* Try using a chacha counter even with less than 64 bytes of input. */
     CHACHA20((u8*)(&next_free_user_ix)
              ,SMALL_FIELD_LEN
              ,(u32*)(temp_handshake_buf + handshake_buf_nonce_offset)
              ,(u32)(SHORT_NONCE_LEN / sizeof(u32))
              ,(u32*)(temp_handshake_buf + handshake_buf_key_offset)
              ,(u32)(SESSION_KEY_LEN / sizeof(u32))
-             ,(reply_buf + SMALL_FIELD_LEN)
+             ,(reply_buf + ix_offset)
              );
              
     /* No need to increment this Nonce because it will be destroyed */
-    Signature_GENERATE( M, Q, Gm, PACKET_ID01_addr, SMALL_FIELD_LEN
-                       ,(reply_buf+ (2 * SMALL_FIELD_LEN))
-                       ,&server_privkey_bigint, PRIVKEY_LEN
-                      );
     
     /* Server bookkeeping - populate this user's slot, find next free slot. */
-  
-    clients[next_free_user_ix].room_ix          = 0;
-    clients[next_free_user_ix].num_pending_msgs = 0;
-    clients[next_free_user_ix].nonce_counter    = 0;
-    clients[next_free_user_ix].time_last_polled = clock();
-
-    for(size_t i = 0; i < MAX_PEND_MSGS; ++i){
-        clients[next_free_user_ix].pending_msgs[i] = calloc(1, MAX_MSG_LEN);
-    }
-    
-    memset( clients[next_free_user_ix].pending_msg_sizes
-           ,0
-           ,(MAX_PEND_MSGS * SMALL_FIELD_LEN)
-          );
+    init_user_slot(next_free_user_ix);
 
     /* Transport the client's long-term public key into their slot. */
     bigint_create( &(clients[next_free_user_ix].client_pubkey)
@@ -1199,6 +2011,29 @@ void process_msg_01(u8* msg_buf, u64 sock_ix){
                   ,&(clients[next_free_user_ix].client_pubkey_mont)
                   ,M
                  );      
+
+    /* Their long-term key gets used in every DH anyone in a room does with
+     * them, so make sure it's in the Q-order subgroup before we keep it.
+     * The slot isn't claimed yet, so just give back what we gave it.
+     */
+    if(check_pubkey_form( &(clients[next_free_user_ix].client_pubkey_mont)
+                         ,M
+                         ,Q
+                        ) == 0
+      )
+    {
+        printf("[ERR] Server: Client's long-term public key is invalid.\n");
+        printf("\n[OK]  Server: Discarding transmission.\n");
+
+        free(clients[next_free_user_ix].client_pubkey.bits);
+        free(clients[next_free_user_ix].client_pubkey_mont.bits);
+
+        for(size_t i = 0; i < MAX_PEND_MSGS; ++i){
+            free(clients[next_free_user_ix].pending_msgs[i]);
+            clients[next_free_user_ix].pending_msgs[i] = NULL;
+        }
+        goto label_cleanup;
+    }
                
      
     /* Compute a client-to-server encryption shared secret which will be used
@@ -1224,45 +2059,69 @@ void process_msg_01(u8* msg_buf, u64 sock_ix){
                   ,M
                   ,&(clients[next_free_user_ix].shared_secret)
                  );
-    
-    /* Reflect the new taken user slot in the global user status bitmask. */
-    users_status_bitmask |= 
-                       (1ULL << (63ULL - next_free_user_ix));
-    
-    /*  Increment it one space to the right, since we're guaranteeing by
-     *  logic in the user erause algorithm that we're always filling in
-     *  a new user in the LEFTMOST possible empty slot.
-     *
-     *  If you're less than (max_users), look at this slot and to the right
-     *  in the bitmask for the next leftmost empty user slot index. If you're
-     *  equal to (max_users) then the maximum number of users are currently
-     *  using Rosetta. Can't let any more people in until one leaves.
-     *
-     *  Here you either reach MAX_CLIENTS, which on the next attempt to 
-     *  let a user in and fill out a user struct for them, will indicate
-     *  that the maximum number of people are currently using Rosetta, or
-     *  you reach a bit at an index less than MAX_CLIENTS that is 0 in the
-     *  global user slots status bitmask.
+
+    /* While this login's one-time keys are still around, make the session's
+     * MAC keys out of them, if the client asked for session MACs.
      */
-    ++next_free_user_ix;
+    clients[next_free_user_ix].macs_agreed = 
+                               (flags_agreed & LOGIN_WANT_SESSION_MACS) != 0;
+
+    if(clients[next_free_user_ix].macs_agreed){
+        init_session_macs( next_free_user_ix
+                          ,temp_handshake_buf + (3 * sizeof(bigint))
+                         );
+    }
     
-    while(next_free_user_ix < MAX_CLIENTS){
-        if(!( users_status_bitmask & (1ULL << (63ULL - next_free_user_ix)))){
-            break;
-        }
-        ++next_free_user_ix;
+    /* Not the end of the world if this fails, they just won't be able to
+     * resume the session and will do a full login again if they drop out.
+     */
+    if(   (flags_agreed & RESUME_WANT_TICKET)
+       && !issue_resume_ticket( next_free_user_ix
+                               ,(u64)time(NULL) + RESUME_TICKET_LIFETIME
+                               ,reply_buf + reply_len - RESUME_TICKET_LEN
+                              )
+      )
+    {
+        printf("[WARN] Server: Logging a client in without a ticket.\n");
+        reply_len    -= RESUME_TICKET_LEN;
+        flags_agreed &= ~((u64)RESUME_WANT_TICKET);
     }
 
+    /* The signature is over the packet ID and the flags we agreed to, so
+     * nobody in between can talk the client into or out of any of them.
+     * That's one of a handful of constant 16 bytes, so it's cached too.
+     * Clients that sent no flags get a signature of the packet ID alone.
+     */
+    if(has_flags){
+        memcpy(reply_buf + SMALL_FIELD_LEN, &flags_agreed, SMALL_FIELD_LEN);
+
+        Signature_GENERATE_CACHED( M, Q, Gm, reply_buf, 2 * SMALL_FIELD_LEN
+                                  ,reply_buf + ix_offset + SMALL_FIELD_LEN
+                                  ,&server_privkey_bigint, PRIVKEY_LEN
+                                 );
+    }
+    else{
+        Signature_GENERATE_CACHED( M, Q, Gm, PACKET_ID01_addr, SMALL_FIELD_LEN
+                                  ,reply_buf + ix_offset + SMALL_FIELD_LEN
+                                  ,&server_privkey_bigint, PRIVKEY_LEN
+                                 );
+    }
+
+    clients[next_free_user_ix].sock_ix = sock_ix;
+    
+    claim_user_slot(next_free_user_ix);
+
 /* A client successfully logged in. Let them know what their user_ix is.    
  
     Server ----> Client
   
 ================================================================================
-| packet ID 01 |  user_ix  |                    SIGNATURE                      | 
-|==============|===========|===================================================|
-|  SMALL_LEN   | SMALL_LEN |                     SIG_LEN                       |
+| packet ID 01 | Flags agreed |  user_ix  |  SIGNATURE  | Resumption ticket if |
+|==============|==============|===========|=============|======================|
+|  SMALL_LEN   |  SMALL_LEN   | SMALL_LEN |   SIG_LEN   | agreed, TICKET_LEN   |
 --------------------------------------------------------------------------------
 
+   Without the Flags agreed field and no ticket for clients that sent no flags.
 */
       
     if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
@@ -1278,20 +2137,7 @@ void process_msg_01(u8* msg_buf, u64 sock_ix){
 label_cleanup:
 
     /* Now it's time to clear and unlock the temporary login memory region. */
-    temp_ptr = (bigint*)temp_handshake_buf;
-    free(temp_ptr->bits);
-
-    temp_ptr = (bigint*)(temp_handshake_buf + sizeof(bigint));
-    free(temp_ptr->bits);
-
-    temp_ptr = (bigint*)(temp_handshake_buf + (2 * sizeof(bigint)));
-    free(temp_ptr->bits);
-
-    memset(temp_handshake_buf, 0, TEMP_BUF_SIZ);
-
-    temp_handshake_memory_region_isLocked = 0;     
-
-    printf("[OK]  Server: Handshake memory region has been released!\n\n");
+    release_handshake_region();
     
     if(reply_buf){
         free(reply_buf);
@@ -1474,10 +2320,10 @@ void process_msg_10(u8* msg_buf, u32 sock_ix){
 
         *((u64*)(reply_buf)) = PACKET_ID11;
 
-        Signature_GENERATE( M, Q, Gm, (u8*)(&PACKET_ID11), SMALL_FIELD_LEN
-                           ,reply_buf + SMALL_FIELD_LEN
-                           ,&server_privkey_bigint, PRIVKEY_LEN
-                          );
+        Signature_GENERATE_CACHED( M, Q, Gm, (u8*)(&PACKET_ID11)
+                                  ,SMALL_FIELD_LEN, reply_buf + SMALL_FIELD_LEN
+                                  ,&server_privkey_bigint, PRIVKEY_LEN
+                                 );
         
         if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
             printf("[ERR] Server: Couldn't send No Room Space message.\n");
@@ -1502,10 +2348,10 @@ void process_msg_10(u8* msg_buf, u32 sock_ix){
            
     *((u64*)(reply_buf)) = PACKET_ID10;
     
-    Signature_GENERATE( M, Q, Gm, (u8*)(&PACKET_ID10), SMALL_FIELD_LEN
-                       ,(reply_buf + SMALL_FIELD_LEN)
-                       ,&server_privkey_bigint, PRIVKEY_LEN
-                      );
+    Signature_GENERATE_CACHED( M, Q, Gm, (u8*)(&PACKET_ID10), SMALL_FIELD_LEN
+                              ,(reply_buf + SMALL_FIELD_LEN)
+                              ,&server_privkey_bigint, PRIVKEY_LEN
+                             );
     
     /* Server bookkeeping - populate this room's slot, find next free slot. */
     rooms[next_free_room_ix].num_people = 1;
@@ -1570,8 +2416,6 @@ label_cleanup:
 */
 void process_msg_20(u8* msg_buf, u32 sock_ix){
 
-    FILE* ran_file = NULL;
-
     const u64 buf_type_21_len = 
           (2 * SMALL_FIELD_LEN) + ONE_TIME_KEY_LEN + SIGNATURE_LEN + PUBKEY_LEN;
 
@@ -1582,6 +2426,7 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
     u64 buf_ixs_pubkeys_write_offset;
     u64 buf_ixs_pubkeys_len;
     u64 reply_len;
+    u64 send_target_ix;
     u64 send_type21_encr_part_offset = SMALL_FIELD_LEN + ONE_TIME_KEY_LEN;
     u64 send_type20_AD_offset        = (2 * SMALL_FIELD_LEN) + ONE_TIME_KEY_LEN;
     u64 num_users_in_room            = 0;
@@ -1590,7 +2435,8 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
     u64 sign_offset                  = ONE_TIME_KEY_LEN + (4 * SMALL_FIELD_LEN);
     u64 signed_len                   = sign_offset;
                               
-    u8  buf_type_21[buf_type_21_len];
+    u8* bufs_type_21[MAX_CLIENTS];
+    u8* buf_type_21;
     u8  room_user_ID_buf[2 * SMALL_FIELD_LEN];
     u8  KAB[SESSION_KEY_LEN];
     u8  KBA[SESSION_KEY_LEN];
@@ -1601,8 +2447,6 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
     u8* reply_buf = NULL;
     u8  room_found;
     
-    size_t ret_val;
-       
     bigint nonce_bigint;
     bigint one;
     bigint aux1;
@@ -1615,7 +2459,6 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
     one.bits = NULL;
     aux1.bits = NULL;
 
-    memset(buf_type_21,           0, buf_type_21_len);
     memset(room_user_ID_buf,      0, 2 * SMALL_FIELD_LEN);
     memset(KAB,                   0, SESSION_KEY_LEN);
     memset(KBA,                   0, SESSION_KEY_LEN);
@@ -1623,6 +2466,7 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
     memset(send_K,                0, ONE_TIME_KEY_LEN);
     memset(type21_encrypted_part, 0, SMALL_FIELD_LEN + PUBKEY_LEN);
     memset(user_ixs_in_room,      0, MAX_CLIENTS * sizeof(u32));
+    memset(bufs_type_21,          0, MAX_CLIENTS * sizeof(u8*));
 
     bigint_create(&one,  MAX_BIGINT_SIZ, 1);
     bigint_create(&aux1, MAX_BIGINT_SIZ, 0);
@@ -1815,17 +2659,8 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
      * (8 + num_keys*(8 + PUB_KEY_LEN)) 
      */
     
-    ran_file = fopen("/dev/urandom", "r");
-    
-    if(!ran_file){
-        printf("[ERR] Server: Couldn't open urandom. Dropping transmission.\n");
-        goto label_cleanup;
-    }
-    
-    ret_val = fread(send_K, 1, ONE_TIME_KEY_LEN, ran_file);
-    
-    if(ret_val != ONE_TIME_KEY_LEN){
-        printf("[ERR] Server: Couldn't read urandom. Dropping transmission.\n");
+    if( ! CSPRNG_GET_BYTES(send_K, ONE_TIME_KEY_LEN) ){
+        printf("[ERR] Server: Couldn't draw key K. Dropping transmission.\n");
         goto label_cleanup;
     }
     
@@ -1890,12 +2725,9 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
                               + ONE_TIME_KEY_LEN 
                               + buf_ixs_pubkeys_len;
     
-    Signature_GENERATE
-        (M, Q, Gm, reply_buf, send_type20_signed_len
-        ,reply_buf + send_type20_signed_len
-        ,&server_privkey_bigint, PRIVKEY_LEN);
-    
-    /* The reply buffer is ready. Transmit it to the chatroom's new client. */  
+    /* The reply buffer is ready. Transmit it to the chatroom's new client,
+     * once a signing worker has put the signature of it at its end.
+     */  
 
     /* Reply to client with the user index and public key of all room guests. 
      * in encrypted form. The key to decrypt them itself is also encrypted
@@ -1926,13 +2758,16 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
     
     */
 
-    if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
-        printf("[ERR] Server: Couldn't send Room-Join-OK message.\n");
-        goto label_cleanup;
-    }
-    else{
-        printf("[OK]  Server: Told client they were permitted in the room.\n");
-    }
+    send_target_ix = sock_ix;
+
+    submit_signed_reply( SIGNED_REPLY_SEND, &send_target_ix, 1
+                        ,reply_buf, reply_len
+                        ,reply_buf, send_type20_signed_len
+                        ,"Room-Join-OK message (type 20)"
+                       );
+
+    /* The signing worker frees it now. */
+    reply_buf = NULL;
     
     printf("\n\n[OK]  Server: SUCCESS - Permitted a user in a chatroom!!\n\n");
     printf("Now to transmit the new user's public key to all room people!!\n");
@@ -1955,21 +2790,23 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
      * whose length in bytes is exactly:
      *
      * (8 + PUB_KEY_LEN) 
+     *
+     * All the TYPE_21 packets are built first and only then handed to the
+     * signing workers, so a failure midway doesn't leave some guests with it.
+     * Each gets its own buffer, since each signing job frees its own.
      */
-       
     for(u64 i = 0; i < num_users_in_room; ++i){
     
-        /* Clear the reply buf to prepare it for next response by the server. */
-        memset(buf_type_21, 0, buf_type_21_len);
+        /* This room guest's own TYPE_21 packet buffer. */
+        bufs_type_21[i] = calloc(1, buf_type_21_len);
+        buf_type_21     = bufs_type_21[i];
        
         /* Place the network packet identifier 21 constant. */
         *((u64*)(buf_type_21)) = PACKET_ID_21;
         
         /* Draw the random one-time use 32-byte key K. */
-        ret_val = fread(send_K, 1, ONE_TIME_KEY_LEN, ran_file);
-    
-        if(ret_val != ONE_TIME_KEY_LEN){
-            printf("[ERR] Server: Couldn't read urandom. Dropping message.\n");
+        if( ! CSPRNG_GET_BYTES(send_K, ONE_TIME_KEY_LEN) ){
+            printf("[ERR] Server: Couldn't draw key K. Dropping message.\n");
             goto label_cleanup;
         }
         
@@ -2075,15 +2912,10 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
         ++(clients[user_ixs_in_room[i]].nonce_counter); 
         
         /* Final part of TYPE_21 replies - signature itself. */
-        /* Compute the signature itself of everything so far.*/
-        
-        Signature_GENERATE
-        (     M, Q, Gm, buf_type_21
-             ,buf_type_21_len - SIGNATURE_LEN
-             ,buf_type_21 + (buf_type_21_len - SIGNATURE_LEN)
-             ,&server_privkey_bigint
-             ,PRIVKEY_LEN
-        );
+        /* It's of everything so far. Computed by a worker after the loop.   */
+    }
+
+    for(u64 i = 0; i < num_users_in_room; ++i){
         
 /* Send the new room guest's index and public key to all room participants.
  
@@ -2096,15 +2928,24 @@ void process_msg_20(u8* msg_buf, u32 sock_ix){
 --------------------------------------------------------------------------------
 
 */     
-        add_pending_msg(user_ixs_in_room[i], buf_type_21_len, buf_type_21);
+        submit_signed_reply( SIGNED_REPLY_PENDING, &(user_ixs_in_room[i]), 1
+                            ,bufs_type_21[i], buf_type_21_len
+                            ,bufs_type_21[i], buf_type_21_len - SIGNATURE_LEN
+                            ,"new room guest's key (type 21)"
+                           );
+
+        /* The signing worker frees it now. */
+        bufs_type_21[i] = NULL;
     }
 
 label_cleanup:
 
-    if(ran_file){ fclose(ran_file); }
-
     if(reply_buf)      { free(reply_buf);       }
     if(buf_ixs_pubkeys){ free(buf_ixs_pubkeys); }
+
+    for(u64 i = 0; i < MAX_CLIENTS; ++i){
+        if(bufs_type_21[i]){ free(bufs_type_21[i]); }
+    }
  
     free(nonce_bigint.bits);
     free(one.bits);
@@ -2120,49 +2961,89 @@ label_cleanup:
  Main packet structure:
  
 ================================================================================
-| packetID 30 |  user_ix  |  TXT_LEN   |    AD   |          Signature1         | 
-|=============|===========|============|=========|=============================|
-|  SMALL_LEN  | SMALL_LEN | SMALL_LEN  | L bytes |            SIG_LEN          |
+| packetID 30 |  user_ix  |  TXT_LEN  |    AD   |  encr_msg  |   Signature1    |
+|=============|===========|===========|=========|============|=================|
+|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes |  TXT_LEN   |     SIG_LEN     |
 --------------------------------------------------------------------------------
 
  AD - Associated Data, of length L bytes: From T = 1 to num_guests:
 
 ================================================================================
-| guestID_1 | encr_key_1 | encr_msg_1| ... |guestID_T | encr_key_T | encr_msg_T| 
-|===========|============|===========|=====|==========|============|===========|
-| SMALL_LEN |  X bytes   |  TXT_LEN  | ... |SMALL_LEN |  X bytes   |  TXT_LEN  |
+|  guestID_1  |  encr_key_1  |  ...  |   guestID_T   |         encr_key_T      |
+|=============|==============|=======|===============|=========================|
+|  SMALL_LEN  |   X bytes    |  ...  |   SMALL_LEN   |          X bytes        |
 --------------------------------------------------------------------------------
 
- L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN + TXT_LEN)
+ L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN)
  X = ONE_TIME_KEY_LEN
 
+ The text is in there only once, encrypted with a one-time key K that each
+ guest finds encrypted for them in the AD. So what we keep for and send to
+ each guest grows with the room by a key per person, not a copy of the text.
+
+ Or a type_31 (mac_mode = 1), in which the sender's session MAC counter and
+ tag are in place of Signature1, see authenticate_client_mac(), and each AD
+ slot has a room MAC tag that only the sender and that guest can check:
+
+================================================================================
+| packetID 31 |  user_ix  |  TXT_LEN  |    AD   |  encr_msg  | counter |  MAC  |
+|=============|===========|===========|=========|============|=========|=======|
+|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes |  TXT_LEN   |  SMALL  |SES_MAC|
+--------------------------------------------------------------------------------
+
+ L = (People in our chatroom - 1) * (SMALL_LEN + ONE_TIME_KEY_LEN + MAC_LEN)
+
+ We don't sign a type_31 either. It's added to the guests' pending messages
+ without the counter and tag, and our signature or session MAC on the poll
+ reply that it goes out in is all that guests need from us. So a message in
+ the room costs no public-key operation on anyone's end, ours included.
+
 */
-void process_msg_30(u8* msg_buf, s64 packet_siz, u64 sign_offset, u64 sender_ix)
+void process_msg_30( u8* msg_buf, s64 packet_siz, u64 sign_offset
+                    ,u64 sender_ix, u8 mac_mode
+                   )
 {
     u64 next_free_receivers_ix = 0;
     u64 reply_len = packet_siz + SIGNATURE_LEN;
     u64 signed_len = (packet_siz - SIGNATURE_LEN);
     u64 *receiver_ixs = NULL;
 
-    char userid[SMALL_FIELD_LEN];
-
     u8 *reply_buf = NULL;
 
-    memset(userid, 0, SMALL_FIELD_LEN);
-
     receiver_ixs = 
     calloc(1, (rooms[clients[sender_ix].room_ix].num_people -1) * sizeof(u64));
 
     reply_buf  = calloc(1, reply_len);
 
-    /* Verify the sender's cryptographic signature. */
-    if( authenticate_client(sender_ix, msg_buf, signed_len, sign_offset) != 1){
-        printf("[ERR] Server: Invalid signature. Discarding transmission.\n\n");
-        goto label_cleanup;
+    /* Verify the sender's cryptographic signature, or their session MAC.
+     *
+     * Their signature is over the packet as its receivers get it, with their
+     * userID in place of their user_ix, as that's all the receivers can check
+     * it against. So put it in before checking it. We've got their index.
+     */
+    if(mac_mode){
+        if(authenticate_client_mac(sender_ix, msg_buf, sign_offset) != 1){
+            printf("[ERR] Server: Invalid MAC. Discarding transmission.\n\n");
+            goto label_cleanup;
+        }
     }
     else{
-        printf("[OK]  Server: Client authenticated successfully!\n");
-    }  
+        memcpy(msg_buf + SMALL_FIELD_LEN, clients[sender_ix].user_id
+               ,SMALL_FIELD_LEN
+              );
+
+        if(authenticate_client(sender_ix, msg_buf, signed_len, sign_offset)
+           != 1
+          )
+        {
+            printf("[ERR] Server: Invalid signature. "
+                   "Discarding transmission.\n\n"
+                  );
+            goto label_cleanup;
+        }
+    }
+
+    printf("[OK]  Server: Client authenticated successfully!\n");
     
     /* Iterate over all user indices to find the other chatroom participants. */
     for(u64 i = 0; i < MAX_CLIENTS; ++i){
@@ -2176,25 +3057,36 @@ void process_msg_30(u8* msg_buf, s64 packet_siz, u64 sign_offset, u64 sender_ix)
             ++next_free_receivers_ix;
         }
     }  
-      
-    /* Place the already received packet into the upgraded type_30 packet */
-    memcpy(reply_buf, msg_buf, packet_siz);
-        
-    /* Compute the server's cryptographic signature of the entire received  
-     * packet, including the sender's cryptographic signature!
+
+    /* A type_31 goes to each guest as it is, minus the counter and the tag,
+     * and with the sender's userID in place of their index, like a type_30.
      */
-    
-    Signature_GENERATE
-                    (M, Q, Gm, reply_buf, packet_siz, (reply_buf + packet_siz)
-                    ,&server_privkey_bigint, PRIVKEY_LEN
-    );
-        
-    /* Replace the sender's index in the server's internal bookkeeping with
-     * their userID so the client's internal bookkeeping can also locate them.
+    if(mac_mode){
+        memcpy(reply_buf, msg_buf, sign_offset);
+        memcpy(reply_buf + SMALL_FIELD_LEN, clients[sender_ix].user_id
+               ,SMALL_FIELD_LEN
+              );
+
+        for(u64 i = 0; i < next_free_receivers_ix; ++i){
+            add_pending_msg(receiver_ixs[i], sign_offset, reply_buf);
+
+            printf("[OK]  Server: Added text message (type 31) to user[%lu]'s"
+                   " pending MSGs.\n"
+                   ,receiver_ixs[i]
+                  );
+        }
+        goto label_cleanup;
+    }
+      
+    /* Place the already received packet into the upgraded type_30 packet.
+     * It already has the sender's userID in place of their index, which is
+     * how the client's internal bookkeeping can also locate them.
      */
-    memcpy(userid, clients[sender_ix].user_id, SMALL_FIELD_LEN);
+    memcpy(reply_buf, msg_buf, packet_siz);
 
-    memcpy(reply_buf + SMALL_FIELD_LEN, userid, SMALL_FIELD_LEN);
+    /* The server's cryptographic signature is of the entire relayed packet,
+     * including the sender's cryptographic signature! A worker computes it.
+     */
 
     /* Add upgraded type_30 packet to the intended receivers' pending MSGs. */
     /*
@@ -2202,15 +3094,21 @@ void process_msg_30(u8* msg_buf, s64 packet_siz, u64 sign_offset, u64 sender_ix)
     Server ---> Client
     
 ================================================================================
-| packetID 30 | sender_id |  TXT_LEN  |    AD   |     Sign1     |    Sign2     |  
-|=============|===========|===========|=========|===============|==============|
-|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes |    SIG_LEN    |   SIG_LEN    |
+| packetID 30 | sender_id |  TXT_LEN  |    AD   | encr_msg |  Sign1  |  Sign2  |
+|=============|===========|===========|=========|==========|=========|=========|
+|  SMALL_LEN  | SMALL_LEN | SMALL_LEN | L bytes | TXT_LEN  | SIG_LEN | SIG_LEN |
 --------------------------------------------------------------------------------    
     
     */
-    for(u64 i = 0; i < rooms[clients[sender_ix].room_ix].num_people - 1; ++i){
-        add_pending_msg(receiver_ixs[i], reply_len, reply_buf);
-    }
+    submit_signed_reply( SIGNED_REPLY_PENDING, receiver_ixs
+                        ,rooms[clients[sender_ix].room_ix].num_people - 1
+                        ,reply_buf, reply_len
+                        ,reply_buf, packet_siz
+                        ,"text message (type 30)"
+                       );
+
+    /* The signing worker frees it now. */
+    reply_buf = NULL;
     
 label_cleanup:
     
@@ -2230,43 +3128,63 @@ label_cleanup:
 |  SMALL_LEN   | SMALL_LEN |                     SIG_LEN                       |
 --------------------------------------------------------------------------------
 
+ Or in session-MAC mode (mac_mode = 1), see authenticate_client_mac(), in
+ which case our reply is MAC'd too, the counter and tag in place of SIGNATURE.
+
 */
-void process_msg_40(u8* msg_buf, u32 sock_ix){
+void process_msg_40(u8* msg_buf, u32 sock_ix, u8 mac_mode){
         
     u8 *reply_buf = NULL;
 
     u64 reply_len;
     u64 reply_write_offset = 0;
+    u64 send_target_ix;
     u64 sign_offset = 2 * SMALL_FIELD_LEN;
     u64 signed_len = sign_offset;
     u64 poller_ix = *((u64*)(msg_buf + SMALL_FIELD_LEN));
+    u64 auth_len = mac_mode ? SESSION_MAC_AUTH_LEN : SIGNATURE_LEN;
 
     printf("[DEBUG] Server: poller_ix in process_msg_40: %lu\n\n", poller_ix);
     
-    /* Verify the sender's cryptographic signature to make sure they're legit */
-    if( authenticate_client(poller_ix, msg_buf, signed_len, sign_offset) != 1 ){
+    /* Make sure the sender is legit, by their session MAC or their signature */
+    if(mac_mode){
+        if(authenticate_client_mac(poller_ix, msg_buf, sign_offset) != 1){
+            printf("[ERR] Server: Invalid session MAC. Discarding it.\n\n");
+            goto label_cleanup;
+        }
+    }
+    else if( authenticate_client(poller_ix, msg_buf, signed_len, sign_offset) 
+             != 1
+           )
+    {
         printf("[ERR] Server: Invalid signature. Discrading transmission.\n\n");
         goto label_cleanup;       
     }
-    else{
-        printf("[OK]  Server: Client authenticated successfully!\n");
-    }
+
+    printf("[OK]  Server: Client authenticated successfully!\n");
     
     clients[poller_ix].time_last_polled = clock();
     
     /* If no pending messages, simply send the NO_PENDING packet type_40. */
     if(clients[poller_ix].num_pending_msgs == 0){
     
-        reply_len = SMALL_FIELD_LEN + SIGNATURE_LEN;
+        reply_len = SMALL_FIELD_LEN + auth_len;
         reply_buf = calloc(1, reply_len);
         
         *((u64*)(reply_buf)) = PACKET_ID_40;
         
-        /* Compute a cryptographic signature so the client can authenticate us*/
-        Signature_GENERATE
+        /* Compute a cryptographic signature so the client can authenticate us
+         * - or rather copy it, as it's the same 8 bytes signed every time.
+         */
+        if(mac_mode){
+            session_mac_seal(poller_ix, reply_buf, SMALL_FIELD_LEN);
+        }
+        else{
+            Signature_GENERATE_CACHED
              ( M, Q, Gm, reply_buf, SMALL_FIELD_LEN, reply_buf + SMALL_FIELD_LEN
               ,&server_privkey_bigint, PRIVKEY_LEN
-        );
+            );
+        }
         
 /*
 
@@ -2299,7 +3217,7 @@ void process_msg_40(u8* msg_buf, u32 sock_ix){
          * of pending messages, even if we will need to do it again later to 
          * actually fetch their pending messages.
          */
-        reply_len = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
+        reply_len = (2 * SMALL_FIELD_LEN) + auth_len;
         reply_write_offset = 2 * SMALL_FIELD_LEN;
         
         for(u64 i = 0; i < clients[poller_ix].num_pending_msgs; ++i){
@@ -2328,21 +3246,14 @@ void process_msg_40(u8* msg_buf, u32 sock_ix){
                  
             reply_write_offset += clients[poller_ix].pending_msg_sizes[i];
             
-            clients[poller_ix].pending_msg_sizes[i] = 0;
-            
             memset( clients[poller_ix].pending_msgs[i]
                    ,0
                    ,clients[poller_ix].pending_msg_sizes[i] 
             );
+
+            clients[poller_ix].pending_msg_sizes[i] = 0;
         }
 
-        /* Compute a cryptographic signature so the client can authenticate us*/
-        Signature_GENERATE
-                         ( M, Q, Gm, reply_buf, reply_len - SIGNATURE_LEN, 
-                           reply_buf + (reply_len - SIGNATURE_LEN)
-                          ,&server_privkey_bigint, PRIVKEY_LEN
-        );
-        
         clients[poller_ix].num_pending_msgs = 0;
 /*
 
@@ -2358,12 +3269,31 @@ void process_msg_40(u8* msg_buf, u32 sock_ix){
 --------------------------------------------------------------------------------
 
 */              
-        /* Send the reply back to the client. */
-        if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
-            printf("[ERR] Server: Couldn't reply with PACKET_ID_41 msg.\n");
+        /* Compute a cryptographic signature so the client can authenticate us
+         * and send the reply back to the client. A MAC is quick enough to do
+         * right here, a signature is left to a signing worker, which sends it.
+         */
+        if(mac_mode){
+            session_mac_seal(poller_ix, reply_buf, reply_len - auth_len);
+
+            if(send(client_socket_fd[sock_ix], reply_buf, reply_len, 0) == -1){
+                printf("[ERR] Server: Couldn't reply with PACKET_ID_41 msg.\n");
+            }
+            else{
+                printf("[OK]  Server: Replied to client with PACKET_ID_41.\n");
+            }
         }
         else{
-            printf("[OK]  Server: Replied to client with PACKET_ID_41 msg.\n");
+            send_target_ix = sock_ix;
+
+            submit_signed_reply( SIGNED_REPLY_SEND, &send_target_ix, 1
+                                ,reply_buf, reply_len
+                                ,reply_buf, reply_len - SIGNATURE_LEN
+                                ,"PACKET_ID_41 reply"
+                               );
+
+            /* The signing worker frees it now. */
+            reply_buf = NULL;
         }
         
         goto label_cleanup;
@@ -2379,20 +3309,28 @@ label_cleanup:
 }
 
 /* A client decided to leave the chatroom they're currently in. */
-void process_msg_50(u8* msg_buf){
+void process_msg_50(u8* msg_buf, u8 mac_mode){
     
     u64 sign_offset = 2 * SMALL_FIELD_LEN;
     u64 signed_len = sign_offset;
     u64 sender_ix = *((u64*)(msg_buf + SMALL_FIELD_LEN));
 
-    /* Verify the sender's cryptographic signature to make sure they're legit */
-    if( authenticate_client(sender_ix, msg_buf, signed_len, sign_offset) != 1 ){
+    /* Make sure the sender is legit, by their session MAC or their signature */
+    if(mac_mode){
+        if(authenticate_client_mac(sender_ix, msg_buf, sign_offset) != 1){
+            printf("[ERR] Server: Invalid session MAC. Discarding it.\n\n");
+            return;
+        }
+    }
+    else if( authenticate_client(sender_ix, msg_buf, signed_len, sign_offset) 
+             != 1
+           )
+    {
         printf("[ERR] Server: Invalid signature. Discrading transmission.\n\n");
         return;      
     }
-    else{
-        printf("[OK]  Server: Client authenticated successfully!\n");
-    }
+
+    printf("[OK]  Server: Client authenticated successfully!\n");
  
     remove_user_from_room(sender_ix);
 
@@ -2400,20 +3338,28 @@ void process_msg_50(u8* msg_buf){
 }
 
 /* A client decided to log off Rosetta. */
-void process_msg_60(u8* msg_buf){
+void process_msg_60(u8* msg_buf, u8 mac_mode){
   
     u64 sign_offset = 2 * SMALL_FIELD_LEN;
     u64 signed_len  = sign_offset;
     u64 sender_ix   = *((u64*)(msg_buf + SMALL_FIELD_LEN));
     
-    /* Verify the sender's cryptographic signature to make sure they're legit */
-    if( authenticate_client(sender_ix, msg_buf, signed_len, sign_offset) != 1 ){
+    /* Make sure the sender is legit, by their session MAC or their signature */
+    if(mac_mode){
+        if(authenticate_client_mac(sender_ix, msg_buf, sign_offset) != 1){
+            printf("[ERR] Server: Invalid session MAC. Discarding it.\n\n");
+            return;
+        }
+    }
+    else if( authenticate_client(sender_ix, msg_buf, signed_len, sign_offset) 
+             != 1
+           )
+    {
         printf("[ERR] Server: Invalid signature. Discrading transmission.\n\n");
         return;     
     }
-    else{
-        printf("[OK]  Server: Client authenticated successfully!\n");
-    }
+
+    printf("[OK]  Server: Client authenticated successfully!\n");
 
     /* Clear the user descriptor structure and alter the global index array. */
     memset(&(clients[sender_ix]), 0, sizeof(struct connected_client));
@@ -2435,6 +3381,7 @@ void process_msg_60(u8* msg_buf){
  *  Here is a complete list of possible legitimate transmissions to the server:
  *
  *      - A client decides to log in Rosetta
+ *      - A client who lost their connection resumes their session.
  *      - A client decides to make a new chat room
  *      - A client decides to join a chat room.
  *      - A client decides to send a new message to the chatroom.
@@ -2454,6 +3401,14 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
 
     u32 ret_val = 0;
 
+    u8 mac_mode = 0;
+
+    u64 key_type = 0;
+
+    u64 login_flags = 0;
+
+    u8 has_login_flags = 0;
+
     char *msg_type_str = calloc(1, 3);
 
     printf("?? right before printing socket[sock_ix]  \n");    
@@ -2470,14 +3425,57 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
         expected_siz = SMALL_FIELD_LEN + PUBKEY_LEN;
         
         strncpy(msg_type_str, "00\0", 3);
-        
+
         if(bytes_read != expected_siz){
             ret_val = 1;
             goto label_error;
         }
+
+        /* If transmission is of a valid type and size, process it. */
+        process_msg_00(client_msg_buf, sock_ix, SMALL_FIELD_LEN);
+        
+        break;
+    }
+
+    /* A client tried to log in Rosetta, and told us their type of keys. */
+    case(PACKET_ID_05):{
+        printf("[OK]  Server: Found a matching packet_ID = 05\n\n");
+        expected_siz = 2 * SMALL_FIELD_LEN;
         
+        strncpy(msg_type_str, "05\0", 3);
+
+        if(bytes_read < expected_siz){
+            ret_val = 1;
+            goto label_error;
+        }
+
+        memcpy(&key_type, client_msg_buf + SMALL_FIELD_LEN, SMALL_FIELD_LEN);
+
+        if(key_type == PK_TYPE_CURVE25519){
+            printf("[ERR] Server: Client wants to log in with Curve25519 "
+                   "keys, but only FFDH-3072 logins are supported so far.\n"
+                  );
+            ret_val = 1;
+            goto label_error;
+        }
+
+        if(key_type != PK_TYPE_FFDH3072){
+            printf("[ERR] Server: Login with unknown key type %lu.\n"
+                   ,key_type
+                  );
+            ret_val = 1;
+            goto label_error;
+        }
+
+        expected_siz += PUBKEY_LEN;
+
+        if(bytes_read != expected_siz){
+            ret_val = 1;
+            goto label_error;
+        }
+
         /* If transmission is of a valid type and size, process it. */
-        process_msg_00(client_msg_buf, sock_ix);
+        process_msg_00(client_msg_buf, sock_ix, 2 * SMALL_FIELD_LEN);
         
         break;
     }
@@ -2488,6 +3486,35 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
         expected_siz = SMALL_FIELD_LEN + PUBKEY_LEN + HMAC_TRUNC_BYTES;
         
         strncpy(msg_type_str, "01\0", 3); 
+
+        /* Newer clients send a flags field too, older ones don't. */
+        if(bytes_read == expected_siz + SMALL_FIELD_LEN){
+            memcpy( &login_flags
+                   ,client_msg_buf + expected_siz
+                   ,SMALL_FIELD_LEN
+                  );
+            expected_siz += SMALL_FIELD_LEN;
+            has_login_flags = 1;
+        }
+        
+        if(bytes_read != expected_siz){           
+            ret_val = 1;
+            goto label_error;
+        }
+    
+        /* If transmission is of a valid type and size, process it. */
+        process_msg_01(client_msg_buf, sock_ix, has_login_flags, login_flags);
+        
+        break;           
+    }
+
+    /* A client who lost their connection wants their session back. */
+    case(PACKET_ID_03):{  
+        printf("[OK]  Server: Found a matching packet_ID = 03\n\n");
+        expected_siz =   (2 * SMALL_FIELD_LEN) + RESUME_NONCE_LEN 
+                       + RESUME_TICKET_LEN + SESSION_MAC_LEN;
+        
+        strncpy(msg_type_str, "03\0", 3); 
         
         if(bytes_read != expected_siz){           
             ret_val = 1;
@@ -2495,7 +3522,7 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
         }
     
         /* If transmission is of a valid type and size, process it. */
-        process_msg_01(client_msg_buf, sock_ix); 
+        process_msg_03(client_msg_buf, sock_ix); 
         
         break;           
     }
@@ -2561,9 +3588,9 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
                        + ( 
                           (rooms[clients[found_user_ix].room_ix].num_people - 1)
                           *
-                          (SMALL_FIELD_LEN + ONE_TIME_KEY_LEN + text_msg_len)
+                          (SMALL_FIELD_LEN + ONE_TIME_KEY_LEN)
                          ) 
-                       + *((u64*)(client_msg_buf + (2 * SMALL_FIELD_LEN)))
+                       + text_msg_len
                        + SIGNATURE_LEN;
                     
         if(bytes_read != expected_siz){
@@ -2576,6 +3603,51 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
                        ,expected_siz
                        ,expected_siz - SIGNATURE_LEN
                        ,found_user_ix
+                       ,0
+                      );
+        break;
+    }
+
+    /* The same, sent with session and room MACs instead of a signature. */
+    case(PACKET_ID_31):{
+        printf("[OK]  Server: Found a matching packet_ID = 31\n\n");
+        strncpy(msg_type_str, "31\0", 3);
+        
+        /* Size must be in bytes: 
+         *
+         *   (3 * SMALL_FIELD_LEN) + AD_LEN + TXT_LEN + SESSION_MAC_AUTH_LEN
+         *
+         *   where AD_LEN is now:
+         *
+         *     N * (SMALL_FIELD_LEN + ONE_TIME_KEY_LEN + SESSION_MAC_LEN)
+         */
+        found_user_ix = *((u64*)(client_msg_buf + SMALL_FIELD_LEN));
+        text_msg_len  = *((u64*)(client_msg_buf + (2 * SMALL_FIELD_LEN)));
+
+        if(found_user_ix >= MAX_CLIENTS){
+            ret_val = 1;
+            goto label_error;
+        }
+
+        expected_siz =   (3 * SMALL_FIELD_LEN)
+                       + ( 
+                          (rooms[clients[found_user_ix].room_ix].num_people - 1)
+                          *
+                          (SMALL_FIELD_LEN + ONE_TIME_KEY_LEN + SESSION_MAC_LEN)
+                         ) 
+                       + text_msg_len
+                       + SESSION_MAC_AUTH_LEN;
+                    
+        if(bytes_read != expected_siz){
+            ret_val = 1;
+            goto label_error;
+        }
+        
+        process_msg_30( client_msg_buf
+                       ,expected_siz
+                       ,expected_siz - SESSION_MAC_AUTH_LEN
+                       ,found_user_ix
+                       ,1
                       );
         break;
     }
@@ -2586,14 +3658,17 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
         strncpy(msg_type_str, "40\0", 3);    
     
         expected_siz = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
+
+        /* The shorter session-MAC form of it, or the signed one. */
+        mac_mode = (bytes_read == (2 * SMALL_FIELD_LEN) + SESSION_MAC_AUTH_LEN);
         
-        if(bytes_read != expected_siz){
+        if(bytes_read != expected_siz && !mac_mode){
             ret_val = 1;
             goto label_error;
         }
         
         /* If transmission is of a valid type and size, process it. */
-        process_msg_40(client_msg_buf, sock_ix);
+        process_msg_40(client_msg_buf, sock_ix, mac_mode);
         
         break;
     }
@@ -2604,14 +3679,17 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
         strncpy(msg_type_str, "50\0", 3);    
     
         expected_siz = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
+
+        /* The shorter session-MAC form of it, or the signed one. */
+        mac_mode = (bytes_read == (2 * SMALL_FIELD_LEN) + SESSION_MAC_AUTH_LEN);
         
-        if(bytes_read != expected_siz){
+        if(bytes_read != expected_siz && !mac_mode){
             ret_val = 1;
             goto label_error;
         }
         
         /* If transmission is of a valid type and size, process it. */
-        process_msg_50(client_msg_buf);
+        process_msg_50(client_msg_buf, mac_mode);
         
         break;        
     }
@@ -2621,14 +3699,17 @@ u32 identify_new_transmission(u8* client_msg_buf, s64 bytes_read, u32 sock_ix){
         strncpy(msg_type_str, "60\0", 3);    
         printf("[OK]  Server: Found a matching packet_ID = 60\n\n");
         expected_siz = (2 * SMALL_FIELD_LEN) + SIGNATURE_LEN;
+
+        /* The shorter session-MAC form of it, or the signed one. */
+        mac_mode = (bytes_read == (2 * SMALL_FIELD_LEN) + SESSION_MAC_AUTH_LEN);
         
-        if(bytes_read != expected_siz){
+        if(bytes_read != expected_siz && !mac_mode){
             ret_val = 1;
             goto label_error;
         }
         
         /* If transmission is of a valid type and size, process it. */
-        process_msg_60(client_msg_buf);
+        process_msg_60(client_msg_buf, mac_mode);
         
         break;            
     
@@ -2671,9 +3752,11 @@ label_cleanup:
     return ret_val;
 }
 
-void remove_user(u64 removing_user_ix){
-    
-    int status;
+/* Free user slot removing_user_ix and everything their session had, and take
+ * them out of their room if they were in one. Their socket is left alone, see
+ * release_socket() for that.
+ */
+void release_user_slot(u64 removing_user_ix){
 
     /* Might have to remove them from a room (as a guest or as the owner)
      * or simply from the server if they weren't in a room.
@@ -2700,30 +3783,78 @@ void remove_user(u64 removing_user_ix){
 
     memset(&(clients[removing_user_ix]), 0, sizeof(struct connected_client));
 
+    /* Replies still being signed for them must not go to whoever's next. */
+    ++(client_epochs[removing_user_ix]);
+
+    /* Update next free user slot if needed. */
+    if(removing_user_ix < next_free_user_ix){
+        next_free_user_ix = removing_user_ix;
+    }
+
     users_status_bitmask &= ~(1ULL << (63ULL - removing_user_ix));
 
-    status = pthread_cancel(client_thread_ids[removing_user_ix]);
+    return;
+}
+
+/* Stop the recv() thread of socket slot sock_ix, close the socket and make
+ * the slot free again. Socket slots are what client_thread_ids[],
+ * client_socket_fd[] and client_payload_buffer_ptrs[] are indexed with, NOT
+ * user slots - look a user's up in clients[user_ix].sock_ix.
+ */
+void release_socket(u64 sock_ix){
+    
+    int status;
+
+    /* The caller holds the mutex. Cancelling ourselves would never let go of
+     * it, and the whole server would stop. Never happens on purpose.
+     */
+    if(pthread_equal(client_thread_ids[sock_ix], pthread_self())){
+        printf("[ERR] Server: A client thread tried to release its own "
+               "socket[%lu]. Left it alone.\n\n", sock_ix
+              );
+        return;
+    }
+
+    status = pthread_cancel(client_thread_ids[sock_ix]);
 
     /* Free the network payload buffer this client's thread had allocated. */
-    free(client_payload_buffer_ptrs[removing_user_ix]);
+    free(client_payload_buffer_ptrs[sock_ix]);
+    client_payload_buffer_ptrs[sock_ix] = NULL;
 
     if(status != 0){
         printf("[ERR] Server: Couldn't stop quitting client's recv thread.\n\n");
     }
 
-    status = close(client_socket_fd[removing_user_ix]);
+    status = close(client_socket_fd[sock_ix]);
 
     if(status != 0){
         printf("[ERR] Server: Couldn't close quitting client's socket.\n\n");
     }
 
     /* Update next free socket slot if needed. */
-    if(removing_user_ix < next_free_socket_ix){
-        next_free_socket_ix = removing_user_ix;
+    if(sock_ix < next_free_socket_ix){
+        next_free_socket_ix = sock_ix;
     }
 
+    /* Replies still being signed for it must not go to its next connection */
+    ++(socket_epochs[sock_ix]);
+
     /* Reflect in global socket bitmask that this socket is now free again. */
-    socket_status_bitmask &= ~(1ULL << (63ULL - removing_user_ix));
+    socket_status_bitmask &= ~(1ULL << (63ULL - sock_ix));
+
+    return;
+}
+
+/* Drop a user from the server entirely: their session, and the connection
+ * it was on.
+ */
+void remove_user(u64 removing_user_ix){
+
+    u64 sock_ix = clients[removing_user_ix].sock_ix;
+
+    release_user_slot(removing_user_ix);
+
+    release_socket(sock_ix);
 
     return;
 }
@@ -2732,6 +3863,10 @@ void* check_for_lost_connections(){
 
     time_t curr_time;
 
+    struct Exp_pool_stats          nonce_stats;
+    struct Exp_pool_stats          dh_stats;
+    struct Signature_service_stats sign_stats;
+
     while(1){
     
         sleep(5); /* Check for lost connections every 10 seconds. */
@@ -2742,6 +3877,36 @@ void* check_for_lost_connections(){
 
         printf("\n[OK] Server: Detector of lost connections STARTED!\n\n");
 
+        Signature_NONCE_POOL_STATS(&nonce_stats);
+
+        printf( "[OK]  Server: Nonce pool %lu/%lu ready, %lu hits, %lu misses, "
+                "%lu made.\n\n"
+               ,nonce_stats.available, nonce_stats.pool_size
+               ,nonce_stats.hits, nonce_stats.misses, nonce_stats.refilled
+              );
+
+        DH_EPHEMERAL_POOL_STATS(&dh_stats);
+
+        /* Misses are logins that found the pool empty and made their own. */
+        printf( "[OK]  Server: DH key pool %lu/%lu ready, %lu hits, "
+                "%lu misses, %lu made.\n\n"
+               ,dh_stats.available, dh_stats.pool_size
+               ,dh_stats.hits, dh_stats.misses, dh_stats.refilled
+              );
+
+        Signature_SERVICE_STATS(&sign_stats);
+
+        printf( "[OK]  Server: Signing workers: %lu, %lu jobs waiting (at most "
+                "%lu), %lu/%lu done.\n\n"
+               ,sign_stats.workers, sign_stats.queued, sign_stats.max_queued
+               ,sign_stats.completed, sign_stats.submitted
+              );
+
+        printf( "[OK]  Server: Sessions resumed: %lu, resumptions refused: "
+                "%lu.\n\n"
+               ,resumes_accepted, resumes_refused
+              );
+
         //printf("[OK]  Server: Checker for lost connections started!\n");
         
         /* Go over all user slots, for every connected client, check the last 
@@ -2798,11 +3963,10 @@ void* check_for_lost_connections(){
         if( 
               temp_handshake_memory_region_isLocked == 1
             &&
-              ( (curr_time - time_curr_login_initiated) > 10)       
+              ( (time(NULL) - time_curr_login_initiated) > 10)       
           )
         {
-            explicit_bzero(temp_handshake_buf, TEMP_BUF_SIZ);
-            temp_handshake_memory_region_isLocked = 0;               
+            release_handshake_region();
         }
         
         curr_time = clock();
@@ -0,0 +1,633 @@
+#include "../../lib/coreutil.h"
+
+#include <x86intrin.h> /* for __rdtsc() */
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+
+/* Benchmark harness for the cryptographic primitives Rosetta is built on.
+ *
+ * Usage: ./bench_crypto <results.json> [baseline.json] [max_regression_%]
+ *
+ * Run it from the bin folder, it loads the DH constants and the server's key
+ * pair from there, just like the server does. Each primitive is run in growing
+ * batches until at least BENCH_MIN_NS nanoseconds of work have been timed (or
+ * it hits its iteration cap - Argon2 at production parameters runs once), then
+ * ns/op, cycles/op, cycles/byte, ops/sec and GB/s are printed and written to
+ * the results file as JSON, one benchmark per line.
+ *
+ * If a baseline file from an earlier run is given and exists, every benchmark
+ * is compared against its entry there by ns/op, and the program exits with 1
+ * if any of them got slower by more than the allowed percentage. That's what
+ * "make bench" uses to catch kernel regressions.
+ */
+
+#define MAX_BIGINT_SIZ  12800
+#define PRIVKEY_LEN     40
+#define SIGNATURE_LEN   ((2 * sizeof(bigint)) + (2 * PRIVKEY_LEN))
+
+#define BENCH_MIN_NS              250000000ULL /* 0.25 sec per benchmark.    */
+#define BENCH_MAX_RESULTS         32
+#define BENCH_NAME_LEN            64
+#define BENCH_DEFAULT_REGRESS_PCT 10.0
+
+struct bench_result{
+    char   name[BENCH_NAME_LEN];
+    u64    bytes_per_op;       /* 0 if the primitive isn't byte-oriented. */
+    u64    iters;
+    double ns_per_op;
+    double cycles_per_op;
+    s64    page_faults;        /* -1 if not counted for this benchmark.   */
+    s64    dtlb_misses;        /* -1 if not counted or not available.     */
+};
+
+/* Page fault and dTLB miss counters from perf_event_open(), for the runs of
+ * Argon2 whose working memory layout we care about. The counters inherit to
+ * threads created after they're opened, which is how Argon2's worker pool
+ * gets counted the first time it starts up.
+ */
+struct bench_counters{
+    int           fd_faults;
+    int           fd_dtlb;
+    struct rusage usage;       /* Fallback for page faults without perf. */
+};
+
+/* Everything the benchmarked calls need, set up once in main(). */
+struct bench_ctx{
+    bigint* M;
+    bigint* Q;
+    bigint* Gm;
+    bigint* a;
+    bigint* Am;
+    bigint* s;
+    bigint* e;
+    bigint  mont_X;
+    bigint  mont_Y;
+    bigint  mont_R;
+    u8*     data;
+    u8*     out;
+    u8*     signature;
+    u64     len;
+    u64     sig_valid;
+    u32     key[8];
+    u32     nonce[3];
+    u8      curve_priv[CURVE25519_PRIVKEY_LEN];
+    u8      curve_pub[CURVE25519_PUBKEY_LEN];
+    u8      curve_peer_pub[CURVE25519_PUBKEY_LEN];
+    u8      curve_sig[CURVE25519_SIG_LEN];
+    u8      curve_shared[CURVE25519_SHARED_LEN];
+    struct Argon2_parms argon2_prms;
+    void (*argon2_G)(u8*, u8*, u8*);
+};
+
+struct bench_result results[BENCH_MAX_RESULTS];
+u64                 num_results = 0;
+
+int bench_perf_open(u32 type, u64 config){
+
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size           = sizeof(attr);
+    attr.type           = type;
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.inherit        = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void bench_counters_start(struct bench_counters* cnt){
+
+    cnt->fd_faults = bench_perf_open( PERF_TYPE_SOFTWARE
+                                     ,PERF_COUNT_SW_PAGE_FAULTS
+                                    );
+
+    cnt->fd_dtlb = bench_perf_open( PERF_TYPE_HW_CACHE
+                                   , PERF_COUNT_HW_CACHE_DTLB
+                                   | (PERF_COUNT_HW_CACHE_OP_READ     <<  8)
+                                   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+                                  );
+
+    getrusage(RUSAGE_SELF, &(cnt->usage));
+
+    if(cnt->fd_faults >= 0){ ioctl(cnt->fd_faults, PERF_EVENT_IOC_ENABLE, 0); }
+    if(cnt->fd_dtlb   >= 0){ ioctl(cnt->fd_dtlb,   PERF_EVENT_IOC_ENABLE, 0); }
+
+    return;
+}
+
+/* Stop counting and store the counts in the most recent benchmark result. */
+void bench_counters_stop(struct bench_counters* cnt){
+
+    struct bench_result* res = &(results[num_results - 1]);
+    struct rusage        usage_end;
+
+    u64 count;
+
+    res->page_faults = -1;
+    res->dtlb_misses = -1;
+
+    if(cnt->fd_faults >= 0){
+        ioctl(cnt->fd_faults, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(cnt->fd_faults, &count, sizeof(count)) == sizeof(count)){
+            res->page_faults = (s64)count;
+        }
+        close(cnt->fd_faults);
+    }
+
+    if(cnt->fd_dtlb >= 0){
+        ioctl(cnt->fd_dtlb, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(cnt->fd_dtlb, &count, sizeof(count)) == sizeof(count)){
+            res->dtlb_misses = (s64)count;
+        }
+        close(cnt->fd_dtlb);
+    }
+
+    /* No perf (e.g. perf_event_paranoid too high) - rusage counts all
+     * threads of the process, good enough for page faults.
+     */
+    if(res->page_faults < 0){
+        getrusage(RUSAGE_SELF, &usage_end);
+        res->page_faults =  (usage_end.ru_minflt - cnt->usage.ru_minflt)
+                          + (usage_end.ru_majflt - cnt->usage.ru_majflt);
+    }
+
+    printf("%-26s %12ld page faults", "", res->page_faults);
+
+    if(res->dtlb_misses >= 0){
+        printf(" %14ld dTLB load misses\n", res->dtlb_misses);
+    }
+    else{
+        printf("    (dTLB miss counter not available)\n");
+    }
+
+    return;
+}
+
+u64 bench_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + (u64)ts.tv_nsec;
+}
+
+/* Time fn(ctx) in doubling batches until BENCH_MIN_NS or max_iters is hit. */
+void bench_run( const char* name, u64 bytes_per_op, u64 max_iters
+               ,void (*fn)(struct bench_ctx*), struct bench_ctx* ctx
+              )
+{
+    struct bench_result* res = &(results[num_results++]);
+
+    u64 batch = 1;
+    u64 iters = 0;
+    u64 total_ns = 0;
+    u64 total_cycles = 0;
+    u64 t0;
+    u64 c0;
+
+    /* Warm up caches and branch predictors, unless one run is all we get. */
+    if(max_iters > 1){
+        fn(ctx);
+    }
+
+    while(total_ns < BENCH_MIN_NS && iters < max_iters){
+
+        if(batch > max_iters - iters){
+            batch = max_iters - iters;
+        }
+
+        t0 = bench_now_ns();
+        c0 = __rdtsc();
+
+        for(u64 i = 0; i < batch; ++i){
+            fn(ctx);
+        }
+
+        total_cycles += __rdtsc() - c0;
+        total_ns     += bench_now_ns() - t0;
+        iters        += batch;
+        batch        *= 2;
+    }
+
+    snprintf(res->name, BENCH_NAME_LEN, "%s", name);
+    res->bytes_per_op  = bytes_per_op;
+    res->iters         = iters;
+    res->ns_per_op     = (double)total_ns     / (double)iters;
+    res->cycles_per_op = (double)total_cycles / (double)iters;
+    res->page_faults   = -1;
+    res->dtlb_misses   = -1;
+
+    printf("%-26s %12.1f ns/op %14.1f cyc/op ", name, res->ns_per_op
+           ,res->cycles_per_op
+          );
+
+    if(bytes_per_op){
+        printf("%9.2f cyc/B ", res->cycles_per_op / (double)bytes_per_op);
+    }
+    else{
+        printf("%9s cyc/B ", "-");
+    }
+
+    printf("%14.1f ops/s ", 1e9 / res->ns_per_op);
+
+    if(bytes_per_op){
+        printf("%8.3f GB/s ", (double)bytes_per_op / res->ns_per_op);
+    }
+
+    printf(" (%lu iters)\n", iters);
+
+    return;
+}
+
+void bench_chacha20(struct bench_ctx* c){
+    CHACHA20(c->data, (u32)c->len, c->nonce, 3, c->key, 8, c->out);
+}
+
+void bench_blake2b(struct bench_ctx* c){
+    BLAKE2B_INIT(c->data, c->len, 0, 64, c->out);
+}
+
+void bench_argon2_G(struct bench_ctx* c){
+    c->argon2_G(c->data, c->data + 1024, c->out);
+}
+
+void bench_argon2(struct bench_ctx* c){
+    Argon2_MAIN(&(c->argon2_prms), c->out);
+}
+
+void bench_mont_mul(struct bench_ctx* c){
+    Montgomery_MUL(&(c->mont_X), &(c->mont_Y), c->M, &(c->mont_R));
+}
+
+void bench_mont_pow(struct bench_ctx* c){
+    MONT_POW_modM(c->Gm, c->a, c->M, &(c->mont_R));
+}
+
+void bench_pubkey_check(struct bench_ctx* c){
+    check_pubkey_form(c->Am, c->M, c->Q);
+}
+
+void bench_sig_gen(struct bench_ctx* c){
+    Signature_GENERATE( c->M, c->Q, c->Gm, c->data, c->len, c->signature
+                       ,c->a, PRIVKEY_LEN
+                      );
+}
+
+void bench_sig_val(struct bench_ctx* c){
+    c->sig_valid += Signature_VALIDATE( c->Gm, c->Am, c->M, c->Q, c->s, c->e
+                                       ,c->data, c->len
+                                       ,Signature_CHOOSE_PREHASH(c->len)
+                                      );
+}
+
+void bench_curve_keygen(struct bench_ctx* c){
+    Curve25519_PUBKEY(c->curve_priv, c->curve_pub);
+}
+
+void bench_curve_agree(struct bench_ctx* c){
+    Curve25519_AGREE(c->curve_priv, c->curve_peer_pub, c->curve_shared);
+}
+
+void bench_curve_sign(struct bench_ctx* c){
+    Curve25519_SIGN( c->curve_priv, c->curve_pub, c->data, c->len
+                    ,c->curve_sig
+                   );
+}
+
+void bench_curve_verify(struct bench_ctx* c){
+    c->sig_valid += Curve25519_VERIFY( c->curve_pub, c->data, c->len
+                                      ,c->curve_sig
+                                     );
+}
+
+u8 write_results_json(const char* path){
+
+    FILE* f = fopen(path, "w");
+
+    if(!f){
+        printf("[ERR] Bench: Couldn't open %s for writing.\n", path);
+        return 0;
+    }
+
+    fprintf(f, "{\n  \"benchmarks\": [\n");
+
+    for(u64 i = 0; i < num_results; ++i){
+
+        fprintf(f, "    {\"name\": \"%s\", \"bytes\": %lu, \"iters\": %lu, "
+                   "\"ns_per_op\": %.1f, \"cycles_per_op\": %.1f, "
+                   "\"cycles_per_byte\": "
+                ,results[i].name, results[i].bytes_per_op, results[i].iters
+                ,results[i].ns_per_op, results[i].cycles_per_op
+               );
+
+        if(results[i].bytes_per_op){
+            fprintf(f, "%.3f", results[i].cycles_per_op
+                               / (double)results[i].bytes_per_op
+                   );
+        }
+        else{
+            fprintf(f, "null");
+        }
+
+        fprintf(f, ", \"ops_per_sec\": %.1f, \"gb_per_sec\": "
+                ,1e9 / results[i].ns_per_op
+               );
+
+        /* Bytes per nanosecond is gigabytes per second. */
+        if(results[i].bytes_per_op){
+            fprintf(f, "%.4f", (double)results[i].bytes_per_op
+                               / results[i].ns_per_op
+                   );
+        }
+        else{
+            fprintf(f, "null");
+        }
+
+        if(results[i].page_faults >= 0){
+            fprintf(f, ", \"page_faults\": %ld", results[i].page_faults);
+        }
+
+        if(results[i].dtlb_misses >= 0){
+            fprintf(f, ", \"dtlb_misses\": %ld", results[i].dtlb_misses);
+        }
+
+        fprintf(f, "}%s\n", (i + 1 < num_results) ? "," : "");
+    }
+
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+
+    printf("\n[OK] Bench: Results written to %s\n", path);
+
+    return 1;
+}
+
+/* Returns how many benchmarks regressed past max_pct against the baseline.
+ * The baseline is a results file from an earlier run, so the parser only has
+ * to understand what write_results_json() writes - one benchmark per line.
+ */
+u64 compare_to_baseline(const char* path, double max_pct){
+
+    FILE* f = fopen(path, "r");
+
+    char   line[512];
+    char   name[BENCH_NAME_LEN];
+    char*  field;
+    double base_ns;
+    double delta_pct;
+    u64    regressions = 0;
+
+    if(!f){
+        printf("[OK] Bench: No baseline at %s - nothing to compare to. "
+               "Run 'make bench_baseline' to save one.\n", path
+              );
+        return 0;
+    }
+
+    printf("\nComparing against baseline %s (max slowdown %.1f%%):\n\n"
+           ,path, max_pct
+          );
+
+    while(fgets(line, sizeof(line), f)){
+
+        if(    (!(field = strstr(line, "\"name\": \"")))
+            || (sscanf(field + 9, "%63[^\"]", name) != 1)
+          )
+        {
+            continue;
+        }
+
+        if(    (!(field = strstr(line, "\"ns_per_op\": ")))
+            || (sscanf(field + 13, "%lf", &base_ns) != 1)
+            || (base_ns <= 0)
+          )
+        {
+            continue;
+        }
+
+        for(u64 i = 0; i < num_results; ++i){
+
+            if(strcmp(results[i].name, name) != 0){
+                continue;
+            }
+
+            delta_pct = ((results[i].ns_per_op - base_ns) / base_ns) * 100.0;
+
+            printf("%-26s %+8.1f%%  %s\n", name, delta_pct
+                   ,(delta_pct > max_pct) ? "<-- REGRESSION" : ""
+                  );
+
+            if(delta_pct > max_pct){
+                ++regressions;
+            }
+        }
+    }
+
+    fclose(f);
+
+    if(regressions){
+        printf("\n[ERR] Bench: %lu benchmark(s) regressed.\n\n", regressions);
+    }
+    else{
+        printf("\n[OK] Bench: No regressions against the baseline.\n\n");
+    }
+
+    return regressions;
+}
+
+int main(int argc, char** argv){
+
+    struct bench_ctx      ctx;
+    struct bench_counters counters;
+
+    const u64 sizes[3]      = {64, 1024, 131072};
+    const char* size_tag[3] = {"64B", "1KB", "128KB"};
+
+    char   name[BENCH_NAME_LEN];
+    double max_pct = BENCH_DEFAULT_REGRESS_PCT;
+    u8     argon2_pw[16];
+    u8     argon2_salt[72];
+
+    if(argc < 2){
+        printf("Usage: %s <results.json> [baseline.json] [max_regression_%%]\n"
+               ,argv[0]
+              );
+        return 1;
+    }
+
+    if(argc > 3){
+        max_pct = atof(argv[3]);
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    ctx.data      = (u8*)calloc(1, 131072);
+    ctx.out       = (u8*)calloc(1, 131072);
+    ctx.signature = (u8*)calloc(1, SIGNATURE_LEN);
+
+    CSPRNG_GET_BYTES(ctx.data, 131072);
+    CSPRNG_GET_BYTES((u8*)ctx.key,   sizeof(ctx.key));
+    CSPRNG_GET_BYTES((u8*)ctx.nonce, sizeof(ctx.nonce));
+
+    ctx.M  = get_BIGINT_from_DAT(3072, "../bin/saved_M.dat\0", 3071
+                                 ,MAX_BIGINT_SIZ);
+    ctx.Q  = get_BIGINT_from_DAT(320, "../bin/saved_Q.dat\0", 320
+                                 ,MAX_BIGINT_SIZ);
+    ctx.Gm = get_BIGINT_from_DAT(3072, "../bin/saved_Gm.dat\0", 3071
+                                 ,MAX_BIGINT_SIZ);
+    ctx.a  = get_BIGINT_from_DAT(320, "../bin/server_privkey.dat\0", 318
+                                 ,MAX_BIGINT_SIZ);
+    ctx.Am = get_BIGINT_from_DAT(3072, "../bin/server_pubkeymont.dat\0", 3071
+                                 ,MAX_BIGINT_SIZ);
+
+    /* get_BIGINT_from_DAT() prints its own error and leaves the number 0. */
+    if(    ctx.M->used_bits == 0 || ctx.Q->used_bits  == 0
+        || ctx.Gm->used_bits == 0 || ctx.a->used_bits == 0
+        || ctx.Am->used_bits == 0
+      )
+    {
+        printf("[ERR] Bench: Couldn't load saved numbers. Run from bin.\n");
+        return 1;
+    }
+
+    printf("\n================= Rosetta crypto primitive benchmarks "
+           "=================\n\n");
+
+    for(u64 i = 0; i < 3; ++i){
+        ctx.len = sizes[i];
+        snprintf(name, BENCH_NAME_LEN, "chacha20_%s", size_tag[i]);
+        bench_run(name, sizes[i], (u64)-1, bench_chacha20, &ctx);
+    }
+
+    for(u64 i = 0; i < 3; ++i){
+        ctx.len = sizes[i];
+        snprintf(name, BENCH_NAME_LEN, "blake2b_%s", size_tag[i]);
+        bench_run(name, sizes[i], (u64)-1, bench_blake2b, &ctx);
+    }
+
+    /* Two random residues mod M, already in Montgomery form as far as the
+     * multiplication is concerned - it doesn't care what they represent.
+     */
+    bigint_create(&ctx.mont_X, MAX_BIGINT_SIZ, 0);
+    bigint_create(&ctx.mont_Y, MAX_BIGINT_SIZ, 0);
+    bigint_create(&ctx.mont_R, MAX_BIGINT_SIZ, 0);
+
+    bigint_equate2(&ctx.mont_X, ctx.Gm);
+    bigint_equate2(&ctx.mont_Y, ctx.Am);
+
+    bench_run("montgomery_mul", 0, (u64)-1, bench_mont_mul, &ctx);
+    bench_run("mont_pow_modM",  0, (u64)-1, bench_mont_pow, &ctx);
+    bench_run("dh_pubkey_check", 0, (u64)-1, bench_pubkey_check, &ctx);
+
+    /* Sign a 1 KB message, same as test_signatures does. */
+    ctx.len = 1024;
+
+    bench_run("signature_generate", 0, (u64)-1, bench_sig_gen, &ctx);
+
+    ctx.s = (bigint*)(ctx.signature);
+    ctx.e = (bigint*)(ctx.signature + sizeof(bigint) + PRIVKEY_LEN);
+
+    ctx.s->bits = (u8*)calloc(1, (size_t)(ctx.s->size_bits / 8));
+    ctx.e->bits = (u8*)calloc(1, (size_t)(ctx.e->size_bits / 8));
+
+    memcpy(ctx.s->bits, ctx.signature + sizeof(bigint), PRIVKEY_LEN);
+    memcpy( ctx.e->bits
+           ,ctx.signature + (2 * sizeof(bigint)) + PRIVKEY_LEN
+           ,PRIVKEY_LEN
+          );
+
+    bench_run("signature_validate", 0, (u64)-1, bench_sig_val, &ctx);
+
+    if(ctx.sig_valid == 0){
+        printf("[ERR] Bench: Signature_VALIDATE rejected the signature!\n");
+        return 1;
+    }
+
+    /* The same 1 KB through the Curve25519 backend, and its key agreement,
+     * to hold against the 3072-bit numbers right above.
+     */
+    Curve25519_KEYGEN(ctx.curve_priv, ctx.curve_peer_pub);
+    Curve25519_KEYGEN(ctx.curve_priv, ctx.curve_pub);
+
+    ctx.sig_valid = 0;
+
+    bench_run("curve25519_keygen", 0, (u64)-1, bench_curve_keygen, &ctx);
+    bench_run("curve25519_agree",  0, (u64)-1, bench_curve_agree,  &ctx);
+    bench_run("curve25519_sign",   0, (u64)-1, bench_curve_sign,   &ctx);
+    bench_run("curve25519_verify", 0, (u64)-1, bench_curve_verify, &ctx);
+
+    if(ctx.sig_valid == 0){
+        printf("[ERR] Bench: Curve25519_VERIFY rejected the signature!\n");
+        return 1;
+    }
+
+    /* Argon2's compression function G() on its own, every version this CPU
+     * can run. Memory filled is 1 KB per call.
+     */
+    __builtin_cpu_init();
+
+    ctx.argon2_G = Argon2_G_SCALAR;
+    bench_run("argon2_G_scalar", 1024, (u64)-1, bench_argon2_G, &ctx);
+
+    if(__builtin_cpu_supports("avx2")){
+        ctx.argon2_G = Argon2_G_AVX2;
+        bench_run("argon2_G_avx2", 1024, (u64)-1, bench_argon2_G, &ctx);
+    }
+
+    if(__builtin_cpu_supports("avx512f")){
+        ctx.argon2_G = Argon2_G_AVX512;
+        bench_run("argon2_G_avx512", 1024, (u64)-1, bench_argon2_G, &ctx);
+    }
+
+    /* Argon2id at the parameters the client logs in and registers with. */
+    CSPRNG_GET_BYTES(argon2_pw,   sizeof(argon2_pw));
+    CSPRNG_GET_BYTES(argon2_salt, sizeof(argon2_salt));
+
+    ctx.argon2_prms.p     = 4;
+    ctx.argon2_prms.T     = 64;
+    ctx.argon2_prms.m     = 2097000;
+    ctx.argon2_prms.t     = 1;
+    ctx.argon2_prms.v     = 0x13;
+    ctx.argon2_prms.y     = 0x02;
+    ctx.argon2_prms.P     = argon2_pw;
+    ctx.argon2_prms.S     = argon2_salt;
+    ctx.argon2_prms.K     = NULL;
+    ctx.argon2_prms.X     = NULL;
+    ctx.argon2_prms.len_P = sizeof(argon2_pw);
+    ctx.argon2_prms.len_S = sizeof(argon2_salt);
+    ctx.argon2_prms.len_K = 0;
+    ctx.argon2_prms.len_X = 0;
+
+    /* Once the old way, with lazily faulted 4 KB pages, for comparison. */
+    argon2_use_hugepages = 0;
+
+    bench_counters_start(&counters);
+    bench_run( "argon2id_production_4k", ctx.argon2_prms.m * 1024, 1
+              ,bench_argon2, &ctx
+             );
+    bench_counters_stop(&counters);
+
+    argon2_use_hugepages = 1;
+
+    bench_counters_start(&counters);
+    bench_run( "argon2id_production", ctx.argon2_prms.m * 1024, 1
+              ,bench_argon2, &ctx
+             );
+    bench_counters_stop(&counters);
+
+    printf("Argon2 used the %s version of G().\n", Argon2_G_impl_name);
+
+    if(!write_results_json(argv[1])){
+        return 1;
+    }
+
+    if(argc > 2 && compare_to_baseline(argv[2], max_pct) > 0){
+        return 1;
+    }
+
+    return 0;
+}
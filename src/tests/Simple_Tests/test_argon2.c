@@ -2,80 +2,324 @@
 
 #define RESBITS 12800
 
+/* Argon2id conformance and throughput harness.
+ *
+ * First the Argon2id test vector from RFC 9106 section 5.3, then a matrix of
+ * (m, t, p) settings from tiny to the 2 GB one the client used to hard-code.
+ * Expected tags of the matrix come from the reference implementation
+ * (libargon2, argon2_hash() with Argon2id, version 0x13), with password
+ * 32 x 0x01, salt 16 x 0x02, no secret, no associated data, 32-byte tag
+ * unless said otherwise. Tags that aren't a multiple of 32 bytes and one
+ * 3 GiB memory size are in there to exercise H' and the index mapping.
+ *
+ * For each one it prints total time, the time of each of the 4 slices summed
+ * over all passes, lane imbalance (the slowest lane's G() time over the mean
+ * lane's) and memory bandwidth, counted as 2 KiB moved per block computed:
+ * the 1 KiB reference block read in and the 1 KiB new block written out.
+ *
+ * Then the asynchronous API: one job run to the end, checking its progress
+ * reports and tag, and one cancelled from its own progress callback.
+ *
+ * Exits with 1 if any check fails, so it can gate Argon2 speed work.
+ */
+
+#define MAX_TAG_LEN 128
+
+struct argon2_case{
+    u64         m;
+    u64         t;
+    u64         p;
+    u64         T;
+    const char* tag_hex;
+};
+
+const struct argon2_case matrix[] = {
+     {8,       1, 1, 32, "27094ba97a2f6ad140cfbb1ffb6c8f25"
+                         "08b68f5e32272544c77cdd7b6994faef"}
+    ,{64,      1, 1, 32, "6a1796cc5b540d398fdecc3120c9f21e"
+                         "591169917c5f8da452f51b064c81e899"}
+    ,{256,     2, 2, 32, "3af4604d4b1a648b326ac8f8367011f5"
+                         "30262029704a72fa771c118ad4dddad3"}
+    ,{1000,    3, 3, 32, "75cb1f00d1c6c6ef11c03a79bdef96f6"
+                         "6e3ef6200b783c443972446211ce2ce8"}
+    ,{4096,    1, 4, 32, "224bf300b4e7cc6e558fedd9bffb2618"
+                         "60d96379934fddd084702fa47e4f5917"}
+    ,{4096,    4, 4, 32, "d2566751eaeff41df8e55771f39df46a"
+                         "af24390aeca25beaab115051568ce3fe"}
+    ,{65536,   2, 8, 32, "96e6f04509db5aaab025fdbd7b11f498"
+                         "48340c9fa56377e0c074837e0c834d78"}
+    ,{262144,  1, 4, 32, "8da7c4749097200e8874cf8359183777"
+                         "c5aa8d6c381d5c00f4568718f1416d32"}
+    ,{2097000, 1, 4, 32, "f7026473e2a0fd5c21c5b433208b0247"
+                         "747bec37e550879937c0cfe929c4ad98"}
+    ,{3145728, 1, 2, 32, "975ee1155d4a68a0d0400b56427b39c8"
+                         "a30fdfbaacb1a684ad8f3b62225578b0"}
+    ,{4096,    1, 4, 40, "ac3c97777745528dc9aea9595cd1b0d6"
+                         "8f85b6d22e539f8d1fca5586ef5d7823"
+                         "f00bf8f6d04fe8fe"}
+    ,{4096,    1, 4, 100,"e7ade4d3d63540d00c043e99665425aa"
+                         "bfe979d702fc1476f613a32c1b3fbe86"
+                         "1815fefcbbb29d081b9c8b91abe7ba1e"
+                         "c67a6ac2f073f712f5c6c18e76802f27"
+                         "a2f643bf668369388741dbb58c6cfe19"
+                         "79fc7505334e16d5e43ed2dfa8ce391c"
+                         "54d15b1d"}
+};
+
+/* RFC 9106 section 5.3: Argon2id, m=32, t=3, p=4, with secret and ad. */
+const char* rfc9106_tag_hex = "0d640df58d78766c08c037a34a8b53c9"
+                              "d01ef0452d75b65eb52520e96b01e659";
+
+void hex_to_bytes(const char* hex, u8* out, u64 len){
+
+    unsigned int byte;
+
+    for(u64 i = 0; i < len; ++i){
+        sscanf(hex + (2 * i), "%2x", &byte);
+        out[i] = (u8)byte;
+    }
+}
+
+/* Run one Argon2id hash with timing on, check its tag and print one row. */
+u8 run_case( struct Argon2_parms* prms, const char* tag_hex){
+
+    struct Argon2_stats stats;
+
+    u8  expected[MAX_TAG_LEN];
+    u8  tag[MAX_TAG_LEN];
+    u8  match;
+
+    u64 start;
+    u64 total_ns;
+    u64 max_lane_ns = 0;
+    u64 sum_lane_ns = 0;
+    u64 m_dash = 4 * prms->p * (prms->m / (4 * prms->p));
+
+    double imbalance = 0;
+
+    memset(&stats, 0, sizeof(struct Argon2_stats));
+    stats.lane_ns = calloc(1, prms->p * sizeof(u64));
+
+    hex_to_bytes(tag_hex, expected, prms->T);
+
+    argon2_stats = &stats;
+
+    start = argon2_now_ns();
+
+    Argon2_MAIN(prms, tag);
+
+    total_ns = argon2_now_ns() - start;
+
+    argon2_stats = NULL;
+
+    for(u64 i = 0; i < prms->p; ++i){
+
+        sum_lane_ns += stats.lane_ns[i];
+
+        if(stats.lane_ns[i] > max_lane_ns){
+            max_lane_ns = stats.lane_ns[i];
+        }
+    }
+
+    if(sum_lane_ns){
+        imbalance = (double)max_lane_ns
+                    / ((double)sum_lane_ns / (double)prms->p);
+    }
+
+    match = (memcmp(tag, expected, prms->T) == 0);
+
+    printf( "m=%-8lu t=%lu p=%-2lu T=%-3lu | total %9.2f ms | slices %8.2f %8.2f "
+            "%8.2f %8.2f ms | imbalance %.3f | %6.2f GB/s | %s\n"
+           ,prms->m, prms->t, prms->p, prms->T
+           ,(double)total_ns / 1e6
+           ,(double)stats.slice_ns[0] / 1e6, (double)stats.slice_ns[1] / 1e6
+           ,(double)stats.slice_ns[2] / 1e6, (double)stats.slice_ns[3] / 1e6
+           ,imbalance
+           ,(double)(m_dash * prms->t * 2048) / (double)total_ns
+           ,match ? "OK" : "MISMATCH"
+          );
+
+    if(!match){
+        printf("[ERR] Argon2 tag mismatch.\n      Got:      ");
+        for(u64 i = 0; i < prms->T; ++i){ printf("%02x", tag[i]); }
+        printf("\n      Expected: %s\n", tag_hex);
+    }
+
+    free(stats.lane_ns);
+
+    return match;
+}
+
+/* Progress callback of the async jobs. user_arg says after how many slices
+ * to cancel the job, 0 for never.
+ */
+u64 progress_calls = 0;
+u64 last_slices_done = 0;
+
+void on_progress( struct Argon2_async* async
+                 ,u64 slices_done, u64 slices_total
+                )
+{
+
+    ++progress_calls;
+    last_slices_done = slices_done;
+
+    printf("[OK] Argon2 async: %lu of %lu slices done.\n"
+           ,slices_done, slices_total
+          );
+
+    if((u64)async->user_arg && slices_done == (u64)async->user_arg){
+        Argon2_CANCEL(async);
+    }
+}
+
+u8 test_async(struct Argon2_parms* prms, const char* tag_hex){
+
+    struct Argon2_async async;
+
+    u8  expected[32];
+    u8  tag[32];
+    u8  zero_tag[32];
+    u8  result;
+    u8  ok = 1;
+
+    memset(zero_tag, 0, 32);
+    hex_to_bytes(tag_hex, expected, 32);
+
+    /* Run to the end. Progress must come once per slice of every pass. */
+    progress_calls = 0;
+
+    if(!Argon2_START(&async, prms, tag, on_progress, NULL, (void*)0)){
+        return 0;
+    }
+
+    result = Argon2_WAIT(&async);
+
+    if(   result != ARGON2_RESULT_DONE || memcmp(tag, expected, 32) != 0
+       || progress_calls != 4 * prms->t || last_slices_done != 4 * prms->t
+      )
+    {
+        printf("[ERR] Argon2 async: full run went wrong. Result %u, %lu "
+               "progress reports.\n", result, progress_calls
+              );
+        ok = 0;
+    }
+    else{
+        printf("[OK] Argon2 async: full run matches.\n");
+    }
+
+    /* Cancel after the 3rd slice. It must stop there, with a zeroed tag. */
+    progress_calls = 0;
+
+    if(!Argon2_START(&async, prms, tag, on_progress, NULL, (void*)3)){
+        return 0;
+    }
+
+    result = Argon2_WAIT(&async);
+
+    if(   result != ARGON2_RESULT_CANCELLED || memcmp(tag, zero_tag, 32) != 0
+       || progress_calls != 3
+      )
+    {
+        printf("[ERR] Argon2 async: cancel went wrong. Result %u, %lu "
+               "progress reports.\n", result, progress_calls
+              );
+        ok = 0;
+    }
+    else{
+        printf("[OK] Argon2 async: cancelled after 3 slices.\n");
+    }
+
+    return ok;
+}
+
 int main(){
 
 /********** NOW TESTING ARGON2id ****************/
-    
+
     struct Argon2_parms prms;
-    
-    double cpu_time_used_argon2;
-    clock_t start, end;
-    
-    /* small, fast -- as in RFC test vector */
-    
-    /*
-    prms.p = 4;   
-    prms.T = 32;  
-    prms.m = 32;
-    prms.t = 3;  
-    prms.v = 19;  
-    prms.y = 2;  
-    */
-    
-    
-    /* big, slow - as used in Rosetta */
-    
-    
-    prms.p = 8;   
-    prms.T = 64;  
-    prms.m = 2097000;  
-    prms.t = 1;  
-    prms.v = 19;  
-    prms.y = 2;  
-    
-    
+
+    u64 failed = 0;
+
     u8   *P = malloc(32),
          *S = malloc(16),
          *K = malloc(8),
          *X = malloc(12);
-         
-    memset(P, 0x01, 32);     
+
+    memset(P, 0x01, 32);
     memset(S, 0x02, 16);
     memset(K, 0x03, 8 );
     memset(X, 0x04, 12);
-    
+
+    memset(&prms, 0, sizeof(struct Argon2_parms));
+
+    /* small, fast -- as in RFC test vector */
+
+    prms.p = 4;
+    prms.T = 32;
+    prms.m = 32;
+    prms.t = 3;
+    prms.v = 19;
+    prms.y = 2;
+
     prms.P = P;
     prms.S = S;
     prms.K = K;
     prms.X = X;
-    
+
     prms.len_P = 32;
     prms.len_S = 16;
     prms.len_K = 8 ;
     prms.len_X = 12;
-    
-    u8* argon2_output_tag = malloc(prms.T);
-    
-    start = clock();
-    
-    Argon2_MAIN(&prms, argon2_output_tag);
-    
-    end = clock();
-    
-    cpu_time_used_argon2 = ((double) (end - start)) / CLOCKS_PER_SEC; 
-    
-    printf("\n\n***** ARGON2id produced %lu-byte Tag: ******\n\n", prms.T);
-    
-    for(uint32_t i = 0; i < prms.T; ++i){
-        if(i % 16 == 0 && i > 0){printf("\n");}
-        printf("%02x ", (uint8_t)argon2_output_tag[i]);
-    }
-    printf("\n\n");
-    
-    printf("TOTAL TIME for Argon2: %lf seconds\n\n"
-            , cpu_time_used_argon2 / (double)prms.p);
-    
-    free(P); free(S); free(K); free(X); free(argon2_output_tag);
-    
-    return 0;
+
+    printf("\n***** ARGON2id RFC 9106 test vector *****\n\n");
+
+    if(!run_case(&prms, rfc9106_tag_hex)){
+        ++failed;
+    }
+
+    /* The matrix, ending with big and slow - as used in Rosetta */
+
+    printf("\n***** ARGON2id (m, t, p) matrix vs reference implementation "
+           "*****\n\n"
+          );
+
+    prms.K = NULL;
+    prms.X = NULL;
+    prms.len_K = 0;
+    prms.len_X = 0;
+
+    for(u64 i = 0; i < sizeof(matrix) / sizeof(struct argon2_case); ++i){
+
+        prms.m = matrix[i].m;
+        prms.t = matrix[i].t;
+        prms.p = matrix[i].p;
+        prms.T = matrix[i].T;
+
+        if(!run_case(&prms, matrix[i].tag_hex)){
+            ++failed;
+        }
+    }
+
+    printf("\n***** ARGON2id asynchronous API *****\n\n");
+
+    prms.m = matrix[6].m;
+    prms.t = matrix[6].t;
+    prms.p = matrix[6].p;
+    prms.T = matrix[6].T;
+
+    if(!test_async(&prms, matrix[6].tag_hex)){
+        ++failed;
+    }
+
+    if(failed){
+        printf("\n[ERR] Argon2: %lu check(s) FAILED.\n\n", failed);
+    }
+    else{
+        printf("\n[OK] Argon2: all checks passed.\n\n");
+    }
+
+    free(P); free(S); free(K); free(X);
+
+    return (failed ? 1 : 0);
 }
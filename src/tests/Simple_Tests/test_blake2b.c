@@ -20,6 +20,9 @@ void uint32_print_bits(uint32_t n){
 
 int main(){
 
+    /* Every MISMATCH or FAIL below counts, and any of them fails the test. */
+    u64 failures = 0;
+
     /********** NOW TESTING BLAKE2B ***************/
 
 
@@ -60,8 +63,145 @@ int main(){
     
     free(b2b_out_buf);
     free(b2b_raw_msg);
-    
-    
+
+
+    /********** NOW TESTING KEYED BLAKE2B (MAC) ***************/
+
+    /* Official BLAKE2b keyed known-answer tests: key = 0x00 .. 0x3F,
+     * messages = the empty string and the bytes 0x00 .. 0xFE (255 bytes).
+     */
+    const char* kat_empty =
+    "10ebb67700b1868efb4417987acf4690ae9d972fb7a590c2f02871799aaa4786"
+    "b5e996e8f0f4eb981fc214b005f42d2ff4233499391653df7aefcbc13fc51568";
+
+    const char* kat_255 =
+    "142709d62e28fcccd0af97fad0f8465b971e82201dc51070faa0372aa43e9248"
+    "4be1c1e73ba10906d5d1853db6a4106e0a7bf9800d373d6dee2d46d62ef2a461";
+
+    struct BLAKE2B_MAC_ctx mac_ctx;
+
+    u8   mac_key[64];
+    u8   mac_msg[255];
+    u8   mac_tag[64];
+    char mac_hex[129];
+
+    for(u32 i = 0; i < 64;  ++i){ mac_key[i] = (u8)i; }
+    for(u32 i = 0; i < 255; ++i){ mac_msg[i] = (u8)i; }
+
+    BLAKE2B_MAC_INIT(&mac_ctx, mac_key, 64, 64);
+
+    BLAKE2B_MAC(&mac_ctx, mac_msg, 0, mac_tag);
+
+    for(u32 i = 0; i < 64; ++i){ sprintf(mac_hex + (2*i), "%02x", mac_tag[i]); }
+
+    if(strcmp(mac_hex, kat_empty) != 0){ ++failures; }
+
+    printf("Keyed BLAKE2b of empty message: %s\n",
+           strcmp(mac_hex, kat_empty) == 0 ? "MATCH" : "MISMATCH"
+          );
+
+    /* Same precomputed context reused for a second, multi-block message. */
+    BLAKE2B_MAC(&mac_ctx, mac_msg, 255, mac_tag);
+
+    for(u32 i = 0; i < 64; ++i){ sprintf(mac_hex + (2*i), "%02x", mac_tag[i]); }
+
+    if(strcmp(mac_hex, kat_255) != 0){ ++failures; }
+
+    if(BLAKE2B_MAC_VERIFY(&mac_ctx, mac_msg, 255, mac_tag) != 1){ ++failures; }
+
+    printf("Keyed BLAKE2b of 255-byte msg : %s\n",
+           strcmp(mac_hex, kat_255) == 0 ? "MATCH" : "MISMATCH"
+          );
+
+    printf("Constant-time verify of tag   : %s\n\n",
+           BLAKE2B_MAC_VERIFY(&mac_ctx, mac_msg, 255, mac_tag) == 1
+           ? "PASS" : "FAIL"
+          );
+
+
+    /********** NOW TESTING MULTI-BUFFER BLAKE2B ***************/
+
+    /* 21 messages of different lengths (1 to 1001 bytes, so 1 to 8 blocks)
+     * and different output lengths, so the lane groups are uneven and lanes
+     * finish at different blocks. Must match one-at-a-time BLAKE2B_INIT.
+     */
+    #define MB_TEST_JOBS 21
+
+    struct BLAKE2B_MB_job mb_jobs[MB_TEST_JOBS];
+
+    u8  mb_msgs  [MB_TEST_JOBS][1024];
+    u8  mb_outs  [MB_TEST_JOBS][64];
+    u8  mb_single[64];
+    u64 mb_mismatches = 0;
+
+    for(u64 i = 0; i < MB_TEST_JOBS; ++i){
+        for(u64 j = 0; j < 1024; ++j){
+            mb_msgs[i][j] = (u8)((i * 31) + (j * 7));
+        }
+        mb_jobs[i].m  = mb_msgs[i];
+        mb_jobs[i].ll = 1 + (i * 50);
+        mb_jobs[i].nn = 64 - (i % 3) * 16;
+        mb_jobs[i].rr = mb_outs[i];
+    }
+
+    BLAKE2B_MB(mb_jobs, MB_TEST_JOBS);
+
+    for(u64 i = 0; i < MB_TEST_JOBS; ++i){
+        BLAKE2B_INIT(mb_msgs[i], mb_jobs[i].ll, 0, mb_jobs[i].nn, mb_single);
+        if(memcmp(mb_single, mb_outs[i], mb_jobs[i].nn) != 0){
+            ++mb_mismatches;
+        }
+    }
+
+    failures += mb_mismatches;
+
+    printf("Multi-buffer BLAKE2b (%u lanes), %u messages: %s\n\n",
+           BLAKE2B_MB_LANES, MB_TEST_JOBS,
+           mb_mismatches == 0 ? "MATCH" : "MISMATCH"
+          );
+
+
+    /********** NOW TESTING BLAKE2bp (4-WAY PARALLEL TREE) ***************/
+
+    /* Reference BLAKE2bp outputs for data bytes (i mod 251), of lengths
+     * 0, 10000 and 131072 bytes, 64-byte digests, unkeyed.
+     */
+    const u64   bp_lens[3] = {0, 10000, 131072};
+    const char* bp_kats[3] = {
+    "b5ef811a8038f70b628fa8b294daae7492b1ebe343a80eaabbf1f6ae664dd67b"
+    "9d90b0120791eab81dc96985f28849f6a305186a85501b405114bfa678df9380",
+    "ce5622afeac4bb4a09386dc4decea346c202fd8dff8c924cad73802e43ee7f75"
+    "78a907e768d333db7569228e362560c0c99d9448405ec85c916c07478d88b771",
+    "07a29e74093675af6a704f6f2461f402efc678c65b8bb63e7dda9efca0482115"
+    "ea25744a1fd866d3efcdaf1d35efefc9f45d8d25180800cf49c1f8ad94144a2e"
+    };
+
+    u8* bp_msg = calloc(1, 131072);
+
+    for(u64 i = 0; i < 131072; ++i){ bp_msg[i] = (u8)(i % 251); }
+
+    for(u64 i = 0; i < 3; ++i){
+        BLAKE2BP(bp_msg, bp_lens[i], 64, mac_tag);
+
+        for(u32 j = 0; j < 64; ++j){
+            sprintf(mac_hex + (2*j), "%02x", mac_tag[j]);
+        }
+
+        if(strcmp(mac_hex, bp_kats[i]) != 0){ ++failures; }
+
+        printf("BLAKE2bp of %6lu-byte msg    : %s\n", bp_lens[i],
+               strcmp(mac_hex, bp_kats[i]) == 0 ? "MATCH" : "MISMATCH"
+              );
+    }
+    printf("\n");
+
+    free(bp_msg);
+
+    if(failures){
+        printf("[ERR] TEST BLAKE2B: %lu check(s) failed.\n\n", failures);
+        return 1;
+    }
+
     return 0;
     
 }
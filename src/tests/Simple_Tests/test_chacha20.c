@@ -18,6 +18,12 @@ void uint32_print_bits(uint32_t n){
     printf("\n\n");
 }
 
+/* Fresh thread, fresh generator state - draw from it and hand it back. */
+void* drbg_thread_draw(void* out){
+    CSPRNG_GET_BYTES((u8*)out, 64);
+    return NULL;
+}
+
 int main(){
     /********* NOW TESTING ChaCha20 **************/
     
@@ -64,6 +70,71 @@ int main(){
     free(key); free(nonce); free(cyphertext);
     */
     
+    /********* NOW TESTING THE ChaCha20 DRBG **************/
+
+    /* Draw enough odd-sized chunks to cross several buffer refills, and make
+     * sure the output isn't stuck, repeating or wildly skewed. Then a second
+     * thread has to get a stream of its own, not a copy of ours.
+     */
+    #define DRBG_TEST_LEN 100000
+
+    u8* drbg_out = calloc(1, DRBG_TEST_LEN);
+    u8  drbg_thread_out[64];
+    u8  drbg_main_out[64];
+    u64 byte_counts[256];
+    u64 drawn = 0;
+    u64 chunk;
+    u64 max_count = 0;
+    u64 min_count = DRBG_TEST_LEN;
+    u8  drbg_ok = 1;
+    u8  threads_ok;
+
+    pthread_t drbg_thread;
+
+    memset(byte_counts, 0, sizeof(byte_counts));
+
+    while(drawn < DRBG_TEST_LEN){
+        chunk = 1 + ((drawn * 7) % 333);
+        if(drawn + chunk > DRBG_TEST_LEN){
+            chunk = DRBG_TEST_LEN - drawn;
+        }
+        drbg_ok &= CSPRNG_GET_BYTES(drbg_out + drawn, chunk);
+        drawn += chunk;
+    }
+
+    for(u64 i = 0; i < DRBG_TEST_LEN; ++i){
+        ++byte_counts[drbg_out[i]];
+    }
+
+    for(u64 i = 0; i < 256; ++i){
+        if(byte_counts[i] > max_count){ max_count = byte_counts[i]; }
+        if(byte_counts[i] < min_count){ min_count = byte_counts[i]; }
+    }
+
+    /* Expected count is ~390 per byte value. */
+    printf("DRBG byte counts: min %lu, max %lu -> %s\n"
+           ,min_count, max_count
+           ,(drbg_ok && min_count > 250 && max_count < 550) ? "PASS" : "FAIL"
+          );
+
+    pthread_create(&drbg_thread, NULL, drbg_thread_draw, drbg_thread_out);
+    pthread_join(drbg_thread, NULL);
+
+    CSPRNG_GET_BYTES(drbg_main_out, 64);
+
+    threads_ok = (memcmp(drbg_thread_out, drbg_main_out, 64) != 0);
+
+    printf("DRBG per-thread streams differ: %s\n\n"
+           ,threads_ok ? "PASS" : "FAIL"
+          );
+
+    free(drbg_out);
+
+    if(!drbg_ok || min_count <= 250 || max_count >= 550 || !threads_ok){
+        printf("[ERR] TEST CHACHA20: DRBG checks failed.\n\n");
+        return 1;
+    }
+
     return 0;
     
 }
@@ -0,0 +1,443 @@
+#include "../../lib/cryptolib.h"
+
+#define RESBITS 12800
+
+/* Curve25519 public-key backend conformance and speed harness.
+ *
+ * X25519 is checked against RFC 7748: the two single-shot vectors of section
+ * 5.2, its iterated vector after 1 and 1000 rounds, and the Alice/Bob key
+ * agreement of section 6.1.
+ *
+ * The signature has no published vectors, since it hashes with BLAKE2b where
+ * Ed25519 hashes with SHA-512. Its expected public keys and signatures come
+ * from the RFC 8032 section 6 Python reference with sha512 swapped for
+ * hashlib.blake2b(digest_size=64). That same script, left on sha512, gives
+ * the RFC's own test vector 1, so the rest of it is known good.
+ *
+ * Then tampering: flipped bits in the data, R, S and the public key, and S
+ * pushed up by L, must all be rejected. Key agreement must come out the same
+ * from both sides and equal X25519 of the clamped scalar with the base u = 9.
+ *
+ * Last, operations per second, for comparing with test_signatures' numbers
+ * of the 3072-bit group.
+ *
+ * Exits with 1 if any check fails.
+ */
+
+struct x25519_case{
+    const char* scalar_hex;
+    const char* u_hex;
+    const char* out_hex;
+};
+
+const struct x25519_case x25519_vectors[] = {
+     {"a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4"
+     ,"e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c"
+     ,"c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552"
+     }
+    ,{"4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d"
+     ,"e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493"
+     ,"95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957"
+     }
+};
+
+const char* x25519_iter_1_hex =
+    "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079";
+const char* x25519_iter_1000_hex =
+    "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51";
+
+const char* alice_priv_hex =
+    "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a";
+const char* alice_pub_hex =
+    "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a";
+const char* bob_priv_hex =
+    "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb";
+const char* bob_pub_hex =
+    "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f";
+const char* alice_bob_shared_hex =
+    "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742";
+
+/* Private key bytes are all priv_byte, or 0, 1, 2 ... 31 if priv_byte is 0
+ * and counting is 1. Data is data_len bytes of 0, 1, 2 ... or "abc".
+ */
+struct sig_case{
+    u8          priv_byte;
+    u8          counting;
+    const char* data;
+    u64         data_len;
+    const char* pub_hex;
+    const char* sig_hex;
+};
+
+const struct sig_case sig_vectors[] = {
+     {0x00, 0, NULL, 0
+     ,"19d3d919475deed4696b5d13018151d1af88b2bd3bcff048b45031c1f36d1858"
+     ,"6f87f830a160312ecfb07091b4c6eeb51ed4ea330cb6a400bf4e00d8cca26fbb"
+      "c818d94aa17ae0e671d1db8496758a7d0f2c49be8f28a3175a1f1e5c5e8ab503"
+     }
+    ,{0x00, 1, "abc", 3
+     ,"f65333fa6303b6a23defd7de2af8aa461cb047ccbf12d4edd29ef3b1eba6706b"
+     ,"f22299476253907d3c66224eb8a939676533e5c59d41ffdca043b4ed82c2e317"
+      "c51e0237699f8c0b2d03078d0776220e34e33bca471afc467c0414d769856c0f"
+     }
+    ,{0xA5, 0, NULL, 200
+     ,"67308108827824d3060484110d29a3fceaa4291ba88c840e362d2bb577e3ce5d"
+     ,"f8c3b63041efa0d7e4df9fe38694d2f113e15b85553e0be139004d8c0d8529cc"
+      "bcd2e58a79e816797f67a738ad506902925318d3f432c09b98523b15593b7b09"
+     }
+};
+
+void hex_to_bytes(const char* hex, u8* out, u64 len){
+
+    unsigned int byte;
+
+    for(u64 i = 0; i < len; ++i){
+        sscanf(hex + (2 * i), "%2x", &byte);
+        out[i] = (u8)byte;
+    }
+}
+
+u8 check_bytes(const char* what, const u8* got, const char* expected_hex){
+
+    u8 expected[64];
+    u64 len = strlen(expected_hex) / 2;
+
+    hex_to_bytes(expected_hex, expected, len);
+
+    if(memcmp(got, expected, len) != 0){
+        printf("[ERR] %s mismatch.\n      Got:      ", what);
+        for(u64 i = 0; i < len; ++i){ printf("%02x", got[i]); }
+        printf("\n      Expected: %s\n", expected_hex);
+        return 0;
+    }
+
+    printf("[OK] %s matches.\n", what);
+
+    return 1;
+}
+
+u64 test_x25519(void){
+
+    u8  k[32];
+    u8  u[32];
+    u8  out[32];
+    u8  alice_priv[32];
+    u8  bob_priv[32];
+    u8  alice_pub[32];
+    u8  bob_pub[32];
+    u8  shared_a[32];
+    u8  shared_b[32];
+    u64 failed = 0;
+
+    const u64 num_vectors = sizeof(x25519_vectors) / sizeof(x25519_vectors[0]);
+
+    for(u64 i = 0; i < num_vectors; ++i){
+
+        hex_to_bytes(x25519_vectors[i].scalar_hex, k, 32);
+        hex_to_bytes(x25519_vectors[i].u_hex,      u, 32);
+
+        X25519(k, u, out);
+
+        if(!check_bytes("X25519 RFC 7748 5.2 vector", out
+                        ,x25519_vectors[i].out_hex))
+        {
+            ++failed;
+        }
+    }
+
+    /* k = u = 9, then k, u = X25519(k, u), k over and over. */
+    memset(k, 0, 32);
+    memset(u, 0, 32);
+    k[0] = 9;
+    u[0] = 9;
+
+    for(u64 i = 1; i <= 1000; ++i){
+
+        X25519(k, u, out);
+
+        memcpy(u, k,   32);
+        memcpy(k, out, 32);
+
+        if(   i == 1
+           && !check_bytes("X25519 iterated x1", k, x25519_iter_1_hex)
+          )
+        {
+            ++failed;
+        }
+    }
+
+    if(!check_bytes("X25519 iterated x1000", k, x25519_iter_1000_hex)){
+        ++failed;
+    }
+
+    hex_to_bytes(alice_priv_hex, alice_priv, 32);
+    hex_to_bytes(bob_priv_hex,   bob_priv,   32);
+
+    memset(u, 0, 32);
+    u[0] = 9;
+
+    X25519(alice_priv, u, alice_pub);
+    X25519(bob_priv,   u, bob_pub);
+    X25519(alice_priv, bob_pub, shared_a);
+    X25519(bob_priv, alice_pub, shared_b);
+
+    if(   !check_bytes("X25519 RFC 7748 6.1 Alice pub", alice_pub
+                       ,alice_pub_hex)
+       || !check_bytes("X25519 RFC 7748 6.1 Bob pub",   bob_pub
+                       ,bob_pub_hex)
+       || !check_bytes("X25519 RFC 7748 6.1 Alice K",   shared_a
+                       ,alice_bob_shared_hex)
+       || !check_bytes("X25519 RFC 7748 6.1 Bob K",     shared_b
+                       ,alice_bob_shared_hex)
+      )
+    {
+        ++failed;
+    }
+
+    /* u = 0 is of small order, there must be no shared secret. */
+    memset(u, 0, 32);
+
+    if(X25519(alice_priv, u, out) != 0){
+        printf("[ERR] X25519 gave a shared secret with u = 0.\n");
+        ++failed;
+    }
+    else{
+        printf("[OK] X25519 refuses u = 0.\n");
+    }
+
+    return failed;
+}
+
+u64 test_signatures(void){
+
+    u8  priv[32];
+    u8  pub[32];
+    u8  sig[64];
+    u8  bad_sig[64];
+    u8  bad_pub[32];
+    u8  data[256];
+    u8  carry;
+    u16 sum;
+    u64 failed = 0;
+
+    const struct sig_case* c;
+
+    for(u64 i = 0; i < sizeof(sig_vectors) / sizeof(sig_vectors[0]); ++i){
+
+        c = &(sig_vectors[i]);
+
+        for(u64 j = 0; j < 32; ++j){
+            priv[j] = c->counting ? (u8)j : c->priv_byte;
+        }
+
+        for(u64 j = 0; j < c->data_len; ++j){
+            data[j] = c->data ? (u8)(c->data[j]) : (u8)j;
+        }
+
+        Curve25519_PUBKEY(priv, pub);
+        Curve25519_SIGN(priv, pub, data, c->data_len, sig);
+
+        if(   !check_bytes("Curve25519 public key", pub, c->pub_hex)
+           || !check_bytes("Curve25519 signature",  sig, c->sig_hex)
+          )
+        {
+            ++failed;
+        }
+
+        if(!Curve25519_VERIFY(pub, data, c->data_len, sig)){
+            printf("[ERR] Curve25519 rejected its own signature.\n");
+            ++failed;
+        }
+
+        /* Every kind of tampering must fail. */
+        if(c->data_len > 0){
+            data[0] ^= 0x01;
+            if(Curve25519_VERIFY(pub, data, c->data_len, sig)){
+                printf("[ERR] Curve25519 accepted tampered data.\n");
+                ++failed;
+            }
+            data[0] ^= 0x01;
+        }
+
+        memcpy(bad_sig, sig, 64);
+        bad_sig[5] ^= 0x20;
+
+        if(Curve25519_VERIFY(pub, data, c->data_len, bad_sig)){
+            printf("[ERR] Curve25519 accepted a tampered R.\n");
+            ++failed;
+        }
+
+        memcpy(bad_sig, sig, 64);
+        bad_sig[40] ^= 0x04;
+
+        if(Curve25519_VERIFY(pub, data, c->data_len, bad_sig)){
+            printf("[ERR] Curve25519 accepted a tampered S.\n");
+            ++failed;
+        }
+
+        /* S + L is the same scalar, but not the canonical one. */
+        memcpy(bad_sig, sig, 64);
+        carry = 0;
+
+        for(u64 j = 0; j < 32; ++j){
+            sum = (u16)(bad_sig[32 + j] + sc25519_L[j] + carry);
+            bad_sig[32 + j] = (u8)sum;
+            carry = (u8)(sum >> 8);
+        }
+
+        if(Curve25519_VERIFY(pub, data, c->data_len, bad_sig)){
+            printf("[ERR] Curve25519 accepted S + L.\n");
+            ++failed;
+        }
+
+        memcpy(bad_pub, pub, 32);
+        bad_pub[0] ^= 0x02;
+
+        if(Curve25519_VERIFY(bad_pub, data, c->data_len, sig)){
+            printf("[ERR] Curve25519 accepted the wrong public key.\n");
+            ++failed;
+        }
+    }
+
+    printf("[OK] Curve25519 signature tampering checks done.\n");
+
+    return failed;
+}
+
+u64 test_agreement(void){
+
+    u8  priv_a[32], pub_a[32];
+    u8  priv_b[32], pub_b[32];
+    u8  shared_a[32], shared_b[32];
+    u8  expanded[64];
+    u8  base_u[32];
+    u8  mont_pub_a[32];
+    u8  mont_pub_b[32];
+    u8  direct[32];
+    u64 failed = 0;
+
+    if(!Curve25519_KEYGEN(priv_a, pub_a) || !Curve25519_KEYGEN(priv_b, pub_b)){
+        return 1;
+    }
+
+    if(   !Curve25519_AGREE(priv_a, pub_b, shared_a)
+       || !Curve25519_AGREE(priv_b, pub_a, shared_b)
+       || memcmp(shared_a, shared_b, 32) != 0
+      )
+    {
+        printf("[ERR] Curve25519 agreement differs between the two sides.\n");
+        ++failed;
+    }
+    else{
+        printf("[OK] Curve25519 agreement matches on both sides.\n");
+    }
+
+    /* Same thing done the plain X25519 way from the clamped scalars. */
+    memset(base_u, 0, 32);
+    base_u[0] = 9;
+
+    curve25519_expand_privkey(priv_a, expanded);
+    X25519(expanded, base_u, mont_pub_a);
+    curve25519_expand_privkey(priv_b, expanded);
+    X25519(expanded, base_u, mont_pub_b);
+    X25519(expanded, mont_pub_a, direct);
+
+    if(memcmp(direct, shared_a, 32) != 0){
+        printf("[ERR] Curve25519 agreement isn't X25519(a, X25519(b, 9)).\n");
+        ++failed;
+    }
+    else{
+        printf("[OK] Curve25519 agreement equals X25519(b, X25519(a, 9)).\n");
+    }
+
+    return failed;
+}
+
+double ops_per_sec(u64 ops, struct timespec* start, struct timespec* end){
+
+    double secs =   (double)(end->tv_sec - start->tv_sec)
+                  + ((double)(end->tv_nsec - start->tv_nsec) / 1e9);
+
+    return (double)ops / secs;
+}
+
+void time_operations(void){
+
+    struct timespec start, end;
+
+    const u64 ops = 2000;
+
+    u8  priv[32], pub[32], peer_priv[32], peer_pub[32];
+    u8  sig[64];
+    u8  shared[32];
+    u8  data[1024];
+    u64 valid = 0;
+
+    Curve25519_KEYGEN(priv, pub);
+    Curve25519_KEYGEN(peer_priv, peer_pub);
+    CSPRNG_GET_BYTES(data, sizeof(data));
+
+    printf("\n***** Curve25519 operations per second, 1 KB data *****\n\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(u64 i = 0; i < ops; ++i){
+        Curve25519_PUBKEY(priv, pub);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("keygen : %9.0f ops/s\n", ops_per_sec(ops, &start, &end));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(u64 i = 0; i < ops; ++i){
+        Curve25519_AGREE(priv, peer_pub, shared);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("agree  : %9.0f ops/s\n", ops_per_sec(ops, &start, &end));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(u64 i = 0; i < ops; ++i){
+        Curve25519_SIGN(priv, pub, data, sizeof(data), sig);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("sign   : %9.0f ops/s\n", ops_per_sec(ops, &start, &end));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(u64 i = 0; i < ops; ++i){
+        valid += Curve25519_VERIFY(pub, data, sizeof(data), sig);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("verify : %9.0f ops/s (%lu valid)\n\n"
+           ,ops_per_sec(ops, &start, &end), valid
+          );
+
+    return;
+}
+
+int main(){
+
+    u64 failed = 0;
+
+    printf("\n***** X25519 RFC 7748 test vectors *****\n\n");
+
+    failed += test_x25519();
+
+    printf("\n***** Curve25519 signatures vs reference implementation "
+           "*****\n\n"
+          );
+
+    failed += test_signatures();
+
+    printf("\n***** Curve25519 key agreement *****\n\n");
+
+    failed += test_agreement();
+
+    time_operations();
+
+    if(failed){
+        printf("[ERR] Curve25519: %lu check(s) FAILED.\n\n", failed);
+    }
+    else{
+        printf("[OK] Curve25519: all checks passed.\n\n");
+    }
+
+    return (failed ? 1 : 0);
+}
@@ -0,0 +1,466 @@
+/* Tests of room text messages, from one guest's construct_msg_30() to the
+ * others' process_msg_30(), with no network connection. Signed type_30s
+ * first, then type_31s with room MAC tags in place of the signatures.
+ *
+ * The client keeps its room in globals, so one process can only be one guest
+ * at a time. Each test guest gets their own copy of those globals, and we
+ * swap a guest's copy in whenever we act as them. The server's part, putting
+ * in the sender's userID and signing the packet, is done here by hand.
+ */
+#include "../../client/Network_Code/TCP_client.h"
+
+#define TEST_NUM_GUESTS 3
+#define TEST_TEXT       "Hello there, room."
+
+/* One guest of the test room, and their view of it. */
+struct test_guest{
+    char   user_id[SMALL_FIELD_LEN];
+    u64    user_ix;
+    bigint privkey;
+    bigint pubkey;
+    bigint pubkey_mont;
+
+    struct roommate roommates[roommates_arr_siz];
+    u64             slots_bitmask;
+    u64             key_usage_bitmask;
+    u64             num_roommates;
+};
+
+struct test_guest guests[TEST_NUM_GUESTS];
+
+bigint server_privkey;
+
+/* Become guest g: their keys, their ID and their roommates. */
+void act_as(struct test_guest* g){
+
+    memcpy(own_user_id, g->user_id, SMALL_FIELD_LEN);
+    own_ix = g->user_ix;
+
+    own_privkey = g->privkey;
+
+    memcpy(roommates, g->roommates, sizeof(roommates));
+    roommate_slots_bitmask     = g->slots_bitmask;
+    roommate_key_usage_bitmask = g->key_usage_bitmask;
+    num_roommates              = g->num_roommates;
+
+    return;
+}
+
+/* Stop being guest g, keeping what happened to their room state meanwhile,
+ * like the nonce counters going up.
+ */
+void done_as(struct test_guest* g){
+
+    memcpy(g->roommates, roommates, sizeof(roommates));
+    g->slots_bitmask     = roommate_slots_bitmask;
+    g->key_usage_bitmask = roommate_key_usage_bitmask;
+    g->num_roommates     = num_roommates;
+
+    return;
+}
+
+/* Give guest g a long-term key pair, as the client makes one at register. */
+void make_test_guest(struct test_guest* g, const char* user_id, u64 user_ix){
+
+    u8 privkey_buf[PRIVKEY_LEN];
+
+    memset(g, 0, sizeof(struct test_guest));
+
+    strncpy(g->user_id, user_id, SMALL_FIELD_LEN - 1);
+    g->user_ix = user_ix;
+
+    gen_priv_key(PRIVKEY_LEN, privkey_buf);
+
+    bigint_create(&(g->privkey), MAX_BIGINT_SIZ, 0);
+    memcpy(g->privkey.bits, privkey_buf, PRIVKEY_LEN);
+    g->privkey.used_bits = get_used_bits(privkey_buf, PRIVKEY_LEN);
+    g->privkey.free_bits = MAX_BIGINT_SIZ - g->privkey.used_bits;
+
+    bigint_create(&(g->pubkey),      MAX_BIGINT_SIZ, 0);
+    bigint_create(&(g->pubkey_mont), MAX_BIGINT_SIZ, 0);
+
+    MONT_POW_modM(Gm, &(g->privkey), M, &(g->pubkey));
+    Get_Mont_Form(&(g->pubkey), &(g->pubkey_mont), M);
+
+    explicit_bzero(privkey_buf, PRIVKEY_LEN);
+
+    return;
+}
+
+/* Put guest `other` into guest g's room, the way process_msg_20() and
+ * process_msg_21() do: same DH, same split of it into KBA, KAB and Nonce.
+ * other_joined_later says which of the two got there first - the one who
+ * was already in the room has the other's key usage bit on.
+ */
+void add_test_roommate( struct test_guest* g, struct test_guest* other
+                       ,u8 other_joined_later
+                      )
+{
+    u64 slot = g->num_roommates;
+
+    bigint shared_secret;
+
+    struct roommate* mate = &(g->roommates[slot]);
+
+    bigint_create(&shared_secret, MAX_BIGINT_SIZ, 0);
+
+    MONT_POW_modM(&(other->pubkey_mont), &(g->privkey), M, &shared_secret);
+
+    memcpy(mate->guest_user_id, other->user_id, SMALL_FIELD_LEN);
+
+    bigint_create(&(mate->guest_pubkey),      MAX_BIGINT_SIZ, 0);
+    bigint_create(&(mate->guest_pubkey_mont), MAX_BIGINT_SIZ, 0);
+    bigint_equate2(&(mate->guest_pubkey),      &(other->pubkey));
+    bigint_equate2(&(mate->guest_pubkey_mont), &(other->pubkey_mont));
+
+    mate->guest_KBA   = (u8*)calloc(1, SESSION_KEY_LEN);
+    mate->guest_KAB   = (u8*)calloc(1, SESSION_KEY_LEN);
+    mate->guest_Nonce = (u8*)calloc(1, LONG_NONCE_LEN);
+
+    memcpy(mate->guest_KBA, shared_secret.bits, SESSION_KEY_LEN);
+    memcpy(mate->guest_KAB, shared_secret.bits + SESSION_KEY_LEN
+           ,SESSION_KEY_LEN
+          );
+    memcpy( mate->guest_Nonce, shared_secret.bits + (2 * SESSION_KEY_LEN)
+           ,LONG_NONCE_LEN
+          );
+
+    mate->guest_nonce_counter = 0;
+
+    g->slots_bitmask |= BITMASK_BIT_ON_AT(slot);
+
+    if(other_joined_later){
+        g->key_usage_bitmask |= BITMASK_BIT_ON_AT(slot);
+    }
+
+    ++(g->num_roommates);
+
+    /* And the room MAC tag key, as the client makes it right after. */
+    act_as(g);
+    init_guest_mac(slot);
+    done_as(g);
+
+    free(shared_secret.bits);
+
+    return;
+}
+
+/* The slot in guest g's roommates that guest `other` is in. */
+u64 test_slot_of(struct test_guest* g, struct test_guest* other){
+
+    for(u64 i = 0; i < g->num_roommates; ++i){
+        if(strncmp( g->roommates[i].guest_user_id, other->user_id
+                   ,SMALL_FIELD_LEN
+                  ) == 0
+          )
+        {
+            return i;
+        }
+    }
+
+    return MAX_CLIENTS + 1;
+}
+
+/* Free what add_test_roommate() gave guest g. */
+void free_test_guest(struct test_guest* g){
+
+    for(u64 i = 0; i < g->num_roommates; ++i){
+        free(g->roommates[i].guest_pubkey.bits);
+        free(g->roommates[i].guest_pubkey_mont.bits);
+        free(g->roommates[i].guest_KBA);
+        free(g->roommates[i].guest_KAB);
+        free(g->roommates[i].guest_Nonce);
+    }
+
+    free(g->privkey.bits);
+    free(g->pubkey.bits);
+    free(g->pubkey_mont.bits);
+
+    return;
+}
+
+/* Have guest `sender` send TEST_TEXT to the room, relay it as the server does
+ * and check every other guest reads TEST_TEXT from it. Returns 1 if they all
+ * did, 0 if not.
+ */
+u8 send_and_receive(int* sock_pair, u64 sender){
+
+    const u64 text_len = strlen(TEST_TEXT);
+
+    u8  text[MAX_TXT_LEN];
+    u8  line[MESSAGE_LINE_LEN];
+    u8  sent_packet[MAX_MSG_LEN];
+    u8  relayed[MAX_MSG_LEN];
+    u8  ok = 1;
+
+    u64 line_len;
+
+    ssize_t packet_len;
+
+    memset(text, 0, MAX_TXT_LEN);
+    memcpy(text, TEST_TEXT, text_len);
+
+    act_as(&(guests[sender]));
+
+    if(construct_msg_30(text, text_len) != 1){
+        printf("[ERR] TEST ROOM: %s couldn't send the message.\n"
+               ,guests[sender].user_id
+              );
+        done_as(&(guests[sender]));
+        return 0;
+    }
+
+    done_as(&(guests[sender]));
+
+    packet_len = recv(sock_pair[1], sent_packet, MAX_MSG_LEN, MSG_DONTWAIT);
+
+    if(packet_len <= (ssize_t)(3 * SMALL_FIELD_LEN)){
+        printf("[ERR] TEST ROOM: No message packet went out.\n");
+        return 0;
+    }
+
+    /* The server's part: their userID in for their user_ix, and Sign2 if
+     * it's a type_30. A type_31 goes on with no signatures at all, the
+     * session MAC it came with is only for the server.
+     */
+    for(u64 i = 0; i < TEST_NUM_GUESTS; ++i){
+
+        if(i == sender){
+            continue;
+        }
+
+        memcpy(relayed, sent_packet, (size_t)packet_len);
+        memcpy( relayed + SMALL_FIELD_LEN, guests[sender].user_id
+               ,SMALL_FIELD_LEN
+              );
+
+        if(*((u64*)sent_packet) == PACKET_ID_30){
+            Signature_GENERATE( M, Q, Gm, relayed, (u64)packet_len
+                               ,relayed + packet_len
+                               ,&server_privkey, PRIVKEY_LEN
+                              );
+        }
+
+        act_as(&(guests[i]));
+
+        if(   process_msg_30(relayed, line, &line_len) != 1
+           || line_len != SMALL_FIELD_LEN + 2 + text_len
+           || strncmp( (char*)line, guests[sender].user_id
+                      ,SMALL_FIELD_LEN
+                     ) != 0
+           || memcmp(line + SMALL_FIELD_LEN + 2, TEST_TEXT, text_len) != 0
+          )
+        {
+            printf("[ERR] TEST ROOM: %s didn't read %s's message right.\n"
+                   ,guests[i].user_id, guests[sender].user_id
+                  );
+            ok = 0;
+        }
+
+        done_as(&(guests[i]));
+    }
+
+    return ok;
+}
+
+/* Both ends of one DH pair make the same room MAC tag key, though their
+ * key usage bits for each other are opposite, so a tag either one makes
+ * checks out on the other's end. One for a different guest doesn't.
+ */
+u8 test_room_mac_keys(struct test_guest* a, struct test_guest* b){
+
+    struct roommate* b_at_a = &(a->roommates[test_slot_of(a, b)]);
+    struct roommate* a_at_b = &(b->roommates[test_slot_of(b, a)]);
+
+    u8 encr_K[ONE_TIME_KEY_LEN];
+    u8 msg_digest[ROOM_DIGEST_LEN];
+    u8 mac_input[ROOM_MAC_INPUT_LEN];
+    u8 tag[SESSION_MAC_LEN];
+    u8 ok = 1;
+
+    memset(encr_K,     0xAB, ONE_TIME_KEY_LEN);
+    memset(msg_digest, 0xCD, ROOM_DIGEST_LEN);
+
+    /* a to b. */
+    room_mac_input( mac_input, a->user_id, b->user_id, strlen(TEST_TEXT), 0
+                   ,encr_K, msg_digest
+                  );
+
+    BLAKE2B_MAC(&(b_at_a->guest_mac_ctx), mac_input, ROOM_MAC_INPUT_LEN, tag);
+
+    if(BLAKE2B_MAC_VERIFY( &(a_at_b->guest_mac_ctx)
+                          ,mac_input, ROOM_MAC_INPUT_LEN, tag
+                         ) != 1
+      )
+    {
+        ok = 0;
+    }
+
+    /* The same tag, as if it was for someone else's copy of K. */
+    room_mac_input( mac_input, a->user_id, a->user_id, strlen(TEST_TEXT), 0
+                   ,encr_K, msg_digest
+                  );
+
+    if(BLAKE2B_MAC_VERIFY( &(a_at_b->guest_mac_ctx)
+                          ,mac_input, ROOM_MAC_INPUT_LEN, tag
+                         ) == 1
+      )
+    {
+        ok = 0;
+    }
+
+    /* b to a. */
+    room_mac_input( mac_input, b->user_id, a->user_id, strlen(TEST_TEXT), 1
+                   ,encr_K, msg_digest
+                  );
+
+    BLAKE2B_MAC(&(a_at_b->guest_mac_ctx), mac_input, ROOM_MAC_INPUT_LEN, tag);
+
+    if(BLAKE2B_MAC_VERIFY( &(b_at_a->guest_mac_ctx)
+                          ,mac_input, ROOM_MAC_INPUT_LEN, tag
+                         ) != 1
+      )
+    {
+        ok = 0;
+    }
+
+    printf("Room MAC keys: %s and %s check each other's tags: %s\n\n"
+           ,a->user_id, b->user_id, ok ? "YES" : "NO"
+          );
+
+    return ok;
+}
+
+/* Turn on type_31s, with made up session MAC keys with the server. */
+void start_room_macs(u8* server_keys, u8* one_time_keys){
+
+    CSPRNG_GET_BYTES(server_keys,   2 * SESSION_KEY_LEN);
+    CSPRNG_GET_BYTES(one_time_keys, 2 * SESSION_KEY_LEN);
+
+    KBA = server_keys;
+    KAB = server_keys + SESSION_KEY_LEN;
+
+    init_session_macs(one_time_keys);
+
+    use_room_macs = 1;
+
+    return;
+}
+
+/* Everyone in a room of three sends a message, twice around, so each pair
+ * of guests has their K wrapped both ways and the per-pair Nonces move on.
+ * Then twice more as type_31s. Guest 0 made the room, guest 1 joined it,
+ * then guest 2 did.
+ */
+u8 test_room_messages(void){
+
+    int sock_pair[2];
+
+    u8 server_keys[2 * SESSION_KEY_LEN];
+    u8 one_time_keys[2 * SESSION_KEY_LEN];
+    u8 ok = 1;
+    u8 mac_ok = 1;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sock_pair) != 0){
+        printf("[ERR] TEST ROOM: Couldn't make the test connection.\n");
+        return 0;
+    }
+
+    own_socket_fd = sock_pair[0];
+
+    make_test_guest(&(guests[0]), "owner", 1);
+    make_test_guest(&(guests[1]), "second", 2);
+    make_test_guest(&(guests[2]), "third", 3);
+
+    for(u64 i = 0; i < TEST_NUM_GUESTS; ++i){
+        for(u64 j = 0; j < TEST_NUM_GUESTS; ++j){
+            if(i != j){
+                add_test_roommate(&(guests[i]), &(guests[j]), j > i);
+            }
+        }
+    }
+
+    for(u64 round = 0; round < 2; ++round){
+        for(u64 i = 0; i < TEST_NUM_GUESTS; ++i){
+            if(!send_and_receive(sock_pair, i)){
+                ok = 0;
+            }
+        }
+    }
+
+    printf("Room messages: every guest reads every other guest's message, "
+           "both ways round: %s\n\n"
+           ,ok ? "YES" : "NO"
+          );
+
+    if(!test_room_mac_keys(&(guests[0]), &(guests[1]))){
+        mac_ok = 0;
+    }
+
+    start_room_macs(server_keys, one_time_keys);
+
+    for(u64 round = 0; round < 2; ++round){
+        for(u64 i = 0; i < TEST_NUM_GUESTS; ++i){
+            if(!send_and_receive(sock_pair, i)){
+                mac_ok = 0;
+            }
+        }
+    }
+
+    printf("Room MACs: every guest reads every other guest's type_31: %s\n\n"
+           ,mac_ok ? "YES" : "NO"
+          );
+
+    use_room_macs = 0;
+    release_session_macs();
+
+    KAB = NULL;
+    KBA = NULL;
+
+    explicit_bzero(server_keys,   sizeof(server_keys));
+    explicit_bzero(one_time_keys, sizeof(one_time_keys));
+
+    for(u64 i = 0; i < TEST_NUM_GUESTS; ++i){
+        free_test_guest(&(guests[i]));
+    }
+
+    /* Those were the test guests', don't let the client free them again. */
+    memset(roommates, 0, sizeof(roommates));
+    memset(&own_privkey, 0, sizeof(bigint));
+
+    close(sock_pair[0]);
+    close(sock_pair[1]);
+
+    own_socket_fd = -1;
+
+    return ok && mac_ok;
+}
+
+int main(){
+
+    u8 ok = 1;
+
+    M  = get_BIGINT_from_DAT
+        (3072, "../bin/saved_M.dat\0",  3071, MAX_BIGINT_SIZ);
+
+    Q  = get_BIGINT_from_DAT
+        (320,  "../bin/saved_Q.dat\0",  320,  MAX_BIGINT_SIZ);
+
+    Gm = get_BIGINT_from_DAT
+        (3072, "../bin/saved_Gm.dat\0", 3071, MAX_BIGINT_SIZ);
+
+    server_pubkey = get_BIGINT_from_DAT
+        (3072, "../bin/server_pubkey.dat\0", 3071, MAX_BIGINT_SIZ);
+
+    server_privkey = *get_BIGINT_from_DAT
+        (320,  "../bin/server_privkey.dat\0", 318, MAX_BIGINT_SIZ);
+
+    bigint_create(&server_pubkey_mont, MAX_BIGINT_SIZ, 0);
+    Get_Mont_Form(server_pubkey, &server_pubkey_mont, M);
+
+    if(!test_room_messages()){
+        ok = 0;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,1094 @@
+/* Tests of the server's per-session state that need no network connection.
+ *
+ * The server is all in TCP_server.c, main() included, so take it in whole
+ * with its main() renamed out of the way, and call its functions directly on
+ * a client slot set up by hand.
+ */
+#define main rosetta_server_main
+#include "../../server/TCP_server.c"
+#undef main
+
+#define TEST_CLIENT_IX 1
+#define TEST_OLD_SOCK  2  /* The connection the test client logged in on.   */
+#define TEST_NEW_SOCK  3  /* The one they resume their session on later.    */
+#define TEST_POLL_SOCK 4  /* The one they poll for pending messages on.     */
+#define TEST_LOGIN_SOCK 5 /* Another client's, logging in from scratch.     */
+
+#define TEST_RESUME_REQ_LEN \
+        (  (2 * SMALL_FIELD_LEN) + RESUME_NONCE_LEN + RESUME_TICKET_LEN \
+         + SESSION_MAC_LEN)
+
+#define TEST_RESUME_REPLY_LEN \
+        (  (2 * SMALL_FIELD_LEN) + (2 * RESUME_NONCE_LEN) + RESUME_TICKET_LEN \
+         + SESSION_MAC_LEN)
+
+/* Put random bytes in a fresh BigInt, as if it was a key we were sent. */
+void make_test_bigint(bigint* n, u64 len_bytes){
+
+    bigint_create(n, MAX_BIGINT_SIZ, 0);
+
+    CSPRNG_GET_BYTES(n->bits, len_bytes);
+
+    n->used_bits = get_used_bits(n->bits, len_bytes);
+    n->free_bits = MAX_BIGINT_SIZ - n->used_bits;
+
+    return;
+}
+
+/* Derive one direction's session MAC key the way the client does it, see
+ * init_session_macs() in TCP_client.h, to check we agree with it.
+ */
+void client_session_mac(u8* session_key, u8* one_time_keys, u8 direction
+                       ,struct BLAKE2B_MAC_ctx* ctx
+                       )
+{
+    u8 mac_key[SESSION_MAC_LEN];
+    u8 kdf_input[(2 * SESSION_KEY_LEN) + 1];
+
+    memcpy(kdf_input, one_time_keys, 2 * SESSION_KEY_LEN);
+
+    kdf_input[2 * SESSION_KEY_LEN] = direction;
+
+    BLAKE2B_KEYED( session_key, SESSION_KEY_LEN, kdf_input, sizeof(kdf_input)
+                  ,SESSION_MAC_LEN, mac_key
+                 );
+
+    BLAKE2B_MAC_INIT(ctx, mac_key, SESSION_MAC_LEN, SESSION_MAC_LEN);
+
+    return;
+}
+
+/* A MAC'd poll from the client, as session_mac_send() in TCP_client.h
+ * makes it: | ID 40 | user_ix | counter | tag |
+ */
+void make_mac_poll(struct BLAKE2B_MAC_ctx* ctx, u64 counter, u8* packet){
+
+    *((u64*)(packet))                         = PACKET_ID_40;
+    *((u64*)(packet + SMALL_FIELD_LEN))       = TEST_CLIENT_IX;
+    *((u64*)(packet + (2 * SMALL_FIELD_LEN))) = counter;
+
+    BLAKE2B_MAC( ctx, packet, 3 * SMALL_FIELD_LEN
+                ,packet + (3 * SMALL_FIELD_LEN)
+               );
+
+    return;
+}
+
+/* Session MACs: a poll is accepted once, only with a counter above the last
+ * one accepted, only with the right tag and only if the client asked for
+ * session MACs at login. Our own tags must check out on the client's side.
+ */
+u8 test_session_macs(void){
+
+    const u64 counter_offset = 2 * SMALL_FIELD_LEN;
+    const u64 poll_len       = counter_offset + SESSION_MAC_AUTH_LEN;
+
+    u8  one_time_keys[2 * SESSION_KEY_LEN];
+    u8  polls[4][(2 * SMALL_FIELD_LEN) + SESSION_MAC_AUTH_LEN];
+    u8  reply[(2 * SMALL_FIELD_LEN) + SESSION_MAC_AUTH_LEN];
+    u8  ok = 1;
+    u8* KAB;
+    u8* KBA;
+
+    struct BLAKE2B_MAC_ctx client_send_ctx;
+    struct BLAKE2B_MAC_ctx client_recv_ctx;
+
+    memset(polls, 0, sizeof(polls));
+    memset(reply, 0, sizeof(reply));
+
+    CSPRNG_GET_BYTES(one_time_keys, sizeof(one_time_keys));
+
+    init_session_macs(TEST_CLIENT_IX, one_time_keys);
+
+    clients[TEST_CLIENT_IX].macs_agreed = 1;
+
+    pick_session_keys( &(clients[TEST_CLIENT_IX].client_pubkey)
+                      ,clients[TEST_CLIENT_IX].shared_secret.bits
+                      ,&KAB, &KBA
+                     );
+
+    client_session_mac( KAB, one_time_keys, SESSION_MAC_DIR_C2S
+                       ,&client_send_ctx
+                      );
+    client_session_mac( KBA, one_time_keys, SESSION_MAC_DIR_S2C
+                       ,&client_recv_ctx
+                      );
+
+    for(u64 i = 0; i < 4; ++i){
+        make_mac_poll(&client_send_ctx, i + 1, polls[i]);
+    }
+
+    /* In order, then the same one again. */
+    if(   authenticate_client_mac(TEST_CLIENT_IX, polls[0], counter_offset) != 1
+       || authenticate_client_mac(TEST_CLIENT_IX, polls[0], counter_offset) != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: First poll or its replay went wrong.\n");
+        ok = 0;
+    }
+
+    /* The 3rd gets here before the 2nd - the 2nd is then too late. */
+    if(   authenticate_client_mac(TEST_CLIENT_IX, polls[2], counter_offset) != 1
+       || authenticate_client_mac(TEST_CLIENT_IX, polls[1], counter_offset) != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Reordered poll wasn't rejected.\n");
+        ok = 0;
+    }
+
+    /* A flipped bit in the tag, then in what it's over. */
+    polls[3][poll_len - 1] ^= 0x01;
+
+    if(authenticate_client_mac(TEST_CLIENT_IX, polls[3], counter_offset) != 0){
+        printf("[ERR] TEST SESSION: Tampered tag wasn't rejected.\n");
+        ok = 0;
+    }
+
+    polls[3][poll_len - 1] ^= 0x01;
+    polls[3][counter_offset] ^= 0x80;
+
+    if(authenticate_client_mac(TEST_CLIENT_IX, polls[3], counter_offset) != 0){
+        printf("[ERR] TEST SESSION: Tampered counter wasn't rejected.\n");
+        ok = 0;
+    }
+
+    polls[3][counter_offset] ^= 0x80;
+
+    /* Right tag, new counter, but they never asked for session MACs. */
+    clients[TEST_CLIENT_IX].macs_agreed = 0;
+
+    if(authenticate_client_mac(TEST_CLIENT_IX, polls[3], counter_offset) != 0){
+        printf("[ERR] TEST SESSION: MAC'd poll taken without agreeing.\n");
+        ok = 0;
+    }
+
+    clients[TEST_CLIENT_IX].macs_agreed = 1;
+
+    if(authenticate_client_mac(TEST_CLIENT_IX, polls[3], counter_offset) != 1){
+        printf("[ERR] TEST SESSION: Last good poll wasn't accepted.\n");
+        ok = 0;
+    }
+
+    /* Our replies: counters 1 and 2, tags the client's keys agree with. */
+    for(u64 i = 1; i <= 2; ++i){
+
+        *((u64*)(reply))                   = PACKET_ID_40;
+        *((u64*)(reply + SMALL_FIELD_LEN)) = TEST_CLIENT_IX;
+
+        session_mac_seal(TEST_CLIENT_IX, reply, 2 * SMALL_FIELD_LEN);
+
+        if(   *((u64*)(reply + (2 * SMALL_FIELD_LEN))) != i
+           || BLAKE2B_MAC_VERIFY( &client_recv_ctx
+                                 ,reply, 3 * SMALL_FIELD_LEN
+                                 ,reply + (3 * SMALL_FIELD_LEN)
+                                ) != 1
+          )
+        {
+            printf("[ERR] TEST SESSION: Our reply %lu doesn't check out.\n"
+                   ,i
+                  );
+            ok = 0;
+        }
+    }
+
+    explicit_bzero(one_time_keys,    sizeof(one_time_keys));
+    explicit_bzero(&client_send_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+    explicit_bzero(&client_recv_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+
+    printf("Session MACs: replayed, reordered, tampered and unagreed polls "
+           "rejected, replies check out: %s\n\n"
+           ,ok ? "YES" : "NO"
+          );
+
+    return ok;
+}
+
+/* Pending messages: what add_pending_msg() queues for a client, a poll gets
+ * back in one type_41, in the order it was queued, and then it's gone. One
+ * past MAX_PEND_MSGS is turned away instead of written past the end.
+ */
+u8 test_pending_msgs(void){
+
+    const u64 msg_len = 3 * SMALL_FIELD_LEN;
+
+    u8  one_time_keys[2 * SESSION_KEY_LEN];
+    u8  poll[(2 * SMALL_FIELD_LEN) + SESSION_MAC_AUTH_LEN];
+    u8  msg[3 * SMALL_FIELD_LEN];
+    u8  ok = 1;
+    u8* reply = calloc(1, MAX_MSG_LEN);
+    u8* KAB;
+    u8* KBA;
+    u8* reply_msg;
+
+    u64 reply_len;
+    u64 auth_offset;
+
+    ssize_t bytes_read;
+
+    int sock_pair[2];
+
+    struct BLAKE2B_MAC_ctx client_send_ctx;
+    struct BLAKE2B_MAC_ctx client_recv_ctx;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sock_pair) != 0){
+        printf("[ERR] TEST SESSION: Couldn't make the test connection.\n");
+        free(reply);
+        return 0;
+    }
+
+    client_socket_fd[TEST_POLL_SOCK] = sock_pair[0];
+
+    CSPRNG_GET_BYTES(one_time_keys, sizeof(one_time_keys));
+
+    init_session_macs(TEST_CLIENT_IX, one_time_keys);
+
+    clients[TEST_CLIENT_IX].macs_agreed = 1;
+
+    pick_session_keys( &(clients[TEST_CLIENT_IX].client_pubkey)
+                      ,clients[TEST_CLIENT_IX].shared_secret.bits
+                      ,&KAB, &KBA
+                     );
+
+    client_session_mac( KAB, one_time_keys, SESSION_MAC_DIR_C2S
+                       ,&client_send_ctx
+                      );
+    client_session_mac( KBA, one_time_keys, SESSION_MAC_DIR_S2C
+                       ,&client_recv_ctx
+                      );
+
+    /* Message i is three of i, one more than there's room for. */
+    for(u64 i = 0; i <= MAX_PEND_MSGS; ++i){
+        for(u64 j = 0; j < 3; ++j){
+            *((u64*)(msg + (j * SMALL_FIELD_LEN))) = i;
+        }
+        add_pending_msg(TEST_CLIENT_IX, msg_len, msg);
+    }
+
+    if(clients[TEST_CLIENT_IX].num_pending_msgs != MAX_PEND_MSGS){
+        printf("[ERR] TEST SESSION: %lu pending messages, not %u.\n"
+               ,clients[TEST_CLIENT_IX].num_pending_msgs, MAX_PEND_MSGS
+              );
+        ok = 0;
+    }
+
+    /* The poll, all of them back, tagged for the client. */
+    make_mac_poll(&client_send_ctx, 1, poll);
+
+    process_msg_40(poll, TEST_POLL_SOCK, 1);
+
+    reply_len =   (2 * SMALL_FIELD_LEN) + SESSION_MAC_AUTH_LEN
+                + (MAX_PEND_MSGS * (SMALL_FIELD_LEN + msg_len));
+
+    auth_offset = reply_len - SESSION_MAC_AUTH_LEN;
+
+    bytes_read = recv(sock_pair[1], reply, MAX_MSG_LEN, MSG_DONTWAIT);
+
+    if(   bytes_read != (ssize_t)reply_len
+       || *((u64*)(reply))                   != PACKET_ID_41
+       || *((u64*)(reply + SMALL_FIELD_LEN)) != MAX_PEND_MSGS
+       || BLAKE2B_MAC_VERIFY( &client_recv_ctx
+                             ,reply, auth_offset + SMALL_FIELD_LEN
+                             ,reply + auth_offset + SMALL_FIELD_LEN
+                            ) != 1
+      )
+    {
+        printf("[ERR] TEST SESSION: Poll didn't get the pending messages.\n");
+        ok = 0;
+        goto label_cleanup;
+    }
+
+    reply_msg = reply + (2 * SMALL_FIELD_LEN);
+
+    for(u64 i = 0; i < MAX_PEND_MSGS; ++i){
+
+        if(   *((u64*)(reply_msg)) != msg_len
+           || *((u64*)(reply_msg + SMALL_FIELD_LEN)) != i
+           || *((u64*)(reply_msg + msg_len)) != i
+          )
+        {
+            printf("[ERR] TEST SESSION: Pending message %lu came back "
+                   "wrong.\n", i
+                  );
+            ok = 0;
+        }
+
+        reply_msg += SMALL_FIELD_LEN + msg_len;
+    }
+
+    /* Nothing's left for the next poll. */
+    make_mac_poll(&client_send_ctx, 2, poll);
+
+    process_msg_40(poll, TEST_POLL_SOCK, 1);
+
+    bytes_read = recv(sock_pair[1], reply, MAX_MSG_LEN, MSG_DONTWAIT);
+
+    if(   bytes_read != (ssize_t)(SMALL_FIELD_LEN + SESSION_MAC_AUTH_LEN)
+       || *((u64*)(reply)) != PACKET_ID_40
+       || clients[TEST_CLIENT_IX].num_pending_msgs != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Second poll still got messages.\n");
+        ok = 0;
+    }
+
+label_cleanup:
+
+    close(sock_pair[0]);
+    close(sock_pair[1]);
+
+    client_socket_fd[TEST_POLL_SOCK] = 0;
+
+    explicit_bzero(one_time_keys,    sizeof(one_time_keys));
+    explicit_bzero(&client_send_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+    explicit_bzero(&client_recv_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+
+    free(reply);
+
+    printf("Pending messages: queued ones come back with the next poll, in "
+           "order, and only once: %s\n\n"
+           ,ok ? "YES" : "NO"
+          );
+
+    return ok;
+}
+
+/* Resumption tickets: one we issue opens to the session it was made from, and
+ * not at all with a flipped bit anywhere or after it expired. A redeemed one's
+ * tag is turned away until requests with it are too old anyway.
+ */
+u8 test_resume_tickets(void){
+
+    const u64 tag_offset = SHORT_NONCE_LEN + RESUME_TICKET_BODY_LEN;
+
+    u64 now = (u64)time(NULL);
+    u64 expiry = now + RESUME_TICKET_LIFETIME;
+
+    u8  ticket[RESUME_TICKET_LEN];
+    u8  body[RESUME_TICKET_BODY_LEN];
+    u8  other_tag[SESSION_MAC_LEN];
+    u8  ok = 1;
+    u8* pubkey_bits      = body + SMALL_FIELD_LEN;
+    u8* pubkey_mont_bits = pubkey_bits + PUBKEY_LEN;
+    u8* secret_bits      = pubkey_mont_bits + PUBKEY_LEN;
+
+    CSPRNG_GET_BYTES(other_tag, SESSION_MAC_LEN);
+
+    /* There and back again. */
+    if(   !issue_resume_ticket(TEST_CLIENT_IX, expiry, ticket)
+       || !open_resume_ticket(ticket, body)
+       || memcmp(body, &expiry, SMALL_FIELD_LEN) != 0
+       || memcmp( pubkey_bits, clients[TEST_CLIENT_IX].client_pubkey.bits
+                 ,PUBKEY_LEN
+                ) != 0
+       || memcmp( pubkey_mont_bits
+                 ,clients[TEST_CLIENT_IX].client_pubkey_mont.bits
+                 ,PUBKEY_LEN
+                ) != 0
+       || memcmp( secret_bits, clients[TEST_CLIENT_IX].shared_secret.bits
+                 ,RESUME_TICKET_SECRET_LEN
+                ) != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Ticket didn't open to what went in.\n");
+        ok = 0;
+    }
+
+    /* A flipped bit in the nonce, the sealed session, then the tag. */
+    for(u64 i = 0; i < 3; ++i){
+
+        u64 flip_at = (i == 0) ? 0 : (i == 1) ? SHORT_NONCE_LEN : tag_offset;
+
+        ticket[flip_at] ^= 0x01;
+
+        if(open_resume_ticket(ticket, body) != 0){
+            printf("[ERR] TEST SESSION: Tampered ticket at byte %lu opened.\n"
+                   ,flip_at
+                  );
+            ok = 0;
+        }
+
+        ticket[flip_at] ^= 0x01;
+    }
+
+    /* Ours and untouched, but expired. */
+    if(   !issue_resume_ticket(TEST_CLIENT_IX, now - 1, ticket)
+       || open_resume_ticket(ticket, body) != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Expired ticket was opened.\n");
+        ok = 0;
+    }
+
+    /* Once only - until requests that could carry it are too old anyway. */
+    if(   redeem_resume_ticket(ticket + tag_offset, now) != 1
+       || redeem_resume_ticket(ticket + tag_offset, now) != 0
+       || redeem_resume_ticket(other_tag, now)           != 1
+       || redeem_resume_ticket( ticket + tag_offset
+                               ,now + (2 * RESUME_MAX_SKEW) + 1
+                              ) != 1
+      )
+    {
+        printf("[ERR] TEST SESSION: Ticket redemption ring went wrong.\n");
+        ok = 0;
+    }
+
+    explicit_bzero(body, RESUME_TICKET_BODY_LEN);
+
+    printf("Resumption tickets: round trip, tampered, expired and redeemed "
+           "twice: %s\n\n"
+           ,ok ? "YES" : "NO"
+          );
+
+    return ok;
+}
+
+/* A resumption request the way resume_session() in TCP_client.h makes it. */
+void make_resume_request(u8* ticket, u64 timestamp, u8* KAB, u8* request){
+
+    const u64 ticket_offset = (2 * SMALL_FIELD_LEN) + RESUME_NONCE_LEN;
+
+    *((u64*)(request))                   = PACKET_ID_03;
+    *((u64*)(request + SMALL_FIELD_LEN)) = timestamp;
+
+    CSPRNG_GET_BYTES(request + (2 * SMALL_FIELD_LEN), RESUME_NONCE_LEN);
+
+    memcpy(request + ticket_offset, ticket, RESUME_TICKET_LEN);
+
+    BLAKE2B_KEYED( KAB, SESSION_KEY_LEN
+                  ,request, ticket_offset + RESUME_TICKET_LEN
+                  ,SESSION_MAC_LEN, request + ticket_offset + RESUME_TICKET_LEN
+                 );
+
+    return;
+}
+
+/* Hand process_msg_03() a request on the new socket, return the packet ID of
+ * what it sent back, with the whole reply in reply if it's that long.
+ */
+u64 send_resume_request(u8* request, int client_end, u8* reply){
+
+    u8 buf[MAX_MSG_LEN];
+
+    ssize_t bytes_read;
+
+    process_msg_03(request, TEST_NEW_SOCK);
+
+    bytes_read = recv(client_end, buf, MAX_MSG_LEN, MSG_DONTWAIT);
+
+    if(bytes_read < (ssize_t)SMALL_FIELD_LEN){
+        return 0;
+    }
+
+    if(bytes_read == TEST_RESUME_REPLY_LEN){
+        memcpy(reply, buf, TEST_RESUME_REPLY_LEN);
+    }
+
+    return *((u64*)buf);
+}
+
+/* Stands in for the recv() thread of the connection the client lost. */
+void* old_connection_thread(void* input){
+
+    (void)input;
+
+    for(;;){
+        pause();
+    }
+
+    return NULL;
+}
+
+/* A full resumption with process_msg_03(), on a different connection than the
+ * session was on, and then again on the same one. The old connection's thread
+ * is stopped and its socket slot freed, but never the one we're on, and the
+ * old session's user slot is the one the resumed session gets. Requests that
+ * are too old, from the future or replayed are refused.
+ */
+u8 test_resume_session(void){
+
+    const u64 ticket_offset =   (2 * SMALL_FIELD_LEN)
+                              + (2 * RESUME_NONCE_LEN);
+
+    u64 now = (u64)time(NULL);
+    u64 new_ix;
+    u64 second_ix;
+
+    u8  ticket[RESUME_TICKET_LEN];
+    u8  request[TEST_RESUME_REQ_LEN];
+    u8  reply[TEST_RESUME_REPLY_LEN];
+    u8  KAB_copy[SESSION_KEY_LEN];
+    u8  KBA_copy[SESSION_KEY_LEN];
+    u8  ok = 1;
+    u8* KAB;
+    u8* KBA;
+
+    int old_pair[2];
+    int new_pair[2];
+
+    void* old_thread_result = NULL;
+
+    struct BLAKE2B_MAC_ctx reply_ctx;
+
+    memset(reply, 0, sizeof(reply));
+
+    if(   socketpair(AF_UNIX, SOCK_STREAM, 0, old_pair) != 0
+       || socketpair(AF_UNIX, SOCK_STREAM, 0, new_pair) != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Couldn't make the test connections.\n");
+        return 0;
+    }
+
+    /* The session lives on the old connection with its own thread, and the
+     * new connection's thread is us.
+     */
+    clients[TEST_CLIENT_IX].sock_ix = TEST_OLD_SOCK;
+
+    client_socket_fd[TEST_OLD_SOCK]           = old_pair[0];
+    client_payload_buffer_ptrs[TEST_OLD_SOCK] = calloc(1, MAX_MSG_LEN);
+    pthread_create( &(client_thread_ids[TEST_OLD_SOCK]), NULL
+                   ,old_connection_thread, NULL
+                  );
+
+    client_socket_fd[TEST_NEW_SOCK]  = new_pair[0];
+    client_thread_ids[TEST_NEW_SOCK] = pthread_self();
+
+    socket_status_bitmask |=   (1ULL << (63ULL - TEST_OLD_SOCK))
+                             | (1ULL << (63ULL - TEST_NEW_SOCK));
+
+    pick_session_keys( &(clients[TEST_CLIENT_IX].client_pubkey)
+                      ,clients[TEST_CLIENT_IX].shared_secret.bits
+                      ,&KAB, &KBA
+                     );
+
+    /* They point into the session's shared secret, which goes away with it. */
+    memcpy(KAB_copy, KAB, SESSION_KEY_LEN);
+    memcpy(KBA_copy, KBA, SESSION_KEY_LEN);
+
+    issue_resume_ticket( TEST_CLIENT_IX, now + RESUME_TICKET_LIFETIME
+                        ,ticket
+                       );
+
+    /* Too old, from the future, and MAC'd with the wrong key. */
+    make_resume_request(ticket, now - (2 * RESUME_MAX_SKEW), KAB_copy, request);
+
+    if(send_resume_request(request, new_pair[1], reply) != PACKET_ID_04){
+        printf("[ERR] TEST SESSION: Too old resumption wasn't refused.\n");
+        ok = 0;
+    }
+
+    make_resume_request(ticket, now + (2 * RESUME_MAX_SKEW), KAB_copy, request);
+
+    if(send_resume_request(request, new_pair[1], reply) != PACKET_ID_04){
+        printf("[ERR] TEST SESSION: Future resumption wasn't refused.\n");
+        ok = 0;
+    }
+
+    make_resume_request(ticket, now, KBA_copy, request);
+
+    if(send_resume_request(request, new_pair[1], reply) != PACKET_ID_04){
+        printf("[ERR] TEST SESSION: Wrong key resumption wasn't refused.\n");
+        ok = 0;
+    }
+
+    /* The real thing, on the new connection. */
+    make_resume_request(ticket, now, KAB_copy, request);
+
+    BLAKE2B_MAC_INIT(&reply_ctx, KBA_copy, SESSION_KEY_LEN, SESSION_MAC_LEN);
+
+    if(   send_resume_request(request, new_pair[1], reply) != PACKET_ID_03
+       || BLAKE2B_MAC_VERIFY( &reply_ctx
+                             ,reply, TEST_RESUME_REPLY_LEN - SESSION_MAC_LEN
+                             ,reply + TEST_RESUME_REPLY_LEN - SESSION_MAC_LEN
+                            ) != 1
+      )
+    {
+        printf("[ERR] TEST SESSION: Good resumption wasn't accepted.\n");
+        ok = 0;
+        goto label_cleanup;
+    }
+
+    new_ix = *((u64*)(reply + SMALL_FIELD_LEN));
+
+    pthread_join(client_thread_ids[TEST_OLD_SOCK], &old_thread_result);
+
+    if(   !(users_status_bitmask & (1ULL << (63ULL - new_ix)))
+       || clients[new_ix].sock_ix != TEST_NEW_SOCK
+       || old_thread_result != PTHREAD_CANCELED
+       || (socket_status_bitmask & (1ULL << (63ULL - TEST_OLD_SOCK)))
+       || !(socket_status_bitmask & (1ULL << (63ULL - TEST_NEW_SOCK)))
+      )
+    {
+        printf("[ERR] TEST SESSION: Old session or connection left behind.\n");
+        ok = 0;
+    }
+
+    /* The user slot the old session let go of is the lowest free one, so
+     * the resumed session must have gotten it back, not a fresh one.
+     */
+    if(new_ix != TEST_CLIENT_IX){
+        printf("[ERR] TEST SESSION: Resumption leaked the old user slot.\n");
+        ok = 0;
+    }
+
+    /* The same request again. */
+    if(send_resume_request(request, new_pair[1], reply) != PACKET_ID_04){
+        printf("[ERR] TEST SESSION: Replayed resumption wasn't refused.\n");
+        ok = 0;
+    }
+
+    /* The new ticket, on the connection its session is already on. Nothing
+     * to stop there, it's the one we're on.
+     */
+    memcpy(ticket, reply + ticket_offset, RESUME_TICKET_LEN);
+
+    make_resume_request(ticket, now, KAB_copy, request);
+
+    if(send_resume_request(request, new_pair[1], reply) != PACKET_ID_03){
+        printf("[ERR] TEST SESSION: Resumption on the same connection "
+               "wasn't accepted.\n"
+              );
+        ok = 0;
+        goto label_cleanup;
+    }
+
+    second_ix = *((u64*)(reply + SMALL_FIELD_LEN));
+
+    if(   second_ix != new_ix
+       || clients[second_ix].sock_ix != TEST_NEW_SOCK
+       || !(socket_status_bitmask & (1ULL << (63ULL - TEST_NEW_SOCK)))
+      )
+    {
+        printf("[ERR] TEST SESSION: Resuming on the same connection let go "
+               "of it.\n"
+              );
+        ok = 0;
+    }
+
+label_cleanup:
+
+    close(old_pair[1]);
+    close(new_pair[0]);
+    close(new_pair[1]);
+
+    explicit_bzero(KAB_copy,   SESSION_KEY_LEN);
+    explicit_bzero(KBA_copy,   SESSION_KEY_LEN);
+    explicit_bzero(&reply_ctx, sizeof(struct BLAKE2B_MAC_ctx));
+
+    printf("Session resumption: old connection dropped, current one kept, "
+           "stale, future and replayed requests refused: %s\n\n"
+           ,ok ? "YES" : "NO"
+          );
+
+    return ok;
+}
+
+/* Replies signed on a worker and sent straight to a socket: one goes out
+ * even though a user slot with the same index was freed meanwhile, one whose
+ * socket got released and taken by a new connection before it was signed
+ * doesn't reach that new connection.
+ */
+u8 test_signed_reply_targets(void){
+
+    const u64 reply_len = SMALL_FIELD_LEN + SIGNATURE_LEN;
+
+    u8  buf[SMALL_FIELD_LEN + SIGNATURE_LEN];
+    u8  ok = 1;
+    u8* reply;
+
+    u64 target = TEST_POLL_SOCK;
+
+    int old_pair[2];
+    int new_pair[2];
+
+    if(   socketpair(AF_UNIX, SOCK_STREAM, 0, old_pair) != 0
+       || socketpair(AF_UNIX, SOCK_STREAM, 0, new_pair) != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Couldn't make the test connections.\n");
+        return 0;
+    }
+
+    if(!Signature_SERVICE_START( M, Q, Gm, &server_privkey_bigint
+                                ,PRIVKEY_LEN, 1
+                               )
+      )
+    {
+        printf("[ERR] TEST SESSION: Couldn't start the signing service.\n");
+        return 0;
+    }
+
+    client_socket_fd[TEST_POLL_SOCK] = old_pair[0];
+    pthread_create( &(client_thread_ids[TEST_POLL_SOCK]), NULL
+                   ,old_connection_thread, NULL
+                  );
+
+    socket_status_bitmask |= (1ULL << (63ULL - TEST_POLL_SOCK));
+
+    /* Holding the mutex, as packet handlers do, keeps the worker from sending
+     * either one before we're done here.
+     */
+    pthread_mutex_lock(&mutex);
+
+    reply = calloc(1, reply_len);
+    *((u64*)reply) = PACKET_ID_40;
+
+    submit_signed_reply( SIGNED_REPLY_SEND, &target, 1, reply, reply_len
+                        ,reply, SMALL_FIELD_LEN, "test reply to keep"
+                       );
+
+    ++(client_epochs[TEST_POLL_SOCK]);
+
+    pthread_mutex_unlock(&mutex);
+
+    /* Let the first one go out before the socket goes away. */
+    Signature_SERVICE_STOP();
+
+    if(!Signature_SERVICE_START( M, Q, Gm, &server_privkey_bigint
+                                ,PRIVKEY_LEN, 1
+                               )
+      )
+    {
+        printf("[ERR] TEST SESSION: Couldn't restart the signing service.\n");
+        return 0;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    reply = calloc(1, reply_len);
+    *((u64*)reply) = PACKET_ID_41;
+
+    submit_signed_reply( SIGNED_REPLY_SEND, &target, 1, reply, reply_len
+                        ,reply, SMALL_FIELD_LEN, "test reply to drop"
+                       );
+
+    release_socket(TEST_POLL_SOCK);
+
+    client_socket_fd[TEST_POLL_SOCK] = new_pair[0];
+    socket_status_bitmask |= (1ULL << (63ULL - TEST_POLL_SOCK));
+
+    pthread_mutex_unlock(&mutex);
+
+    Signature_SERVICE_STOP();
+
+    if(   recv(old_pair[1], buf, reply_len, MSG_DONTWAIT) != (ssize_t)reply_len
+       || *((u64*)buf) != PACKET_ID_40
+      )
+    {
+        printf("[ERR] TEST SESSION: Reply dropped for someone else's slot.\n");
+        ok = 0;
+    }
+
+    if(recv(new_pair[1], buf, reply_len, MSG_DONTWAIT) != -1){
+        printf("[ERR] TEST SESSION: Reply went to a new connection.\n");
+        ok = 0;
+    }
+
+    socket_status_bitmask &= ~(1ULL << (63ULL - TEST_POLL_SOCK));
+    client_socket_fd[TEST_POLL_SOCK] = 0;
+
+    close(old_pair[1]);
+    close(new_pair[0]);
+    close(new_pair[1]);
+
+    printf("Signed replies: sent to the connection they're for, not to one "
+           "that took its socket slot since: %s\n\n"
+           ,ok ? "YES" : "NO"
+          );
+
+    return ok;
+}
+
+/* A DH key pair, made the way the client makes its short-term and long-term
+ * ones.
+ */
+void make_test_keypair(bigint* priv, bigint* pub){
+
+    u8 priv_buf[PRIVKEY_LEN];
+
+    gen_priv_key(PRIVKEY_LEN, priv_buf);
+
+    bigint_create(priv, MAX_BIGINT_SIZ, 0);
+    memcpy(priv->bits, priv_buf, PRIVKEY_LEN);
+    priv->used_bits = get_used_bits(priv_buf, PRIVKEY_LEN);
+    priv->free_bits = MAX_BIGINT_SIZ - priv->used_bits;
+
+    bigint_create(pub, MAX_BIGINT_SIZ, 0);
+
+    MONT_POW_modM(Gm, priv, M, pub);
+
+    explicit_bzero(priv_buf, PRIVKEY_LEN);
+
+    return;
+}
+
+/* A login whose short-term public key isn't in the subgroup of order Q is
+ * told to try later, and doesn't keep the login handshake memory region for
+ * itself - a good login right after it goes all the way through.
+ */
+u8 test_login_after_bad_key(void){
+
+    u8  packet[SMALL_FIELD_LEN + PUBKEY_LEN + HMAC_TRUNC_BYTES];
+    u8  nonce[SHORT_NONCE_LEN];
+    u8  ok = 1;
+    u8* reply = calloc(1, MAX_MSG_LEN);
+    u8* KAB_s;
+    u8* KBA_s;
+
+    u64 user_ix = MAX_CLIENTS;
+
+    ssize_t bytes_read;
+
+    int sock_pair[2];
+
+    bigint short_priv;
+    bigint short_pub;
+    bigint long_priv;
+    bigint long_pub;
+    bigint B_s;
+    bigint B_s_mont;
+    bigint X;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sock_pair) != 0){
+        printf("[ERR] TEST SESSION: Couldn't make the test connection.\n");
+        free(reply);
+        return 0;
+    }
+
+    /* The reply to a good packet 00 is signed and sent by a signing worker. */
+    if(!Signature_SERVICE_START( M, Q, Gm, &server_privkey_bigint
+                                ,PRIVKEY_LEN, 1
+                               )
+      )
+    {
+        printf("[ERR] TEST SESSION: Couldn't start the signing service.\n");
+        free(reply);
+        return 0;
+    }
+
+    client_socket_fd[TEST_LOGIN_SOCK] = sock_pair[0];
+
+    /* The login handshake memory region, as self_init() makes it. */
+    temp_handshake_buf = calloc(1, TEMP_BUF_SIZ);
+
+    make_test_keypair(&short_priv, &short_pub);
+    make_test_keypair(&long_priv,  &long_pub);
+
+    bigint_create(&B_s,      MAX_BIGINT_SIZ, 0);
+    bigint_create(&B_s_mont, MAX_BIGINT_SIZ, 0);
+    bigint_create(&X,        MAX_BIGINT_SIZ, 0);
+
+    /* 2 is in range, but not in the subgroup. */
+    memset(packet, 0, sizeof(packet));
+
+    *((u64*)packet) = PACKET_ID_00;
+    packet[SMALL_FIELD_LEN] = 2;
+
+    process_msg_00(packet, TEST_LOGIN_SOCK, SMALL_FIELD_LEN);
+
+    bytes_read = recv(sock_pair[1], reply, MAX_MSG_LEN, MSG_DONTWAIT);
+
+    if(   bytes_read != (ssize_t)(SMALL_FIELD_LEN + SIGNATURE_LEN)
+       || *((u64*)reply) != PACKET_ID_02
+       || temp_handshake_memory_region_isLocked != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Bad short-term key kept the login "
+               "locked.\n"
+              );
+        ok = 0;
+    }
+
+    /* Now a good one. */
+    memcpy(packet + SMALL_FIELD_LEN, short_pub.bits, PUBKEY_LEN);
+
+    process_msg_00(packet, TEST_LOGIN_SOCK, SMALL_FIELD_LEN);
+
+    bytes_read = recv(sock_pair[1], reply, MAX_MSG_LEN, 0);
+
+    if(   bytes_read != (ssize_t)(SMALL_FIELD_LEN + PUBKEY_LEN + SIGNATURE_LEN)
+       || *((u64*)reply) != PACKET_ID_00
+      )
+    {
+        printf("[ERR] TEST SESSION: Good login got no packet 00 back.\n");
+        ok = 0;
+        goto label_cleanup;
+    }
+
+    /* The client's side of the DH, X = B_s^a_s, split up as the server does. */
+    memcpy(B_s.bits, reply + SMALL_FIELD_LEN, PUBKEY_LEN);
+    B_s.used_bits = get_used_bits(B_s.bits, PUBKEY_LEN);
+    B_s.free_bits = MAX_BIGINT_SIZ - B_s.used_bits;
+
+    Get_Mont_Form(&B_s, &B_s_mont, M);
+
+    MONT_POW_modM(&B_s_mont, &short_priv, M, &X);
+
+    KAB_s = X.bits;
+    KBA_s = X.bits + SESSION_KEY_LEN;
+
+    memcpy( nonce, X.bits + (2 * SESSION_KEY_LEN) + INIT_AUTH_LEN
+           ,SHORT_NONCE_LEN
+          );
+
+    /* Our long-term public key, encrypted and MAC'd with KAB_s. */
+    *((u64*)packet) = PACKET_ID_01;
+
+    CHACHA20( long_pub.bits, PUBKEY_LEN
+             ,(u32*)nonce, (u32)(SHORT_NONCE_LEN / sizeof(u32))
+             ,(u32*)KAB_s, (u32)(SESSION_KEY_LEN / sizeof(u32))
+             ,packet + SMALL_FIELD_LEN
+            );
+
+    BLAKE2B_KEYED( KAB_s, SESSION_KEY_LEN, packet + SMALL_FIELD_LEN, PUBKEY_LEN
+                  ,HMAC_TRUNC_BYTES, packet + SMALL_FIELD_LEN + PUBKEY_LEN
+                 );
+
+    process_msg_01(packet, TEST_LOGIN_SOCK, 0, 0);
+
+    bytes_read = recv(sock_pair[1], reply, MAX_MSG_LEN, MSG_DONTWAIT);
+
+    if(   bytes_read != (ssize_t)((2 * SMALL_FIELD_LEN) + SIGNATURE_LEN)
+       || *((u64*)reply) != PACKET_ID_01
+      )
+    {
+        printf("[ERR] TEST SESSION: Good login wasn't let in.\n");
+        ok = 0;
+        goto label_cleanup;
+    }
+
+    /* Our user_ix, with KBA_s and the next Nonce. */
+    ++(*((u64*)nonce));
+
+    CHACHA20( reply + SMALL_FIELD_LEN, SMALL_FIELD_LEN
+             ,(u32*)nonce, (u32)(SHORT_NONCE_LEN / sizeof(u32))
+             ,(u32*)KBA_s, (u32)(SESSION_KEY_LEN / sizeof(u32))
+             ,(u8*)(&user_ix)
+            );
+
+    if(   user_ix >= MAX_CLIENTS
+       || !(users_status_bitmask & (1ULL << (63ULL - user_ix)))
+       || clients[user_ix].sock_ix != TEST_LOGIN_SOCK
+       || memcmp(clients[user_ix].client_pubkey.bits, long_pub.bits, PUBKEY_LEN)
+       || temp_handshake_memory_region_isLocked != 0
+      )
+    {
+        printf("[ERR] TEST SESSION: Logged in user's slot isn't right.\n");
+        ok = 0;
+    }
+
+label_cleanup:
+
+    Signature_SERVICE_STOP();
+
+    close(sock_pair[0]);
+    close(sock_pair[1]);
+
+    client_socket_fd[TEST_LOGIN_SOCK] = 0;
+
+    explicit_bzero(nonce, SHORT_NONCE_LEN);
+    explicit_bzero(short_priv.bits, PRIVKEY_LEN);
+    explicit_bzero(long_priv.bits,  PRIVKEY_LEN);
+    explicit_bzero(X.bits, PUBKEY_LEN);
+
+    free(short_priv.bits);
+    free(short_pub.bits);
+    free(long_priv.bits);
+    free(long_pub.bits);
+    free(B_s.bits);
+    free(B_s_mont.bits);
+    free(X.bits);
+    free(reply);
+    free(temp_handshake_buf);
+
+    temp_handshake_buf = NULL;
+
+    printf("Login: a bad short-term key is told to try later and doesn't "
+           "hold up the good login after it: %s\n\n"
+           ,ok ? "YES" : "NO"
+          );
+
+    return ok;
+}
+
+int main(){
+
+    bigint server_pubkey;
+
+    u8 ticket_mac_key[SESSION_MAC_LEN];
+    u8 ok = 1;
+
+    /* Refusing a resumption is a signed reply, so sign as the server does. */
+    M  = get_BIGINT_from_DAT
+        (3072, "../bin/saved_M.dat\0",  3071, MAX_BIGINT_SIZ);
+
+    Q  = get_BIGINT_from_DAT
+        (320,  "../bin/saved_Q.dat\0",  320,  MAX_BIGINT_SIZ);
+
+    Gm = get_BIGINT_from_DAT
+        (3072, "../bin/saved_Gm.dat\0", 3071, MAX_BIGINT_SIZ);
+
+    server_privkey_bigint = *get_BIGINT_from_DAT( 320
+                                                 ,"../bin/server_privkey.dat\0"
+                                                 ,318
+                                                 ,MAX_BIGINT_SIZ
+                                                );
+
+    /* This run's ticket keys, as self_init() makes them. */
+    CSPRNG_GET_BYTES(ticket_enc_key, SESSION_KEY_LEN);
+    CSPRNG_GET_BYTES(ticket_mac_key, SESSION_MAC_LEN);
+
+    BLAKE2B_MAC_INIT( &ticket_mac_ctx
+                     ,ticket_mac_key, SESSION_MAC_LEN, SESSION_MAC_LEN
+                    );
+
+    /* Just enough of a logged in client for the session state. Its long-term
+     * shared secret with us only needs to be random, not a real DH result.
+     */
+    make_test_bigint(&server_pubkey, PUBKEY_LEN);
+    make_test_bigint(&(clients[TEST_CLIENT_IX].client_pubkey), PUBKEY_LEN);
+    make_test_bigint(&(clients[TEST_CLIENT_IX].client_pubkey_mont), PUBKEY_LEN);
+    make_test_bigint( &(clients[TEST_CLIENT_IX].shared_secret)
+                     ,RESUME_TICKET_SECRET_LEN
+                    );
+
+    server_pubkey_bigint = &server_pubkey;
+
+    init_user_slot(TEST_CLIENT_IX);
+    claim_user_slot(TEST_CLIENT_IX);
+
+    if(!test_session_macs()){
+        ok = 0;
+    }
+
+    if(!test_pending_msgs()){
+        ok = 0;
+    }
+
+    if(!test_signed_reply_targets()){
+        ok = 0;
+    }
+
+    if(!test_login_after_bad_key()){
+        ok = 0;
+    }
+
+    if(!test_resume_tickets()){
+        ok = 0;
+    }
+
+    /* Last, it replaces the test client's session with resumed ones. */
+    if(!test_resume_session()){
+        ok = 0;
+    }
+
+    for(u64 i = 0; i < MAX_CLIENTS; ++i){
+        if(users_status_bitmask & (1ULL << (63ULL - i))){
+            release_user_slot(i);
+        }
+    }
+
+    free(server_pubkey.bits);
+
+    return ok ? 0 : 1;
+}
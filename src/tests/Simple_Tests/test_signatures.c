@@ -1,10 +1,20 @@
-#include "../../lib/cryptolib.h"
+#include "../../lib/coreutil.h"
 
 #define MAX_BIGINT_SIZ 12800
 #define PRIVKEY_LEN    40
 #define SIGNATURE_LEN  ((2 * sizeof(bigint)) + (2 * PRIVKEY_LEN))
 #define TEST_DATA_LEN  1024
 
+/* Signing service test: which jobs' on_done() ran, in the order they ran. */
+#define SERVICE_TEST_JOBS 8
+
+uint64_t service_done_order[SERVICE_TEST_JOBS];
+uint64_t service_num_done = 0;
+
+void service_test_done(struct Signature_job* job){
+    service_done_order[service_num_done++] = *((uint64_t*)(job->user_arg));
+}
+
 int main(){
 
     struct bigint *M, *Q, *G, *Gm, *Am, *a, *s, *e;
@@ -14,21 +24,14 @@ int main(){
     
     /* Text bytes to be signed */    
     uint8_t* msg = calloc(1, TEST_DATA_LEN);
-    FILE* ran = NULL;
-    size_t status;
     uint8_t* result_signature = calloc(1, SIGNATURE_LEN);
     uint8_t isValid;
+    uint64_t prehash_id;
 
-    ran = fopen("/dev/urandom","r");
-    
-    status = fread(msg, 1, TEST_DATA_LEN, ran);
-    
-    if(status != TEST_DATA_LEN){
-        printf("[ERR] TEST SIG_GEN: Failed to read urandom. Quitting.\n\n");
+    if( ! CSPRNG_GET_BYTES(msg, TEST_DATA_LEN) ){
+        printf("[ERR] TEST SIG_GEN: Failed to draw random bytes. Quitting.\n\n");
         return 1;
     }
-    
-    fclose(ran);
 
     M  = get_BIGINT_from_DAT( 3072
                              ,"../saved_nums/saved_M.dat\0"
@@ -87,6 +90,9 @@ int main(){
     s = (struct bigint *)(result_signature + 0);
     e = (struct bigint *)(result_signature + sizeof(bigint) + PRIVKEY_LEN);    
     
+    /* The prehash marker shares its slot with s->bits. Grab it first. */
+    prehash_id = Signature_GET_PREHASH_ID(result_signature);
+
     s->bits = calloc(1, (size_t)(s->size_bits / 8));
     e->bits = calloc(1, (size_t)(e->size_bits / 8));
  
@@ -115,7 +121,7 @@ int main(){
     */
     time = clock();
 
-    isValid = Signature_VALIDATE(Gm, Am, M, Q, s, e, msg, TEST_DATA_LEN);
+    isValid = Signature_VALIDATE(Gm, Am, M, Q, s, e, msg, TEST_DATA_LEN, prehash_id);
     
     time = clock() - time;
     total_time_sec = ((double)time)/CLOCKS_PER_SEC;
@@ -128,6 +134,458 @@ int main(){
     else{
         printf("Valid Signature: YES\n");
     }
-    
+
+    /* Now the batch interface: sign 5 different messages in one call. */
+    #define BATCH_SIGS 5
+
+    uint8_t* batch_datas[BATCH_SIGS];
+    uint8_t* batch_sigs [BATCH_SIGS];
+    uint64_t batch_lens [BATCH_SIGS];
+    uint64_t batch_valid = 0;
+
+    for(uint64_t i = 0; i < BATCH_SIGS; ++i){
+        batch_datas[i] = msg + (i * 100);
+        batch_lens[i]  = TEST_DATA_LEN - (i * 100);
+        batch_sigs[i]  = calloc(1, SIGNATURE_LEN);
+    }
+
+    time = clock();
+
+    Signature_GENERATE_BATCH( M, Q, Gm, BATCH_SIGS, batch_datas, batch_lens
+                             ,batch_sigs, a, PRIVKEY_LEN
+                            );
+
+    time = clock() - time;
+    total_time_sec = ((double)time)/CLOCKS_PER_SEC;
+    printf("Time taken for Sig_GEN_BATCH of %u: %lf sec.\n\n"
+           ,BATCH_SIGS, total_time_sec
+          );
+
+    for(uint64_t i = 0; i < BATCH_SIGS; ++i){
+
+        memcpy( s->bits
+               ,batch_sigs[i] + (1*sizeof(struct bigint)) +  0
+               ,PRIVKEY_LEN
+              );
+        s->used_bits = ((struct bigint *)(batch_sigs[i]))->used_bits;
+        s->free_bits = s->size_bits - s->used_bits;
+
+        memcpy( e->bits
+               ,batch_sigs[i] + (2*sizeof(struct bigint)) + PRIVKEY_LEN
+               ,PRIVKEY_LEN
+              );
+        e->used_bits =
+        ((struct bigint *)(batch_sigs[i] + sizeof(bigint) + PRIVKEY_LEN))
+        ->used_bits;
+        e->free_bits = e->size_bits - e->used_bits;
+
+        batch_valid += Signature_VALIDATE( Gm, Am, M, Q, s, e
+                                          ,batch_datas[i], batch_lens[i]
+                                          ,Signature_GET_PREHASH_ID(batch_sigs[i])
+                                         );
+
+        free(batch_sigs[i]);
+    }
+
+    printf("Valid Batch Signatures: %lu of %u\n", batch_valid, BATCH_SIGS);
+
+    /* A payload big enough to get prehashed with the BLAKE2bp tree instead. */
+    #define LARGE_DATA_LEN (4 * SIG_PREHASH_BLAKE2BP_MIN_LEN)
+
+    uint8_t* large_msg = calloc(1, LARGE_DATA_LEN);
+    uint8_t* large_sig = calloc(1, SIGNATURE_LEN);
+
+    for(uint64_t i = 0; i < LARGE_DATA_LEN; ++i){
+        large_msg[i] = msg[i % TEST_DATA_LEN] ^ (uint8_t)i;
+    }
+
+    Signature_GENERATE( M, Q, Gm, large_msg, LARGE_DATA_LEN
+                       ,large_sig, a, PRIVKEY_LEN
+                      );
+
+    prehash_id = Signature_GET_PREHASH_ID(large_sig);
+
+    memcpy(s->bits, large_sig + (1*sizeof(struct bigint)), PRIVKEY_LEN);
+    s->used_bits = ((struct bigint *)(large_sig))->used_bits;
+    s->free_bits = s->size_bits - s->used_bits;
+
+    memcpy( e->bits
+           ,large_sig + (2*sizeof(struct bigint)) + PRIVKEY_LEN
+           ,PRIVKEY_LEN
+          );
+    e->used_bits =
+    ((struct bigint *)(large_sig + sizeof(bigint) + PRIVKEY_LEN))->used_bits;
+    e->free_bits = e->size_bits - e->used_bits;
+
+    isValid = Signature_VALIDATE( Gm, Am, M, Q, s, e
+                                 ,large_msg, LARGE_DATA_LEN, prehash_id
+                                );
+
+    printf("Large (%u bytes, prehash %lu) Signature valid: %s\n"
+           ,LARGE_DATA_LEN, prehash_id, isValid ? "YES" : "NO"
+          );
+
+    free(large_msg);
+    free(large_sig);
+
+    /* Now with the nonce pool: wait for it to fill up, then sign out of it.
+     * It fills in one batch and then waits a minute before the next, so the
+     * one signature more than the pool holds must be a miss.
+     */
+    #define POOL_TEST_SIZ 4
+
+    struct Exp_pool_stats nonce_stats;
+
+    uint8_t* pool_sig = calloc(1, SIGNATURE_LEN);
+    uint8_t  pool_ok  = 1;
+
+    if(!Signature_NONCE_POOL_START(M, Q, Gm, POOL_TEST_SIZ, POOL_TEST_SIZ
+                                  ,60000
+                                  )
+      )
+    {
+        printf("[ERR] TEST SIG_GEN: Couldn't start the nonce pool.\n\n");
+        return 1;
+    }
+
+    do{
+        usleep(10000);
+        Signature_NONCE_POOL_STATS(&nonce_stats);
+    } while(nonce_stats.available < POOL_TEST_SIZ);
+
+    for(uint64_t i = 0; i <= POOL_TEST_SIZ; ++i){
+
+        time = clock();
+
+        Signature_GENERATE( M, Q, Gm, msg, TEST_DATA_LEN
+                           ,pool_sig, a, PRIVKEY_LEN
+                          );
+
+        time = clock() - time;
+        total_time_sec = ((double)time)/CLOCKS_PER_SEC;
+
+        memcpy(s->bits, pool_sig + sizeof(struct bigint), PRIVKEY_LEN);
+        s->used_bits = ((struct bigint *)(pool_sig))->used_bits;
+        s->free_bits = s->size_bits - s->used_bits;
+
+        memcpy( e->bits
+               ,pool_sig + (2*sizeof(struct bigint)) + PRIVKEY_LEN
+               ,PRIVKEY_LEN
+              );
+        e->used_bits =
+        ((struct bigint *)(pool_sig + sizeof(bigint) + PRIVKEY_LEN))
+        ->used_bits;
+        e->free_bits = e->size_bits - e->used_bits;
+
+        isValid = Signature_VALIDATE( Gm, Am, M, Q, s, e, msg, TEST_DATA_LEN
+                                     ,Signature_GET_PREHASH_ID(pool_sig)
+                                    );
+
+        printf("Pooled Sig_GEN[%lu]: %lf sec, valid: %s\n"
+               ,i, total_time_sec, isValid ? "YES" : "NO"
+              );
+
+        if(isValid != 1){
+            pool_ok = 0;
+        }
+    }
+
+    Signature_NONCE_POOL_STATS(&nonce_stats);
+
+    printf("\nNonce pool: %lu hits, %lu misses (expected %u and 1).\n\n"
+           ,nonce_stats.hits, nonce_stats.misses, POOL_TEST_SIZ
+          );
+
+    Signature_NONCE_POOL_STOP();
+
+    free(pool_sig);
+
+    if(   !pool_ok
+       || nonce_stats.hits != POOL_TEST_SIZ
+       || nonce_stats.misses != 1
+      )
+    {
+        return 1;
+    }
+
+    /* The DH ephemeral key pool is the same kind of pool, for login key pairs.
+     * Each pair taken out must be a real (b, G^b mod M), pooled or not, and
+     * once it's empty, the next one is a miss, made on the spot.
+     */
+    struct Exp_pool_stats dh_stats;
+
+    struct bigint dh_priv;
+    struct bigint dh_pub;
+    struct bigint dh_check;
+
+    uint8_t dh_ok = 1;
+
+    bigint_create(&dh_priv,  MAX_BIGINT_SIZ, 0);
+    bigint_create(&dh_pub,   MAX_BIGINT_SIZ, 0);
+    bigint_create(&dh_check, MAX_BIGINT_SIZ, 0);
+
+    if(!DH_EPHEMERAL_POOL_START(M, Q, Gm, 2, 2, 60000)){
+        printf("[ERR] TEST SIG_GEN: Couldn't start the DH key pool.\n\n");
+        return 1;
+    }
+
+    do{
+        usleep(10000);
+        DH_EPHEMERAL_POOL_STATS(&dh_stats);
+    } while(dh_stats.available < 2);
+
+    for(uint64_t i = 0; i < 3; ++i){
+
+        if(!DH_EPHEMERAL_KEYPAIR(M, Q, Gm, &dh_priv, &dh_pub)){
+            dh_ok = 0;
+            break;
+        }
+
+        MONT_POW_modM(Gm, &dh_priv, M, &dh_check);
+
+        if(   bigint_compare2(&dh_check, &dh_pub) != 2
+           || bigint_compare2(&dh_priv, Q) != 3
+          )
+        {
+            dh_ok = 0;
+        }
+    }
+
+    DH_EPHEMERAL_POOL_STATS(&dh_stats);
+    DH_EPHEMERAL_POOL_STOP();
+
+    printf("DH key pool: %lu hits, %lu misses (expected 2 and 1), "
+           "pairs valid: %s\n\n"
+           ,dh_stats.hits, dh_stats.misses, dh_ok ? "YES" : "NO"
+          );
+
+    free(dh_priv.bits);
+    free(dh_pub.bits);
+    free(dh_check.bits);
+
+    if(!dh_ok || dh_stats.hits != 2 || dh_stats.misses != 1){
+        return 1;
+    }
+
+    /* Signature cache: the same 8 bytes signed 4 times, the 3rd time with
+     * another key, so that's miss, hit, miss, hit. The 4th must still find
+     * the 1st key's entry, as the other key's signature took another slot.
+     */
+    uint64_t packet_id = 0xCAFB1C01456DF7F0;
+
+    uint8_t* cached_sigs[4];
+    uint8_t  cache_ok = 1;
+
+    struct bigint other_key;
+
+    bigint_create(&other_key, MAX_BIGINT_SIZ, 0);
+    bigint_equate2(&other_key, a);
+    other_key.bits[0] ^= 1;
+
+    for(uint64_t i = 0; i < 4; ++i){
+
+        cached_sigs[i] = calloc(1, SIGNATURE_LEN);
+
+        time = clock();
+
+        Signature_GENERATE_CACHED( M, Q, Gm, (uint8_t*)&packet_id, 8
+                                  ,cached_sigs[i], (i == 2) ? &other_key : a
+                                  ,PRIVKEY_LEN
+                                 );
+
+        time = clock() - time;
+        total_time_sec = ((double)time)/CLOCKS_PER_SEC;
+
+        /* Only the 1st key's signatures can be checked against Am. */
+        if(i == 2){
+            printf("Cached Sig_GEN[%lu]: %lf sec, other key\n"
+                   ,i, total_time_sec
+                  );
+            continue;
+        }
+
+        memcpy(s->bits, cached_sigs[i] + sizeof(struct bigint), PRIVKEY_LEN);
+        s->used_bits = ((struct bigint *)(cached_sigs[i]))->used_bits;
+        s->free_bits = s->size_bits - s->used_bits;
+
+        memcpy( e->bits
+               ,cached_sigs[i] + (2*sizeof(struct bigint)) + PRIVKEY_LEN
+               ,PRIVKEY_LEN
+              );
+        e->used_bits =
+        ((struct bigint *)(cached_sigs[i] + sizeof(bigint) + PRIVKEY_LEN))
+        ->used_bits;
+        e->free_bits = e->size_bits - e->used_bits;
+
+        isValid = Signature_VALIDATE( Gm, Am, M, Q, s, e
+                                     ,(uint8_t*)&packet_id, 8
+                                     ,Signature_GET_PREHASH_ID(cached_sigs[i])
+                                    );
+
+        printf("Cached Sig_GEN[%lu]: %lf sec, valid: %s\n"
+               ,i, total_time_sec, isValid ? "YES" : "NO"
+              );
+
+        if(isValid != 1){
+            cache_ok = 0;
+        }
+    }
+
+    /* The hits are copies of the 1st, the other key's signature isn't. */
+    if(   memcmp(cached_sigs[0], cached_sigs[1], SIGNATURE_LEN) != 0
+       || memcmp(cached_sigs[0], cached_sigs[3], SIGNATURE_LEN) != 0
+       || memcmp(cached_sigs[0], cached_sigs[2], SIGNATURE_LEN) == 0
+      )
+    {
+        cache_ok = 0;
+    }
+
+    printf("\nSignature cache: %lu hits, %lu misses (expected 2 and 2), "
+           "copies match: %s\n\n"
+           ,sig_cache.hits, sig_cache.misses, cache_ok ? "YES" : "NO"
+          );
+
+    for(uint64_t i = 0; i < 4; ++i){
+        free(cached_sigs[i]);
+    }
+
+    free(other_key.bits);
+
+    if(!cache_ok || sig_cache.hits != 2 || sig_cache.misses != 2){
+        return 1;
+    }
+
+    /* Signing service: a few jobs over different data on 3 workers. Each
+     * signature must be valid, and on_done() must have run in the order the
+     * jobs were submitted, whichever worker finished first.
+     */
+    struct Signature_job           jobs[SERVICE_TEST_JOBS];
+    struct Signature_service_stats service_stats;
+
+    uint64_t job_ixs[SERVICE_TEST_JOBS];
+    uint8_t* job_sigs = calloc(SERVICE_TEST_JOBS, SIGNATURE_LEN);
+    uint8_t  service_ok = 1;
+
+    if(!Signature_SERVICE_START(M, Q, Gm, a, PRIVKEY_LEN, 3)){
+        printf("[ERR] TEST SIG_GEN: Couldn't start the signing service.\n\n");
+        return 1;
+    }
+
+    time = clock();
+
+    for(uint64_t i = 0; i < SERVICE_TEST_JOBS; ++i){
+
+        job_ixs[i] = i;
+
+        jobs[i].data      = msg + (i * (TEST_DATA_LEN / SERVICE_TEST_JOBS));
+        jobs[i].data_len  = TEST_DATA_LEN / SERVICE_TEST_JOBS;
+        jobs[i].signature = job_sigs + (i * SIGNATURE_LEN);
+        jobs[i].on_done   = service_test_done;
+        jobs[i].user_arg  = &(job_ixs[i]);
+
+        if(!Signature_SERVICE_SUBMIT(&(jobs[i]))){
+            printf("[ERR] TEST SIG_GEN: Couldn't submit job %lu.\n\n", i);
+            return 1;
+        }
+    }
+
+    Signature_SERVICE_STATS(&service_stats);
+    Signature_SERVICE_STOP();
+
+    time = clock() - time;
+    total_time_sec = ((double)time)/CLOCKS_PER_SEC;
+
+    for(uint64_t i = 0; i < SERVICE_TEST_JOBS; ++i){
+
+        uint8_t* job_sig = job_sigs + (i * SIGNATURE_LEN);
+
+        memcpy(s->bits, job_sig + sizeof(struct bigint), PRIVKEY_LEN);
+        s->used_bits = ((struct bigint *)(job_sig))->used_bits;
+        s->free_bits = s->size_bits - s->used_bits;
+
+        memcpy( e->bits
+               ,job_sig + (2*sizeof(struct bigint)) + PRIVKEY_LEN
+               ,PRIVKEY_LEN
+              );
+        e->used_bits =
+        ((struct bigint *)(job_sig + sizeof(bigint) + PRIVKEY_LEN))->used_bits;
+        e->free_bits = e->size_bits - e->used_bits;
+
+        isValid = Signature_VALIDATE( Gm, Am, M, Q, s, e
+                                     ,jobs[i].data, jobs[i].data_len
+                                     ,Signature_GET_PREHASH_ID(job_sig)
+                                    );
+
+        if(!isValid || i >= service_num_done || service_done_order[i] != i){
+            service_ok = 0;
+        }
+    }
+
+    printf("Signing service: %lu jobs on %lu workers in %lf sec CPU, "
+           "%lu done, valid and in order: %s\n\n"
+           ,(uint64_t)SERVICE_TEST_JOBS, service_stats.workers, total_time_sec
+           ,service_num_done, service_ok ? "YES" : "NO"
+          );
+
+    free(job_sigs);
+
+    if(!service_ok){
+        return 1;
+    }
+
+    /* Public key check: our own Am is in the Q-order subgroup so it passes.
+     * 1 and M-1 are the two keys that would make a DH secret guessable, and
+     * 2 isn't in the subgroup, so none of those three may get through.
+     */
+    struct bigint bad_key;
+    struct bigint bad_key_mont;
+    struct bigint m_minus_one;
+
+    uint8_t pubkey_ok;
+
+    bigint_create(&bad_key,      MAX_BIGINT_SIZ, 1);
+    bigint_create(&bad_key_mont, MAX_BIGINT_SIZ, 0);
+    bigint_create(&m_minus_one,  MAX_BIGINT_SIZ, 0);
+
+    time = clock();
+    pubkey_ok = check_pubkey_form(Am, M, Q);
+    total_time_sec = (double)(clock() - time) / CLOCKS_PER_SEC;
+
+    Get_Mont_Form(&bad_key, &bad_key_mont, M);
+
+    if(check_pubkey_form(&bad_key_mont, M, Q)){
+        pubkey_ok = 0;
+    }
+
+    bigint_sub2(M, &bad_key, &m_minus_one);
+    Get_Mont_Form(&m_minus_one, &bad_key_mont, M);
+
+    if(check_pubkey_form(&bad_key_mont, M, Q)){
+        pubkey_ok = 0;
+    }
+
+    bigint_nullify(&bad_key);
+    bad_key.bits[0] = 2;
+    bad_key.used_bits = 2;
+    bad_key.free_bits = MAX_BIGINT_SIZ - 2;
+    Get_Mont_Form(&bad_key, &bad_key_mont, M);
+
+    if(check_pubkey_form(&bad_key_mont, M, Q)){
+        pubkey_ok = 0;
+    }
+
+    printf("Public key check: valid key took %lf sec, "
+           "bad keys 1, M-1 and 2 rejected: %s\n\n"
+           ,total_time_sec, pubkey_ok ? "YES" : "NO"
+          );
+
+    free(bad_key.bits);
+    free(bad_key_mont.bits);
+    free(m_minus_one.bits);
+
+    if(!pubkey_ok){
+        return 1;
+    }
+
     return 0; 
 }